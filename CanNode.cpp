@@ -6,10 +6,32 @@
  * \date 6-20-16
  */
 #include "CanNode.h"
+#include "CanTransport.h"
 
 CanNode *CanNode::nodes[MAX_NODES] = {nullptr};
 bool CanNode::newMessage = false;
-CanMessage CanNode::tmpMsg;
+#ifdef CAN_TIMESTAMPS
+CanLatencyTable CanNode::latencyTable;
+#endif
+
+CanRing<CanNode::Deferred, CAN_BACKGROUND_QUEUE_SIZE> CanNode::background;
+uint32_t CanNode::backgroundBudget = CAN_BACKGROUND_BUDGET;
+CanPriorityStats CanNode::priorityTimes[CAN_PRIORITIES];
+
+CanNode::PeriodicEntry CanNode::periodic[MAX_PERIODIC];
+uint8_t CanNode::periodicUsed = 0;
+uint32_t CanNode::periodicDue = 0;
+volatile bool CanNode::periodicBusy = false;
+
+CanNode::DispatchEntry CanNode::dispatch[DISPATCH_SIZE];
+uint8_t CanNode::dispatchUsed = 0;
+uint8_t CanNode::idTable[0x800];
+uint8_t CanNode::fmiTable[MAX_FILTER_NUM + 1];
+
+CanNode::StringRequest CanNode::strRequest = {0, nullptr, 0, 0, 0, 0,
+                                              DATA_ERROR};
+uint8_t CanNode::activeStrings = 0;
+uint8_t CanNode::stringIds = 0;
 
 /**
  * Initilizes a CanNode object with and ID and a RTR function.
@@ -30,8 +52,19 @@ CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
 
   // if this is the first run clear list of nodes
   if (!has_run) {
+    // empty dispatch table
+    memset(idTable, NO_ENTRY, sizeof(idTable));
+    memset(fmiTable, NO_ENTRY, sizeof(fmiTable));
+
     can_init();
+#ifdef CAN_AUTOBAUD
+    canBitrate bitrate;
+    if (can_autobaud(&bitrate, CAN_AUTOBAUD_LISTEN, CAN_AUTOBAUD) != BUS_OK) {
+      can_set_bitrate(CAN_BITRATE_500K);
+    }
+#else
     can_set_bitrate(CAN_BITRATE_500K);
+#endif
     can_enable();
     has_run = true;
   }
@@ -44,10 +77,7 @@ CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
     }
     // otherwise its open
 
-    for(int j = 0; j < NUM_FILTERS; j++){
-        this->filters[j] = 0;
-        this->handle[j] = nullptr;
-    }
+    this->numFilters = 0;
 
     // add id etc
     nodes[i] = this;
@@ -55,9 +85,16 @@ CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
     //clear the name and info pointers
     this->nameStr=nullptr;
     this->infoStr=nullptr;
+    this->txStr=nullptr;
+    this->txStrId=0;
     this->rtrHandle = rtrHandle;
 
     this->id = id;
+    // handle requests for the node's data, name and info
+    addDispatch(this, id, DISPATCH_RTR, nullptr);
+    addDispatch(this, id + 1, DISPATCH_NAME, nullptr);
+    addDispatch(this, id + 2, DISPATCH_INFO, nullptr);
+
     // add filters to hardware
     // default filters
     can_add_filter_id(id);     // rtr filter
@@ -86,41 +123,122 @@ CanNode::CanNode(CanNodeType id, filterHandler rtrHandle) {
  * CanNode_addFilter(id, handler);
  * ~~~~~~~~~~~~
  *
+ * The priority says when the handler is called (see \ref CanPriority). A
+ * message with handlers in more than one class is handed to each class in
+ * turn, immediate handlers first. Use \ref CAN_PRIORITY_IMMEDIATE for short
+ * handlers that can't wait for the main loop, like a kill switch, and
+ * \ref CAN_PRIORITY_BACKGROUND for slow ones that shouldn't hold up the
+ * others, like logging. Filters should be added before the bus gets busy, an
+ * immediate handler can be called as soon as it is added.
+ *
  * \param node [in,out] pointer to a node that was initilized with CanNode_init()
  * \param filter [in] id of the device that should be handled by handle
  * \param handle [in] function used to handle the filter
+ * \param priority [in] when the handler is called
  *
  * \returns true if the filter was added, false if otherwise.
  *
  * \see can_add_filter_mask() for using mask filtering
  */
-bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
-  if (filter > 0x7FF || handle == nullptr) {
+bool CanNode::addFilter(uint16_t filter, filterHandler handle,
+                        CanPriority priority) {
+  if (filter > 0x7FF || handle == nullptr || priority >= CAN_PRIORITIES) {
     return false;
   }
 
   // add to the end of the list of filters... If there's room.
-  for (uint8_t i = 0; i < NUM_FILTERS; ++i) {
-    if (this->filters[i] == 0) {
-      // save the filter id
-      this->filters[i] = filter;
-      // save a pointer to the handler function
-      this->handle[i] = handle;
-
-      /*
-       * If not a reseved address, add to hardware filtering
-       * aka. It's assumed that the id was already added to the
-       * hardware filtering if the id is below 52.
-       */
-      if (filter > 52) {
-        can_add_filter_id(filter);
-      }
+  if (this->numFilters >= NUM_FILTERS ||
+      !addDispatch(this, filter, DISPATCH_FILTER, handle, priority)) {
+    return false; // no empty slots
+  }
+  ++this->numFilters;
+
+  // the receive interrupt only looks through the table once it has to
+  if (priority == CAN_PRIORITY_IMMEDIATE) {
+    can_rx_set_hook(handleImmediate);
+  }
 
-      return true; // Sucess! Filter has been added
+  /*
+   * If not a reseved address, add to hardware filtering
+   * aka. It's assumed that the id was already added to the
+   * hardware filtering if the id is below 52.
+   */
+  if (filter > MAX_FILTER_NUM) {
+    can_add_filter_id(filter);
+  }
+
+  return true; // Sucess! Filter has been added
+}
+
+/**
+ * Adds an entry to the end of the chains for its id and, for filters that can
+ * be a filter number, for its filter number. Keeping the chains in the order
+ * entries were added means handlers are called in the same order that nodes
+ * were created and filters were added.
+ *
+ * \param node node the entry belongs to
+ * \param filter id (or filter number) the entry handles
+ * \param kind a \ref DispatchKind
+ * \param handle handler function for \ref DISPATCH_FILTER entries
+ * \param priority \ref CanPriority of \ref DISPATCH_FILTER entries
+ *
+ * \returns true if the entry was added, false if the table is full.
+ */
+bool CanNode::addDispatch(CanNode *node, uint16_t filter, uint8_t kind,
+                          filterHandler handle, uint8_t priority) {
+  if (dispatchUsed >= DISPATCH_SIZE) {
+    return false;
+  }
+
+  uint8_t e = dispatchUsed++;
+  dispatch[e].node = node;
+  dispatch[e].handle = handle;
+  dispatch[e].filter = filter & 0x7FF;
+  dispatch[e].kind = kind;
+  dispatch[e].priority = kind == DISPATCH_FILTER ? priority
+                                                  : (uint8_t)CAN_PRIORITY_HIGH;
+  dispatch[e].nextId = NO_ENTRY;
+  dispatch[e].nextFmi = NO_ENTRY;
+
+  uint8_t *link = &idTable[filter & 0x7FF];
+  while (*link != NO_ENTRY) {
+    link = &dispatch[*link].nextId;
+  }
+  *link = e;
+
+  if (kind == DISPATCH_FILTER && filter <= MAX_FILTER_NUM) {
+    link = &fmiTable[filter];
+    while (*link != NO_ENTRY) {
+      link = &dispatch[*link].nextFmi;
     }
+    *link = e;
   }
 
-  return false; // no empty slots
+  return true;
+}
+
+/**
+ * Removes the entry addDispatch() added last, for when what it was added for
+ * failed. It is always at the end of its chains.
+ */
+void CanNode::dropDispatch() {
+  uint8_t e = dispatchUsed - 1;
+
+  uint8_t *link = &idTable[dispatch[e].filter];
+  while (*link != e) {
+    link = &dispatch[*link].nextId;
+  }
+  *link = NO_ENTRY;
+
+  if (dispatch[e].kind == DISPATCH_FILTER &&
+      dispatch[e].filter <= MAX_FILTER_NUM) {
+    link = &fmiTable[dispatch[e].filter];
+    while (*link != e) {
+      link = &dispatch[*link].nextFmi;
+    }
+    *link = NO_ENTRY;
+  }
+  --dispatchUsed;
 }
 
 //getter and setter functions -------------------------------------------------
@@ -130,6 +248,9 @@ bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
  * \param node [in] Specifies the node to send data from (basically an id)
  * \param data [in] Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
  * \see CanNode_sendData_uint16()
@@ -141,23 +262,17 @@ bool CanNode::addFilter(uint16_t filter, filterHandler handle) {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_int8(int8_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t)data;
-  // set other odds and ends
-  msg.rtr = false;
-  msg.len = 2;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_int8(int8_t data) const {
+  return send<int8_t>(data);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_int16()
  * \see CanNode_sendData_uint16()
@@ -169,23 +284,17 @@ void CanNode::sendData_int8(int8_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_uint8(uint8_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = data;
-  // set other odds and ends
-  msg.len = 2;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_uint8(uint8_t data) const {
+  return send<uint8_t>(data);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_uint16()
@@ -197,24 +306,17 @@ void CanNode::sendData_uint8(uint8_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_int16(int16_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t)(data & 0x00ff);
-  msg.data[2] = (uint8_t)((data & 0xff00) >> 8);
-  // set other odds and ends
-  msg.len = 3;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_int16(int16_t data) const {
+  return send<int16_t>(data);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -226,24 +328,17 @@ void CanNode::sendData_int16(int16_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_uint16(uint16_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x00ff);
-  msg.data[2] = (uint8_t)((data & 0xff00) >> 8);
-  // set other odds and ends
-  msg.len = 3;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_uint16(uint16_t data) const {
+  return send<uint16_t>(data);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -255,26 +350,17 @@ void CanNode::sendData_uint16(uint16_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_int32(int32_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT32) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x000000ff);
-  msg.data[2] = (uint8_t)((data & 0x0000ff00) >> 8);
-  msg.data[3] = (uint8_t)((data & 0x00ff0000) >> 16);
-  msg.data[4] = (uint8_t)((data & 0xff000000) >> 24);
-  // set other odds and ends
-  msg.len = 5;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_int32(int32_t data) const {
+  return send<int32_t>(data);
 }
 
 /**
  * \param[in] node Specifies the node to send data from (basically an id)
  * \param[in] data Data to send
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see CanNode_sendData_int8()
  * \see CanNode_sendData_uint8()
  * \see CanNode_sendData_int16()
@@ -286,20 +372,8 @@ void CanNode::sendData_int32(int32_t data) const {
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
  */
-void CanNode::sendData_uint32(uint32_t data) const {
-  CanMessage msg;
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT32) << 5) | (0x1F & CAN_DATA);
-  // data
-  msg.data[1] = (uint8_t) (data & 0x000000ff);
-  msg.data[2] = (uint8_t)((data & 0x0000ff00) >> 8);
-  msg.data[3] = (uint8_t)((data & 0x00ff0000) >> 16);
-  msg.data[4] = (uint8_t)((data & 0xff000000) >> 24);
-  // set other odds and ends
-  msg.len = 5;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
+CanState CanNode::sendData_uint32(uint32_t data) const {
+  return send<uint32_t>(data);
 }
 
 /**
@@ -309,6 +383,9 @@ void CanNode::sendData_uint32(uint32_t data) const {
  *
  * \param[in] Pointer to a CanMessage with the data, len, and rtr fields filled. 
  *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * transmit queue was full and it was dropped.
+ *
  * \see sendData_int8()
  * \see sendData_uint8()
  * \see sendData_int16()
@@ -321,9 +398,90 @@ void CanNode::sendData_uint32(uint32_t data) const {
  * \see sendDataArr_uint8()
  * \see sendDataArr_int16()
  */
-void CanNode::sendData_custom(CanMessage* msg) const {
+CanState CanNode::sendData_custom(CanMessage* msg) const {
     msg->id = this->id;
-    can_tx(msg, 5);
+    return transmit(msg, CAN_SEND_KIND_CUSTOM);
+}
+
+/**
+ * Like publish(), for a message with no type byte.
+ *
+ * \param[in] msg message with the data and len fields filled
+ *
+ * \returns false if \ref CAN_RTR_RESPONSES nodes already publish a value
+ */
+bool CanNode::publishData_custom(CanMessage *msg) const {
+  msg->id = this->id;
+  return can_rtr_response_set(msg);
+}
+
+void CanNode::unpublish() const {
+  can_rtr_response_clear(this->id);
+}
+
+/**
+ * Hold back messages from the node that don't say anything new, see
+ * can_send_policy.h for the rules. The policy applies to every data message
+ * sent on the node's id, from the sendData functions and from the periodic
+ * scheduler. Each type of message, the messages from sendData_custom() and
+ * each periodic message are compared with the last one of their own. A
+ * message that is held back is not an error, the send functions return
+ * \ref BUS_OK for it.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanNode node(ENGINE_TEMP, tempRTR);
+ * // send when the temperature moves by more than 2, at most every 50 ms and
+ * // at least once a second
+ * node.setSendPolicy(2, 50, 1000);
+ *
+ * // a node that sends a frame of signals (see CanSignal.h) with
+ * // sendData_custom() gives the policy the layout
+ * node.setSendPolicy(4, 20, 500, servoLayout, 3);
+ * ~~~~~~~~~~~~
+ *
+ * \param deadband largest change in the raw integer value that is not sent
+ * \param minInterval mili-seconds after a message before a change is sent
+ * \param maxInterval mili-seconds after a message before the same value is
+ * sent again, 0 to never send it again
+ * \param layout signals of the messages without a type byte, nullptr to
+ * send those whenever a byte changes. The array has to outlive the policy.
+ * \param numSignals number of signals in layout
+ */
+void CanNode::setSendPolicy(uint32_t deadband, uint16_t minInterval,
+                            uint16_t maxInterval, const CanSignal *layout,
+                            uint8_t numSignals) {
+  policy.set(true, deadband, minInterval, maxInterval, layout, numSignals);
+}
+
+void CanNode::clearSendPolicy() {
+  policy.set(false, 0, 0, 0);
+}
+
+/**
+ * Sends a message on the bus if the node's send policy lets it through.
+ *
+ * \param msg message to send
+ * \param kind type byte of the message or one of the CAN_SEND_KIND values,
+ * the policy compares it with the last message of the same kind
+ *
+ * \returns \ref BUS_OK if the message was sent, queued or held back,
+ * otherwise the same as can_tx().
+ */
+CanState CanNode::transmit(CanMessage *msg, uint16_t kind) const {
+  if (!policy.active()) {
+    return can_tx(msg, 5);
+  }
+  uint32_t now = HAL_GetTick();
+  if (!policy.admit(msg, kind, now)) {
+    return BUS_OK;
+  }
+  CanState state = can_tx(msg, 5);
+  if (state == BUS_OK) {
+    policy.sent(msg, kind, now);
+  }
+  return state;
 }
 
 /**
@@ -334,7 +492,8 @@ void CanNode::sendData_custom(CanMessage* msg) const {
  * \param data An array of data
  * \param len  Length of the data to be sent. Maximum length of 7
  *
- * \returns \ref DATA_OVERFLOW if len > 7, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len > 7, \ref BUS_BUSY if the transmit queue
+ * was full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_uint8()
  * \see CanNode_sendDataArr_int16()
@@ -348,25 +507,7 @@ void CanNode::sendData_custom(CanMessage* msg) const {
  * \see CanNode_sendData_uint32()
  */
 CanState CanNode::sendDataArr_int8(int8_t *data, uint8_t len) const {
-  CanMessage msg;
-  // check if valid
-  if (len > 7) {
-    return DATA_OVERFLOW;
-  }
-
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i + 1] = (uint8_t)data[i];
-  }
-
-  // set other odds and ends
-  msg.len = len + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  return sendArr(data, len);
 }
 
 /**
@@ -377,7 +518,8 @@ CanState CanNode::sendDataArr_int8(int8_t *data, uint8_t len) const {
  * \param data An array of data
  * \param len  Length of the data to be sent. Maximum length of 7
  *
- * \returns \ref DATA_OVERFLOW if len > 7, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len > 7, \ref BUS_BUSY if the transmit queue
+ * was full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_int8()
  * \see CanNode_sendDataArr_int16()
@@ -391,36 +533,19 @@ CanState CanNode::sendDataArr_int8(int8_t *data, uint8_t len) const {
  * \see CanNode_sendData_uint32()
  */
 CanState CanNode::sendDataArr_uint8(uint8_t *data, uint8_t len) const {
-  CanMessage msg;
-  // check if valid
-  if (len > 7) {
-    return DATA_OVERFLOW;
-  }
-
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT8) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i + 1] = data[i];
-  }
-
-  // set other odds and ends
-  msg.len = len + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  return sendArr(data, len);
 }
 
 /**
  * Sends an array of data over the CANBus.
- * Maximum size for the aray is 2 integers.
+ * Maximum size for the aray is 3 integers.
  *
  * \param node Pointer to a CanNode
  * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 2
+ * \param len  Length of the data to be sent. Maximum length of 3
  *
- * \returns \ref DATA_OVERFLOW if len > 2, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len > 3, \ref BUS_BUSY if the transmit queue
+ * was full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_int8()
  * \see CanNode_sendDataArr_uint8()
@@ -434,37 +559,19 @@ CanState CanNode::sendDataArr_uint8(uint8_t *data, uint8_t len) const {
  * \see CanNode_sendData_uint32()
  */
 CanState CanNode::sendDataArr_int16(int16_t *data, uint8_t len) const {
-  CanMessage msg;
-  // check if valid
-  if (len > 2) {
-    return DATA_OVERFLOW;
-  }
-
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_INT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i * 2 + 1] = (uint8_t) (data[i] & 0x00ff);
-    msg.data[i * 2 + 2] = (uint8_t)((data[i] & 0xff00) >> 8);
-  }
-
-  // set other odds and ends
-  msg.len = len * 2 + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  return sendArr(data, len);
 }
 
 /**
  * Sends an array of data over the CANBus.
- * Maximum size for the aray is 2 integers.
+ * Maximum size for the aray is 3 integers.
  *
  * \param node Pointer to a CanNode
  * \param data An array of data
- * \param len  Length of the data to be sent. Maximum length of 2
+ * \param len  Length of the data to be sent. Maximum length of 3
  *
- * \returns \ref DATA_OVERFLOW if len > 2, \ref DATA_OK otherwise
+ * \returns \ref DATA_OVERFLOW if len > 3, \ref BUS_BUSY if the transmit queue
+ * was full, \ref DATA_OK otherwise
  *
  * \see CanNode_sendDataArr_int8()
  * \see CanNode_sendDataArr_uint8()
@@ -478,26 +585,7 @@ CanState CanNode::sendDataArr_int16(int16_t *data, uint8_t len) const {
  * \see CanNode_sendData_uint32()
  */
 CanState CanNode::sendDataArr_uint16(uint16_t *data, uint8_t len) const {
-  CanMessage msg;
-  // check if valid
-  if (len > 2) {
-    return DATA_OVERFLOW;
-  }
-
-  // configuration byte
-  msg.data[0] = (uint8_t)((0x7 & CAN_UINT16) << 5) | (0x1F & CAN_DATA);
-  // data
-  for (uint8_t i = 0; i < len; ++i) {
-    msg.data[i * 2 + 1] = (uint8_t)(data[i] & 0x00ff);
-    msg.data[i * 2 + 2] = (uint8_t)((data[i] & 0xff00) >> 8);
-  }
-
-  // set other odds and ends
-  msg.len = len * 2 + 1;
-  msg.rtr = false;
-  msg.id = this->id;
-  can_tx(&msg, 5);
-  return DATA_OK;
+  return sendArr(data, len);
 }
 
 /**
@@ -532,23 +620,7 @@ CanState CanNode::sendDataArr_uint16(uint16_t *data, uint8_t len) const {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData_int8(const CanMessage *msg, int8_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT8 ||   // not right type
-      msg->len != 2 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = (int8_t)msg->data[1];
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -583,23 +655,7 @@ CanState CanNode::getData_int8(const CanMessage *msg, int8_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData_uint8(const CanMessage *msg, uint8_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT8 ||  // not right type
-      msg->len != 2 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = msg->data[1];
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -633,24 +689,7 @@ CanState CanNode::getData_uint8(const CanMessage *msg, uint8_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData_int16(const CanMessage *msg, int16_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT16 ||  // not right type
-      msg->len != 3 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = (int16_t)msg->data[1];
-  *data |= (int16_t)(msg->data[2] << 8);
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -684,24 +723,7 @@ CanState CanNode::getData_int16(const CanMessage *msg, int16_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData_uint16(const CanMessage *msg, uint16_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT16 || // not right type
-      msg->len != 3 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = (uint16_t)msg->data[1];
-  *data |= (uint16_t)(msg->data[2] << 8);
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -735,26 +757,7 @@ CanState CanNode::getData_uint16(const CanMessage *msg, uint16_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getData_int32(const CanMessage *msg, int32_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT32 ||  // not right type
-      msg->len != 5 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = (uint32_t)msg->data[1];
-  *data |= (uint32_t)(msg->data[2] << 8);
-  *data |= (uint32_t)(msg->data[3] << 16);
-  *data |= (uint32_t)(msg->data[4] << 24);
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -788,26 +791,7 @@ CanState CanNode::getData_int32(const CanMessage *msg, int32_t *data) {
  * \see CanNode_getData_int32()
  */
 CanState CanNode::getData_uint32(const CanMessage *msg, uint32_t *data) {
-
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT32 || // not right type
-      msg->len != 5 ||                     // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  // data
-  *data = (uint32_t)msg->data[1];
-  *data |= (uint32_t)(msg->data[2] << 8);
-  *data |= (uint32_t)(msg->data[3] << 16);
-  *data |= (uint32_t)(msg->data[4] << 24);
-
-  return DATA_OK;
+  return get(msg, data);
 }
 
 /**
@@ -849,25 +833,7 @@ CanState CanNode::getData_uint32(const CanMessage *msg, uint32_t *data) {
  * \see CanNode_getData_uint32()
  */
 CanState CanNode::getDataArr_int8(const CanMessage *msg, int8_t data[7], uint8_t *len) {
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT8 ||   // not right type
-      msg->len > 1 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i++) {
-    data[i] = (int8_t)msg->data[i + 1];
-  }
-
-  return DATA_OK;
+  return getArr(msg, data, len);
 }
 
 /**
@@ -910,25 +876,7 @@ CanState CanNode::getDataArr_int8(const CanMessage *msg, int8_t data[7], uint8_t
  */
 CanState CanNode::getDataArr_uint8(const CanMessage *msg, uint8_t data[7],
                           uint8_t *len) {
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT8 ||  // not right type
-      msg->len > 1 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i++) {
-    data[i] = (uint8_t)msg->data[i + 1];
-  }
-
-  return DATA_OK;
+  return getArr(msg, data, len);
 }
 
 /**
@@ -971,28 +919,7 @@ CanState CanNode::getDataArr_uint8(const CanMessage *msg, uint8_t data[7],
  */
 CanState CanNode::getDataArr_int16(const CanMessage *msg, int16_t data[3],
                                   uint8_t *len) {
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_INT16 ||  // not right type
-      msg->len > 7 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i += 2) {
-    data[i] = (int16_t)msg->data[i + 1];
-    data[i] |= (int16_t)(msg->data[i + 2] << 8);
-  }
-
-  // b/c 16 bit ints are twice as long as 8 bit ones
-  *len /= 2;
-  return DATA_OK;
+  return getArr(msg, data, len);
 }
 
 /**
@@ -1035,34 +962,23 @@ CanState CanNode::getDataArr_int16(const CanMessage *msg, int16_t data[3],
  */
 CanState CanNode::getDataArr_uint16(const CanMessage *msg, uint16_t data[3],
                           uint8_t *len) {
-  if (msg == nullptr) {
-    return DATA_ERROR;
-  }
-
-  // check configuration byte
-  if ((msg->data[0] >> 5) != CAN_UINT16 || // not right type
-      msg->len > 7 ||                      // not right length
-      (msg->data[0] & 0x1F) != CAN_DATA) { // not data
-
-    return INVALID_TYPE;
-  }
-
-  *len = msg->len - 1;
-  // data
-  for (int i = 0; i < *len; i += 2) {
-    data[i] = (uint16_t)msg->data[i + 1];
-    data[i] |= (uint16_t)(msg->data[i + 2] << 8);
-  }
-
-  // b/c 16 bit ints are twice as long as 8 bit ones
-  *len /= 2;
-  return DATA_OK;
+  return getArr(msg, data, len);
 }
 
 /**
  * Function that should be called from within the main loop. It calls handler
  * functions for each stored node.
  *
+ * Messages are collected by the receive interrupt into a ring buffer (see
+ * \ref CAN_RX_RING_SIZE), this function drains the ring. At most one ring's
+ * worth of messages is handled per call so a busy bus can't keep the main loop
+ * from running. Name and info strings that are being sent or recieved also
+ * move along a frame at a time here.
+ *
+ * Handlers are given a pointer to the message in the receive ring, which is
+ * only good until the handler returns. A handler that needs the message
+ * longer calls retain() and later release() instead of copying it.
+ *
  * Because of the unknown length of the handler
  * functions this function call could take a very long time. In order to keep
  * this function call to take a reasonable ammount of time, be sure to make
@@ -1074,57 +990,514 @@ CanState CanNode::getDataArr_uint16(const CanMessage *msg, uint16_t data[3],
  * is not sending a request frame.
  */
 void CanNode::checkForMessages() {
-  // pc code should check if a new message is avalible
-  // TODO stm32 uses an interrupt to put the newest message in a struct
+  uint32_t start = can_time_us();
+
+  // follow the controller back onto the bus after a bus-off
+  can_recover();
+
+  // keep string and segmented transfers moving
+  advanceStrings();
+  CanTransport::poll();
+  publishPeriodic();
+
+  // handlers get the message where it sits in the receive ring, the time one
+  // message's handlers end is the time the next one's begin
+  uint32_t begin = can_time_us();
+  for (uint16_t n = 0; n < CAN_RX_RING_SIZE; ++n) {
+    CanMessage *msg = can_rx_claim();
+    if (msg == nullptr) {
+      break;
+    }
+#ifdef CAN_TIMESTAMPS
+    uint32_t recieved = msg->timestamp;
+#else
+    uint32_t recieved = start;
+#endif
+    uint8_t classes = handleMessage(msg, CAN_PRIORITY_HIGH);
+    uint32_t end = can_time_us();
+#ifdef CAN_TIMESTAMPS
+    latencyTable.record(msg->id, begin - recieved, end - begin);
+#endif
+    if (classes & (1 << CAN_PRIORITY_HIGH)) {
+      recordPriority(CAN_PRIORITY_HIGH, begin - recieved, end - begin);
+    }
+    // background handlers get a copy so the ring slot is free right away
+    if (classes & (1 << CAN_PRIORITY_BACKGROUND) &&
+        !background.push(Deferred{*msg, recieved})) {
+      ++priorityTimes[CAN_PRIORITY_BACKGROUND].dropped;
+    }
+    can_rx_release(msg);
+    begin = end;
+  }
 
-  // if there are no new messages don't do anything
-  if (!is_can_msg_pending()) {
-    HAL_GPIO_TogglePin(User_LED_GPIO_Port, User_LED_Pin);
-    return;
+  if (!background.empty()) {
+    runBackground(start);
   }
 
-  can_rx(&tmpMsg, 5);
-  // loop through nodes
-  for (uint8_t i = 0; i < MAX_NODES; ++i) {
+  // clear new message flag
+  newMessage = false;
+}
 
-    // CanNode takes over if the caller asks for a reserved id
-    // rtr request for node data
-    if (nodes[i] == nullptr) {
-        continue;
+/**
+ * Waits for work with the core halted (see can_wait()) and then does it with
+ * checkForMessages(). Calling this in the main loop instead of
+ * checkForMessages() lets the node idle between messages rather than spin.
+ *
+ * The wait ends as soon as a message is in the receive ring, so a message
+ * reaches its handlers within the wakeup time of the core. It also ends when
+ * the next periodic message is due, and is skipped while background handlers,
+ * strings or segmented transfers have work left that no message would wake
+ * the core for.
+ *
+ * Put the controller to sleep with can_sleep() as well when the bus is going
+ * to be quiet for a while, bus activity wakes it and the core.
+ *
+ * \param timeout longest time to wait in mili-seconds
+ */
+void CanNode::waitForMessages(uint32_t timeout) {
+  uint32_t wait = timeout;
+  if (!background.empty() || activeStrings > 0 || CanTransport::sending()) {
+    wait = 0;
+  }
+  if (periodicUsed > 0) {
+    int32_t left = (int32_t)(periodicDue - HAL_GetTick());
+    if (left <= 0) {
+      wait = 0;
+    } else if ((uint32_t)left < wait) {
+      wait = (uint32_t)left;
     }
-    if (tmpMsg.id == nodes[i]->id && tmpMsg.rtr) {
-      nodes[i]->rtrHandle(&tmpMsg);
+  }
+
+  if (wait > 0) {
+    can_wait(wait);
+  }
+  checkForMessages();
+}
+
+/**
+ * Calls the background handlers of the messages waiting for them, oldest
+ * first, until none are left or \ref CAN_BACKGROUND_BUDGET micro-seconds have
+ * passed since checkForMessages() started. A handler that is started always
+ * runs to the end, so the budget can be overrun by one handler.
+ *
+ * \param start can_time_us() at the start of checkForMessages()
+ */
+void CanNode::runBackground(uint32_t start) {
+  for (;;) {
+    uint32_t begin = can_time_us();
+    if (begin - start >= backgroundBudget) {
+      return;
     }
-    // get name id if asked with an rtr
-    else if (tmpMsg.id == nodes[i]->id + 1 && tmpMsg.rtr) {
-      nodes[i]->sendName();
+    Deferred *deferred = background.claim();
+    if (deferred == nullptr) {
+      return;
     }
-    // get info id
-    else if (tmpMsg.id == nodes[i]->id + 2 && tmpMsg.rtr) {
-      nodes[i]->sendInfo();
+    handleMessage(&deferred->msg, CAN_PRIORITY_BACKGROUND);
+    recordPriority(CAN_PRIORITY_BACKGROUND, begin - deferred->recieved,
+                   can_time_us() - begin);
+    background.release(deferred);
+  }
+}
+
+/**
+ * Runs in the receive interrupt for every message while an immediate filter
+ * exists, before the message goes into the receive ring.
+ */
+void CanNode::handleImmediate(CanMessage *msg) {
+  uint32_t begin = can_time_us();
+  if (handleMessage(msg, CAN_PRIORITY_IMMEDIATE) &
+      (1 << CAN_PRIORITY_IMMEDIATE)) {
+#ifdef CAN_TIMESTAMPS
+    uint32_t latency = begin - msg->timestamp;
+#else
+    uint32_t latency = 0;
+#endif
+    recordPriority(CAN_PRIORITY_IMMEDIATE, latency, can_time_us() - begin);
+  }
+}
+
+void CanNode::recordPriority(uint8_t priority, uint32_t latency,
+                             uint32_t duration) {
+  CanPriorityStats *stats = &priorityTimes[priority];
+  ++stats->messages;
+  if (latency > stats->maxLatency) {
+    stats->maxLatency = latency;
+  }
+  if (duration > stats->maxDuration) {
+    stats->maxDuration = duration;
+  }
+}
+
+/**
+ * \param us micro-seconds into a checkForMessages() call that background
+ * handlers can still be started, 0 stops them from running
+ */
+void CanNode::setBackgroundBudget(uint32_t us) {
+  backgroundBudget = us;
+}
+
+/**
+ * How long the messages of a class waited for their handlers and how long the
+ * handlers took, see \ref CanPriorityStats. Watching the immediate and high
+ * classes shows whether the ids that matter are serviced in time.
+ *
+ * \returns the timing, or nullptr if the class doesn't exist
+ */
+const CanPriorityStats *CanNode::priorityStats(CanPriority priority) {
+  if (priority >= CAN_PRIORITIES) {
+    return nullptr;
+  }
+  return &priorityTimes[priority];
+}
+
+void CanNode::clearPriorityStats() {
+  memset(priorityTimes, 0, sizeof(priorityTimes));
+}
+
+/**
+ * Keep a message a handler was given after the handler returns, for example
+ * to finish with it on the next pass of the main loop. Every retain() needs a
+ * release(). The slot of a retained message, and the slots after it, can't
+ * take new messages until it is released, so only keep a message briefly.
+ *
+ * \param msg message given to the handler
+ *
+ * \returns msg
+ */
+CanMessage *CanNode::retain(CanMessage *msg) {
+  can_rx_retain(msg);
+  return msg;
+}
+
+/// \param msg message kept with retain()
+void CanNode::release(CanMessage *msg) {
+  can_rx_release(msg);
+}
+
+#ifdef CAN_TIMESTAMPS
+/**
+ * Histograms of the time messages with an id waited between reception and
+ * their handlers, and the time the handlers took (see can_latency.h). Only
+ * the first \ref CAN_LATENCY_IDS ids recieved get histograms of their own.
+ *
+ * \param id id of the messages
+ *
+ * \returns the histograms or nullptr if none are kept for the id.
+ */
+const CanLatency *CanNode::latency(uint16_t id) {
+  return latencyTable.get(id);
+}
+
+/**
+ * Histograms of every message handed out by checkForMessages(), including
+ * the ids without histograms of their own.
+ */
+const CanLatency *CanNode::latencyTotal() {
+  return latencyTable.total();
+}
+
+void CanNode::clearLatency() {
+  latencyTable.clear();
+}
+#endif
+
+/**
+ * Adds a message to the periodic schedule. Every \p period mili-seconds the
+ * scheduler calls \p fill for the data and sends the message on the id of the
+ * node. A message is due at the ticks that are \p phase past a multiple of
+ * its period, so messages with the same period and different phases never go
+ * out in the same mili-second.
+ *
+ * With \ref CAN_PHASE_AUTO the phase is picked so the message lines up as
+ * rarely as possible with the messages already scheduled, which keeps every
+ * message from going out in the same mili-second and spreads the load on the
+ * bus.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * void fillTemp(CanMessage *msg) {
+ *   CanNode::encode(msg, readTemperature());
+ * }
+ *
+ * CanNode node(ENGINE_TEMP, tempRTR);
+ * node.addPeriodic(100, fillTemp);
+ * ~~~~~~~~~~~~
+ *
+ * \param period mili-seconds between messages
+ * \param fill function that fills in the data of each message
+ * \param phase mili-seconds after each multiple of the period the message is
+ * due, or \ref CAN_PHASE_AUTO
+ *
+ * \returns a handle for periodicStats(), or \ref CAN_NO_PERIODIC if the period
+ * is 0 or the schedule is full.
+ */
+uint8_t CanNode::addPeriodic(uint16_t period, periodicHandler fill,
+                             uint16_t phase) {
+  if (period == 0 || fill == nullptr || periodicUsed >= MAX_PERIODIC) {
+    return CAN_NO_PERIODIC;
+  }
+  if (phase == CAN_PHASE_AUTO) {
+    phase = spreadPhase(period);
+  }
+  phase %= period;
+
+  // first tick from now that is phase past a multiple of the period
+  uint32_t now = HAL_GetTick();
+  uint32_t due = now - now % period + phase;
+  if ((int32_t)(due - now) < 0) {
+    due += period;
+  }
+
+  // keep a publishPeriodic() in an interrupt away from the new entry
+  periodicBusy = true;
+  PeriodicEntry *entry = &periodic[periodicUsed];
+  memset(entry, 0, sizeof(*entry));
+  entry->node = this;
+  entry->fill = fill;
+  entry->due = due;
+  entry->stats.id = this->id;
+  entry->stats.period = period;
+  entry->stats.phase = phase;
+  if (periodicUsed == 0 || (int32_t)(due - periodicDue) < 0) {
+    periodicDue = due;
+  }
+  ++periodicUsed;
+  periodicBusy = false;
+  return periodicUsed - 1;
+}
+
+static uint16_t gcd(uint16_t a, uint16_t b) {
+  while (b != 0) {
+    uint16_t r = a % b;
+    a = b;
+    b = r;
+  }
+  return a;
+}
+
+/**
+ * Two messages with periods p1 and p2 go out in the same mili-second whenever
+ * their phases are equal modulo gcd(p1, p2), which happens once every
+ * lcm(p1, p2) mili-seconds. The cost of a phase is how often it lines up with
+ * the messages already scheduled, gcd(p1, p2) / p2 for each one it lines up
+ * with (p1 is the same for every phase), and the cheapest phase wins. Ties go
+ * to the earliest phase.
+ */
+uint16_t CanNode::spreadPhase(uint16_t period) {
+  uint16_t best = 0;
+  uint32_t bestCost = UINT32_MAX;
+
+  for (uint16_t phase = 0; phase < period && bestCost > 0; ++phase) {
+    uint32_t cost = 0;
+    for (uint8_t i = 0; i < periodicUsed; ++i) {
+      const CanPeriodicStats *other = &periodic[i].stats;
+      uint16_t g = gcd(period, other->period);
+      if (phase % g == other->phase % g) {
+        cost += ((uint32_t)g << 16) / other->period;
+      }
     }
-    // configuration id
-    //else if (nodes[i] != nullptr && tmpMsg.id == nodes[i]->id + 3) {
-      // CanNode_nodeHandler(&nodes[i], &tmpMsg);
-    else {
-      // call callbacks for the user defined filters
-      for (uint8_t j = 0; j < NUM_FILTERS; ++j) {
-        if (tmpMsg.id == nodes[i]->filters[j]) {
-          // call handler function
-          nodes[i]->handle[j](&tmpMsg);
+    if (cost < bestCost) {
+      best = phase;
+      bestCost = cost;
+    }
+  }
+  return best;
+}
+
+/**
+ * Sends every periodic message that is due. checkForMessages() calls this, so
+ * by default the messages go out as often as the main loop polls. For less
+ * jitter call it from a timer interrupt, like HAL_SYSTICK_Callback(), the fill
+ * functions then run in the interrupt. A call that interrupts another one
+ * returns right away.
+ *
+ * Messages go through the send policy of their node (see setSendPolicy()),
+ * the ones it holds back are not counted as sent or missed.
+ *
+ * A message more than a period late skips the periods it missed instead of
+ * going out several times in a row, the skipped periods are counted in
+ * CanPeriodicStats::missed.
+ */
+void CanNode::publishPeriodic() {
+  uint32_t now = HAL_GetTick();
+  if (periodicUsed == 0 || (int32_t)(now - periodicDue) < 0 || periodicBusy) {
+    return;
+  }
+  periodicBusy = true;
+
+  uint32_t next = periodic[0].due;
+  for (uint8_t i = 0; i < periodicUsed; ++i) {
+    PeriodicEntry *entry = &periodic[i];
+    CanPeriodicStats *stats = &entry->stats;
+
+    if ((int32_t)(now - entry->due) >= 0) {
+      CanMessage msg;
+      msg.id = stats->id;
+      msg.len = 0;
+      msg.rtr = false;
+      entry->fill(&msg);
+
+      CanSendPolicy *policy = &entry->node->policy;
+      uint32_t time = can_time_us();
+      if (!policy->admit(&msg, CAN_SEND_KIND_PERIODIC(i), now)) {
+        // held back by the node's send policy, counted there
+      } else if (can_tx(&msg, 5) == BUS_OK) {
+        policy->sent(&msg, CAN_SEND_KIND_PERIODIC(i), now);
+        uint32_t late = time - entry->due * 1000;
+        if (stats->sent > 0) {
+          uint32_t interval = time - entry->last;
+          if (stats->sent == 1 || interval < stats->minInterval) {
+            stats->minInterval = interval;
+          }
+          if (interval > stats->maxInterval) {
+            stats->maxInterval = interval;
+          }
+        }
+        if (late > stats->maxLate) {
+          stats->maxLate = late;
         }
-        // check if the filter match equals a filter id
-        else if ( tmpMsg.fmi == nodes[i]->filters[j] ) { // filter matches
+        stats->totalLate += late;
+        entry->last = time;
+        ++stats->sent;
+      } else {
+        ++stats->missed;
+      }
+
+      uint32_t skipped = (now - entry->due) / stats->period;
+      stats->missed += skipped;
+      entry->due += (skipped + 1) * stats->period;
+    }
+
+    if ((int32_t)(entry->due - next) < 0) {
+      next = entry->due;
+    }
+  }
+
+  periodicDue = next;
+  periodicBusy = false;
+}
 
-          // call handler function
-          nodes[i]->handle[j](&tmpMsg);
+/**
+ * \param handle handle returned by addPeriodic()
+ *
+ * \returns the timing of the message, or nullptr if the handle is not in use.
+ */
+const CanPeriodicStats *CanNode::periodicStats(uint8_t handle) {
+  if (handle >= periodicUsed) {
+    return nullptr;
+  }
+  return &periodic[handle].stats;
+}
+
+void CanNode::clearPeriodicStats() {
+  periodicBusy = true;
+  for (uint8_t i = 0; i < periodicUsed; ++i) {
+    CanPeriodicStats *stats = &periodic[i].stats;
+    stats->sent = 0;
+    stats->missed = 0;
+    stats->minInterval = 0;
+    stats->maxInterval = 0;
+    stats->maxLate = 0;
+    stats->totalLate = 0;
+  }
+  periodicBusy = false;
+}
+
+/**
+ * Calls the handlers of one priority class for a single recieved message.
+ *
+ * Handlers are found through the dispatch table, one lookup by the id of the
+ * message and one by the filter number that accepted it, so the cost doesn't
+ * depend on how many nodes and filters there are. If a node answers an rtr
+ * request for one of its own ids, its user filters are not called for that
+ * message. Rtr requests, strings and transfers are handled with the high
+ * class.
+ *
+ * \param[in] msg message taken from the recieve ring
+ * \param priority \ref CanPriority of the handlers to call
+ *
+ * \returns a bit (1 << priority) for each class that has a handler for the
+ * message
+ */
+uint8_t CanNode::handleMessage(CanMessage *msg, uint8_t priority) {
+  CanNode *claimed = nullptr;
+  bool high = priority == CAN_PRIORITY_HIGH;
+  uint8_t classes = 0;
+
+  for (uint8_t e = idTable[msg->id & 0x7FF]; e != NO_ENTRY;
+       e = dispatch[e].nextId) {
+    DispatchEntry *entry = &dispatch[e];
+
+    switch (entry->kind) {
+    case DISPATCH_FILTER:
+      // call callbacks for the user defined filters
+      if (entry->node != claimed) {
+        classes |= 1 << entry->priority;
+        if (entry->priority == priority) {
+          entry->handle(msg);
+        }
+      }
+      break;
+    // CanNode takes over if the caller asks for a reserved id
+    case DISPATCH_RTR:
+      // rtr request for node data
+      if (msg->rtr) {
+        claimed = entry->node;
+        if (high && claimed->rtrHandle != nullptr) {
+          claimed->rtrHandle(msg);
         }
       }
+      break;
+    case DISPATCH_NAME:
+      // get name id if asked with an rtr
+      if (msg->rtr) {
+        claimed = entry->node;
+        if (high) {
+          claimed->sendName();
+        }
+      }
+      break;
+    case DISPATCH_INFO:
+      // get info id
+      if (msg->rtr) {
+        claimed = entry->node;
+        if (high) {
+          claimed->sendInfo();
+        }
+      }
+      break;
+    case DISPATCH_STRING:
+      // part of a string we asked for
+      if (high && !msg->rtr) {
+        recieveString(msg);
+      }
+      break;
+    case DISPATCH_TRANSPORT:
+      // segmented transfer
+      if (high) {
+        entry->handle(msg);
+      }
+      break;
     }
   }
 
-  // clear new message flag
-  newMessage = false;
+  // check if the filter match equals a filter id
+  if (msg->fmi > MAX_FILTER_NUM) {
+    return classes;
+  }
+  for (uint8_t e = fmiTable[msg->fmi]; e != NO_ENTRY;
+       e = dispatch[e].nextFmi) {
+    DispatchEntry *entry = &dispatch[e];
+    // entries for the id of the message were already called
+    if (entry->filter != msg->id && entry->node != claimed) {
+      classes |= 1 << entry->priority;
+      if (entry->priority == priority) {
+        entry->handle(msg);
+      }
+    }
+  }
+  return classes;
 }
 
 void CanNode::setName(const char *name) {
@@ -1135,121 +1508,229 @@ void CanNode::setInfo(const char *info) {
     this->infoStr = info;
 }
 
-void CanNode::getString(uint16_t id, char *buff, uint8_t len,
-                        uint8_t timeout) {
+/**
+ * Sends a request for a string to another node and returns. The characters
+ * are collected by checkForMessages() as they arrive, use stringStatus() to
+ * find out when the string is complete. Only one string can be requested at a
+ * time.
+ *
+ * \param id id the string is sent from (the node's id + 1 or + 2)
+ * \param buff character buffer to put the string into
+ * \param len length of the character buffer
+ * \param timeout length in mili-seconds before giving up on the string
+ *
+ * \returns \ref BUS_BUSY if another string is still being recieved or the
+ * request couldn't be sent, \ref DATA_ERROR if there is no room to recieve
+ * from another id or no filter left for it, \ref BUS_OK otherwise.
+ */
+CanState CanNode::getString(uint16_t id, char *buff, uint8_t len,
+                            uint16_t timeout) {
   CanMessage msg;
-  uint32_t tickStart;
+
+  if (buff == nullptr || len == 0) {
+    return DATA_ERROR;
+  }
+  // finish the last request if it timed out
+  if (stringStatus() == NO_DATA) {
+    return BUS_BUSY;
+  }
+
+  // the string frames need to get through the hardware filters and into the
+  // dispatch table, this is only done the first time an id is used
+  bool known = false;
+  for (uint8_t e = idTable[id & 0x7FF]; e != NO_ENTRY; e = dispatch[e].nextId) {
+    known |= dispatch[e].kind == DISPATCH_STRING;
+  }
+  if (!known) {
+    if (stringIds >= MAX_STRING_IDS ||
+        !addDispatch(nullptr, id, DISPATCH_STRING, nullptr)) {
+      return DATA_ERROR;
+    }
+    // without a filter the string would never arrive
+    if (can_add_filter_id(id) == CAN_FILTER_ERROR) {
+      dropDispatch();
+      return DATA_ERROR;
+    }
+    ++stringIds;
+  }
+
+  buff[0] = '\0';
+  strRequest.id = id;
+  strRequest.buff = buff;
+  strRequest.len = len;
+  strRequest.pos = 0;
+  strRequest.start = HAL_GetTick();
+  strRequest.timeout = timeout;
+  strRequest.state = NO_DATA;
+
   // send a request to the specified CanNode and query its get name address
   msg.id = id;
   msg.len = 1;
   msg.rtr = true;
   msg.data[0] = CAN_GET_NAME | (CAN_INT8 << 5);
-  can_tx(&msg, 5);
-
-  msg.id = 0;
-  // get start time
-  tickStart = HAL_GetTick();
-
-  int badMessages = 0;
-
-  char *str = buff;
-  // keep collecting data until a null character is reached, buffer is full,
-  // or a timeout condition is reached.
-  while (str - buff < len && HAL_GetTick() - tickStart < timeout) {
-    // wait for message or timeout
-    while (!is_can_msg_pending() && HAL_GetTick() - tickStart < timeout)
-      ;
-    // get the next buffer
-    can_rx(&msg, 5);
-    // check if it is from our id
-    if (msg.id != id || (msg.data[0] & 0x1F) != CAN_NAME_INFO) {
-      badMessages++;
-      if (badMessages > 10) {
-        msg.id = id;
-        msg.len = 1;
-        msg.rtr = true;
-        msg.data[0] = CAN_GET_NAME | (CAN_INT8 << 5);
-        can_tx(&msg, 5);
-        msg.id = 0;
-      }
-      HAL_Delay(50);
-      continue;
+  if (can_tx(&msg, 5) != BUS_OK) {
+    strRequest.state = DATA_ERROR;
+    return BUS_BUSY;
+  }
+  return BUS_OK;
+}
+
+/**
+ * Check on the string from the last call to requestName() or requestInfo().
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.c}
+ * char name[MAX_NAME_LEN];
+ * CanNode::requestName(THROTTLE, name, MAX_NAME_LEN, 100);
+ * while (CanNode::stringStatus() == NO_DATA) {
+ *   CanNode::checkForMessages();
+ * }
+ * ~~~~~~~~~~~~
+ *
+ * \returns \ref NO_DATA while the string is still arriving, \ref DATA_OK once
+ * the whole string is in the buffer, or \ref DATA_ERROR if the request timed
+ * out or nothing was requested. The buffer is always null terminated once
+ * this stops returning \ref NO_DATA.
+ */
+CanState CanNode::stringStatus() {
+  if (strRequest.state == NO_DATA &&
+      HAL_GetTick() - strRequest.start >= strRequest.timeout) {
+    // this makes sure that the string is null terminated
+    strRequest.buff[strRequest.len - 1] = '\0';
+    strRequest.state = DATA_ERROR;
+  }
+  return strRequest.state;
+}
+
+/**
+ * Copy the characters in a string frame into the requested buffer.
+ *
+ * \param[in] msg a message from the id the string was requested from
+ */
+void CanNode::recieveString(const CanMessage *msg) {
+  // check if it is the string we asked for
+  if (stringStatus() != NO_DATA || msg->id != strRequest.id ||
+      (msg->data[0] & 0x1F) != CAN_NAME_INFO) {
+    return;
+  }
+
+  // get all the data from this buffer
+  for (uint8_t i = 1; i < msg->len && i < 8; ++i) {
+    char c = (char)msg->data[i];
+    strRequest.buff[strRequest.pos++] = c;
+
+    if (c == '\0') {
+      strRequest.state = DATA_OK;
+      return;
     }
-    // get all the data from this buffer
-    for (uint8_t i = 1; i < msg.len && str - buff < len; ++str, ++i) {
-      *str = msg.data[i];
+    if (strRequest.pos >= strRequest.len) {
+      // buffer is full
+      strRequest.buff[strRequest.len - 1] = '\0';
+      strRequest.state = DATA_OK;
+      return;
     }
   }
-
-  // this won't hurt anything and if the function timeouted this will make sure
-  // that the string is null terminated
-  *(buff + len - 1) = '\0';
 }
 
 /**
  * Get the name string from the node of the given id and put it in a character
- * buffer.
+ * buffer. This only sends the request, see stringStatus().
  *
  * \param id id of the node that you want the name of
  * \param buff character buffer to put the name into
  * \param len length of the character buffer
  * \param timeout length in mili-seconds before giving up the message
  *
+ * \returns \ref BUS_OK if the request was sent, see getString()
+ *
  * \see CanNode_requestInfo()
  */
-void CanNode::requestName(CanNodeType id, char *buff, uint8_t len,
-                          uint16_t timeout) {
-  getString(id + 1, buff, len, timeout);
+CanState CanNode::requestName(CanNodeType id, char *buff, uint8_t len,
+                              uint16_t timeout) {
+  return getString(id + 1, buff, len, timeout);
 }
 
 /**
  * Get the info string from the node of the given id and put it in a character
- * buffer. The function will never deliver more than \ref MAX_INFO_LEN.
+ * buffer. The function will never deliver more than \ref MAX_INFO_LEN. This
+ * only sends the request, see stringStatus().
  *
  * \param id id of the node that you want the information string of
  * \param info character buffer to put the info string into
  * \param buff_len length of the character buffer
  * \param timeout length in mili-seconds before giving up the message
  *
+ * \returns \ref BUS_OK if the request was sent, see getString()
+ *
  * \see CanNode_requestName()
  */
-void CanNode::requestInfo(CanNodeType id, char *buff, uint8_t len,
-                          uint16_t timeout) {
-  getString(id + 2, buff, len, timeout);
+CanState CanNode::requestInfo(CanNodeType id, char *buff, uint8_t len,
+                              uint16_t timeout) {
+  return getString(id + 2, buff, len, timeout);
 }
 
+/**
+ * Start sending a string, seven characters to a frame. The frames are sent by
+ * checkForMessages(), one each time it is called and only when the transmit
+ * mailboxes are empty and nothing is queued, so a string never delays the
+ * node's other messages. A new string replaces one that is still being sent.
+ *
+ * \param id id to send the string on
+ * \param str null terminated string to send
+ */
 void CanNode::sendString(uint16_t id, const char *str) {
-  CanMessage msg;
-  msg.id = id;
-  msg.rtr = false;
-  msg.data[0] = CAN_NAME_INFO | CAN_INT8 << 5;
-
-  bool msgFinished = false;
-
-  //fill buffers and send them 
-  const char *namePtr = str;
   //check that there is valid data to transmit
-  if(namePtr == nullptr){
-      return;
+  if (str == nullptr) {
+    return;
+  }
+  if (this->txStr == nullptr) {
+    ++activeStrings;
   }
-  //loop while the string is valid
-  while (!msgFinished) {
+  this->txStr = str;
+  this->txStrId = id;
+}
+
+/**
+ * Send the next frame of every string that is being sent, if the transmit
+ * mailboxes have room for it.
+ */
+void CanNode::advanceStrings() {
+  for (uint8_t i = 0; i < MAX_NODES && activeStrings > 0; ++i) {
+    CanNode *node = nodes[i];
+    if (node == nullptr || node->txStr == nullptr) {
+      continue;
+    }
+    // let the node's real time messages go first, waiting for every mailbox
+    // to empty also keeps the frames of a string in order since mailboxes
+    // with the same id are sent lowest mailbox first
+    if (can_tx_pending() > 0 || can_tx_free_mailboxes() < CAN_TX_MAILBOXES) {
+      return;
+    }
+
+    CanMessage msg;
+    msg.id = node->txStrId;
+    msg.rtr = false;
+    msg.data[0] = CAN_NAME_INFO | CAN_INT8 << 5;
 
     // break if end of name has been reached
+    const char *namePtr = node->txStr;
     for (msg.len = 1; msg.len < 8; msg.len++, namePtr++) {
-
       // set data
       msg.data[msg.len] = *namePtr;
-      if(*namePtr == '\0'){
-          msgFinished = true;
-          msg.len++;
-          break;
+      if (*namePtr == '\0') {
+        namePtr = nullptr;
+        msg.len++;
+        break;
       }
+    }
 
+    if (can_tx(&msg, 5) == BUS_OK) {
+      node->txStr = namePtr;
+      if (namePtr == nullptr) {
+        --activeStrings;
+      }
     }
-    //transmit data with 5ms timeout
-    can_tx(&msg, 5);
-    HAL_Delay(50);
   }
 }
 
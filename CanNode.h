@@ -18,8 +18,12 @@
 #include <cstdlib>
 #include <cstring>
 #include <cstdbool>
+#include <type_traits>
 #include "CanTypes.h"
 #include "can_driver.h" // low level CAN driver
+#include "can_ring.h"
+#include "can_latency.h"
+#include "can_send_policy.h"
 
 using std::int8_t;
 using std::uint8_t;
@@ -46,6 +50,107 @@ using std::uint32_t;
  */
 typedef void (*filterHandler)(CanMessage *data);
 
+/**
+ * \enum CanPriority
+ * \brief When the handler of a filter is called
+ *
+ * \see CanNode::addFilter
+ */
+typedef enum {
+  CAN_PRIORITY_IMMEDIATE,  ///< From the receive interrupt as soon as the message
+                           ///< arrives, the handler has to be short
+  CAN_PRIORITY_HIGH,       ///< From checkForMessages() as messages are taken
+                           ///< out of the receive ring (the default)
+  CAN_PRIORITY_BACKGROUND  ///< From checkForMessages() once the receive ring is
+                           ///< empty, while there is time left in the budget
+} CanPriority;
+
+/// Number of \ref CanPriority classes
+#define CAN_PRIORITIES 3
+
+/**
+ * \struct CanPriorityStats
+ * \brief Timing of the handlers of one \ref CanPriority class
+ *
+ * Times are in micro-seconds. The latency runs from when the message was
+ * recieved to when its handlers of the class started. Without CAN_TIMESTAMPS
+ * the time a message was recieved is not known, it is then counted from the
+ * start of the checkForMessages() call that took it out of the receive ring
+ * and is 0 for the immediate class.
+ */
+typedef struct {
+  uint32_t messages;    ///< messages the class's handlers were called for
+  uint32_t maxLatency;  ///< longest time a message waited for the handlers
+  uint32_t maxDuration; ///< longest time the handlers of a message took
+  uint32_t dropped;     ///< messages that didn't fit in the class's queue
+} CanPriorityStats;
+
+/**
+ * \typedef periodicHandler
+ * \brief Function that fills in a message the scheduler is about to send
+ *
+ * The id is already set to the id of the node, the function sets the data and
+ * length, for example with CanNode::encode().
+ *
+ * \see CanNode::addPeriodic
+ */
+typedef void (*periodicHandler)(CanMessage *msg);
+
+/// Let addPeriodic() pick the phase that spreads the bus load the most
+#define CAN_PHASE_AUTO 0xFFFF
+/// Returned by addPeriodic() if the schedule is full
+#define CAN_NO_PERIODIC 0xFF
+
+/**
+ * \struct CanPeriodicStats
+ * \brief Timing of a message sent by the periodic scheduler
+ *
+ * Times are in micro-seconds from can_time_us(). A message is late by the
+ * time between when it was due and when it was handed to the driver, so the
+ * lateness is the jitter the scheduler adds. The intervals are between the
+ * frames handed to the driver.
+ */
+typedef struct {
+  uint16_t id;          ///< id the message is sent on
+  uint16_t period;      ///< mili-seconds between messages
+  uint16_t phase;       ///< mili-seconds after each multiple of the period
+  uint32_t sent;        ///< messages handed to the driver
+  uint32_t missed;      ///< periods skipped or not accepted by the driver
+  uint32_t minInterval; ///< shortest time between two messages
+  uint32_t maxInterval; ///< longest time between two messages
+  uint32_t maxLate;     ///< longest time a message was late
+  uint32_t totalLate;   ///< sum of the lateness of every message
+} CanPeriodicStats;
+
+/**
+ * \struct CanDataType
+ * \brief The \ref CanNodeDataType of each integer type send() and get() take.
+ *
+ * Only the types below have a tag, using send() or get() with any other type
+ * fails to compile.
+ */
+template <typename T> struct CanDataType;
+/// \cond
+template <> struct CanDataType<int8_t> {
+  static constexpr CanNodeDataType type = CAN_INT8;
+};
+template <> struct CanDataType<uint8_t> {
+  static constexpr CanNodeDataType type = CAN_UINT8;
+};
+template <> struct CanDataType<int16_t> {
+  static constexpr CanNodeDataType type = CAN_INT16;
+};
+template <> struct CanDataType<uint16_t> {
+  static constexpr CanNodeDataType type = CAN_UINT16;
+};
+template <> struct CanDataType<int32_t> {
+  static constexpr CanNodeDataType type = CAN_INT32;
+};
+template <> struct CanDataType<uint32_t> {
+  static constexpr CanNodeDataType type = CAN_UINT32;
+};
+/// \endcond
+
 /** \addtogroup CanNode_Module CanNode
  * \brief Library to provide a higher level protocol for CAN communication.
  * Specifically for stm32 microcontrollers
@@ -129,54 +234,240 @@ typedef void (*filterHandler)(CanMessage *data);
  */
 
 class CanNode {
+  // channels add themselves to the dispatch table
+  friend class CanTransport;
 
 
 private:
+  /// Largest filter id that is a filter number from can_add_filter_mask()
+  static const uint8_t MAX_FILTER_NUM = 52;
+  /// Number of different ids strings can be requested from
+  static const uint8_t MAX_STRING_IDS = 4;
+  /// Size of the dispatch table, three intrinsic entries and the filters for
+  /// each node, the ids strings were requested from and the transport channels
+  static const uint16_t DISPATCH_SIZE =
+      MAX_NODES * (3 + NUM_FILTERS) + MAX_STRING_IDS + MAX_TRANSPORTS;
+  /// Marks the end of a chain in the dispatch table
+  static const uint8_t NO_ENTRY = 0xFF;
+  static_assert(DISPATCH_SIZE < NO_ENTRY,
+                "MAX_NODES, NUM_FILTERS and MAX_TRANSPORTS are too large for "
+                "the dispatch table");
+
+  /// What the dispatch table does with a message that matches an entry
+  enum DispatchKind : uint8_t {
+    DISPATCH_RTR,   ///< rtr request for node data, calls rtrHandle
+    DISPATCH_NAME,  ///< rtr request for the name string
+    DISPATCH_INFO,  ///< rtr request for the info string
+    DISPATCH_FILTER, ///< user filter added with addFilter()
+    DISPATCH_STRING, ///< part of a string requested with getString()
+    DISPATCH_TRANSPORT ///< frame for a CanTransport channel, calls handle
+  };
+
+  /// An entry in the recieve dispatch table
+  struct DispatchEntry {
+    CanNode *node;        ///< node the entry belongs to
+    filterHandler handle; ///< handler for DISPATCH_FILTER entries
+    uint16_t filter;      ///< id (or filter number) to match
+    uint8_t kind;         ///< a \ref DispatchKind
+    uint8_t priority;     ///< a \ref CanPriority, the other kinds are high
+    uint8_t nextId;       ///< next entry with the same id
+    uint8_t nextFmi;      ///< next entry with the same filter number
+  };
+
+  /// A message waiting for its background handlers
+  struct Deferred {
+    CanMessage msg;    ///< copy of the message
+    uint32_t recieved; ///< time the latency of the message is counted from
+  };
+
+  /// A message sent by the periodic scheduler
+  struct PeriodicEntry {
+    CanNode *node;          ///< node the message is sent from
+    periodicHandler fill;   ///< fills in the message
+    uint32_t due;           ///< tick the message is due
+    uint32_t last;          ///< can_time_us() of the last message sent
+    CanPeriodicStats stats; ///< timing kept for periodicStats()
+  };
+
+  /// State of the string requested with getString()
+  struct StringRequest {
+    uint16_t id;      ///< id the string is sent from
+    char *buff;       ///< buffer the string goes into
+    uint8_t len;      ///< length of buff
+    uint8_t pos;      ///< number of characters recieved
+    uint32_t start;   ///< tick the request was sent
+    uint16_t timeout; ///< mili-seconds to wait for the whole string
+    CanState state;   ///< value returned by stringStatus()
+  };
+
   static bool newMessage;
-  static CanMessage tmpMsg;
+#ifdef CAN_TIMESTAMPS
+  static CanLatencyTable latencyTable; ///< wait and handler time per id
+#endif
+  static CanRing<Deferred, CAN_BACKGROUND_QUEUE_SIZE> background;
+  static uint32_t backgroundBudget; ///< us background handlers can start in
+  static CanPriorityStats priorityTimes[CAN_PRIORITIES]; ///< per class timing
+  static StringRequest strRequest;
+  static uint8_t activeStrings; ///< nodes that have a string to send
+  static uint8_t stringIds;     ///< ids with a \ref DISPATCH_STRING entry
   static CanNode *nodes[MAX_NODES];
 
+  static PeriodicEntry periodic[MAX_PERIODIC]; ///< the periodic schedule
+  static uint8_t periodicUsed;                 ///< entries of periodic in use
+  static uint32_t periodicDue;   ///< tick the next periodic message is due
+  static volatile bool periodicBusy; ///< publishPeriodic() is running
+
+  static DispatchEntry dispatch[DISPATCH_SIZE]; ///< all handlers of all nodes
+  static uint8_t dispatchUsed;                  ///< entries of dispatch in use
+  static uint8_t idTable[0x800]; ///< first entry for each 11-bit id
+  static uint8_t fmiTable[MAX_FILTER_NUM + 1]; ///< first entry for each
+                                               ///< filter number
+
+  /// \brief Add an entry to the dispatch table.
+  static bool addDispatch(CanNode *node, uint16_t filter, uint8_t kind,
+                          filterHandler handle,
+                          uint8_t priority = CAN_PRIORITY_HIGH);
+  /// \brief Take back the last entry added to the dispatch table.
+  static void dropDispatch();
+  /// \brief Call the handlers of one class for a recieved message.
+  static uint8_t handleMessage(CanMessage *msg, uint8_t priority);
+  /// \brief Call the immediate handlers from the receive interrupt.
+  static void handleImmediate(CanMessage *msg);
+  /// \brief Call background handlers while there is budget left.
+  static void runBackground(uint32_t start);
+  /// \brief Add a message to the timing of a class.
+  static void recordPriority(uint8_t priority, uint32_t latency,
+                             uint32_t duration);
+  /// \brief First byte of a data message holding T.
+  template <typename T> static constexpr uint8_t configByte() {
+    return (uint8_t)(((0x7 & CanDataType<T>::type) << 5) | (0x1F & CAN_DATA));
+  }
+  /// \brief Write an integer least significant byte first.
+  template <typename T> static void pack(uint8_t *out, T value) {
+    uint32_t bits = (typename std::make_unsigned<T>::type)value;
+    out[0] = (uint8_t)bits;
+    if (sizeof(T) > 1) {
+      out[1] = (uint8_t)(bits >> 8);
+    }
+    if (sizeof(T) > 2) {
+      out[2] = (uint8_t)(bits >> 16);
+      out[3] = (uint8_t)(bits >> 24);
+    }
+  }
+  /// \brief Read an integer written by pack().
+  template <typename T> static T unpack(const uint8_t *in) {
+    uint32_t bits = in[0];
+    if (sizeof(T) > 1) {
+      bits |= (uint32_t)in[1] << 8;
+    }
+    if (sizeof(T) > 2) {
+      bits |= (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    }
+    return (T)(typename std::make_unsigned<T>::type)bits;
+  }
+
+  /// \brief Phase that overlaps the least with the scheduled messages.
+  static uint16_t spreadPhase(uint16_t period);
+  /// \brief Send a message from the node unless its send policy holds it back.
+  CanState transmit(CanMessage *msg, uint16_t kind) const;
+  /// \brief Send the next part of the strings nodes are sending.
+  static void advanceStrings();
+  /// \brief Add part of the requested string from a message.
+  static void recieveString(const CanMessage *msg);
+
   uint16_t id;                   ///< id of the node
   uint8_t status;                ///< status of the node (not currently used)
-  uint16_t filters[NUM_FILTERS]; ///< array of id's to handle
+  uint8_t numFilters;            ///< number of filters added with addFilter()
   filterHandler rtrHandle;       ///< function to handle rtr requests for
                                  /// the node
 
-  filterHandler handle[NUM_FILTERS]; ///< array of function pointers to call
-                                     ///< when a id in filters is found
   CanNodeType sensorType;            ///< Type of sensor
   const char *nameStr;               ///< points to the name of the node
   const char *infoStr;               ///< points to the info string for the node
+  const char *txStr;                 ///< rest of the string being sent
+  uint16_t txStrId;                  ///< id the string is being sent on
+  mutable CanSendPolicy policy;      ///< which messages go on the bus
 
 public:
   /// \brief Initilize a CanNode from given parameters.
   CanNode(CanNodeType id, filterHandler rtrHandle);
   /// \brief Add a filter and handler to a given CanNode.
-  bool addFilter(uint16_t filter, filterHandler handle);
+  bool addFilter(uint16_t filter, filterHandler handle,
+                 CanPriority priority = CAN_PRIORITY_HIGH);
   /// \brief Check all initilized CanNodes for messages and call callbacks.
   static void checkForMessages();
+  /// \brief Halt until there are messages and then check for them.
+  static void waitForMessages(uint32_t timeout);
+  /// \brief Keep a message given to a handler after the handler returns.
+  static CanMessage *retain(CanMessage *msg);
+  /// \brief Let go of a message kept with retain().
+  static void release(CanMessage *msg);
+  /// \brief Set how long into checkForMessages() background handlers start.
+  static void setBackgroundBudget(uint32_t us);
+  /// \brief Timing of the handlers of a priority class.
+  static const CanPriorityStats *priorityStats(CanPriority priority);
+  /// \brief Start the timing of every priority class over.
+  static void clearPriorityStats();
+
+  /**
+   * \anchor periodicFunctions
+   * \name Periodic Functions
+   * These functions send a node's messages at a fixed rate. The messages go
+   * out from checkForMessages(), or from publishPeriodic() called in a timer
+   * interrupt for less jitter.
+   * @{
+   */
+  /// \brief Send a message from the node every period mili-seconds.
+  uint8_t addPeriodic(uint16_t period, periodicHandler fill,
+                      uint16_t phase = CAN_PHASE_AUTO);
+  /// \brief Send the periodic messages that are due.
+  static void publishPeriodic();
+  /// \brief Timing of a periodic message, nullptr if there is none.
+  static const CanPeriodicStats *periodicStats(uint8_t handle);
+  /// \brief Start the timing of every periodic message over.
+  static void clearPeriodicStats();
+  //@}
+
+#ifdef CAN_TIMESTAMPS
+  /// \brief Latency histograms of an id, nullptr if none are kept for it.
+  static const CanLatency *latency(uint16_t id);
+  /// \brief Latency histograms of every recieved message.
+  static const CanLatency *latencyTotal();
+  /// \brief Start the latency histograms over.
+  static void clearLatency();
+#endif
 
   /**
    * \anchor sendData
    * \name sendData Functions
    * These functions that send data over the CANBus and support various integer
-   * types of data. They are non-blocking.
+   * types of data. They are non-blocking, if all the transmit mailboxes are
+   * full the message waits in the driver's transmit queue.
    * @{
    */
   /// \brief Send a signed 8-bit integer.
-  void sendData_int8(int8_t data) const;
+  CanState sendData_int8(int8_t data) const;
   /// \brief Send an unsigned 8-bit integer.
-  void sendData_uint8(uint8_t data) const;
+  CanState sendData_uint8(uint8_t data) const;
   /// \brief Send a signed 16-bit integer.
-  void sendData_int16(int16_t data) const;
+  CanState sendData_int16(int16_t data) const;
   /// \brief Send an unsigned 16-bit integer.
-  void sendData_uint16(uint16_t data) const;
+  CanState sendData_uint16(uint16_t data) const;
   /// \brief Send a signed 32-bit integer.
-  void sendData_int32(int32_t data) const;
+  CanState sendData_int32(int32_t data) const;
   /// \brief Send an unsigned 32-bit integer.
-  void sendData_uint32(uint32_t data) const;
+  CanState sendData_uint32(uint32_t data) const;
   /// \brief Send a custom CanMessage.
-  void sendData_custom(CanMessage* data) const;
+  CanState sendData_custom(CanMessage* data) const;
+
+  /// \brief Only send messages that changed by more than a deadband.
+  void setSendPolicy(uint32_t deadband, uint16_t minInterval,
+                     uint16_t maxInterval, const CanSignal *layout = nullptr,
+                     uint8_t numSignals = 0);
+  /// \brief Send every message again.
+  void clearSendPolicy();
+  /// \brief The send policy and how many messages it let through and held back.
+  const CanSendPolicy *sendPolicy() const { return &policy; }
 
   /// \brief Send an array of uinsigned 8-bit integers.
   CanState sendDataArr_int8(int8_t *data, uint8_t len) const;
@@ -186,6 +477,82 @@ public:
   CanState sendDataArr_int16(int16_t *data, uint8_t len) const;
   /// \brief Send an array of signed 16-bit integers.
   CanState sendDataArr_uint16(uint16_t *data, uint8_t len) const;
+
+  /**
+   * Send an integer, the type byte and the length come from the type of
+   * value.
+   *
+   * ~~~~~~~~~~~~ {.cpp}
+   * node.send<uint16_t>(rpm);
+   * ~~~~~~~~~~~~
+   */
+  template <typename T> CanState send(T value) const {
+    CanMessage msg;
+    encode(&msg, value);
+    msg.id = this->id;
+    return transmit(&msg, msg.data[0]);
+  }
+
+  /**
+   * Keep a value ready as the answer to remote requests for the node's id.
+   * The receive interrupt answers them straight away with the last value
+   * published, without waiting for checkForMessages(), and the node's rtr
+   * handler is no longer called. Publish again whenever the value changes.
+   *
+   * ~~~~~~~~~~~~ {.cpp}
+   * node.publish<uint16_t>(rpm);
+   * ~~~~~~~~~~~~
+   *
+   * \returns false if \ref CAN_RTR_RESPONSES nodes already publish a value
+   */
+  template <typename T> bool publish(T value) const {
+    CanMessage msg;
+    encode(&msg, value);
+    msg.id = this->id;
+    return can_rtr_response_set(&msg);
+  }
+  /// \brief Publish a custom CanMessage as the answer to remote requests.
+  bool publishData_custom(CanMessage *msg) const;
+  /// \brief Answer remote requests with the rtr handler again.
+  void unpublish() const;
+
+  /// \brief Fill in the data, length and rtr fields of a message holding T.
+  template <typename T> static void encode(CanMessage *msg, T value) {
+    msg->data[0] = configByte<T>();
+    pack(&msg->data[1], value);
+    msg->len = 1 + sizeof(T);
+    msg->rtr = false;
+  }
+
+  /**
+   * Send an array of integers whose size is known when compiling, an array
+   * that doesn't fit in a message doesn't compile.
+   */
+  template <typename T, uint8_t N> CanState sendArr(const T (&data)[N]) const {
+    static_assert(N * sizeof(T) <= 7, "the array doesn't fit in a message");
+    return sendArr(data, N);
+  }
+
+  /**
+   * Send an array of len integers.
+   *
+   * \returns \ref DATA_OVERFLOW if the array doesn't fit in a message,
+   * otherwise the same as send().
+   */
+  template <typename T> CanState sendArr(const T *data, uint8_t len) const {
+    CanMessage msg;
+    if (len > 7 / sizeof(T)) {
+      return DATA_OVERFLOW;
+    }
+    msg.data[0] = configByte<T>();
+    for (uint8_t i = 0; i < len; ++i) {
+      pack(&msg.data[1 + i * sizeof(T)], data[i]);
+    }
+    msg.len = (uint8_t)(1 + len * sizeof(T));
+    msg.rtr = false;
+    msg.id = this->id;
+    return transmit(&msg, msg.data[0]);
+  }
   //@}
 
   /**
@@ -221,6 +588,45 @@ public:
   static CanState getDataArr_int16(const CanMessage *msg, int16_t data[3], uint8_t *len);
   /// \brief Get an array of unsigned 16-bit integers from a CanMessage.
   static CanState getDataArr_uint16(const CanMessage *msg, uint16_t data[3], uint8_t *len);
+
+  /**
+   * Get an integer of type T from a CanMessage.
+   *
+   * \returns \ref DATA_ERROR if the message is null, \ref INVALID_TYPE if the
+   * message doesn't hold a T or \ref DATA_OK.
+   */
+  template <typename T> static CanState get(const CanMessage *msg, T *data) {
+    if (msg == nullptr) {
+      return DATA_ERROR;
+    }
+    if (msg->data[0] != configByte<T>() || msg->len != 1 + sizeof(T)) {
+      return INVALID_TYPE;
+    }
+    *data = unpack<T>(&msg->data[1]);
+    return DATA_OK;
+  }
+
+  /**
+   * Get an array of integers of type T from a CanMessage. data needs room for
+   * 7 / sizeof(T) integers.
+   *
+   * \returns the same as get(), the number of integers is put in len.
+   */
+  template <typename T>
+  static CanState getArr(const CanMessage *msg, T *data, uint8_t *len) {
+    if (msg == nullptr) {
+      return DATA_ERROR;
+    }
+    if (msg->data[0] != configByte<T>() || msg->len < 1 || msg->len > 8 ||
+        (msg->len - 1) % sizeof(T) != 0) {
+      return INVALID_TYPE;
+    }
+    *len = (uint8_t)((msg->len - 1) / sizeof(T));
+    for (uint8_t i = 0; i < *len; ++i) {
+      data[i] = unpack<T>(&msg->data[1 + i * sizeof(T)]);
+    }
+    return DATA_OK;
+  }
   //@}
 
   /**
@@ -228,7 +634,8 @@ public:
    * \name Info Functions
    * These functions handle names for the \ref CanNode_Module library. They
    * allow for providing a name and descriptive text for a node and requesting
-   * the same information from another node.
+   * the same information from another node. Strings are sent and recieved a
+   * frame at a time from checkForMessages(), so none of these functions wait.
    * @{
    */
   /// \brief Set the name string
@@ -236,11 +643,13 @@ public:
   /// \brief Set the info string
   void setInfo(const char *info);
   /// \brief request the name string from another CanNode
-  static void requestName(CanNodeType id, char *buff, uint8_t len,
-                          uint16_t timeout);
+  static CanState requestName(CanNodeType id, char *buff, uint8_t len,
+                              uint16_t timeout);
   /// \brief request the info string from another CanNode
-  static void requestInfo(CanNodeType id, char *buff, uint8_t len,
-                          uint16_t timeout);
+  static CanState requestInfo(CanNodeType id, char *buff, uint8_t len,
+                              uint16_t timeout);
+  /// \brief Check on a string requested with requestName() or requestInfo()
+  static CanState stringStatus();
 
   // private functions to handle CanNode name functions
 
@@ -259,9 +668,10 @@ public:
   void sendInfo();
 
   /// \brief Get a string
-  static void getString(uint16_t id, char *buff, uint8_t len, uint8_t timeout);
+  static CanState getString(uint16_t id, char *buff, uint8_t len,
+                            uint16_t timeout);
   /// \brief Send a string
-  static void sendString(uint16_t id, const char *str);
+  void sendString(uint16_t id, const char *str);
 
 };
 #endif //_CAN_NODE_H_
@@ -0,0 +1,204 @@
+/**
+ * \file CanSignal.h
+ * \brief Bit level signals packed several to a frame.
+ *
+ * The sendData functions spend the first byte of every frame on the type and
+ * send one value per frame. A node with several readings to report can put
+ * them all in one frame instead by describing where each one goes, much like
+ * the signal list of a DBC file:
+ *
+ * | Field    | Meaning                                                   |
+ * |----------|-----------------------------------------------------------|
+ * | start    | first (least significant) bit, bit 0 is bit 0 of data[0]  |
+ * | length   | number of bits, 1 - 32                                    |
+ * | isSigned | the raw value is two's complement                         |
+ * | scale    | physical value = raw * scale + offset                     |
+ * | offset   |                                                           |
+ *
+ * Signals are little endian (Intel byte order in DBC terms), the same order
+ * the rest of CanNode uses, and may cross byte boundaries. Frames of signals
+ * carry no type byte, the id says which layout the frame has.
+ *
+ * A layout is a constexpr array of \ref CanSignal, canSignalsFit() checks it
+ * when the program is compiled. Because the signals are constants the masks
+ * and shifts in CanSignalFrame are worked out by the compiler and each
+ * signal ends up as a couple of and, or and shift instructions.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * // 12-bit position in 0.025 % steps and a temperature from -40 to 215 C
+ * constexpr CanSignal servoPos(0, 12, false, 0.025f, 0.0f);
+ * constexpr CanSignal servoTemp(12, 8, false, 1.0f, -40.0f);
+ * constexpr CanSignal servoCurrent(20, 10, true, 0.01f, 0.0f);
+ * constexpr CanSignal servoLayout[] = {servoPos, servoTemp, servoCurrent};
+ * static_assert(canSignalsFit(servoLayout, 4), "servo signals overlap");
+ *
+ * void sendServo(CanNode *node) {
+ *   CanMessage msg;
+ *   CanSignalFrame frame;
+ *   frame.set(servoPos, position);
+ *   frame.set(servoTemp, temperature);
+ *   frame.set(servoCurrent, current);
+ *   frame.write(&msg, 4);
+ *   node->sendData_custom(&msg);
+ * }
+ *
+ * void servoHandler(CanMessage *msg) {
+ *   CanSignalFrame frame(msg);
+ *   float position = frame.get(servoPos);
+ * }
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_SIGNAL_H_
+#define _CAN_SIGNAL_H_
+
+#include "CanTypes.h"
+#include <stddef.h>
+
+/**
+ * \defgroup CanSignal_Module CanSignal
+ * \brief Several values packed in one frame
+ *@{
+ */
+
+/**
+ * \struct CanSignal
+ * \brief Where a value is in a frame and how it is scaled.
+ */
+struct CanSignal {
+  uint8_t start;  ///< least significant bit, counted from bit 0 of data[0]
+  uint8_t length; ///< number of bits, 1 - 32
+  bool isSigned;  ///< raw value is two's complement
+  float scale;    ///< size of one raw step
+  float offset;   ///< physical value of a raw 0
+
+  constexpr CanSignal(uint8_t start, uint8_t length, bool isSigned = false,
+                      float scale = 1.0f, float offset = 0.0f)
+      : start(start), length(length), isSigned(isSigned), scale(scale),
+        offset(offset) {}
+
+  /// \brief Bits of the frame the signal takes.
+  constexpr uint64_t mask() const {
+    return (((uint64_t)1 << length) - 1) << start;
+  }
+  /// \brief Smallest raw value.
+  constexpr int64_t rawMin() const {
+    return isSigned ? -((int64_t)1 << (length - 1)) : 0;
+  }
+  /// \brief Largest raw value.
+  constexpr int64_t rawMax() const {
+    return isSigned ? ((int64_t)1 << (length - 1)) - 1
+                    : ((int64_t)1 << length) - 1;
+  }
+  /// \brief Check the signal fits in a frame of len bytes.
+  constexpr bool fits(uint8_t len) const {
+    return length >= 1 && length <= 32 && len <= 8 && start + length <= len * 8;
+  }
+};
+
+/**
+ * Check every signal of a layout fits in a frame of len bytes and no two of
+ * them share a bit. Meant for a static_assert next to the layout.
+ */
+template <size_t N>
+constexpr bool canSignalsFit(const CanSignal (&layout)[N], uint8_t len) {
+  uint64_t used = 0;
+  for (size_t i = 0; i < N; ++i) {
+    if (!layout[i].fits(len) || (used & layout[i].mask())) {
+      return false;
+    }
+    used |= layout[i].mask();
+  }
+  return true;
+}
+
+/**
+ * \class CanSignalFrame
+ * \brief Data of one frame while signals are put in or taken out.
+ *
+ * The eight data bytes are kept as one 64-bit word so a signal that crosses
+ * bytes is a single shift. Reading a message or writing one back copies the
+ * bytes once.
+ */
+class CanSignalFrame {
+private:
+  uint64_t bits;
+
+public:
+  /// \brief Start an empty frame, every bit not set by a signal is 0.
+  constexpr CanSignalFrame() : bits(0) {}
+
+  /// \brief Take the data of a recieved message.
+  explicit CanSignalFrame(const CanMessage *msg) : bits(0) {
+    for (uint8_t i = 0; i < msg->len && i < 8; ++i) {
+      bits |= (uint64_t)msg->data[i] << (8 * i);
+    }
+  }
+
+  /**
+   * Put a raw value in a signal. Bits above the length of the signal are
+   * dropped, use set() to have out of range values clamped.
+   */
+  CanSignalFrame &setRaw(const CanSignal &sig, int32_t raw) {
+    bits = (bits & ~sig.mask()) | (((uint64_t)(uint32_t)raw << sig.start) &
+                                   sig.mask());
+    return *this;
+  }
+
+  /**
+   * Put a physical value in a signal. The value is rounded to the nearest
+   * step and clamped to what the signal can hold.
+   */
+  CanSignalFrame &set(const CanSignal &sig, float value) {
+    float raw = (value - sig.offset) / sig.scale;
+    raw += raw < 0 ? -0.5f : 0.5f;
+    if (raw <= (float)sig.rawMin()) {
+      return setRaw(sig, (int32_t)sig.rawMin());
+    }
+    if (raw >= (float)sig.rawMax()) {
+      return setRaw(sig, (int32_t)sig.rawMax());
+    }
+    return setRaw(sig, (int32_t)(int64_t)raw);
+  }
+
+  /// \brief Raw value of a signal, sign extended if the signal is signed.
+  int32_t getRaw(const CanSignal &sig) const {
+    uint32_t raw = (uint32_t)((bits & sig.mask()) >> sig.start);
+    if (sig.isSigned && sig.length < 32 &&
+        (raw & ((uint32_t)1 << (sig.length - 1)))) {
+      raw |= ~(uint32_t)0 << sig.length;
+    }
+    return (int32_t)raw;
+  }
+
+  /// \brief Raw value of an unsigned signal.
+  uint32_t getUnsigned(const CanSignal &sig) const {
+    return (uint32_t)((bits & sig.mask()) >> sig.start);
+  }
+
+  /// \brief Physical value of a signal.
+  float get(const CanSignal &sig) const {
+    float raw = sig.isSigned ? (float)getRaw(sig) : (float)getUnsigned(sig);
+    return raw * sig.scale + sig.offset;
+  }
+
+  /**
+   * Copy the frame into a message. Only the data and length are set, the id
+   * is filled in by CanNode::sendData_custom().
+   *
+   * \param msg message to write
+   * \param len bytes the layout needs, up to 8
+   */
+  void write(CanMessage *msg, uint8_t len = 8) const {
+    msg->len = len > 8 ? 8 : len;
+    msg->rtr = false;
+    for (uint8_t i = 0; i < 8; ++i) {
+      msg->data[i] = (uint8_t)(bits >> (8 * i));
+    }
+  }
+};
+
+//@}
+#endif // _CAN_SIGNAL_H_
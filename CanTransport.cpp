@@ -0,0 +1,375 @@
+/**
+ * \file CanTransport.cpp
+ * \brief Segmented transport state machines.
+ */
+
+#include "CanTransport.h"
+#include "CanNode.h"
+
+CanTransport *CanTransport::channels[MAX_TRANSPORTS];
+uint8_t CanTransport::numChannels = 0;
+
+/**
+ * Opens a channel and adds its recieve id to the hardware filters and the
+ * CanNode dispatch table. Create channels after the first CanNode, up to
+ * \ref MAX_TRANSPORTS of them. If there is no room left, in the channels, the
+ * dispatch table or the filters, the channel is never given any frames.
+ *
+ * \param txId id this end of the channel sends on
+ * \param rxId id the other end of the channel sends on
+ * \param buff buffer for recieved blocks, blocks longer than this are refused
+ * \param len length of buff
+ * \param handle function called when a block has been recieved, can be nullptr
+ */
+CanTransport::CanTransport(uint16_t txId, uint16_t rxId, uint8_t *buff,
+                           uint16_t len, transportHandler handle) {
+  this->txId = txId & 0x7FF;
+  this->rxId = rxId & 0x7FF;
+
+  this->txData = nullptr;
+  this->txLen = 0;
+  this->txPos = 0;
+  this->txSeq = 0;
+  this->txBlock = 0;
+  this->txStMin = 0;
+  this->txStep = TX_IDLE;
+  this->txTime = 0;
+  this->txState = DATA_OK;
+
+  this->rxBuff = buff;
+  this->rxSize = buff == nullptr ? 0 : len;
+  this->rxLen = 0;
+  this->rxPos = 0;
+  this->rxSeq = 0;
+  this->rxBlock = 0;
+  this->blockSize = 0;
+  this->stMin = 0;
+  this->rxTime = 0;
+  this->rxState = NO_DATA;
+  this->lost = 0;
+  this->handle = handle;
+
+  if (numChannels >= MAX_TRANSPORTS) {
+    return;
+  }
+
+  // handleFrame() gives a frame to every channel on its id, so each id only
+  // needs one dispatch entry and one filter
+  bool shared = false;
+  for (uint8_t i = 0; i < numChannels; ++i) {
+    shared |= channels[i]->rxId == this->rxId;
+  }
+  if (!shared) {
+    if (!CanNode::addDispatch(nullptr, this->rxId,
+                              CanNode::DISPATCH_TRANSPORT, handleFrame)) {
+      return;
+    }
+    // without a filter the channel would never get a frame
+    if (can_add_filter_id(this->rxId) == CAN_FILTER_ERROR) {
+      CanNode::dropDispatch();
+      return;
+    }
+  }
+  channels[numChannels++] = this;
+}
+
+/**
+ * Sets what the flow control frames of this channel ask the sender for. The
+ * default of 0 and 0 lets the sender send the whole block as fast as it can.
+ *
+ * \param blockSize consecutive frames before the sender waits for the next
+ * flow control frame, 0 for no limit
+ * \param stMin minimum time between consecutive frames, 0 - 127 ms or
+ * 0xF1 - 0xF9 for 100 - 900 us
+ */
+void CanTransport::setFlowControl(uint8_t blockSize, uint8_t stMin) {
+  this->blockSize = blockSize;
+  this->stMin = stMin;
+}
+
+/**
+ * Starts sending a block to the other end of the channel. Blocks of up to
+ * seven bytes go out as a single frame, longer ones as a first frame followed
+ * by consecutive frames as the reciever's flow control allows. The data is not
+ * copied and has to stay valid until sendStatus() stops returning \ref NO_DATA.
+ *
+ * \param data block to send
+ * \param len length of the block, up to \ref CAN_TP_MAX_LEN
+ *
+ * \returns \ref BUS_OK if the transfer was started, \ref BUS_BUSY if a block is
+ * still being sent or the first frame couldn't be queued, \ref DATA_OVERFLOW if
+ * the block is too long and \ref DATA_ERROR if there is no data.
+ */
+CanState CanTransport::send(const uint8_t *data, uint16_t len) {
+  CanMessage msg;
+
+  if (data == nullptr || len == 0) {
+    return DATA_ERROR;
+  }
+  if (len > CAN_TP_MAX_LEN) {
+    return DATA_OVERFLOW;
+  }
+  if (txStep != TX_IDLE) {
+    return BUS_BUSY;
+  }
+
+  msg.id = txId;
+  msg.rtr = false;
+
+  if (len <= 7) {
+    msg.len = len + 1;
+    msg.data[0] = TP_SINGLE | len;
+    memcpy(&msg.data[1], data, len);
+    txState = can_tx(&msg, 5) == BUS_OK ? DATA_OK : BUS_BUSY;
+    return txState;
+  }
+
+  msg.len = 8;
+  msg.data[0] = TP_FIRST | (len >> 8);
+  msg.data[1] = len & 0xFF;
+  memcpy(&msg.data[2], data, 6);
+  if (can_tx(&msg, 5) != BUS_OK) {
+    return BUS_BUSY;
+  }
+
+  txData = data;
+  txLen = len;
+  txPos = 6;
+  txSeq = 1;
+  txStep = TX_WAIT_FC;
+  txTime = HAL_GetTick();
+  txState = NO_DATA;
+  return BUS_OK;
+}
+
+/**
+ * Send the consecutive frames that are allowed now. Frames are only handed to
+ * the driver while its transmit queue is empty, that keeps the mailboxes busy
+ * without crowding out other messages waiting in the queue.
+ */
+void CanTransport::advanceSend(uint32_t now) {
+  while (txStep == TX_SENDING && can_tx_pending() == 0) {
+    // a tick can end right after the last frame, wait one more to be sure the
+    // gap is at least STmin
+    if (txStMin > 0 && now - txTime <= txStMin) {
+      return;
+    }
+
+    CanMessage msg;
+    uint16_t chunk = txLen - txPos < 7 ? txLen - txPos : 7;
+    msg.id = txId;
+    msg.rtr = false;
+    msg.len = chunk + 1;
+    msg.data[0] = TP_CONSECUTIVE | txSeq;
+    memcpy(&msg.data[1], &txData[txPos], chunk);
+    if (can_tx(&msg, 5) != BUS_OK) {
+      return;
+    }
+
+    txPos += chunk;
+    txSeq = (txSeq + 1) & 0x0F;
+    txTime = now;
+
+    if (txPos >= txLen) {
+      txStep = TX_IDLE;
+      txState = DATA_OK;
+    } else if (txBlock > 0 && --txBlock == 0) {
+      txStep = TX_WAIT_FC;
+    }
+  }
+}
+
+/**
+ * Flow control from the reciever of the block being sent.
+ */
+void CanTransport::recieveFlowControl(const CanMessage *msg) {
+  if (txStep != TX_WAIT_FC || msg->len < 3) {
+    return;
+  }
+
+  txTime = HAL_GetTick();
+  switch (msg->data[0] & 0x0F) {
+  case TP_CTS:
+    txBlock = msg->data[1];
+    txStMin = msg->data[2];
+    if (txStMin > 0x7F) {
+      // 100 - 900 us, the tick only counts whole mili-seconds
+      txStMin = (txStMin >= 0xF1 && txStMin <= 0xF9) ? 1 : 0x7F;
+    }
+    txStep = TX_SENDING;
+    // the first frame of a block goes out right away
+    txTime -= txStMin + 1;
+    break;
+  case TP_WAIT:
+    break;
+  default:
+    // the reciever has no room for the block
+    txStep = TX_IDLE;
+    txState = DATA_OVERFLOW;
+    break;
+  }
+}
+
+void CanTransport::sendFlowControl(FlowStatus status) {
+  CanMessage msg;
+  msg.id = txId;
+  msg.rtr = false;
+  msg.len = 3;
+  msg.data[0] = TP_FLOW_CONTROL | status;
+  msg.data[1] = blockSize;
+  msg.data[2] = stMin;
+  can_tx(&msg, 5);
+}
+
+/**
+ * Single, first and consecutive frames of a block from the other end.
+ */
+void CanTransport::recieveFrame(const CanMessage *msg) {
+  uint8_t pci = msg->data[0];
+
+  switch (pci & 0xF0) {
+  case TP_SINGLE: {
+    uint8_t len = pci & 0x0F;
+    if (len == 0 || len > 7 || len + 1 > msg->len) {
+      return;
+    }
+    if (rxState == NO_DATA && rxLen > 0) {
+      // a new block replaces one that wasn't finished
+      ++lost;
+    }
+    if (len > rxSize) {
+      rxLen = 0;
+      rxState = DATA_OVERFLOW;
+      return;
+    }
+    memcpy(rxBuff, &msg->data[1], len);
+    rxLen = len;
+    rxState = DATA_OK;
+    break;
+  }
+  case TP_FIRST: {
+    uint16_t len = (uint16_t)((pci & 0x0F) << 8) | msg->data[1];
+    if (len <= 7 || msg->len < 8) {
+      return;
+    }
+    if (rxState == NO_DATA && rxLen > 0) {
+      ++lost;
+    }
+    if (len > rxSize) {
+      rxLen = 0;
+      rxState = DATA_OVERFLOW;
+      sendFlowControl(TP_OVERFLOW);
+      return;
+    }
+    memcpy(rxBuff, &msg->data[2], 6);
+    rxLen = len;
+    rxPos = 6;
+    rxSeq = 1;
+    rxBlock = blockSize;
+    rxTime = HAL_GetTick();
+    rxState = NO_DATA;
+    sendFlowControl(TP_CTS);
+    return;
+  }
+  case TP_CONSECUTIVE: {
+    if (rxState != NO_DATA || rxLen == 0) {
+      return;
+    }
+    if ((pci & 0x0F) != rxSeq) {
+      // a frame went missing, the block can't be put back together
+      ++lost;
+      rxLen = 0;
+      rxState = DATA_ERROR;
+      return;
+    }
+    uint16_t chunk = rxLen - rxPos < 7 ? rxLen - rxPos : 7;
+    if (chunk + 1 > msg->len) {
+      ++lost;
+      rxLen = 0;
+      rxState = DATA_ERROR;
+      return;
+    }
+    memcpy(&rxBuff[rxPos], &msg->data[1], chunk);
+    rxPos += chunk;
+    rxSeq = (rxSeq + 1) & 0x0F;
+    rxTime = HAL_GetTick();
+
+    if (rxPos < rxLen) {
+      if (blockSize > 0 && --rxBlock == 0) {
+        rxBlock = blockSize;
+        sendFlowControl(TP_CTS);
+      }
+      return;
+    }
+    rxState = DATA_OK;
+    break;
+  }
+  default:
+    return;
+  }
+
+  // the block is complete
+  if (handle != nullptr) {
+    handle(this, rxLen);
+  }
+}
+
+/**
+ * Called by the dispatch table for frames on the recieve id of a channel.
+ */
+void CanTransport::handleFrame(CanMessage *msg) {
+  if (msg->rtr || msg->len == 0) {
+    return;
+  }
+
+  for (uint8_t i = 0; i < numChannels; ++i) {
+    CanTransport *channel = channels[i];
+    if (channel->rxId != msg->id) {
+      continue;
+    }
+    if ((msg->data[0] & 0xF0) == TP_FLOW_CONTROL) {
+      channel->recieveFlowControl(msg);
+    } else {
+      channel->recieveFrame(msg);
+    }
+  }
+}
+
+/**
+ * Sends the consecutive frames that are due and gives up on transfers whose
+ * other end has gone quiet for \ref CAN_TP_TIMEOUT.
+ */
+void CanTransport::poll() {
+  uint32_t now = HAL_GetTick();
+
+  for (uint8_t i = 0; i < numChannels; ++i) {
+    CanTransport *channel = channels[i];
+
+    if (channel->txStep == TX_WAIT_FC &&
+        now - channel->txTime >= CAN_TP_TIMEOUT) {
+      channel->txStep = TX_IDLE;
+      channel->txState = DATA_ERROR;
+    }
+    channel->advanceSend(now);
+
+    if (channel->rxState == NO_DATA && channel->rxLen > 0 &&
+        now - channel->rxTime >= CAN_TP_TIMEOUT) {
+      ++channel->lost;
+      channel->rxLen = 0;
+      channel->rxState = DATA_ERROR;
+    }
+  }
+}
+
+/**
+ * Consecutive frames go out from poll() as the mailboxes empty and STmin
+ * passes, no message arrives to say they are due.
+ */
+bool CanTransport::sending() {
+  for (uint8_t i = 0; i < numChannels; ++i) {
+    if (channels[i]->txStep == TX_SENDING) {
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,165 @@
+/**
+ * \file CanTransport.h
+ * \brief Segmented transport for payloads that don't fit in one CAN frame.
+ *
+ * A CanTransport is a channel between two nodes that moves blocks of up to
+ * 4095 bytes using the ISO 15765-2 (ISO-TP) framing:
+ *
+ * | Frame        | data[0]    | Rest of the frame                          |
+ * |--------------|------------|--------------------------------------------|
+ * | Single       | 0x0 \| len | up to 7 bytes of payload                   |
+ * | First        | 0x1 \| len | low byte of the length, 6 bytes of payload |
+ * | Consecutive  | 0x2 \| seq | up to 7 bytes of payload                   |
+ * | Flow control | 0x3 \| fs  | block size, STmin                          |
+ *
+ * The receiver answers a first frame with a flow control frame that says how
+ * many consecutive frames may be sent before it answers again (the block size,
+ * 0 for all of them) and the minimum time between them (STmin). Consecutive
+ * frames carry a 4-bit sequence number, a frame that is missing or out of
+ * order ends the transfer with an error instead of handing on a corrupt block.
+ *
+ * A channel sends on one id and recieves on another, the other end of the
+ * channel uses the same two ids the other way round. Transfers in both
+ * directions can run at the same time and every channel runs independently of
+ * the others. Channels are serviced by CanNode::checkForMessages(), nothing in
+ * this module waits.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * uint8_t config[512];
+ * void configHandler(CanTransport *channel, uint16_t len);
+ *
+ * void main(void) {
+ *   CanNode node(THROTTLE, throttleRTR);
+ *   CanTransport channel(THROTTLE + 3, 1400, config, sizeof(config),
+ *                        configHandler);
+ *
+ *   channel.send(samples, sizeof(samples));
+ *   while (true) {
+ *     CanNode::checkForMessages();
+ *   }
+ * }
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_TRANSPORT_H_
+#define _CAN_TRANSPORT_H_
+
+#include "CanTypes.h"
+#include "can_driver.h"
+
+/**
+ * \defgroup CanTransport_Module CanTransport
+ * \brief Segmented transfers between two nodes
+ *@{
+ */
+
+#ifndef CAN_TP_TIMEOUT
+/// Mili-seconds to wait for the next flow control or consecutive frame before
+/// a transfer is given up (N_Bs and N_Cr). Can be overwriten by redefinition
+#define CAN_TP_TIMEOUT 1000
+#endif
+
+/// Largest block a single transfer can carry
+#define CAN_TP_MAX_LEN 4095
+
+class CanTransport;
+
+/**
+ * \typedef transportHandler
+ * \brief Called when a channel has recieved a whole block.
+ *
+ * The block is in the buffer given to the channel, it stays there until the
+ * next first or single frame arrives.
+ */
+typedef void (*transportHandler)(CanTransport *channel, uint16_t len);
+
+/**
+ * \class CanTransport
+ * \brief Channel for segmented transfers to and from another node.
+ */
+class CanTransport {
+private:
+  /// Protocol control information, the high nibble of data[0]
+  enum FrameType : uint8_t {
+    TP_SINGLE = 0x00,
+    TP_FIRST = 0x10,
+    TP_CONSECUTIVE = 0x20,
+    TP_FLOW_CONTROL = 0x30
+  };
+
+  /// Flow status of a flow control frame
+  enum FlowStatus : uint8_t { TP_CTS = 0, TP_WAIT = 1, TP_OVERFLOW = 2 };
+
+  /// What the sending side is doing
+  enum TxStep : uint8_t { TX_IDLE, TX_WAIT_FC, TX_SENDING };
+
+  static CanTransport *channels[MAX_TRANSPORTS]; ///< open channels
+  static uint8_t numChannels; ///< channels in use, packed at the start
+
+  /// \brief Hand a frame from the dispatch table to its channel.
+  static void handleFrame(CanMessage *msg);
+  /// \brief Send the flow control frame for the block being recieved.
+  void sendFlowControl(FlowStatus status);
+  /// \brief Send consecutive frames that are due.
+  void advanceSend(uint32_t now);
+  void recieveFlowControl(const CanMessage *msg);
+  void recieveFrame(const CanMessage *msg);
+
+  uint16_t txId; ///< id frames are sent on
+  uint16_t rxId; ///< id frames are recieved on
+
+  // sending side
+  const uint8_t *txData; ///< block being sent
+  uint16_t txLen;        ///< length of the block being sent
+  uint16_t txPos;        ///< bytes handed to the driver
+  uint8_t txSeq;         ///< sequence number of the next consecutive frame
+  uint8_t txBlock;       ///< frames left in this block, 0 if unlimited
+  uint8_t txStMin;       ///< mili-seconds between consecutive frames
+  uint8_t txStep;        ///< \ref TxStep
+  uint32_t txTime;       ///< tick of the last frame sent or recieved
+  CanState txState;      ///< value returned by sendStatus()
+
+  // recieving side
+  uint8_t *rxBuff;          ///< buffer recieved blocks go in
+  uint16_t rxSize;          ///< size of rxBuff
+  uint16_t rxLen;           ///< length of the block being recieved
+  uint16_t rxPos;           ///< bytes recieved so far
+  uint8_t rxSeq;            ///< expected sequence number
+  uint8_t rxBlock;          ///< frames left before the next flow control
+  uint8_t blockSize;        ///< block size asked for in flow control frames
+  uint8_t stMin;            ///< STmin asked for in flow control frames
+  uint32_t rxTime;          ///< tick of the last frame recieved
+  CanState rxState;         ///< value returned by recieveStatus()
+  uint32_t lost;            ///< transfers lost to missing frames or timeouts
+  transportHandler handle;  ///< called when a block is complete
+
+public:
+  /// \brief Open a channel to another node.
+  CanTransport(uint16_t txId, uint16_t rxId, uint8_t *buff, uint16_t len,
+               transportHandler handle);
+
+  /// \brief Start sending a block.
+  CanState send(const uint8_t *data, uint16_t len);
+  /// \brief State of the last block sent.
+  CanState sendStatus() const { return txState; }
+
+  /// \brief State of the block being recieved.
+  CanState recieveStatus() const { return rxState; }
+  /// \brief Length of the last complete block.
+  uint16_t recieved() const { return rxState == DATA_OK ? rxLen : 0; }
+  /// \brief Number of incoming transfers that were lost.
+  uint32_t lostTransfers() const { return lost; }
+
+  /// \brief Set the block size and frame spacing the sender is asked for.
+  void setFlowControl(uint8_t blockSize, uint8_t stMin);
+
+  /// \brief Move all the channels along, called by CanNode::checkForMessages().
+  static void poll();
+  /// \brief A channel has consecutive frames left to send.
+  static bool sending();
+};
+
+//@}
+#endif // _CAN_TRANSPORT_H_
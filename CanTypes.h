@@ -27,6 +27,35 @@
 #define NUM_FILTERS 10
 #endif
 
+#ifndef MAX_TRANSPORTS
+/// Maximum number of CanTransport channels. Can be overwriten by redefinition
+#define MAX_TRANSPORTS 4
+#endif
+
+#ifndef CAN_BACKGROUND_QUEUE_SIZE
+/// Number of messages that can wait for their background handlers. Must be a
+/// power of two. Can be overwriten by redefinition
+#define CAN_BACKGROUND_QUEUE_SIZE 8
+#endif
+
+#ifndef CAN_BACKGROUND_BUDGET
+/// Micro-seconds into a checkForMessages() call that background handlers can
+/// still be started. Can be overwriten by redefinition
+#define CAN_BACKGROUND_BUDGET 1000
+#endif
+
+#ifndef MAX_PERIODIC
+/// Maximum number of messages sent by the periodic scheduler. Can be overwriten
+/// by redefinition
+#define MAX_PERIODIC 16
+#endif
+
+/*
+ * Define CAN_TIMESTAMPS to give every recieved message the time it arrived in
+ * CanMessage::timestamp and to keep latency histograms (see can_latency.h).
+ * Messages are four bytes bigger with it.
+ */
+
 /// Maximum length of a name string for the CanNode_getName()
 #define MAX_NAME_LEN 30
 /// Maximum length of a info string for the CanNode_getInfo()
@@ -114,7 +143,8 @@ typedef enum {
                  ///used
   DATA_OVERFLOW, ///< Too much data was was put in the message
   BUS_BUSY,      ///< The bus is working with someone else right now
-  BUS_OFF        ///< The bus is off - call can_init() and can_enable()
+  BUS_OFF        ///< The controller is off the bus, see can_enable() and
+                 ///< can_set_recovery()
 } CanState;
 
 
@@ -133,6 +163,9 @@ typedef struct {
   uint8_t fmi;     ///< Filter mask index (what filter triggered message)                           
   bool rtr;        ///< Asking for data (true) or sending data (false)                              
   uint8_t data[8]; ///< Data                                                                        
+#ifdef CAN_TIMESTAMPS
+  uint32_t timestamp; ///< can_time_us() when the message was recieved
+#endif
 } CanMessage;
 
 /**
@@ -0,0 +1,86 @@
+/**
+ * autobaud_bench.cpp
+ * \brief Measures how long can_autobaud() takes to find each bitrate.
+ *
+ * For every bitrate the bus is reset and two remote nodes are added at that
+ * bitrate, one of them sends a frame every \ref PERIOD_US micro-seconds and
+ * the other acknowledges it. The time from the call to can_autobaud() to its
+ * return is measured on the simulated bus clock. Bitrates late in the order
+ * can_autobaud() tries take longer, since every wrong bitrate before them
+ * costs a frame.
+ *
+ * A last case runs on a bus with no traffic and checks that detection gives
+ * up once \ref TIMEOUT_MS is over.
+ *
+ * Writes one result per bitrate, the case is autobaud_<bitrate>, in ns per
+ * detection. Exits with 1 if a bitrate is detected wrong or a detection takes
+ * longer than the timeout.
+ */
+#include <cstdio>
+#include "CanNode.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t PERIOD_US = 10000;
+static const uint32_t TIMEOUT_MS = 500;
+
+static const struct {
+  canBitrate bitrate;
+  const char *name;
+} RATES[] = {
+    {CAN_BITRATE_10K, "autobaud_10k"},   {CAN_BITRATE_20K, "autobaud_20k"},
+    {CAN_BITRATE_50K, "autobaud_50k"},   {CAN_BITRATE_100K, "autobaud_100k"},
+    {CAN_BITRATE_125K, "autobaud_125k"}, {CAN_BITRATE_250K, "autobaud_250k"},
+    {CAN_BITRATE_500K, "autobaud_500k"}, {CAN_BITRATE_750K, "autobaud_750k"},
+    {CAN_BITRATE_1000K, "autobaud_1000k"},
+};
+
+// find the bitrate of the bus, returns the time it took in ns
+static uint64_t detect(canBitrate *found, CanState *state) {
+  can_init();
+  uint64_t start = can_sim_time_ns();
+  *state = can_autobaud(found, CAN_AUTOBAUD_LISTEN, TIMEOUT_MS);
+  return can_sim_time_ns() - start;
+}
+
+int main(int argc, char **argv) {
+  CanMessage msg = {ENGINE_TEMP, 3, 0, false, {CAN_UINT16 << 5, 0x12, 0x34}};
+  int failed = 0;
+
+  bench_open("autobaud_bench", argc, argv);
+  for (const auto &rate : RATES) {
+    can_sim_reset();
+    uint8_t sender = can_sim_add_node(rate.bitrate);
+    can_sim_add_node(rate.bitrate);
+    can_sim_send_periodic(sender, &msg, PERIOD_US);
+
+    canBitrate found = CAN_BITRATE_500K;
+    CanState state;
+    uint64_t ns = detect(&found, &state);
+    bench_result(rate.name, (double)ns);
+
+    if (state != BUS_OK || found != rate.bitrate) {
+      fprintf(stderr, "%s: detected %d with state %d\n", rate.name, found,
+              state);
+      failed = 1;
+    } else if (ns > (uint64_t)TIMEOUT_MS * 1000000) {
+      fprintf(stderr, "%s: took longer than the timeout\n", rate.name);
+      failed = 1;
+    }
+  }
+
+  // nothing to hear, detection has to give up in time
+  can_sim_reset();
+  canBitrate found;
+  CanState state;
+  uint64_t ns = detect(&found, &state);
+  bench_result("autobaud_silent", (double)ns);
+  if (state != NO_DATA || ns > ((uint64_t)TIMEOUT_MS + 1) * 1000000) {
+    fprintf(stderr, "autobaud_silent: state %d after %llu ns\n", state,
+            (unsigned long long)ns);
+    failed = 1;
+  }
+
+  bench_close();
+  return failed;
+}
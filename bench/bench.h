@@ -0,0 +1,97 @@
+/**
+ * \file bench.h
+ * \brief Helpers shared by the host benchmarks.
+ *
+ * The benchmarks are built against the simulated bus, for example
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * g++ -std=c++14 -O2 -DCAN_HOST -I. *.cpp bench/frame_bench.cpp -o frame_bench
+ * ./frame_bench results.csv $(git rev-parse --short HEAD)
+ * ~~~~~~~~~~~~
+ *
+ * Every benchmark writes its results as CSV rows to stdout, and appends them
+ * to the file given as the first argument if there is one. The second
+ * argument is a label, usually the commit, so the rows of several builds can
+ * go in one file and be compared. Each row is
+ *
+ * | Column      | Meaning                                            |
+ * |-------------|----------------------------------------------------|
+ * | label       | second argument, empty if not given                |
+ * | bench       | name of the benchmark program                      |
+ * | case        | what was measured                                  |
+ * | max_nodes   | \ref MAX_NODES the library was built with          |
+ * | num_filters | \ref NUM_FILTERS the library was built with        |
+ * | ns_per_op   | nano-seconds per frame or per call                 |
+ *
+ * The dispatch cost depends on the table sizes, build dispatch_bench with
+ * different -DMAX_NODES= and -DNUM_FILTERS= to cover them.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include "CanTypes.h"
+
+/// \brief Nano-seconds on a monotonic clock.
+static inline uint64_t bench_now_ns() {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/// \brief Keep the compiler from optimizing away a value.
+template <typename T> static inline void bench_keep(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+static FILE *bench_file = nullptr;
+static const char *bench_name = "";
+static const char *bench_label = "";
+
+/**
+ * Open the results file named on the command line and print the header. The
+ * header only goes in the file when the file is new.
+ *
+ * \param name name of the benchmark for the bench column
+ */
+static inline void bench_open(const char *name, int argc, char **argv) {
+  bench_name = name;
+  if (argc > 2) {
+    bench_label = argv[2];
+  }
+  if (argc > 1) {
+    bench_file = fopen(argv[1], "a");
+    if (bench_file == nullptr) {
+      perror(argv[1]);
+    } else if (fseek(bench_file, 0, SEEK_END) == 0 &&
+               ftell(bench_file) == 0) {
+      fprintf(bench_file,
+              "label,bench,case,max_nodes,num_filters,ns_per_op\n");
+    }
+  }
+  printf("label,bench,case,max_nodes,num_filters,ns_per_op\n");
+}
+
+/// \brief Write one result row.
+static inline void bench_result(const char *name, double ns) {
+  const char *format = "%s,%s,%s,%u,%u,%.2f\n";
+  printf(format, bench_label, bench_name, name, (unsigned)MAX_NODES,
+         (unsigned)NUM_FILTERS, ns);
+  if (bench_file != nullptr) {
+    fprintf(bench_file, format, bench_label, bench_name, name,
+            (unsigned)MAX_NODES, (unsigned)NUM_FILTERS, ns);
+  }
+}
+
+/// \brief Close the results file.
+static inline void bench_close() {
+  if (bench_file != nullptr) {
+    fclose(bench_file);
+    bench_file = nullptr;
+  }
+}
+
+#endif // _BENCH_H_
@@ -0,0 +1,117 @@
+/**
+ * busoff_bench.cpp
+ * \brief Measures how long the node takes to get back on the bus after a
+ * bus-off with each recovery policy.
+ *
+ * The node sends a frame every mili-second to a remote node. For each case a
+ * second remote node is set to the wrong bitrate, its error flags destroy
+ * every frame the node sends until the node goes bus-off. The faulty node is
+ * fixed right then and the bus runs for another \ref RUN_MS. Everything runs
+ * on the stopped bus clock, so the times are bus times and don't depend on how
+ * fast the machine is.
+ *
+ * Writes busoff_<case>, the time from the bus-off until the node was back in
+ * ns. The driver notices it is back when a frame gets through or, with
+ * nothing to send, at the next CanNode::checkForMessages(), so the cases that
+ * throw the frames away come out up to a mili-second later.
+ *
+ * Exits with 1 if the node doesn't recover, if the recovery without ABOM
+ * doesn't wait for \ref CAN_RECOVERY_BACKOFF_MIN, or if a frame is lost when
+ * the policy keeps them or sent when it throws them away.
+ */
+#include <cstdio>
+#include "CanNode.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t RUN_MS = 100;
+static const uint16_t ID = 0x100;
+
+// 128 times 11 recessive bits at 500 kbit/s
+static const uint32_t RECOVERY_US = 128 * 11 * 2;
+
+static uint8_t ecu;
+static uint8_t faulty;
+static uint32_t given; // frames given to can_tx()
+
+static void rtr(CanMessage *msg) { bench_keep(msg); }
+
+// send a frame and let the bus run for a mili-second
+static void tick() {
+  CanMessage msg = {ID, 2, 0, false, {0}};
+  msg.data[0] = (uint8_t)given;
+  msg.data[1] = (uint8_t)(given >> 8);
+  ++given;
+  can_tx(&msg, 0);
+  CanNode::waitForMessages(1);
+}
+
+// one bus-off with a policy, returns the recovery time in us or 0 if the node
+// didn't recover, and the frames the ecu got
+static uint32_t recover(CanRecoveryPolicy policy, bool flush, CanStats *st,
+                        uint32_t *recieved) {
+  can_set_recovery(policy, flush);
+  can_stats_reset();
+  given = 0;
+  // counts frames even when its FIFO is full
+  uint32_t before = can_sim_controller(ecu)->rx_frames;
+
+  can_sim_controller(faulty)->bitrate = CAN_BITRATE_250K;
+  do {
+    tick();
+    can_stats_snapshot(st);
+  } while (st->bus_offs == 0);
+  can_sim_controller(faulty)->bitrate = CAN_BITRATE_500K;
+
+  for (uint32_t ms = 0; ms < RUN_MS; ++ms) {
+    tick();
+  }
+  can_stats_snapshot(st);
+  *recieved = can_sim_controller(ecu)->rx_frames - before;
+  return st->recoveries == 1 ? st->recover_us : 0;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    CanRecoveryPolicy policy;
+    bool flush;
+    const char *name;
+  } CASES[] = {
+      {CAN_RECOVER_AUTO, false, "busoff_auto"},
+      {CAN_RECOVER_AUTO, true, "busoff_auto_flush"},
+      {CAN_RECOVER_BACKOFF, false, "busoff_backoff"},
+      {CAN_RECOVER_BACKOFF, true, "busoff_backoff_flush"},
+  };
+  int failed = 0;
+
+  can_sim_set_speed(0);
+  CanNode node(THROTTLE, rtr);
+  ecu = can_sim_add_node(CAN_BITRATE_500K);
+  faulty = can_sim_add_node(CAN_BITRATE_500K);
+
+  bench_open("busoff_bench", argc, argv);
+  for (const auto &c : CASES) {
+    CanStats st;
+    uint32_t recieved;
+    uint32_t us = recover(c.policy, c.flush, &st, &recieved);
+    bench_result(c.name, us * 1000.0);
+
+    uint32_t lost = given - recieved;
+    fprintf(stderr, "%s: back after %u us, %u of %u frames not sent\n",
+            c.name, us, lost, given);
+    if (us < RECOVERY_US) {
+      failed = 1;
+    }
+    // the wait is counted in whole ticks of HAL_GetTick()
+    if (c.policy == CAN_RECOVER_BACKOFF &&
+        us < (CAN_RECOVERY_BACKOFF_MIN - 1) * 1000 + RECOVERY_US) {
+      failed = 1;
+    }
+    if (c.flush ? lost != st.tx_flushed + st.tx_aborted : lost != 0) {
+      failed = 1;
+    }
+  }
+
+  bench_close();
+  return failed;
+}
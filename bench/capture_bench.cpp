@@ -0,0 +1,132 @@
+/**
+ * capture_bench.cpp
+ * \brief Measures recording several full buses to a capture file and
+ * converting it to and from candump text.
+ *
+ * Built like the other benchmarks, it needs no CAN hardware:
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * g++ -std=c++14 -O2 -DCAN_HOST -I. *.cpp bench/capture_bench.cpp \
+ *     -lpthread -o capture_bench
+ * ./capture_bench results.csv $(git rev-parse --short HEAD)
+ * ~~~~~~~~~~~~
+ *
+ * \ref BUSES threads each record frames as a full 1 Mbit/s bus would carry
+ * them, \ref FRAMES_PER_MS every mili-second for \ref RUN_MS mili-seconds,
+ * into a CanCaptureWriter. The capture is then turned into candump text and
+ * back.
+ *
+ * Writes the cases capture_record, the time of CanCaptureWriter::record() in
+ * ns, and capture_to_candump and capture_from_candump in ns per frame. The
+ * size of the file per second of bus time goes to stderr. Exits with 1 if a
+ * frame is lost or the conversion doesn't give back the same frames.
+ */
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <sys/stat.h>
+#include "can_capture.h"
+#include "bench.h"
+
+static const uint8_t BUSES = 4;
+// short frames, the most a 1 Mbit/s bus carries
+static const uint32_t FRAMES_PER_MS = 16;
+static const uint32_t RUN_MS = 2000;
+static const char *CAPTURE = "capture_bench.cap";
+static const char *CANDUMP = "capture_bench.log";
+static const char *CONVERTED = "capture_bench_converted.cap";
+
+static std::atomic<uint64_t> record_ns;
+
+// one bus, records its frames every mili-second like a receive thread
+static void bus(CanCaptureWriter *writer, uint8_t index) {
+  CanMessage msg = {(uint16_t)(0x100 + index), 2, 0, false, {0, 0}};
+  uint64_t spent = 0;
+  uint64_t start = bench_now_ns();
+  for (uint32_t ms = 0; ms < RUN_MS; ++ms) {
+    while (bench_now_ns() - start < ms * 1000000ull) {
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    uint64_t begin = bench_now_ns();
+    for (uint32_t i = 0; i < FRAMES_PER_MS; ++i) {
+      msg.data[0] = (uint8_t)i;
+      msg.data[1] = (uint8_t)ms;
+      writer->record(index, &msg);
+    }
+    spent += bench_now_ns() - begin;
+  }
+  record_ns += spent;
+}
+
+int main(int argc, char **argv) {
+  static CanCaptureWriter writer;
+  int failed = 0;
+
+  bench_open("capture_bench", argc, argv);
+  for (uint8_t i = 0; i < BUSES; ++i) {
+    char name[8];
+    snprintf(name, sizeof(name), "can%u", i);
+    writer.setName(i, name);
+  }
+  if (!writer.open(CAPTURE)) {
+    fprintf(stderr, "can't create %s\n", CAPTURE);
+    return 1;
+  }
+  std::thread threads[BUSES];
+  for (uint8_t i = 0; i < BUSES; ++i) {
+    threads[i] = std::thread(bus, &writer, i);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  writer.close();
+
+  uint32_t expected = BUSES * FRAMES_PER_MS * RUN_MS;
+  bench_result("capture_record", (double)record_ns / expected);
+  struct stat info;
+  stat(CAPTURE, &info);
+  fprintf(stderr, "%u frames, %u lost, %.0f kB per second\n", writer.written(),
+          writer.lost(), info.st_size / 1024.0 / (RUN_MS / 1000.0));
+  if (writer.written() != expected || writer.lost() != 0 || writer.error()) {
+    failed = 1;
+  }
+
+  FILE *text = fopen(CANDUMP, "w");
+  uint64_t begin = bench_now_ns();
+  int32_t out = can_capture_to_candump(CAPTURE, text);
+  bench_result("capture_to_candump",
+               (double)(bench_now_ns() - begin) / expected);
+  fclose(text);
+
+  text = fopen(CANDUMP, "r");
+  begin = bench_now_ns();
+  int32_t in = can_capture_from_candump(text, CONVERTED);
+  bench_result("capture_from_candump",
+               (double)(bench_now_ns() - begin) / expected);
+  fclose(text);
+
+  // candump keeps micro-seconds, the frames have to match all the same
+  CanCaptureReader first, second;
+  first.open(CAPTURE);
+  second.open(CONVERTED);
+  CanBusFrame a, b;
+  uint32_t same = 0;
+  while (first.next(&a) && second.next(&b) && a.bus == b.bus &&
+         a.msg.id == b.msg.id && a.msg.len == b.msg.len &&
+         memcmp(a.msg.data, b.msg.data, a.msg.len) == 0 &&
+         a.time / 1000 == b.time / 1000) {
+    ++same;
+  }
+  if (out != (int32_t)expected || in != out || same != expected) {
+    fprintf(stderr, "%d frames to candump, %d back, %u the same\n", out, in,
+            same);
+    failed = 1;
+  }
+
+  remove(CAPTURE);
+  remove(CANDUMP);
+  remove(CONVERTED);
+  bench_close();
+  return failed;
+}
@@ -0,0 +1,69 @@
+/**
+ * dispatch_bench.cpp
+ * \brief Measures the cost of CanNode::checkForMessages() per frame as nodes
+ * and filters are added.
+ *
+ * Nodes are added one at a time, each with \ref NUM_FILTERS filters. After each
+ * node a ring's worth of frames is put straight into the receive path with
+ * can_sim_inject() and only the call to checkForMessages() is timed. Frames
+ * cycle through every registered filter id, so each one calls one handler.
+ *
+ * Writes one result per node count, the case is dispatch_nodes_<n>. Build it
+ * with different MAX_NODES and NUM_FILTERS to see how the table sizes matter.
+ */
+#include <cstdio>
+#include "CanNode.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t ROUNDS = 20000;
+static uint32_t handled = 0;
+
+static void rtr(CanMessage *msg) { bench_keep(msg); }
+
+static void handler(CanMessage *msg) {
+  bench_keep(msg);
+  ++handled;
+}
+
+int main(int argc, char **argv) {
+  uint16_t ids[MAX_NODES * NUM_FILTERS];
+  uint16_t numIds = 0;
+
+  bench_open("dispatch_bench", argc, argv);
+  for (uint8_t n = 0; n < MAX_NODES; ++n) {
+    CanNode *node = new CanNode((CanNodeType)(100 + 4 * n), rtr);
+    for (uint8_t f = 0; f < NUM_FILTERS; ++f) {
+      ids[numIds] = 1000 + numIds;
+      node->addFilter(ids[numIds], handler);
+      ++numIds;
+    }
+
+    uint64_t total = 0;
+    uint32_t frames = 0;
+    uint16_t next = 0;
+    for (uint32_t round = 0; round < ROUNDS; ++round) {
+      for (uint16_t i = 0; i < CAN_RX_RING_SIZE; ++i) {
+        CanMessage msg = {ids[next], 2, 0xFF, false, {0x20, (uint8_t)i}};
+        next = (next + 1) % numIds;
+        can_sim_inject(CAN_SIM_LOCAL, &msg);
+      }
+      uint64_t start = bench_now_ns();
+      CanNode::checkForMessages();
+      total += bench_now_ns() - start;
+      frames += CAN_RX_RING_SIZE;
+    }
+
+    char name[32];
+    snprintf(name, sizeof(name), "dispatch_nodes_%u", n + 1);
+    bench_result(name, (double)total / frames);
+  }
+
+  bench_close();
+  if (handled != (uint32_t)MAX_NODES * ROUNDS * CAN_RX_RING_SIZE) {
+    fprintf(stderr, "handled %u frames, expected %u\n", handled,
+            (unsigned)MAX_NODES * ROUNDS * CAN_RX_RING_SIZE);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,265 @@
+/**
+ * frame_bench.cpp
+ * \brief Measures every sendData and getData function and the name and info
+ * string path, per frame.
+ *
+ * The send cases go through can_tx() into the simulated mailboxes. The
+ * mailboxes are emptied by hand after every call, as if the frame had gone out
+ * right away, so every call takes the path straight into a mailbox and never
+ * the transmit queue. On the host can_tx() also brings the simulated bus up to
+ * date, send_custom is the cost of that and the mailbox with no encoding.
+ *
+ * The decode cases run over a buffer of messages that is filled before they
+ * are timed.
+ *
+ * The string cases time checkForMessages() while a 30 character name goes out
+ * one frame at a time, and while the frames of a requested name are put
+ * straight into the receive path with can_sim_inject().
+ *
+ * Writes one result per case, in ns per frame.
+ */
+#include <cstdio>
+#include <cstring>
+#include "CanNode.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t ROUNDS = 200000;
+static const uint16_t BATCH = 256;
+static CanMessage msgs[BATCH];
+
+static const char NAME[] = "Throttle body servo controller";
+
+static void rtr(CanMessage *msg) { bench_keep(msg); }
+
+// pretend the frames in the mailboxes were sent
+static void drain() {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    can->mailbox[box].pending = false;
+  }
+}
+
+template <typename F> static void send(const char *name, F body) {
+  uint64_t start = bench_now_ns();
+  for (uint32_t round = 0; round < ROUNDS; ++round) {
+    body(round);
+    drain();
+  }
+  uint64_t total = bench_now_ns() - start;
+  bench_result(name, (double)total / ROUNDS);
+}
+
+// fill the buffer with messages for the decode cases
+template <typename F> static void fill(F encode) {
+  for (uint16_t i = 0; i < BATCH; ++i) {
+    encode(&msgs[i], i * 2654435761u);
+  }
+}
+
+template <typename F> static void get(const char *name, F body) {
+  uint64_t start = bench_now_ns();
+  for (uint32_t round = 0; round < ROUNDS / BATCH * 16; ++round) {
+    for (uint16_t i = 0; i < BATCH; ++i) {
+      body(&msgs[i]);
+    }
+    bench_keep(msgs);
+  }
+  uint64_t total = bench_now_ns() - start;
+  bench_result(name, (double)total / ((double)(ROUNDS / BATCH * 16) * BATCH));
+}
+
+// send the name of a node over and over, timing checkForMessages()
+static void stringSend(CanNode *node) {
+  uint64_t total = 0;
+  uint32_t frames = 0;
+
+  node->setName(NAME);
+  for (uint32_t round = 0; round < ROUNDS / 8; ++round) {
+    node->sendName();
+    for (uint8_t f = 0; f < (sizeof(NAME) + 6) / 7; ++f) {
+      uint64_t start = bench_now_ns();
+      CanNode::checkForMessages();
+      total += bench_now_ns() - start;
+      ++frames;
+      drain();
+    }
+  }
+  bench_result("string_send_frame", (double)total / frames);
+}
+
+// request a name and feed in the frames of the answer
+static void stringRecieve(uint16_t id) {
+  uint64_t total = 0;
+  uint32_t frames = 0;
+  uint32_t bad = 0;
+  CanMessage answer[(sizeof(NAME) + 6) / 7];
+  char buff[MAX_NAME_LEN + 2];
+
+  for (uint8_t f = 0; f < sizeof(answer) / sizeof(answer[0]); ++f) {
+    uint8_t len = 0;
+    answer[f].id = id;
+    answer[f].rtr = false;
+    answer[f].fmi = 0xFF;
+    answer[f].data[0] = CAN_NAME_INFO | CAN_INT8 << 5;
+    while (len < 7 && (size_t)(f * 7 + len) < sizeof(NAME)) {
+      answer[f].data[1 + len] = NAME[f * 7 + len];
+      ++len;
+    }
+    answer[f].len = len + 1;
+  }
+
+  for (uint32_t round = 0; round < ROUNDS / 8; ++round) {
+    CanNode::getString(id, buff, sizeof(buff), 1000);
+    drain();
+    for (uint8_t f = 0; f < sizeof(answer) / sizeof(answer[0]); ++f) {
+      can_sim_inject(CAN_SIM_LOCAL, &answer[f]);
+    }
+    uint64_t start = bench_now_ns();
+    CanNode::checkForMessages();
+    total += bench_now_ns() - start;
+    frames += sizeof(answer) / sizeof(answer[0]);
+    if (CanNode::stringStatus() != DATA_OK || strcmp(buff, NAME) != 0) {
+      ++bad;
+    }
+  }
+  bench_result("string_recieve_frame", (double)total / frames);
+  if (bad > 0) {
+    fprintf(stderr, "%u names were not recieved\n", bad);
+  }
+}
+
+int main(int argc, char **argv) {
+  CanNode node(THROT_BODY, rtr);
+  int8_t arr8[7] = {1, -2, 3, -4, 5, -6, 7};
+  uint8_t arrU8[7] = {1, 2, 3, 4, 5, 6, 7};
+  int16_t arr16[3] = {-1000, 2000, -3000};
+  uint16_t arrU16[3] = {1000, 2000, 3000};
+  uint32_t sum = 0;
+
+  bench_open("frame_bench", argc, argv);
+
+  send("send_custom", [&node](uint32_t v) {
+    CanMessage msg = {0, 2, 0, false, {CAN_CUSTOM << 5, (uint8_t)v}};
+    node.sendData_custom(&msg);
+  });
+  send("send_int8", [&node](uint32_t v) { node.sendData_int8((int8_t)v); });
+  send("send_uint8", [&node](uint32_t v) { node.sendData_uint8((uint8_t)v); });
+  send("send_int16", [&node](uint32_t v) { node.sendData_int16((int16_t)v); });
+  send("send_uint16",
+       [&node](uint32_t v) { node.sendData_uint16((uint16_t)v); });
+  send("send_int32", [&node](uint32_t v) { node.sendData_int32((int32_t)v); });
+  send("send_uint32", [&node](uint32_t v) { node.sendData_uint32(v); });
+  send("send_arr_int8", [&](uint32_t v) {
+    arr8[0] = (int8_t)v;
+    node.sendDataArr_int8(arr8, 7);
+  });
+  send("send_arr_uint8", [&](uint32_t v) {
+    arrU8[0] = (uint8_t)v;
+    node.sendDataArr_uint8(arrU8, 7);
+  });
+  send("send_arr_int16", [&](uint32_t v) {
+    arr16[0] = (int16_t)v;
+    node.sendDataArr_int16(arr16, 3);
+  });
+  send("send_arr_uint16", [&](uint32_t v) {
+    arrU16[0] = (uint16_t)v;
+    node.sendDataArr_uint16(arrU16, 3);
+  });
+
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, (int8_t)v); });
+  get("get_int8", [&sum](CanMessage *msg) {
+    int8_t data;
+    if (CanNode::getData_int8(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, (uint8_t)v); });
+  get("get_uint8", [&sum](CanMessage *msg) {
+    uint8_t data;
+    if (CanNode::getData_uint8(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, (int16_t)v); });
+  get("get_int16", [&sum](CanMessage *msg) {
+    int16_t data;
+    if (CanNode::getData_int16(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, (uint16_t)v); });
+  get("get_uint16", [&sum](CanMessage *msg) {
+    uint16_t data;
+    if (CanNode::getData_uint16(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, (int32_t)v); });
+  get("get_int32", [&sum](CanMessage *msg) {
+    int32_t data;
+    if (CanNode::getData_int32(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) { CanNode::encode(msg, v); });
+  get("get_uint32", [&sum](CanMessage *msg) {
+    uint32_t data;
+    if (CanNode::getData_uint32(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+
+  // the array cases decode full frames
+  fill([](CanMessage *msg, uint32_t v) {
+    CanNode::encode(msg, (int8_t)v);
+    msg->len = 8;
+  });
+  get("get_arr_int8", [&sum](CanMessage *msg) {
+    int8_t data[7];
+    uint8_t len;
+    if (CanNode::getDataArr_int8(msg, data, &len) == DATA_OK) {
+      sum += data[len - 1];
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) {
+    CanNode::encode(msg, (uint8_t)v);
+    msg->len = 8;
+  });
+  get("get_arr_uint8", [&sum](CanMessage *msg) {
+    uint8_t data[7];
+    uint8_t len;
+    if (CanNode::getDataArr_uint8(msg, data, &len) == DATA_OK) {
+      sum += data[len - 1];
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) {
+    CanNode::encode(msg, (int16_t)v);
+    msg->len = 7;
+  });
+  get("get_arr_int16", [&sum](CanMessage *msg) {
+    int16_t data[3];
+    uint8_t len;
+    if (CanNode::getDataArr_int16(msg, data, &len) == DATA_OK) {
+      sum += data[len - 1];
+    }
+  });
+  fill([](CanMessage *msg, uint32_t v) {
+    CanNode::encode(msg, (uint16_t)v);
+    msg->len = 7;
+  });
+  get("get_arr_uint16", [&sum](CanMessage *msg) {
+    uint16_t data[3];
+    uint8_t len;
+    if (CanNode::getDataArr_uint16(msg, data, &len) == DATA_OK) {
+      sum += data[len - 1];
+    }
+  });
+
+  stringSend(&node);
+  stringRecieve(ENGINE_TEMP + 1);
+
+  bench_keep(sum);
+  bench_close();
+  return 0;
+}
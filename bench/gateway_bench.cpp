@@ -0,0 +1,215 @@
+/**
+ * gateway_bench.cpp
+ * \brief Measures how many frames a CanGateway moves with one to four buses.
+ *
+ * Built like the other benchmarks, it needs no CAN hardware:
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * g++ -std=c++14 -O2 -DCAN_HOST -I. *.cpp bench/gateway_bench.cpp \
+ *     -lpthread -o gateway_bench
+ * ./gateway_bench results.csv $(git rev-parse --short HEAD)
+ * ~~~~~~~~~~~~
+ *
+ * Each bus is a CanMemoryBus with a thread of its own injecting
+ * \ref FRAMES frames as fast as the gateway keeps up with them. Each bus is polled by a
+ * thread of its own too, so with enough cores the buses don't share one. In
+ * the routed cases every frame of bus 0 is also sent on bus 1.
+ *
+ * Writes the cases gateway_<n>_bus and gateway_<n>_bus_routed, the wall
+ * clock time in ns per frame over every bus. The frames per second, the mean
+ * latency from the receive thread to the handlers and, for more than one bus,
+ * how many times the frames per second of one bus the gateway reached go to
+ * stderr. Exits with 1 if a frame is lost, or if a machine with
+ * \ref THREADS_PER_BUS cores for every bus doesn't get at least
+ * \ref MIN_SCALING of n times the frames of one bus through with n buses.
+ * Exits with 2 if nothing failed but the machine has too few cores to check
+ * the scaling of every case, the results then say nothing about it.
+ */
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+#include "can_gateway.h"
+#include "bench.h"
+
+static const uint32_t FRAMES = 200000;
+static const uint8_t MAX_BUSES = 4;
+// the receive thread, the poller and the producer of a bus
+static const unsigned THREADS_PER_BUS = 3;
+static const double MIN_SCALING = 0.7;
+
+// a bus can't be held back, frames the gateway has no room for are lost, so
+// the producers send no more than half a ring ahead of the handlers
+static const uint32_t AHEAD = CAN_GATEWAY_QUEUE_SIZE / 2;
+
+static std::atomic<uint32_t> handled[MAX_BUSES];
+static std::atomic<uint32_t> taken; // routed frames taken off bus 1
+
+static void handler(const CanBusFrame *frame) {
+  handled[frame->bus].fetch_add(1, std::memory_order_relaxed);
+  bench_keep(frame);
+}
+
+// another node on a bus, sends as fast as the gateway keeps up
+static void producer(CanMemoryBus *bus, uint8_t index, bool routed) {
+  CanMessage msg = {(uint16_t)(0x100 + index), 8, 0, false,
+                    {1, 2, 3, 4, 5, 6, 7, 8}};
+  for (uint32_t i = 0; i < FRAMES; ++i) {
+    while (i - handled[index].load(std::memory_order_relaxed) >= AHEAD ||
+           (routed && i - taken.load(std::memory_order_relaxed) >= AHEAD)) {
+      std::this_thread::yield();
+    }
+    msg.data[0] = (uint8_t)i;
+    while (!bus->inject(&msg)) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+// runs on every bus, polls until each of its frames is handled or dropped
+static void poller(CanGateway *gateway, uint8_t bus) {
+  while (true) {
+    if (gateway->poll(bus, CAN_GATEWAY_QUEUE_SIZE) > 0) {
+      continue;
+    }
+    CanGatewayStats stats;
+    gateway->stats(bus, &stats);
+    if (stats.handled + stats.dropped >= FRAMES) {
+      return;
+    }
+    std::this_thread::yield();
+  }
+}
+
+// takes the routed frames off bus 1 like its other nodes would
+static void drain(CanMemoryBus *bus, std::atomic<bool> *done) {
+  CanMessage msg;
+  while (!*done) {
+    if (bus->take(&msg)) {
+      taken.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      std::this_thread::yield();
+    }
+  }
+  while (bus->take(&msg)) {
+    taken.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// frames per second of the last run
+static double rate;
+
+static int run(uint8_t count, bool routed, const char *name,
+               CanGateway *gateway) {
+  static CanMemoryBus buses[MAX_BUSES];
+
+  for (uint8_t i = 0; i < count; ++i) {
+    gateway->addBus(&buses[i]);
+  }
+  if (routed) {
+    gateway->addRoute(0, 0, 0, 1);
+  }
+  gateway->addHandler(CAN_GATEWAY_ANY_BUS, 0, 0, handler);
+
+  for (uint8_t i = 0; i < MAX_BUSES; ++i) {
+    handled[i] = 0;
+  }
+  taken = 0;
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  uint64_t start = bench_now_ns();
+  gateway->start();
+  for (uint8_t i = 0; i < count; ++i) {
+    threads.emplace_back(poller, gateway, i);
+    threads.emplace_back(producer, &buses[i], i, routed && i == 0);
+  }
+  std::thread drainer;
+  if (routed) {
+    drainer = std::thread(drain, &buses[1], &done);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  gateway->stop();
+  done = true;
+  if (routed) {
+    drainer.join();
+  }
+
+  uint32_t total = FRAMES * count;
+  uint64_t latency = 0;
+  int failed = 0;
+  for (uint8_t i = 0; i < count; ++i) {
+    CanGatewayStats stats;
+    gateway->stats(i, &stats);
+    latency += stats.totalLatency;
+    if (stats.dropped != 0 || stats.routeDrops != 0) {
+      fprintf(stderr, "%s: bus %u dropped %u, %u routed copies lost\n", name,
+              i, stats.dropped, stats.routeDrops);
+      failed = 1;
+    }
+  }
+  if (routed && taken != FRAMES) {
+    fprintf(stderr, "%s: %u of %u routed frames arrived\n", name,
+            taken.load(), FRAMES);
+    failed = 1;
+  }
+
+  rate = total * 1e9 / elapsed;
+  bench_result(name, (double)elapsed / total);
+  fprintf(stderr, "%s: %.0f frames/s, mean latency %.1f us\n", name, rate,
+          (double)latency / total);
+  return failed;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    uint8_t buses;
+    bool routed;
+    const char *name;
+  } CASES[] = {
+      {1, false, "gateway_1_bus"},
+      {2, false, "gateway_2_bus"},
+      {4, false, "gateway_4_bus"},
+      {2, true, "gateway_2_bus_routed"},
+  };
+  // a gateway per case, they are too big for the stack
+  static CanGateway gateways[sizeof(CASES) / sizeof(CASES[0])];
+  unsigned cores = std::thread::hardware_concurrency();
+  double single = 0;
+  bool skipped = false;
+  int failed = 0;
+
+  bench_open("gateway_bench", argc, argv);
+  fprintf(stderr, "%u cores\n", cores);
+  for (uint8_t i = 0; i < sizeof(CASES) / sizeof(CASES[0]); ++i) {
+    failed |= run(CASES[i].buses, CASES[i].routed, CASES[i].name, &gateways[i]);
+    if (CASES[i].routed) {
+      continue;
+    }
+    if (CASES[i].buses == 1) {
+      single = rate;
+      continue;
+    }
+
+    // each bus has cores of its own, the rate should go up with the buses
+    double scaling = rate / single;
+    bool enough = cores >= THREADS_PER_BUS * CASES[i].buses;
+    fprintf(stderr, "%s: %.2f times one bus%s\n", CASES[i].name, scaling,
+            enough ? "" : ", not checked");
+    if (!enough) {
+      skipped = true;
+    } else if (scaling < MIN_SCALING * CASES[i].buses) {
+      failed = 1;
+    }
+  }
+  if (skipped && !failed) {
+    fprintf(stderr,
+            "scaling not checked, %u cores where %u buses need %u\n", cores,
+            MAX_BUSES, THREADS_PER_BUS * MAX_BUSES);
+    failed = 2;
+  }
+  bench_close();
+  return failed;
+}
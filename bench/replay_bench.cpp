@@ -0,0 +1,171 @@
+/**
+ * replay_bench.cpp
+ * \brief Measures how fast and how true to the recorded timing a capture is
+ * played back to a node.
+ *
+ * Built like the other benchmarks against the simulated bus:
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * g++ -std=c++14 -O2 -DCAN_HOST -I. *.cpp bench/replay_bench.cpp \
+ *     -lpthread -o replay_bench
+ * ./replay_bench results.csv $(git rev-parse --short HEAD)
+ * ~~~~~~~~~~~~
+ *
+ * A capture of \ref FRAMES frames on two buses is made from candump text, the
+ * frames of bus 0 come every \ref PERIOD_US micro-seconds give or take a
+ * little. It is played to a node at real time, ten times real time and at
+ * \ref CAN_REPLAY_MAX_SPEED. The node asks another node for its name when the
+ * first frame goes out with a timeout of \ref TIMEOUT_MS, nobody answers.
+ *
+ * Writes the case replay_max_per_frame, the wall clock time of a frame at
+ * full speed, and replay_<speed>_error, how far on average each frame reached
+ * its handler from where the capture puts it relative to the first, in bus
+ * time. Exits with 1 if a frame is lost, the timing is off by more than a
+ * period at full speed, or the timeout doesn't go off right after the last
+ * frame recorded before it at full speed. At the other speeds the bus clock
+ * follows the wall clock, and how far the program falls behind it depends on
+ * what else the machine is doing. The frame the timeout goes off after is
+ * only printed for them.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include "CanNode.h"
+#include "can_replay.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t FRAMES = 2000;
+static const uint32_t PERIOD_US = 500;
+static const uint16_t TIMEOUT_MS = 100;
+static const uint16_t ID = 0x123;
+static const char *CANDUMP = "replay_bench.log";
+static const char *CAPTURE = "replay_bench.cap";
+
+static uint32_t arrived[FRAMES]; // can_time_us() at the handler
+static uint32_t handled;
+
+// where the capture puts frame i of bus 0, in us after the first
+static uint32_t recorded_us(uint32_t i) { return i * PERIOD_US + (i % 7) * 20; }
+
+static void handler(CanMessage *msg) {
+  if (handled < FRAMES) {
+    arrived[handled] = can_time_us();
+  }
+  ++handled;
+  bench_keep(msg);
+}
+
+static void rtr(CanMessage *msg) { bench_keep(msg); }
+
+static bool make_capture() {
+  FILE *text = fopen(CANDUMP, "w");
+  if (text == nullptr) {
+    return false;
+  }
+  for (uint32_t i = 0; i < FRAMES; ++i) {
+    uint64_t us = 1000000000ull + recorded_us(i);
+    fprintf(text, "(%llu.%06llu) can0 %03X#%02X%02X\n",
+            (unsigned long long)(us / 1000000),
+            (unsigned long long)(us % 1000000), ID, i & 0xFF, i >> 8);
+    // another bus the replay leaves out
+    fprintf(text, "(%llu.%06llu) can1 456#00\n",
+            (unsigned long long)(us / 1000000),
+            (unsigned long long)(us % 1000000 + 100));
+  }
+  fclose(text);
+  text = fopen(CANDUMP, "r");
+  int32_t count = can_capture_from_candump(text, CAPTURE);
+  fclose(text);
+  remove(CANDUMP);
+  return count == (int32_t)FRAMES * 2;
+}
+
+// play the capture once, returns the frames handled before the timeout
+static uint32_t play(double speed, double *error_ns, uint64_t *wall_ns) {
+  char name[MAX_NAME_LEN];
+  CanReplay replay;
+  replay.open(CAPTURE);
+  replay.setBus(0);
+  replay.setSpeed(speed);
+  handled = 0;
+
+  uint32_t atTimeout = FRAMES + 1;
+  bool asked = false;
+  uint64_t begin = bench_now_ns();
+  while (replay.step()) {
+    // at the tick of the first frame, at full speed the first step gets the
+    // clock there
+    if (!asked && replay.played() > 0) {
+      asked = true;
+      CanNode::requestName(START_SWITCH, name, sizeof(name), TIMEOUT_MS);
+    }
+    if (asked && atTimeout > FRAMES && CanNode::stringStatus() != NO_DATA) {
+      atTimeout = handled;
+    }
+  }
+  *wall_ns = bench_now_ns() - begin;
+  can_sim_set_speed(1);
+
+  uint64_t total = 0;
+  for (uint32_t i = 1; i < FRAMES && i < handled; ++i) {
+    int64_t off = (int64_t)(arrived[i] - arrived[0]) - recorded_us(i);
+    total += (uint64_t)llabs(off) * 1000;
+  }
+  *error_ns = (double)total / (FRAMES - 1);
+  if (handled != FRAMES || replay.played() != FRAMES) {
+    fprintf(stderr, "%u of %u frames handled\n", handled, FRAMES);
+    return 0;
+  }
+  return atTimeout;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    double speed;
+    const char *name;
+    const char *error;
+  } SPEEDS[] = {
+      {CAN_REPLAY_MAX_SPEED, "max", "replay_max_error"},
+      {10, "10x", "replay_10x_error"},
+      {1, "1x", "replay_1x_error"},
+  };
+  int failed = 0;
+
+  CanNode node(THROTTLE, rtr);
+  node.addFilter(ID, handler);
+  if (!make_capture()) {
+    fprintf(stderr, "can't make %s\n", CAPTURE);
+    return 1;
+  }
+
+  // no frame of the capture ends within a frame of the timeout, so the frames
+  // recorded before it are the ones handled before it
+  uint32_t expected = 0;
+  while (recorded_us(expected) < TIMEOUT_MS * 1000u) {
+    ++expected;
+  }
+
+  bench_open("replay_bench", argc, argv);
+  for (const auto &s : SPEEDS) {
+    double error;
+    uint64_t wall;
+    uint32_t atTimeout = play(s.speed, &error, &wall);
+    if (s.speed == CAN_REPLAY_MAX_SPEED) {
+      bench_result("replay_max_per_frame", (double)wall / FRAMES);
+      // frames differ in length by a few stuff bits, not more
+      if (error > PERIOD_US * 1000.0 || atTimeout != expected) {
+        failed = 1;
+      }
+    }
+    bench_result(s.error, error);
+    fprintf(stderr, "%s: %.3f s, timeout after %u of %u frames\n", s.name,
+            wall / 1e9, atTimeout, expected);
+    if (atTimeout == 0) {
+      failed = 1;
+    }
+  }
+
+  remove(CAPTURE);
+  bench_close();
+  return failed;
+}
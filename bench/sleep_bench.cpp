@@ -0,0 +1,162 @@
+/**
+ * sleep_bench.cpp
+ * \brief Measures how quickly an idle node gets to its handlers and how much
+ * of the time it spends idle.
+ *
+ * A remote node sends a frame every \ref PERIOD_US micro-seconds for
+ * \ref RUN_MS mili-seconds and another one acknowledges them. The local node runs its main loop three ways:
+ *
+ * - poll: calls CanNode::checkForMessages() over and over, the core never
+ *   rests
+ * - wait: calls CanNode::waitForMessages(), the core is halted between
+ *   frames
+ * - sleep: puts the controller to sleep with can_sleep() after every frame,
+ *   so each frame wakes it up and is lost, the frame after it is handled
+ *
+ * The latency runs from the end of a frame on the simulated bus to the start
+ * of its handler, the busy time is the time outside of can_wait() divided by
+ * the frames handled. The idle share of each loop goes to stderr.
+ *
+ * Writes the cases <loop>_latency_mean, <loop>_latency_max and
+ * <loop>_busy_per_frame in ns. Exits with 1 if a waiting loop takes longer
+ * than \ref MAX_MEAN_NS on average to get to a handler, or the sleeping loop
+ * doesn't lose the frames that wake it.
+ */
+#include <cstdio>
+#include "CanNode.h"
+#include "can_sim.h"
+#include "bench.h"
+
+static const uint32_t PERIOD_US = 5000;
+static const uint32_t RUN_MS = 1000;
+static const uint16_t ID = 1500;
+// the host scheduler can hold up any one frame, so only the mean is checked
+static const double MAX_MEAN_NS = 100000;
+
+static uint64_t frame_ns; // time a frame takes on the bus
+static uint64_t total_ns; // latency of every frame handled
+static uint64_t max_ns;   // largest latency
+static uint32_t handled;  // frames handled
+static uint8_t sender;    // remote node sending the frames
+
+static void handler(CanMessage *msg) {
+  uint64_t now = can_sim_time_ns();
+  // the sender's mailbox already holds the request for the next frame, the
+  // bus is otherwise quiet so the last one started a period before it
+  const CanSimMailbox *box = &can_sim_controller(sender)->mailbox[0];
+  uint64_t latency = now - (box->requested - box->period + frame_ns);
+  total_ns += latency;
+  if (latency > max_ns) {
+    max_ns = latency;
+  }
+  ++handled;
+  bench_keep(msg);
+}
+
+static void rtr(CanMessage *msg) { bench_keep(msg); }
+
+enum Loop { POLL, WAIT, SLEEP };
+
+// run one main loop against the periodic sender, returns the idle share in
+// tenths of a percent
+static uint16_t run(Loop loop, uint64_t *busy_per_frame) {
+  CanMessage msg = {ID, 3, 0, false, {CAN_UINT16 << 5, 0x12, 0x34}};
+
+  total_ns = max_ns = 0;
+  handled = 0;
+  frame_ns = (uint64_t)can_sim_frame_bits(&msg) * 1000000000ull /
+             can_sim_bitrate_bps(CAN_BITRATE_500K);
+
+  can_stats_reset();
+  uint64_t begin = can_sim_time_ns();
+  can_sim_send_periodic(sender, &msg, PERIOD_US);
+
+  uint32_t start = HAL_GetTick();
+  uint32_t seen = 0;
+  while (HAL_GetTick() - start < RUN_MS) {
+    switch (loop) {
+    case POLL:
+      CanNode::checkForMessages();
+      break;
+    case WAIT:
+      CanNode::waitForMessages(RUN_MS);
+      break;
+    case SLEEP:
+      if (handled != seen) {
+        seen = handled;
+        can_sleep();
+      }
+      CanNode::waitForMessages(RUN_MS);
+      break;
+    }
+  }
+
+  CanStats stats;
+  can_stats_snapshot(&stats);
+  uint64_t elapsed = can_sim_time_ns() - begin;
+
+  // stop the sender and wake the controller for the next loop
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    can_sim_controller(sender)->mailbox[box].pending = false;
+  }
+  can_enable();
+  HAL_Delay(1);
+  CanNode::checkForMessages();
+
+  uint64_t idle = stats.idle_us * 1000;
+  uint64_t busy = elapsed > idle ? elapsed - idle : 0;
+  *busy_per_frame = handled == 0 ? 0 : busy / handled;
+  return stats.idle;
+}
+
+int main(int argc, char **argv) {
+  static const struct {
+    Loop loop;
+    const char *name;
+    const char *mean;
+    const char *max;
+    const char *busy;
+  } LOOPS[] = {
+      {POLL, "poll", "poll_latency_mean", "poll_latency_max",
+       "poll_busy_per_frame"},
+      {WAIT, "wait", "wait_latency_mean", "wait_latency_max",
+       "wait_busy_per_frame"},
+      {SLEEP, "sleep", "sleep_latency_mean", "sleep_latency_max",
+       "sleep_busy_per_frame"},
+  };
+  int failed = 0;
+
+  CanNode node(THROTTLE, rtr);
+  node.addFilter(ID, handler);
+  sender = can_sim_add_node(CAN_BITRATE_500K);
+  // acknowledges the frames the sleeping controller misses, without it they
+  // would be sent again
+  can_sim_add_node(CAN_BITRATE_500K);
+
+  bench_open("sleep_bench", argc, argv);
+  for (const auto &loop : LOOPS) {
+    uint64_t busy;
+    uint16_t idle = run(loop.loop, &busy);
+    double mean = handled == 0 ? 0 : (double)total_ns / handled;
+    bench_result(loop.mean, mean);
+    bench_result(loop.max, (double)max_ns);
+    bench_result(loop.busy, (double)busy);
+    fprintf(stderr, "%s: %u frames handled, idle %u.%u %%\n", loop.name,
+            handled, idle / 10, idle % 10);
+
+    uint32_t frames = RUN_MS * 1000 / PERIOD_US;
+    if (loop.loop != POLL && mean > MAX_MEAN_NS) {
+      fprintf(stderr, "%s: handlers waited %.0f ns on average\n", loop.name,
+              mean);
+      failed = 1;
+    }
+    if (loop.loop == SLEEP && (handled > frames / 2 + 1 || handled == 0)) {
+      // every other frame wakes the controller and is lost
+      fprintf(stderr, "sleep: %u of %u frames handled\n", handled, frames);
+      failed = 1;
+    }
+  }
+
+  bench_close();
+  return failed;
+}
@@ -0,0 +1,298 @@
+/**
+ * socketcan_fake_bench.cpp
+ * \brief Runs the SocketCAN driver against a fake kernel, for machines
+ * without a CAN interface.
+ *
+ * The socket calls the driver makes are swapped for the functions below with
+ * the linker's --wrap, so no vcan interface or CAN support in the kernel is
+ * needed:
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * g++ -std=c++14 -O2 -DCAN_HOST -DCAN_SOCKETCAN -DCAN_TIMESTAMPS -I. \
+ *     CanNode.cpp CanTransport.cpp can_driver_socketcan.cpp \
+ *     bench/socketcan_fake_bench.cpp -lpthread -o socketcan_fake_bench \
+ *     -Wl,--wrap=socket,--wrap=bind,--wrap=if_nametoindex,--wrap=setsockopt \
+ *     -Wl,--wrap=recvmmsg,--wrap=sendmmsg,--wrap=send,--wrap=poll
+ * ./socketcan_fake_bench results.csv $(git rev-parse --short HEAD)
+ * ~~~~~~~~~~~~
+ *
+ * The fake kernel keeps the filters the driver sets and drops the frames
+ * they don't let through, hands out the waiting frames with the drop count
+ * and the timestamps, and takes sent frames until it is told it is full.
+ * Build it with CAN_SOCKETCAN_HW_TIMESTAMPS as well to check the adapter's
+ * stamps.
+ *
+ * Writes socketcan_fake_cpu_per_frame, the time the node takes for each of
+ * \ref FRAMES frames from the socket to the handler, in ns. The real kernel
+ * adds its own time to that. Exits with 1 if the driver gets something wrong.
+ */
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "CanNode.h"
+#include "can_socketcan.h"
+#include "bench.h"
+
+static const uint32_t FRAMES = 200000;
+static const uint16_t ID = 1500;
+static const int FAKE_FD = 42;
+// how far the fake adapter's clock is behind the monotonic clock, in ns
+static const int64_t ADAPTER_BEHIND = 5000000000ll;
+// how long the fake kernel takes to stamp a frame after the adapter did
+static const int64_t KERNEL_DELAY = 30000;
+
+static std::deque<struct can_frame> waiting; // frames the socket hasn't read
+static struct can_filter filters[2 * CAN_FILTER_BANKS];
+static int num_filters = -1; // -1 until the driver sets them
+static uint32_t drops;      // SO_RXQ_OVFL
+static uint32_t room = 1000; // frames the kernel takes before ENOBUFS
+static uint32_t sent;
+static struct can_frame last_sent;
+
+#ifdef CAN_TIMESTAMPS
+static int64_t clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct timespec ns_timespec(int64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return ts;
+}
+#endif
+
+// a frame arrives from the bus
+static void inject(uint32_t id, uint8_t len) {
+  struct can_frame frame;
+  memset(&frame, 0, sizeof(frame));
+  frame.can_id = id;
+  frame.can_dlc = len;
+
+  bool pass = num_filters < 0 || (id & CAN_ERR_FLAG);
+  for (int i = 0; i < num_filters && !pass; ++i) {
+    pass = ((id ^ filters[i].can_id) & filters[i].can_mask) == 0;
+  }
+  if (pass) {
+    waiting.push_back(frame);
+  }
+}
+
+static void sent_frame(const struct can_frame *frame) {
+  last_sent = *frame;
+  --room;
+  ++sent;
+}
+
+extern "C" {
+int __wrap_socket(int, int, int) { return FAKE_FD; }
+
+int __wrap_bind(int, const struct sockaddr *, socklen_t) { return 0; }
+
+unsigned int __wrap_if_nametoindex(const char *name) {
+  return strcmp(name, CAN_SOCKETCAN_INTERFACE) == 0 ? 3 : 0;
+}
+
+int __wrap_setsockopt(int, int level, int opt, const void *value,
+                      socklen_t len) {
+  if (level == SOL_CAN_RAW && opt == CAN_RAW_FILTER) {
+    num_filters = (int)(len / sizeof(struct can_filter));
+    memcpy(filters, value, len);
+  }
+  return 0;
+}
+
+// the frames with their drop count and, stamped just now, their times
+int __wrap_recvmmsg(int, struct mmsghdr *msgs, unsigned int count, int,
+                    struct timespec *) {
+  if (waiting.empty()) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  unsigned int i = 0;
+  for (; i < count && !waiting.empty(); ++i) {
+    struct msghdr *hdr = &msgs[i].msg_hdr;
+    memcpy(hdr->msg_iov[0].iov_base, &waiting.front(), sizeof(can_frame));
+    msgs[i].msg_len = sizeof(can_frame);
+    waiting.pop_front();
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SO_RXQ_OVFL;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(drops));
+    memcpy(CMSG_DATA(cmsg), &drops, sizeof(drops));
+    size_t used = CMSG_SPACE(sizeof(drops));
+
+#ifdef CAN_TIMESTAMPS
+    struct scm_timestamping stamps;
+    memset(&stamps, 0, sizeof(stamps));
+    stamps.ts[0] = ns_timespec(clock_ns(CLOCK_REALTIME));
+#ifdef CAN_SOCKETCAN_HW_TIMESTAMPS
+    stamps.ts[2] = ns_timespec(clock_ns(CLOCK_MONOTONIC) - ADAPTER_BEHIND -
+                               KERNEL_DELAY);
+#endif
+    cmsg = (struct cmsghdr *)((char *)hdr->msg_control + used);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TIMESTAMPING;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(stamps));
+    memcpy(CMSG_DATA(cmsg), &stamps, sizeof(stamps));
+    used += CMSG_SPACE(sizeof(stamps));
+#endif
+    hdr->msg_controllen = used;
+  }
+  return (int)i;
+}
+
+int __wrap_sendmmsg(int, struct mmsghdr *msgs, unsigned int count, int) {
+  if (room == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  unsigned int i = 0;
+  for (; i < count && room > 0; ++i) {
+    sent_frame((const struct can_frame *)msgs[i].msg_hdr.msg_iov[0].iov_base);
+  }
+  return (int)i;
+}
+
+ssize_t __wrap_send(int, const void *buff, size_t len, int) {
+  if (room == 0) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  sent_frame((const struct can_frame *)buff);
+  return (ssize_t)len;
+}
+
+int __wrap_poll(struct pollfd *fds, nfds_t, int) {
+  fds[0].revents = waiting.empty() ? 0 : POLLIN;
+  return waiting.empty() ? 0 : 1;
+}
+}
+
+static uint32_t handled;
+static uint32_t rtrs;
+static uint32_t worst_us; // largest time from the kernel to the handler
+
+static void handler(CanMessage *msg) {
+#ifdef CAN_TIMESTAMPS
+  uint32_t us = can_time_us() - msg->timestamp;
+  if (us > worst_us) {
+    worst_us = us;
+  }
+#endif
+  ++handled;
+  bench_keep(msg);
+}
+
+static void rtr(CanMessage *msg) {
+  ++rtrs;
+  bench_keep(msg);
+}
+
+static int check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "%s\n", what);
+  }
+  return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  int failed = 0;
+
+  CanNode node(THROTTLE, rtr);
+  node.addFilter(ID, handler);
+  failed |= check(can_socketcan_fd() == FAKE_FD, "socket not opened");
+  // both clocks are the same, see can_time_us()
+  uint32_t tick = HAL_GetTick();
+  failed |= check(can_time_us() - tick * 1000 < 2000,
+                  "can_time_us() and HAL_GetTick() disagree");
+  failed |= check(num_filters > 0, "no filters set");
+
+  // only the frames the filters let through reach the node
+  for (int i = 0; i < 100; ++i) {
+    inject(ID, 8);
+    inject(ID + 1, 8);
+    inject(ID | CAN_EFF_FLAG, 8);
+  }
+  failed |= check(waiting.size() == 100, "filters let other frames through");
+  while (!waiting.empty() || is_can_msg_pending()) {
+    CanNode::checkForMessages();
+  }
+  failed |= check(handled == 100, "frames lost");
+  // the handler runs long after the frame was stamped only if the clocks
+  // don't match
+  failed |= check(worst_us < 100000, "timestamps off the clock of can_time_us");
+
+  // remote requests go to the handler, or are answered right away once the
+  // node has published a value
+  inject(THROTTLE | CAN_RTR_FLAG, 0);
+  CanNode::checkForMessages();
+  failed |= check(rtrs == 1, "remote request not handled");
+  node.publish<uint16_t>(77);
+  uint32_t before = sent;
+  inject(THROTTLE | CAN_RTR_FLAG, 0);
+  CanNode::checkForMessages();
+  failed |= check(rtrs == 1 && sent == before + 1 &&
+                      (last_sent.can_id & CAN_SFF_MASK) == THROTTLE,
+                  "published value not sent");
+
+  // the kernel's drop count ends up in the stats
+  CanStats st;
+  can_stats_reset();
+  drops = 5;
+  inject(ID, 1);
+  CanNode::checkForMessages();
+  can_stats_snapshot(&st);
+  failed |= check(st.rx_fifo_overruns == 5, "kernel drops not counted");
+
+  // frames wait while the kernel is full and go out in id order
+  room = 0;
+  before = sent;
+  node.sendData_uint8(1);
+  CanMessage msg = {};
+  msg.id = 100;
+  msg.len = 1;
+  msg.data[0] = 1;
+  can_tx(&msg, 0);
+  failed |= check(can_tx_pending() == 2, "frames not queued");
+  room = 100;
+  failed |= check(can_tx_pending() == 0 && sent == before + 2 &&
+                      (last_sent.can_id & CAN_SFF_MASK) == THROTTLE,
+                  "queued frames not sent in order");
+
+  // one bus worth of frames at a time
+  bench_open("socketcan_fake_bench", argc, argv);
+  handled = 0;
+  worst_us = 0;
+  uint64_t total = 0;
+  for (uint32_t done = 0; done < FRAMES; done += CAN_SOCKETCAN_BATCH) {
+    for (uint32_t i = 0; i < CAN_SOCKETCAN_BATCH; ++i) {
+      inject(ID, 8);
+    }
+    uint64_t start = bench_now_ns();
+    while (!waiting.empty() || is_can_msg_pending()) {
+      CanNode::checkForMessages();
+    }
+    total += bench_now_ns() - start;
+  }
+  bench_result("socketcan_fake_cpu_per_frame", (double)total / handled);
+  failed |= check(handled == FRAMES, "frames lost under load");
+  failed |= check(worst_us < 100000, "timestamps off under load");
+  fprintf(stderr, "%u frames, at most %u us from the kernel to the handler\n",
+          handled, worst_us);
+
+  bench_close();
+  return failed;
+}
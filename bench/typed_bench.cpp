@@ -0,0 +1,139 @@
+/**
+ * typed_bench.cpp
+ * \brief Compares the encode and decode cost of the typed templates with the
+ * hand written per type code they replaced.
+ *
+ * The hand written functions are copies of the sendData_uint16/uint32 and
+ * getData_uint16/uint32 bodies from before the templates, without the call to
+ * can_tx(). Each case runs over a buffer of messages so the compiler can't
+ * fold the work away. The decode cases fill the buffer before they are timed.
+ *
+ * Writes one result per case, in ns per message.
+ */
+#include <cstdio>
+#include "CanNode.h"
+#include "bench.h"
+
+static const uint32_t ROUNDS = 20000;
+static const uint16_t BATCH = 256;
+static CanMessage msgs[BATCH];
+
+static void legacy_encode_uint16(CanMessage *msg, uint16_t data) {
+  msg->data[0] = (uint8_t)((0x7 & CAN_UINT16) << 5) | (0x1F & CAN_DATA);
+  msg->data[1] = (uint8_t)(data & 0x00ff);
+  msg->data[2] = (uint8_t)((data & 0xff00) >> 8);
+  msg->len = 3;
+  msg->rtr = false;
+}
+
+static void legacy_encode_uint32(CanMessage *msg, uint32_t data) {
+  msg->data[0] = (uint8_t)((0x7 & CAN_UINT32) << 5) | (0x1F & CAN_DATA);
+  msg->data[1] = (uint8_t)(data & 0x000000ff);
+  msg->data[2] = (uint8_t)((data & 0x0000ff00) >> 8);
+  msg->data[3] = (uint8_t)((data & 0x00ff0000) >> 16);
+  msg->data[4] = (uint8_t)((data & 0xff000000) >> 24);
+  msg->len = 5;
+  msg->rtr = false;
+}
+
+static CanState legacy_decode_uint16(const CanMessage *msg, uint16_t *data) {
+  if (msg == nullptr) {
+    return DATA_ERROR;
+  }
+  if ((msg->data[0] >> 5) != CAN_UINT16 || msg->len != 3 ||
+      (msg->data[0] & 0x1F) != CAN_DATA) {
+    return INVALID_TYPE;
+  }
+  *data = (uint16_t)msg->data[1];
+  *data |= (uint16_t)(msg->data[2] << 8);
+  return DATA_OK;
+}
+
+static CanState legacy_decode_uint32(const CanMessage *msg, uint32_t *data) {
+  if (msg == nullptr) {
+    return DATA_ERROR;
+  }
+  if ((msg->data[0] >> 5) != CAN_UINT32 || msg->len != 5 ||
+      (msg->data[0] & 0x1F) != CAN_DATA) {
+    return INVALID_TYPE;
+  }
+  *data = (uint32_t)msg->data[1];
+  *data |= (uint32_t)(msg->data[2] << 8);
+  *data |= (uint32_t)(msg->data[3] << 16);
+  *data |= (uint32_t)(msg->data[4] << 24);
+  return DATA_OK;
+}
+
+// fill the buffer with messages for the decode cases
+template <typename T> static void fill(void (*encode)(CanMessage *, T)) {
+  for (uint16_t i = 0; i < BATCH; ++i) {
+    encode(&msgs[i], (T)(i * 2654435761u));
+  }
+}
+
+template <typename F> static void run(const char *name, F body) {
+  uint64_t start = bench_now_ns();
+  for (uint32_t round = 0; round < ROUNDS; ++round) {
+    for (uint16_t i = 0; i < BATCH; ++i) {
+      body(&msgs[i], round + i);
+    }
+    bench_keep(msgs);
+  }
+  uint64_t total = bench_now_ns() - start;
+  bench_result(name, (double)total / ((double)ROUNDS * BATCH));
+}
+
+int main(int argc, char **argv) {
+  uint32_t sum = 0;
+
+  bench_open("typed_bench", argc, argv);
+  run("encode_uint16_legacy", [](CanMessage *msg, uint32_t v) {
+    legacy_encode_uint16(msg, (uint16_t)v);
+  });
+  run("encode_uint16_template", [](CanMessage *msg, uint32_t v) {
+    CanNode::encode<uint16_t>(msg, (uint16_t)v);
+  });
+  run("encode_uint32_legacy", [](CanMessage *msg, uint32_t v) {
+    legacy_encode_uint32(msg, v);
+  });
+  run("encode_uint32_template", [](CanMessage *msg, uint32_t v) {
+    CanNode::encode<uint32_t>(msg, v);
+  });
+
+  fill(legacy_encode_uint16);
+  run("decode_uint16_legacy", [&sum](CanMessage *msg, uint32_t) {
+    uint16_t data;
+    if (legacy_decode_uint16(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  run("decode_uint16_template", [&sum](CanMessage *msg, uint32_t) {
+    uint16_t data;
+    if (CanNode::get(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  run("decode_uint16_wrapper", [&sum](CanMessage *msg, uint32_t) {
+    uint16_t data;
+    if (CanNode::getData_uint16(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  fill(legacy_encode_uint32);
+  run("decode_uint32_legacy", [&sum](CanMessage *msg, uint32_t) {
+    uint32_t data;
+    if (legacy_decode_uint32(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+  run("decode_uint32_template", [&sum](CanMessage *msg, uint32_t) {
+    uint32_t data;
+    if (CanNode::get(msg, &data) == DATA_OK) {
+      sum += data;
+    }
+  });
+
+  bench_keep(sum);
+  bench_close();
+  return 0;
+}
@@ -0,0 +1,152 @@
+/**
+ * \file can_bit_timing.h
+ * \brief Works out the bxCAN bit timing for a clock and bitrate when the
+ * program is compiled.
+ *
+ * A bit is split into time quanta, each one prescaler clock cycles long:
+ *
+ * | Segment | Quanta  | Register field |
+ * |---------|---------|----------------|
+ * | sync    | 1       |                |
+ * | BS1     | 1 - 16  | TS1 + 1        |
+ * | BS2     | 1 - 8   | TS2 + 1        |
+ *
+ * The bit is sampled between BS1 and BS2. canBitTiming() tries every number
+ * of quanta from 25 down to 8, keeps the ones that give the bitrate within
+ * \ref CAN_BITRATE_TOLERANCE with a prescaler of 1 - 1024, and picks the one
+ * whose sample point is closest to the one asked for. Ties go to the most
+ * quanta, which lets the resynchronization jump width (SJW) be as large as
+ * possible. If no timing has the sample point within tolerance the result is
+ * not valid.
+ *
+ * Because it is constexpr the result can be checked with a static_assert:
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * static_assert(canBitTiming(CAN_CLOCK_HZ, 1000000).valid,
+ *               "this board can't run the bus at 1 Mbit/s");
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_BIT_TIMING_H_
+#define _CAN_BIT_TIMING_H_
+
+#include <stdint.h>
+
+#ifndef CAN_CLOCK_HZ
+#ifdef STM32F3
+/// Clock of the CAN peripheral (APB1) in Hz. Can be overwriten by redefinition
+#define CAN_CLOCK_HZ 24000000
+#else
+#define CAN_CLOCK_HZ 16000000
+#endif
+#endif
+
+#ifndef CAN_SAMPLE_POINT
+/// Sample point in tenths of a percent of the bit, 87.5 % is what CANopen and
+/// most automotive networks use. Can be overwriten by redefinition
+#define CAN_SAMPLE_POINT 875
+#endif
+
+#ifndef CAN_SAMPLE_POINT_TOLERANCE
+/// Largest distance from \ref CAN_SAMPLE_POINT in tenths of a percent. Can be
+/// overwriten by redefinition
+#define CAN_SAMPLE_POINT_TOLERANCE 25
+#endif
+
+#ifndef CAN_BITRATE_TOLERANCE
+/// Largest bitrate error in parts per million, 0 only takes exact bitrates.
+/// Can be overwriten by redefinition
+#define CAN_BITRATE_TOLERANCE 0
+#endif
+
+/**
+ * \struct CanBitTiming
+ * \brief Bit timing of a bxCAN controller
+ */
+struct CanBitTiming {
+  uint16_t prescaler; ///< clock cycles per time quantum, 1 - 1024
+  uint8_t bs1;        ///< quanta in bit segment 1, 1 - 16
+  uint8_t bs2;        ///< quanta in bit segment 2, 1 - 8
+  uint8_t sjw;        ///< resynchronization jump width in quanta, 1 - 4
+  bool valid;         ///< a timing within the tolerances was found
+
+  /// \brief Quanta in a bit.
+  constexpr uint32_t quanta() const { return 1 + bs1 + bs2; }
+  /// \brief Sample point in tenths of a percent.
+  constexpr uint32_t samplePoint() const {
+    return 1000 * (1 + bs1) / quanta();
+  }
+  /// \brief Bitrate the timing gives with a clock.
+  constexpr uint32_t bitrate(uint32_t clock) const {
+    return clock / (prescaler * quanta());
+  }
+  /// \brief Value of the BTR register, without the mode bits.
+  constexpr uint32_t btr() const {
+    return (uint32_t)(sjw - 1) << 24 | (uint32_t)(bs2 - 1) << 20 |
+           (uint32_t)(bs1 - 1) << 16 | (uint32_t)(prescaler - 1);
+  }
+};
+
+/**
+ * Find the bit timing for a bitrate.
+ *
+ * \param clock clock of the CAN peripheral in Hz
+ * \param bitrate bitrate in bits per second
+ * \param samplePoint sample point in tenths of a percent
+ * \param tolerance largest sample point error in tenths of a percent
+ *
+ * \returns the timing, CanBitTiming::valid is false if there is none
+ */
+constexpr CanBitTiming canBitTiming(uint32_t clock, uint32_t bitrate,
+                                    uint16_t samplePoint = CAN_SAMPLE_POINT,
+                                    uint16_t tolerance =
+                                        CAN_SAMPLE_POINT_TOLERANCE) {
+  CanBitTiming best = {1, 1, 1, 1, false};
+  uint32_t bestRateError = 0;
+  uint32_t bestPointError = 0;
+
+  for (uint32_t quanta = 25; quanta >= 8; --quanta) {
+    uint64_t perBit = (uint64_t)bitrate * quanta;
+    uint64_t prescaler = ((uint64_t)clock + perBit / 2) / perBit;
+    if (bitrate == 0 || prescaler < 1 || prescaler > 1024) {
+      continue;
+    }
+    uint64_t actual = clock / (prescaler * quanta);
+    uint64_t rateError = (actual > bitrate ? actual - bitrate
+                                           : bitrate - actual) *
+                         1000000 / bitrate;
+    if (clock % (prescaler * quanta) != 0 && rateError == 0) {
+      // not exact, even if it rounds to the right bitrate
+      rateError = 1;
+    }
+    if (rateError > CAN_BITRATE_TOLERANCE) {
+      continue;
+    }
+
+    for (uint32_t bs2 = 1; bs2 <= 8; ++bs2) {
+      uint32_t bs1 = quanta - 1 - bs2;
+      if (bs1 < 1 || bs1 > 16) {
+        continue;
+      }
+      uint32_t point = 1000 * (1 + bs1) / quanta;
+      uint32_t pointError =
+          point > samplePoint ? point - samplePoint : samplePoint - point;
+      if (pointError > tolerance) {
+        continue;
+      }
+      if (!best.valid || rateError < bestRateError ||
+          (rateError == bestRateError && pointError < bestPointError)) {
+        best.prescaler = (uint16_t)prescaler;
+        best.bs1 = (uint8_t)bs1;
+        best.bs2 = (uint8_t)bs2;
+        best.sjw = (uint8_t)(bs2 < 4 ? bs2 : 4);
+        best.valid = true;
+        bestRateError = (uint32_t)rateError;
+        bestPointError = pointError;
+      }
+    }
+  }
+  return best;
+}
+
+#endif // _CAN_BIT_TIMING_H_
@@ -0,0 +1,534 @@
+/**
+ * \file can_capture.cpp
+ * \brief Capture file writer, reader and candump conversion.
+ */
+
+#ifdef CAN_HOST
+
+#include "can_capture.h"
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+
+static const char MAGIC[4] = {'C', 'C', 'A', 'P'};
+
+// ns since 1970
+static uint64_t system_time_ns(void) {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+static void header_init(CanCaptureHeader *header) {
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, MAGIC, sizeof(MAGIC));
+  header->version = CAN_CAPTURE_VERSION;
+  header->recordSize = sizeof(CanCaptureRecord);
+}
+
+static void header_name(CanCaptureHeader *header, uint8_t bus,
+                        const char *name) {
+  if (bus < CAN_CAPTURE_MAX_BUSES) {
+    // always leaves the last byte 0
+    memset(header->names[bus], 0, CAN_CAPTURE_NAME_LEN);
+    memcpy(header->names[bus], name, strnlen(name, CAN_CAPTURE_NAME_LEN - 1));
+  }
+}
+
+uint8_t CanCaptureEncoder::frame(const CanBusFrame *frame,
+                                 CanCaptureRecord *out) {
+  int64_t delta = (int64_t)(frame->time - last);
+  uint8_t count = 0;
+  if (delta > INT32_MAX || delta < INT32_MIN) {
+    memset(&out[0], 0, sizeof(out[0]));
+    out[0].bus = frame->bus;
+    out[0].kind = CAN_CAPTURE_TIME;
+    memcpy(out[0].data, &frame->time, sizeof(frame->time));
+    delta = 0;
+    ++count;
+  }
+
+  CanCaptureRecord *rec = &out[count++];
+  uint8_t len = frame->msg.len > 8 ? 8 : frame->msg.len;
+  rec->delta = (int32_t)delta;
+  rec->id = (uint16_t)((frame->msg.id & 0x7FF) | (frame->msg.rtr ? 0x800 : 0) |
+                       (len << 12));
+  rec->bus = frame->bus;
+  rec->kind = CAN_CAPTURE_FRAME;
+  memset(rec->data, 0, sizeof(rec->data));
+  memcpy(rec->data, frame->msg.data, len);
+  last = frame->time;
+  return count;
+}
+
+uint8_t CanCaptureEncoder::lost(uint8_t bus, uint32_t count, uint64_t time,
+                                CanCaptureRecord *out) {
+  CanBusFrame marker;
+  memset(&marker, 0, sizeof(marker));
+  marker.bus = bus;
+  marker.time = time;
+  // takes the time the same way as a frame, then becomes the lost record
+  uint8_t used = frame(&marker, out);
+  CanCaptureRecord *rec = &out[used - 1];
+  rec->id = 0;
+  rec->kind = CAN_CAPTURE_LOST;
+  memcpy(rec->data, &count, sizeof(count));
+  return used;
+}
+
+CanCaptureWriter::CanCaptureWriter()
+    : offset(0), filling(0), used(0), pending(-1), pendingUsed(0),
+      file(nullptr), running(false), records(0), failed(false) {
+  header_init(&header);
+  for (uint8_t i = 0; i < CAN_CAPTURE_BUSES; ++i) {
+    buses[i].lost = 0;
+    buses[i].reported = 0;
+  }
+}
+
+CanCaptureWriter::~CanCaptureWriter() { close(); }
+
+void CanCaptureWriter::setName(uint8_t bus, const char *name) {
+  header_name(&header, bus, name);
+}
+
+bool CanCaptureWriter::open(const char *path) {
+  if (file != nullptr) {
+    return false;
+  }
+  file = fopen(path, "wb");
+  if (file == nullptr) {
+    return false;
+  }
+  // whole segments are written at once, stdio would only copy them again
+  setvbuf(file, nullptr, _IONBF, 0);
+
+  header.start = system_time_ns();
+  offset = (int64_t)(header.start - can_gateway_time_ns());
+  encoder.reset(header.start);
+  if (fwrite(&header, sizeof(header), 1, file) != 1) {
+    fclose(file);
+    file = nullptr;
+    return false;
+  }
+
+  filling = 0;
+  used = 0;
+  pending = -1;
+  failed = false;
+  records = 0;
+  running = true;
+  encoding = std::thread(&CanCaptureWriter::encode, this);
+  writing = std::thread(&CanCaptureWriter::write, this);
+  return true;
+}
+
+void CanCaptureWriter::close() {
+  if (file == nullptr) {
+    return;
+  }
+  running = false;
+  encoding.join();
+  writing.join();
+  fclose(file);
+  file = nullptr;
+}
+
+bool CanCaptureWriter::record(const CanBusFrame *frame) {
+  if (frame->bus >= CAN_CAPTURE_BUSES) {
+    return false;
+  }
+  Bus *bus = &buses[frame->bus];
+  if (!bus->queue.push(*frame)) {
+    bus->lost.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+bool CanCaptureWriter::record(uint8_t bus, const CanMessage *msg) {
+  CanBusFrame frame = {*msg, can_gateway_time_ns(), bus};
+  return record(&frame);
+}
+
+uint32_t CanCaptureWriter::lost() const {
+  uint32_t total = 0;
+  for (uint8_t i = 0; i < CAN_CAPTURE_BUSES; ++i) {
+    total += buses[i].lost.load(std::memory_order_relaxed);
+  }
+  return total;
+}
+
+// give the full segment to the writing thread, waits if it is still busy
+// with the other one
+void CanCaptureWriter::handOff() {
+  std::unique_lock<std::mutex> guard(lock);
+  ready.wait(guard, [this] { return pending < 0; });
+  pending = (int16_t)filling;
+  pendingUsed = used;
+  filling ^= 1;
+  used = 0;
+  ready.notify_all();
+}
+
+void CanCaptureWriter::emit(const CanCaptureRecord *recs, uint8_t count) {
+  for (uint8_t i = 0; i < count; ++i) {
+    if (used == CAN_CAPTURE_SEGMENT) {
+      handOff();
+    }
+    segments[filling][used++] = recs[i];
+  }
+}
+
+/*
+ * The encoding thread. The rings are merged by time so the deltas stay small,
+ * a frame read late on one bus can still be a little older than the one
+ * before it and gets a negative delta.
+ */
+void CanCaptureWriter::encode() {
+  CanBusFrame *heads[CAN_CAPTURE_BUSES] = {};
+  CanCaptureRecord recs[2];
+  auto flushed = std::chrono::steady_clock::now();
+
+  while (true) {
+    // frames recorded before close() are still written
+    bool stopping = !running.load();
+    uint32_t done = 0;
+
+    while (true) {
+      int16_t oldest = -1;
+      for (uint8_t i = 0; i < CAN_CAPTURE_BUSES; ++i) {
+        if (heads[i] == nullptr) {
+          heads[i] = buses[i].queue.claim();
+        }
+        if (heads[i] != nullptr &&
+            (oldest < 0 || heads[i]->time < heads[oldest]->time)) {
+          oldest = i;
+        }
+      }
+      if (oldest < 0) {
+        break;
+      }
+      CanBusFrame frame = *heads[oldest];
+      buses[oldest].queue.release(heads[oldest]);
+      heads[oldest] = nullptr;
+      frame.time += offset;
+      emit(recs, encoder.frame(&frame, recs));
+      ++done;
+    }
+    if (done > 0) {
+      records.fetch_add(done, std::memory_order_relaxed);
+    }
+
+    for (uint8_t i = 0; i < CAN_CAPTURE_BUSES; ++i) {
+      uint32_t lost = buses[i].lost.load(std::memory_order_relaxed);
+      if (lost != buses[i].reported) {
+        uint64_t now = can_gateway_time_ns() + offset;
+        emit(recs, encoder.lost(i, lost - buses[i].reported, now, recs));
+        buses[i].reported = lost;
+      }
+    }
+
+    if (stopping) {
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (used > 0 &&
+        now - flushed >= std::chrono::milliseconds(CAN_CAPTURE_FLUSH_MS)) {
+      handOff();
+      flushed = now;
+    }
+    if (done == 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+
+  if (used > 0) {
+    handOff();
+  }
+  std::unique_lock<std::mutex> guard(lock);
+  ready.wait(guard, [this] { return pending < 0; });
+  pending = -2; // tells the writing thread to stop
+  ready.notify_all();
+}
+
+// the writing thread, the only one that waits for the disk
+void CanCaptureWriter::write() {
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [this] { return pending != -1; });
+    if (pending == -2) {
+      return;
+    }
+    const CanCaptureRecord *segment = segments[pending];
+    uint16_t count = pendingUsed;
+    guard.unlock();
+    if (fwrite(segment, sizeof(CanCaptureRecord), count, file) != count) {
+      failed = true;
+    }
+    guard.lock();
+    pending = -1;
+    ready.notify_all();
+  }
+}
+
+bool CanCaptureReader::open(const char *path) {
+  close();
+  file = fopen(path, "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+      header.recordSize != sizeof(CanCaptureRecord)) {
+    close();
+    return false;
+  }
+  time = header.start;
+  dropped = 0;
+  count = position = 0;
+  return true;
+}
+
+void CanCaptureReader::close() {
+  if (file != nullptr) {
+    fclose(file);
+    file = nullptr;
+  }
+}
+
+bool CanCaptureReader::next(CanBusFrame *frame) {
+  if (file == nullptr) {
+    return false;
+  }
+  while (true) {
+    if (position == count) {
+      count = (uint16_t)fread(buffer, sizeof(CanCaptureRecord), BUFFER, file);
+      position = 0;
+      if (count == 0) {
+        return false;
+      }
+    }
+    const CanCaptureRecord *rec = &buffer[position++];
+    time += (int64_t)rec->delta;
+
+    switch (rec->kind) {
+    case CAN_CAPTURE_FRAME:
+      memset(frame, 0, sizeof(*frame));
+      frame->msg.id = rec->id & 0x7FF;
+      frame->msg.rtr = (rec->id & 0x800) != 0;
+      frame->msg.len = (uint8_t)(rec->id >> 12);
+      memcpy(frame->msg.data, rec->data, sizeof(rec->data));
+      frame->time = time;
+      frame->bus = rec->bus;
+      return true;
+    case CAN_CAPTURE_TIME:
+      memcpy(&time, rec->data, sizeof(time));
+      break;
+    case CAN_CAPTURE_LOST: {
+      uint32_t lost;
+      memcpy(&lost, rec->data, sizeof(lost));
+      dropped += lost;
+      break;
+    }
+    default:
+      // from a newer version, the delta still counts
+      break;
+    }
+  }
+}
+
+const char *CanCaptureReader::name(uint8_t bus) const {
+  static const char NONE[] = "";
+  if (file == nullptr || bus >= CAN_CAPTURE_MAX_BUSES) {
+    return NONE;
+  }
+  // the writer always leaves the last byte 0, files from elsewhere might not
+  return memchr(header.names[bus], 0, CAN_CAPTURE_NAME_LEN) != nullptr
+             ? header.names[bus]
+             : NONE;
+}
+
+int32_t can_capture_to_candump(const char *path, FILE *out) {
+  static const char HEX[] = "0123456789ABCDEF";
+  CanCaptureReader reader;
+  if (!reader.open(path)) {
+    return -1;
+  }
+
+  char names[CAN_CAPTURE_MAX_BUSES][CAN_CAPTURE_NAME_LEN];
+  for (uint8_t i = 0; i < CAN_CAPTURE_MAX_BUSES; ++i) {
+    if (reader.name(i)[0] != '\0') {
+      strcpy(names[i], reader.name(i));
+    } else {
+      snprintf(names[i], sizeof(names[i]), "can%u", i);
+    }
+  }
+
+  CanBusFrame frame;
+  int32_t count = 0;
+  while (reader.next(&frame)) {
+    char text[24];
+    char *p = text;
+    *p++ = '#';
+    if (frame.msg.rtr) {
+      *p++ = 'R';
+      if (frame.msg.len > 0) {
+        *p++ = HEX[frame.msg.len];
+      }
+    } else {
+      for (uint8_t i = 0; i < frame.msg.len; ++i) {
+        *p++ = HEX[frame.msg.data[i] >> 4];
+        *p++ = HEX[frame.msg.data[i] & 0xF];
+      }
+    }
+    *p = '\0';
+    const char *name =
+        frame.bus < CAN_CAPTURE_MAX_BUSES ? names[frame.bus] : "can?";
+    fprintf(out, "(%llu.%06llu) %s %03X%s\n",
+            (unsigned long long)(frame.time / 1000000000ull),
+            (unsigned long long)(frame.time % 1000000000ull / 1000), name,
+            frame.msg.id, text);
+    ++count;
+  }
+  return count;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
+
+// one line of candump -l, false if it isn't a classic frame with a short id
+static bool candump_parse(const char *line, uint64_t *time, char *name,
+                          CanMessage *msg) {
+  char *end;
+  if (*line++ != '(') {
+    return false;
+  }
+  uint64_t sec = strtoull(line, &end, 10);
+  if (*end != '.') {
+    return false;
+  }
+  // the fraction is usually micro-seconds, but take any number of digits
+  uint64_t ns = 0;
+  uint32_t scale = 100000000;
+  for (line = end + 1; *line >= '0' && *line <= '9'; ++line) {
+    ns += (uint64_t)(*line - '0') * scale;
+    scale /= 10;
+  }
+  *time = sec * 1000000000ull + ns;
+  if (*line++ != ')' || *line++ != ' ') {
+    return false;
+  }
+
+  uint8_t n = 0;
+  while (*line != ' ' && *line != '\0') {
+    if (n < CAN_CAPTURE_NAME_LEN - 1) {
+      name[n++] = *line;
+    }
+    ++line;
+  }
+  name[n] = '\0';
+  if (*line++ != ' ') {
+    return false;
+  }
+
+  const char *hash = strchr(line, '#');
+  if (hash == nullptr || hash - line != 3 || hash[1] == '#') {
+    return false; // extended id or CAN FD
+  }
+  uint32_t id = (uint32_t)strtoul(line, &end, 16);
+  if (end != hash || id > 0x7FF) {
+    return false;
+  }
+
+  memset(msg, 0, sizeof(*msg));
+  msg->id = (uint16_t)id;
+  line = hash + 1;
+  if (*line == 'R') {
+    msg->rtr = true;
+    int len = hex_digit(line[1]);
+    msg->len = len > 0 && len <= 8 ? (uint8_t)len : 0;
+    return true;
+  }
+  while (msg->len < 8) {
+    int high = hex_digit(line[0]);
+    int low = high < 0 ? -1 : hex_digit(line[1]);
+    if (low < 0) {
+      break;
+    }
+    msg->data[msg->len++] = (uint8_t)(high << 4 | low);
+    line += 2;
+  }
+  return true;
+}
+
+int32_t can_capture_from_candump(FILE *in, const char *path) {
+  FILE *file = fopen(path, "wb");
+  if (file == nullptr) {
+    return -1;
+  }
+  CanCaptureHeader header;
+  header_init(&header);
+  // written again at the end with the names and the start time
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+  CanCaptureEncoder encoder;
+  static CanCaptureRecord batch[CAN_CAPTURE_SEGMENT];
+  uint16_t used = 0;
+  uint8_t buses = 0;
+  int32_t count = 0;
+  char line[256];
+
+  while (ok && fgets(line, sizeof(line), in) != nullptr) {
+    CanBusFrame frame;
+    char name[CAN_CAPTURE_NAME_LEN];
+    if (!candump_parse(line, &frame.time, name, &frame.msg)) {
+      continue;
+    }
+    uint8_t bus = 0;
+    while (bus < buses && strcmp(header.names[bus], name) != 0) {
+      ++bus;
+    }
+    if (bus == buses) {
+      if (buses == CAN_CAPTURE_MAX_BUSES) {
+        continue;
+      }
+      header_name(&header, buses++, name);
+    }
+    if (count == 0) {
+      header.start = frame.time;
+      encoder.reset(frame.time);
+    }
+    frame.bus = bus;
+
+    if (used + 2 > CAN_CAPTURE_SEGMENT) {
+      ok = fwrite(batch, sizeof(batch[0]), used, file) == used;
+      used = 0;
+    }
+    used += encoder.frame(&frame, &batch[used]);
+    ++count;
+  }
+
+  if (ok && used > 0) {
+    ok = fwrite(batch, sizeof(batch[0]), used, file) == used;
+  }
+  if (ok) {
+    ok = fseek(file, 0, SEEK_SET) == 0 &&
+         fwrite(&header, sizeof(header), 1, file) == 1;
+  }
+  ok = fclose(file) == 0 && ok;
+  return ok ? count : -1;
+}
+
+#endif // CAN_HOST
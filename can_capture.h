@@ -0,0 +1,291 @@
+/**
+ * \file can_capture.h
+ * \brief Recording bus traffic to a file and reading it back.
+ *
+ * A capture file starts with a CanCaptureHeader and is followed by
+ * CanCaptureRecord records of 16 bytes each, nothing else. Each frame is one
+ * record holding the bus it came from and the nano-seconds since the record
+ * before it, so a file can be read from any record on once the time is known
+ * and a full 1 Mbit/s bus takes under 300 kB a second. Times run on the
+ * system clock, a gap of more than two seconds gets a CAN_CAPTURE_TIME record
+ * with the full time first. The numbers are little endian.
+ *
+ * CanCaptureWriter records on a PC while a gateway or a node runs. The frames
+ * go through a lock free ring for each bus to a thread that encodes them into
+ * one of two buffers, while another thread writes the other buffer to the
+ * file. The receive path never waits for the disk, if the rings fill up the
+ * frames are lost and a CAN_CAPTURE_LOST record says how many.
+ *
+ * can_capture_to_candump() and can_capture_from_candump() convert a capture
+ * to and from the log format of candump -l from can-utils,
+ *
+ * ~~~~~~~~~~~~
+ * (1436509052.249713) can0 123#1122334455667788
+ * (1436509052.249801) can1 7DF#R
+ * ~~~~~~~~~~~~
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * static CanCaptureWriter capture;
+ * capture.setName(pt, "can0");
+ * capture.setName(bd, "can1");
+ * capture.open("drive.cap");
+ * gateway.setCapture(&capture);
+ * gateway.start();
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_CAPTURE_H_
+#define _CAN_CAPTURE_H_
+
+#ifdef CAN_HOST
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include "CanTypes.h"
+#include "can_gateway.h"
+#include "can_ring.h"
+
+/**
+ * \defgroup CanCapture_Module CanCapture
+ * \brief Capture files of bus traffic
+ *@{
+ */
+
+#ifndef CAN_CAPTURE_BUSES
+/// Buses a writer has rings for, at most \ref CAN_CAPTURE_MAX_BUSES. Can be
+/// overwriten by redefinition
+#define CAN_CAPTURE_BUSES 8
+#endif
+
+#ifndef CAN_CAPTURE_QUEUE_SIZE
+/// Frames each bus can hold for the encoding thread. Must be a power of two.
+/// Can be overwriten by redefinition
+#define CAN_CAPTURE_QUEUE_SIZE 4096
+#endif
+
+#ifndef CAN_CAPTURE_SEGMENT
+/// Records in each of the two buffers of a writer. Can be overwriten by
+/// redefinition
+#define CAN_CAPTURE_SEGMENT 4096
+#endif
+
+#ifndef CAN_CAPTURE_FLUSH_MS
+/// Longest a recorded frame waits in a buffer before it is written, in
+/// mili-seconds. Can be overwriten by redefinition
+#define CAN_CAPTURE_FLUSH_MS 200
+#endif
+
+/// Most buses a capture file can have
+#define CAN_CAPTURE_MAX_BUSES 16
+/// Longest interface name kept in the header
+#define CAN_CAPTURE_NAME_LEN 16
+/// Version of the file format
+#define CAN_CAPTURE_VERSION 1
+
+static_assert(CAN_CAPTURE_BUSES <= CAN_CAPTURE_MAX_BUSES,
+              "CAN_CAPTURE_BUSES must be at most CAN_CAPTURE_MAX_BUSES");
+
+/**
+ * \enum CanCaptureKind
+ * \brief What a record holds
+ */
+typedef enum {
+  CAN_CAPTURE_FRAME = 0, ///< A frame
+  CAN_CAPTURE_TIME,      ///< The time in data, ns since 1970, delta is 0
+  CAN_CAPTURE_LOST,      ///< Frames of the bus lost by the writer, the count
+                         ///< is in the first four bytes of data
+} CanCaptureKind;
+
+/**
+ * \struct CanCaptureHeader
+ * \brief Start of a capture file
+ */
+typedef struct {
+  char magic[4];       ///< "CCAP"
+  uint16_t version;    ///< \ref CAN_CAPTURE_VERSION
+  uint16_t recordSize; ///< sizeof(CanCaptureRecord)
+  uint64_t start;      ///< ns since 1970 the first delta counts from
+  char names[CAN_CAPTURE_MAX_BUSES][CAN_CAPTURE_NAME_LEN]; ///< interface of
+                                                           ///< each bus
+} CanCaptureHeader;
+
+/**
+ * \struct CanCaptureRecord
+ * \brief One frame or event in a capture file
+ */
+typedef struct {
+  int32_t delta;   ///< ns since the record before, can be negative
+  uint16_t id;     ///< id in bits 0-10, rtr bit 11, length bits 12-15
+  uint8_t bus;     ///< bus index
+  uint8_t kind;    ///< CanCaptureKind
+  uint8_t data[8]; ///< data of a frame, or what kind says
+} CanCaptureRecord;
+
+static_assert(sizeof(CanCaptureRecord) == 16, "records must be 16 bytes");
+
+/**
+ * \class CanCaptureEncoder
+ * \brief Turns frames into records, keeping the time of the last one.
+ */
+class CanCaptureEncoder {
+private:
+  uint64_t last;
+
+public:
+  /// \brief Start counting deltas from a time in ns since 1970.
+  void reset(uint64_t start) { last = start; }
+
+  /**
+   * Encode a frame with its time in ns since 1970.
+   *
+   * \param out room for two records
+   *
+   * \returns records used, 2 if a CAN_CAPTURE_TIME record was needed
+   */
+  uint8_t frame(const CanBusFrame *frame, CanCaptureRecord *out);
+
+  /// \brief Encode a CAN_CAPTURE_LOST record, returns records used.
+  uint8_t lost(uint8_t bus, uint32_t count, uint64_t time,
+               CanCaptureRecord *out);
+};
+
+/**
+ * \class CanCaptureWriter
+ * \brief Records frames from several threads to a file without waiting.
+ *
+ * Each bus must be recorded from one thread only, the receive thread of the
+ * bus in a gateway or the receive hook of a node.
+ */
+class CanCaptureWriter {
+private:
+  /// Frames of one bus on their way to the encoding thread
+  struct alignas(64) Bus {
+    CanRing<CanBusFrame, CAN_CAPTURE_QUEUE_SIZE> queue;
+    std::atomic<uint32_t> lost; ///< frames the ring had no room for
+    uint32_t reported;          ///< lost frames already in the file
+  };
+
+  Bus buses[CAN_CAPTURE_BUSES];
+  CanCaptureHeader header;
+  CanCaptureEncoder encoder;
+  int64_t offset; ///< system clock minus can_gateway_time_ns()
+
+  CanCaptureRecord segments[2][CAN_CAPTURE_SEGMENT];
+  uint16_t filling; ///< segment being encoded into
+  uint16_t used;    ///< records in it
+
+  // handing full segments to the writing thread
+  std::mutex lock;
+  std::condition_variable ready;
+  int16_t pending; ///< segment waiting to be written, -1 if none
+  uint16_t pendingUsed;
+
+  FILE *file;
+  std::thread encoding;
+  std::thread writing;
+  std::atomic<bool> running;
+  std::atomic<uint32_t> records; ///< frames put in the file
+  std::atomic<bool> failed;
+
+  void encode();
+  void write();
+  void emit(const CanCaptureRecord *recs, uint8_t count);
+  void handOff();
+
+public:
+  CanCaptureWriter();
+  ~CanCaptureWriter();
+
+  /// \brief Name the interface of a bus, before open().
+  void setName(uint8_t bus, const char *name);
+
+  /// \brief Create the file and start the threads.
+  bool open(const char *path);
+  /// \brief Write what is left and close the file.
+  void close();
+
+  /**
+   * Record a frame, never waits.
+   *
+   * \param frame the frame, its time from can_gateway_time_ns()
+   *
+   * \returns false if it was lost
+   */
+  bool record(const CanBusFrame *frame);
+  /// \brief Record a frame of a bus as read now.
+  bool record(uint8_t bus, const CanMessage *msg);
+
+  /// \brief Frames put in the file so far.
+  uint32_t written() const { return records.load(std::memory_order_relaxed); }
+  /// \brief Frames lost so far over every bus.
+  uint32_t lost() const;
+  /// \brief The file could not be written.
+  bool error() const { return failed; }
+};
+
+/**
+ * \class CanCaptureReader
+ * \brief Reads a capture file a frame at a time.
+ */
+class CanCaptureReader {
+private:
+  static const uint16_t BUFFER = 4096;
+
+  FILE *file;
+  CanCaptureHeader header;
+  uint64_t time;
+  uint32_t dropped;
+  CanCaptureRecord buffer[BUFFER];
+  uint16_t count;
+  uint16_t position; ///< next record of the buffer
+
+public:
+  CanCaptureReader() : file(nullptr) {}
+  ~CanCaptureReader() { close(); }
+
+  /// \brief Open a file, false if it is not a capture.
+  bool open(const char *path);
+  void close();
+
+  /**
+   * Read the next frame.
+   *
+   * \param frame the frame, its time in ns since 1970
+   *
+   * \returns false at the end of the file
+   */
+  bool next(CanBusFrame *frame);
+
+  /// \brief Interface name of a bus, empty if the file has none.
+  const char *name(uint8_t bus) const;
+  /// \brief Time the capture starts, in ns since 1970.
+  uint64_t start() const { return header.start; }
+  /// \brief Frames the writer lost, of the records read so far.
+  uint32_t lost() const { return dropped; }
+};
+
+/**
+ * Write a capture as candump -l text. Buses without a name in the file are
+ * called can0, can1 and so on after their index.
+ *
+ * \returns frames converted, -1 if the capture can't be read
+ */
+int32_t can_capture_to_candump(const char *path, FILE *out);
+
+/**
+ * Make a capture from candump -l text. Interfaces get bus indexes in the
+ * order they first show up. Extended and CAN FD frames are left out.
+ *
+ * \returns frames converted, -1 if the capture can't be written
+ */
+int32_t can_capture_from_candump(FILE *in, const char *path);
+
+//@}
+#endif // CAN_HOST
+#endif // _CAN_CAPTURE_H_
@@ -5,21 +5,78 @@
  */
 
 
+#ifndef CAN_HOST
+
 #include "CanNode.h"
+#include "can_ring.h"
+#include "can_filter_plan.h"
+#include "can_bit_timing.h"
 
 static CAN_HandleTypeDef hcan;
-static uint16_t prescaler;
-static uint8_t bs1;
-static uint8_t bs2;
+static uint32_t btr;
 static CanState bus_state;
-static uint8_t num_msg;
+
+// bit timing of every canBitrate at CAN_CLOCK_HZ, worked out by the compiler
+#define CAN_BITRATES (CAN_BITRATE_1000K + 1)
+static constexpr CanBitTiming bit_timings[CAN_BITRATES] = {
+    canBitTiming(CAN_CLOCK_HZ, 10000),  canBitTiming(CAN_CLOCK_HZ, 20000),
+    canBitTiming(CAN_CLOCK_HZ, 50000),  canBitTiming(CAN_CLOCK_HZ, 100000),
+    canBitTiming(CAN_CLOCK_HZ, 125000), canBitTiming(CAN_CLOCK_HZ, 250000),
+    canBitTiming(CAN_CLOCK_HZ, 500000), canBitTiming(CAN_CLOCK_HZ, 750000),
+    canBitTiming(CAN_CLOCK_HZ, 1000000)};
+
+static_assert(bit_timings[CAN_BITRATE_125K].valid,
+              "no bit timing for 125 kbit/s at CAN_CLOCK_HZ, can_init() "
+              "starts with it");
+static_assert(bit_timings[CAN_BITRATE_500K].valid,
+              "no bit timing for 500 kbit/s at CAN_CLOCK_HZ, CanNode runs "
+              "the bus at it");
+
+// messages taken out of the hardware FIFOs by the receive interrupt
+static CanRing<CanMessage, CAN_RX_RING_SIZE> rx_ring;
+
+// traffic counters, updated from the interrupts (see can_stats.h)
+static CanStatsCounter stats;
+static uint32_t stats_since;
+static uint32_t stats_drops;
+
+// messages waiting for a transmit mailbox, only touched with the CAN
+// interrupts held off or from the transmit interrupt
+static CanTxQueue<CAN_TX_QUEUE_SIZE> tx_queue;
+
+// every id and mask asked for and how they are laid out in the filter banks
+static CanFilterPlan<2 * CAN_FILTER_BANKS> filter_plan;
+
+// answers to remote requests sent by the receive interrupt
+static CanRtrTable<CAN_RTR_RESPONSES> rtr_table;
+
+// called by the receive interrupt for every message, see can_rx_set_hook()
+static void (*volatile rx_hook)(CanMessage *msg) = nullptr;
+
+// bus-off handling, see can_set_recovery()
+static CanRecoveryPolicy recovery = CAN_RECOVER_AUTO;
+static bool recovery_flush = false;
+static volatile bool off_bus;         // went bus-off and isn't back yet
+static volatile uint32_t off_since;   // can_time_us() when it went bus-off
+static volatile uint32_t off_tick;    // HAL_GetTick() when it went bus-off
+static volatile uint32_t backoff = CAN_RECOVERY_BACKOFF_MIN;
+// EWGF, EPVF and BOFF as last seen, the interrupt counts the ones that get set
+static volatile uint8_t error_state;
+
+// hold off interrupts while the transmit queue is used from the main loop
+#define CAN_CRITICAL_ENTER()                                                   \
+  uint32_t primask = __get_PRIMASK();                                          \
+  __disable_irq()
+#define CAN_CRITICAL_EXIT() __set_PRIMASK(primask)
 
 void can_init(void) {
   // default to kbit/s
   can_set_bitrate(CAN_BITRATE_125K);
   hcan.Instance = CAN; // this is for convinience debugging
-  num_msg = 0;
   bus_state = BUS_OFF;
+  off_bus = false;
+  error_state = 0;
+  backoff = CAN_RECOVERY_BACKOFF_MIN;
 }
 
 static inline void can_io_init() {
@@ -54,212 +111,321 @@ void can_enable(void) {
       ;
     // Exit sleep mode
     CAN->MCR &= ~CAN_MCR_SLEEP;
-    // Setup timing: BS1 and BS2 are set in can_set_bitrate().
-    // The prescalar is set to whatever it was set to from can_set_bitrate()
-    CAN->BTR = bs2 << 20 | bs1 << 16 | prescaler;
+    // Setup timing: the timing is set in can_set_bitrate()
+    CAN->BTR = btr;
+    // leave bus-off on its own or only when we come through here again
+    if (recovery == CAN_RECOVER_AUTO) {
+      CAN->MCR |= CAN_MCR_ABOM;
+    } else {
+      CAN->MCR &= ~CAN_MCR_ABOM;
+    }
 
     CAN->MCR &= ~CAN_MCR_INRQ; /* Leave init mode */
     /* Wait the init mode leaving */
     while ((CAN->MSR & CAN_MSR_INAK) == CAN_MSR_INAK)
       ;
 
-    /* Set FIFO0 message pending IT enable */
-    // CAN->IER |= CAN_IER_FMPIE0;
+    /* Set FIFO0 and FIFO1 message pending and mailbox empty IT enable */
+    CAN->IER |= CAN_IER_FMPIE0 | CAN_IER_FMPIE1 | CAN_IER_TMEIE;
+    // error warning, error passive and bus-off raise the status change
+    // interrupt
+    CAN->IER |= CAN_IER_ERRIE | CAN_IER_EWGIE | CAN_IER_EPVIE | CAN_IER_BOFIE;
+#ifdef STM32F0
+    HAL_NVIC_SetPriority(CEC_CAN_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(CEC_CAN_IRQn);
+#else
+    HAL_NVIC_SetPriority(USB_HP_CAN_TX_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USB_HP_CAN_TX_IRQn);
+    HAL_NVIC_SetPriority(USB_LP_CAN_RX0_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USB_LP_CAN_RX0_IRQn);
+    HAL_NVIC_SetPriority(CAN_RX1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(CAN_RX1_IRQn);
+    HAL_NVIC_SetPriority(CAN_SCE_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(CAN_SCE_IRQn);
+#endif
 
     bus_state = BUS_OK;
+  } else if (CAN->MCR & CAN_MCR_SLEEP) {
+    // still asleep from can_sleep(), wake up without waiting for the bus
+    CAN->MCR &= ~CAN_MCR_SLEEP;
+    while ((CAN->MSR & CAN_MSR_SLAK) == CAN_MSR_SLAK)
+      ;
   }
                                        
   //HAL_GPIO_WritePin(CAN_EN_GPIO_Port, CAN_EN_Pin, GPIO_PIN_RESET); 
 }
 
-void can_set_bitrate(canBitrate bitrate) {
-  // all these values were calculated from the equation given in the reference
-  // manual for
-  // finding the baudrate. They are calculated from an LibreOffice Calc
-  // spreadsheet for a 16MHZ clock
-#ifndef STM32F3
-  switch (bitrate) {
-  case CAN_BITRATE_10K:
-    prescaler = 159;
-    bs1 = 3;
-    bs2 = 4;
-    break;
-  case CAN_BITRATE_20K:
-    prescaler = 99;
-    bs1 = 2;
-    bs2 = 3;
-    break;
-  case CAN_BITRATE_50K:
-    prescaler = 31;
-    bs1 = 4;
-    bs2 = 3;
-    break;
-  case CAN_BITRATE_100K:
-    prescaler = 19;
-    bs1 = 3;
-    bs2 = 2;
-    break;
-  case CAN_BITRATE_125K:
-    prescaler = 7;
-    bs1 = 7;
-    bs2 = 6;
-    break;
-  case CAN_BITRATE_250K:
-    prescaler = 7;
-    bs1 = 1;
-    bs2 = 4;
-    break;
-  case CAN_BITRATE_500K:
-    prescaler = 1;
-    bs1 = 7;
-    bs2 = 6;
-    break;
-  case CAN_BITRATE_750K:
-    prescaler = 2;
-    bs1 = 2;
-    bs2 = 2;
-    break;
-  case CAN_BITRATE_1000K:
-    prescaler = 1;
-    bs1 = 2;
-    bs2 = 3;
-    break;
+// CAN_RECOVER_BACKOFF has waited long enough after a bus-off
+static bool can_retry_due(void) {
+  return off_bus && bus_state == BUS_OFF && recovery == CAN_RECOVER_BACKOFF &&
+         HAL_GetTick() - off_tick >= backoff;
+}
+
+/**
+ * Puts the controller in sleep mode with automatic wakeup (AWUM). It leaves
+ * the bus once the frame it is sending, if any, is done and draws next to no
+ * power. The first activity on the bus wakes it up again on its own, the
+ * wakeup interrupt then brings the core out of can_wait().
+ *
+ * The controller has to find the end of a frame before it takes part in the
+ * bus again, so the frame that wakes it is lost. A node that sleeps needs the
+ * other nodes to send a frame it can miss first, or to repeat what they send.
+ * Frames given to can_tx() while the controller sleeps wait in the mailboxes
+ * until it wakes up, can_enable() wakes it without waiting for the bus.
+ */
+void can_sleep(void) {
+  if (bus_state != BUS_OK) {
+    return;
   }
-#endif
-// used the same spreadsheet for a 24MHz clock
-#ifdef STM32F3
-  switch (bitrate) {
-  case CAN_BITRATE_10K:
-    prescaler = 479;
-    bs1 = 2;
-    bs2 = 0;
-    break;
-  case CAN_BITRATE_20K:
-    prescaler = 149;
-    bs1 = 4;
-    bs2 = 1;
-    break;
-  case CAN_BITRATE_50K:
-    prescaler = 95;
-    bs1 = 2;
-    bs2 = 0;
-    break;
-  case CAN_BITRATE_100K:
-    prescaler = 23;
-    bs1 = 4;
-    bs2 = 3;
-    break;
-  case CAN_BITRATE_125K:
-    prescaler = 31;
-    bs1 = 3;
-    bs2 = 0;
-    break;
-  case CAN_BITRATE_250K:
-    prescaler = 23;
-    bs1 = 0;
-    bs2 = 1;
-    break;
-  case CAN_BITRATE_500K:
-    prescaler = 5;
-    bs1 = 2;
-    bs2 = 3;
-    break;
-  case CAN_BITRATE_750K:
-    prescaler = 3;
-    bs1 = 4;
-    bs2 = 1;
-    break;
-  case CAN_BITRATE_1000K:
-    prescaler = 2;
-    bs1 = 5;
-    bs2 = 0;
-    break;
+  CAN->MCR |= CAN_MCR_AWUM;
+  CAN->IER |= CAN_IER_WKUIE;
+  CAN->MCR = (CAN->MCR & ~CAN_MCR_INRQ) | CAN_MCR_SLEEP;
+  while ((CAN->MSR & CAN_MSR_SLAK) != CAN_MSR_SLAK)
+    ;
+}
+
+/**
+ * Halts the core with WFI until the receive interrupt puts a message in the
+ * receive ring. Every interrupt ends a WFI, the SysTick one every mili-second,
+ * so the ring and the time are checked again after each one. The check and
+ * the WFI run with the interrupts held off, an interrupt that comes between
+ * them is left pending and ends the WFI right away instead of being missed.
+ *
+ * The time spent halted is counted in CanStats::idle_us. The wait also ends
+ * when can_recover() has a bus-off recovery to start.
+ *
+ * \param timeout longest time to wait in mili-seconds
+ *
+ * \returns true if there is a message in the receive ring
+ */
+bool can_wait(uint32_t timeout) {
+  uint32_t start = HAL_GetTick();
+
+  while (rx_ring.empty() && HAL_GetTick() - start < timeout &&
+         !can_retry_due()) {
+    uint32_t begin = can_time_us();
+    __disable_irq();
+    if (rx_ring.empty()) {
+      __WFI();
+    }
+    __enable_irq();
+    stats.idle(can_time_us() - begin);
   }
-#endif
+  return !rx_ring.empty();
 }
 
 /**
- * \param id id to filter on 
+ * The controller goes bus-off when its transmit error counter passes 255,
+ * after about 32 frames in a row that it couldn't send. Until it recovers it
+ * neither sends nor recieves. The policy says how the recovery starts, see
+ * \ref CanRecoveryPolicy.
  *
- * \returns the filter number of the added filter returns \ref CAN_FILTER_ERROR
- * if the function was unable to add a filter.
+ * Frames that are waiting when the controller goes bus-off, and the ones given
+ * to can_tx() while it is off, are kept and go out once it is back, or thrown
+ * away if \p flush is set. Throwing them away keeps a node from sending stale
+ * values all at once when it comes back, can_tx() then returns \ref BUS_OFF
+ * until it is back.
+ *
+ * A new policy is used from the next bus-off on.
+ *
+ * \param policy how to start the recovery
+ * \param flush throw away the frames waiting to be sent
  */
-uint16_t can_add_filter_id(uint16_t id) {
-    
-  CAN_FilterTypeDef filter;
-  uint8_t bank_num, fltr_num;
-  const int MAX_FILTER = 12;
-
-  // mostly setup filter
-  filter.FilterIdLow = 0;
-  filter.FilterIdHigh = 0;
-  filter.FilterMaskIdLow = 0;
-  filter.FilterMaskIdHigh = 0;
-  filter.FilterMode = CAN_FILTERMODE_IDLIST;
-  filter.FilterScale = CAN_FILTERSCALE_16BIT;
-  filter.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-  filter.FilterBank = 0;
-  filter.FilterActivation = CAN_FILTER_ENABLE;
-
-  // loop through filter banks to find an empty filter register
-  for (fltr_num = bank_num = 0; bank_num < MAX_FILTER; bank_num++) {
-    // this is a register currently in use, check if there is any openings
-    if (CAN->FA1R & (1 << bank_num)) {
-      // check if bank is using a mask or a id list
-      if (CAN->FM1R & (1 << bank_num)) {
-        // id list
-
-        filter.FilterBank = bank_num;
-
-        // if we are here then the first slot has already been filled
-        filter.FilterMaskIdLow = (CAN->sFilterRegister[bank_num].FR1 >> 16) && 0xFFFF;
-        filter.FilterIdLow = CAN->sFilterRegister[bank_num].FR1 && 0xFFFF;
-
-        ++fltr_num;
-        // check if second slot has been filled
-        if (filter.FilterIdLow == 0) {
-          filter.FilterIdLow = id;
-          HAL_CAN_ConfigFilter(&hcan, &filter);
-          return fltr_num;
-        } 
-        filter.FilterMaskIdHigh = (CAN->sFilterRegister[bank_num].FR2 >> 16) && 0xFFFF;
-        filter.FilterIdHigh = CAN->sFilterRegister[bank_num].FR2 && 0xFFFF;
-
-        ++fltr_num;
-        // check if third slot has been filled
-        if (filter.FilterMaskIdHigh == 0) {
-          filter.FilterMaskIdHigh = id;
-          HAL_CAN_ConfigFilter(&hcan, &filter);
-          return fltr_num;
-        } 
-
-        ++fltr_num;
-        // check if fourth slot has been filled
-        if (filter.FilterIdHigh == 0) {
-          filter.FilterIdHigh = id;
-          HAL_CAN_ConfigFilter(&hcan, &filter);
-          return fltr_num;
-        } 
-        // no empty slots incriment number, should be 4 greater than when
-        // started
-        ++fltr_num;
-
-      } else {
-        // add the number of filters in an id-mask to the filter number
-        fltr_num += 2;
-      }
+void can_set_recovery(CanRecoveryPolicy policy, bool flush) {
+  CAN_CRITICAL_ENTER();
+  recovery = policy;
+  recovery_flush = flush;
+  if (bus_state == BUS_OK) {
+    if (policy == CAN_RECOVER_AUTO) {
+      CAN->MCR |= CAN_MCR_ABOM;
     } else {
+      CAN->MCR &= ~CAN_MCR_ABOM;
+    }
+  }
+  CAN_CRITICAL_EXIT();
+}
+
+// back on the bus after a bus-off, called with the interrupts held off
+static void can_bus_on(void) {
+  off_bus = false;
+  stats.recovered(can_time_us() - off_since);
+}
+
+/**
+ * The error interrupt only sees the error state get worse, this sees it get
+ * better. It notes when the controller is back on the bus after a bus-off,
+ * for CanStats::recover_us, and with \ref CAN_RECOVER_BACKOFF starts the
+ * recovery once the wait is over by running can_enable() again.
+ * CanNode::checkForMessages() calls it, it reads nothing from the controller
+ * while the error state is clear.
+ *
+ * \returns \ref BUS_OK if the controller is on the bus, \ref BUS_OFF if it
+ * went bus-off and isn't back yet
+ */
+CanState can_recover(void) {
+  if (!off_bus && error_state == 0) {
+    return BUS_OK;
+  }
+
+  CAN_CRITICAL_ENTER();
+  uint32_t esr = CAN->ESR;
+  error_state &= (uint8_t)esr;
+  if (off_bus && bus_state == BUS_OK && !(esr & CAN_ESR_BOFF)) {
+    can_bus_on();
+  }
+  bool retry = can_retry_due();
+  CAN_CRITICAL_EXIT();
+
+  if (retry) {
+    // leaving initilization mode starts the recovery
+    can_enable();
+    backoff = backoff * 2 < CAN_RECOVERY_BACKOFF_MAX ? backoff * 2
+                                                     : CAN_RECOVERY_BACKOFF_MAX;
+  }
+  return off_bus ? BUS_OFF : BUS_OK;
+}
+
+void can_set_bitrate(canBitrate bitrate) {
+  // bitrates the clock can't make have no timing, the bitrate stays the same
+  if (bitrate < CAN_BITRATES && bit_timings[bitrate].valid) {
+    btr = bit_timings[bitrate].btr();
+  }
+}
+
+// bitrates in the order can_autobaud() tries them, the most common first
+static const canBitrate autobaud_order[] = {
+    CAN_BITRATE_500K, CAN_BITRATE_1000K, CAN_BITRATE_250K,
+    CAN_BITRATE_125K, CAN_BITRATE_750K,  CAN_BITRATE_100K,
+    CAN_BITRATE_50K,  CAN_BITRATE_20K,   CAN_BITRATE_10K};
+
+/**
+ * The controller is put in silent mode, where it recieves frames but never
+ * drives the bus, so listening at the wrong bitrate doesn't disturb the other
+ * nodes with error flags. At each bitrate the last error code is set to 7
+ * (which only software can write) and watched:
+ *
+ * - 0 means a frame was recieved without errors, the bitrate is right
+ * - 1 - 6 means a frame was seen with errors, the next bitrate is tried right
+ *   away
+ * - 7 after \p listen mili-seconds means nothing was heard, the next bitrate
+ *   is tried
+ *
+ * Bitrates are tried over and over until one is found or \p timeout runs out,
+ * so the detection takes at most \p timeout. Call it after can_init() and
+ * before can_enable(), the bitrate found is set with can_set_bitrate() and
+ * used by can_enable().
+ *
+ * \param[out] bitrate the bitrate found
+ * \param listen mili-seconds to wait for a frame at each bitrate
+ * \param timeout mili-seconds to give up after
+ *
+ * \returns \ref BUS_OK if the bitrate was found, \ref NO_DATA if nothing was
+ * heard in time and \ref BUS_BUSY if the controller is already enabled.
+ */
+CanState can_autobaud(canBitrate *bitrate, uint16_t listen, uint32_t timeout) {
+  CanState state = NO_DATA;
+  uint32_t start = HAL_GetTick();
+  uint8_t next = 0;
+
+  if (bus_state != BUS_OFF) {
+    return BUS_BUSY;
+  }
+  RCC->APB1ENR |= RCC_APB1ENR_CANEN;
+  can_io_init();
 
-      filter.FilterIdLow = (id << 5);
-      filter.FilterBank = bank_num;
+  while (state != BUS_OK && HAL_GetTick() - start < timeout) {
+    canBitrate rate = autobaud_order[next];
+    next = (next + 1) % (sizeof(autobaud_order) / sizeof(autobaud_order[0]));
+    if (!bit_timings[rate].valid) {
+      continue;
+    }
 
-      HAL_CAN_ConfigFilter(&hcan, &filter);
-      // return the filter number
-      return fltr_num;
+    CAN->MCR |= CAN_MCR_INRQ;
+    while ((CAN->MSR & CAN_MSR_INAK) != CAN_MSR_INAK)
+      ;
+    CAN->MCR &= ~CAN_MCR_SLEEP;
+    CAN->BTR = bit_timings[rate].btr() | CAN_BTR_SILM;
+    // LEC = 7, the hardware replaces it after the next frame
+    CAN->ESR = CAN_ESR_LEC;
+    // the controller joins the bus once it has seen 11 recessive bits
+    CAN->MCR &= ~CAN_MCR_INRQ;
+
+    uint32_t since = HAL_GetTick();
+    uint32_t lec = CAN_ESR_LEC;
+    while (lec == CAN_ESR_LEC && HAL_GetTick() - since < listen &&
+           HAL_GetTick() - start < timeout) {
+      lec = CAN->ESR & CAN_ESR_LEC;
     }
+    if (lec == 0) {
+      *bitrate = rate;
+      state = BUS_OK;
+    }
+  }
+
+  // back to initilization mode for can_enable()
+  CAN->MCR |= CAN_MCR_INRQ;
+  while ((CAN->MSR & CAN_MSR_INAK) != CAN_MSR_INAK)
+    ;
+  if (state == BUS_OK) {
+    can_set_bitrate(*bitrate);
+  }
+  return state;
+}
+
+// the 16-bit filter register for a slot of the plan, the RTR bit is ignored
+// and the IDE bit is always compared so extended frames never match
+static uint32_t can_filter_reg(const CanFilterSlot &slot) {
+  uint32_t id = (uint32_t)slot.id << 5;
+  uint32_t mask = ((uint32_t)slot.mask << 5) | 0x0008;
+  return mask << 16 | id;
+}
+
+/*
+ * Write the filter plan to the filter banks, every bank holds two 16-bit mask
+ * filters for FIFO0. Banks past the end of the plan are turned off.
+ */
+static void can_filter_apply() {
+  uint8_t count = filter_plan.size();
+
+  CAN->FMR |= CAN_FMR_FINIT;
+  CAN->FA1R = 0;
+  CAN->FM1R = 0;
+  CAN->FS1R = 0;
+  CAN->FFA1R = 0;
+  for (uint8_t bank = 0; bank < CAN_FILTER_BANKS && 2 * bank < count; ++bank) {
+    uint32_t fr1 = can_filter_reg(filter_plan.slot(2 * bank));
+    // an odd filter at the end is written twice
+    uint32_t fr2 = 2 * bank + 1 < count
+                       ? can_filter_reg(filter_plan.slot(2 * bank + 1))
+                       : fr1;
+    CAN->sFilterRegister[bank].FR1 = fr1;
+    CAN->sFilterRegister[bank].FR2 = fr2;
+    CAN->FA1R |= 1UL << bank;
+  }
+  CAN->FMR &= ~CAN_FMR_FINIT;
+}
+
+/**
+ * The id is added to the filter plan and the filter banks are laid out again
+ * (see can_filter_plan.h). Both data and remote frames with the id are
+ * accepted.
+ *
+ * \param id id to filter on
+ *
+ * \returns the id, or \ref CAN_FILTER_ERROR if there was no room for it.
+ */
+uint16_t can_add_filter_id(uint16_t id) {
+  // the plan is worked out with the interrupts on, only the copy is not
+  if (!filter_plan.addId(id)) {
+    return CAN_FILTER_ERROR;
+  }
+  CAN_CRITICAL_ENTER();
+  if (filter_plan.apply()) {
+    can_filter_apply();
   }
+  CAN_CRITICAL_EXIT();
 
-  return CAN_FILTER_ERROR;
+  return id;
 }
 
 /**
@@ -276,84 +442,53 @@ uint16_t can_add_filter_id(uint16_t id) {
  * uint16_t id = can_add_filter_mask(id_to_filter, id_mask);
  * CanNode_addFilter(id, handler);
  * ~~~~~~~~~~~~
+ *
+ * The returned number is a handle, not the hardware filter number. Messages
+ * that match the mask arrive with the handle in CanMessage::fmi, even after
+ * other filters have been added. If a message matches more than one mask it
+ * only gets the handle of the first of them that was added.
  * 
  * \param id base id of the filter mask
  * \param mask mask on top of the base id, 0's are don't cares
  *
- * \returns the filter number of the added filter returns \ref CAN_FILTER_ERROR
+ * \returns the handle of the added filter returns \ref CAN_FILTER_ERROR
  * if the function was unable to add a filter.
  */
 uint16_t can_add_filter_mask(uint16_t id, uint16_t mask) {
-  CAN_FilterTypeDef filter;
-  uint8_t bank_num, fltr_num;
-  const int MAX_FILTER = 12;
-
-  // mostly setup filter
-  filter.FilterIdLow = 0;
-  filter.FilterIdHigh = 0;
-  filter.FilterMaskIdLow = 0;
-  filter.FilterMaskIdHigh = 0;
-  filter.FilterMode = CAN_FILTERMODE_IDMASK;
-  filter.FilterScale = CAN_FILTERSCALE_16BIT;
-  filter.FilterFIFOAssignment = CAN_FILTER_FIFO0;
-  filter.FilterBank = 0;
-  filter.FilterActivation = ENABLE;
-
-  // loop through filter banks to find an empty filter register
-  for (fltr_num = bank_num = 0; bank_num < MAX_FILTER; bank_num++) {
-    // this is a register currently in use, check if there is any openings
-    if (CAN->FA1R & (1 << bank_num)) {
-      // check if bank is using a mask or a id list
-      if ((CAN->FM1R & (1 << bank_num)) == 0) {
-        // id mask
-
-        // if we are here then the first slot has been taken. fill it
-        // from the registers
-        filter.FilterIdLow = CAN->sFilterRegister[bank_num].FR1;
-        filter.FilterIdHigh = (CAN->sFilterRegister[bank_num].FR1 >> 16);
-
-        // incriment filter index
-        ++fltr_num;
-
-        // fill the new slot
-        filter.FilterMaskIdLow = (id << 5);
-        filter.FilterMaskIdHigh = (mask << 5);
-
-        // configure it
-        HAL_CAN_ConfigFilter(&hcan, &filter);
-      } else {
-        // add the number of filters in an id-list to the filter number
-        fltr_num += 4;
-      }
-    } else {
+  uint8_t handle = filter_plan.addMask(id, mask);
+  if (handle == CAN_FILTER_NO_HANDLE) {
+    return CAN_FILTER_ERROR;
+  }
+  CAN_CRITICAL_ENTER();
+  if (filter_plan.apply()) {
+    can_filter_apply();
+  }
+  CAN_CRITICAL_EXIT();
 
-      filter.FilterIdLow = (id << 5);
-      filter.FilterIdHigh = (mask << 5);
-      filter.FilterBank = bank_num;
+  return handle;
+}
 
-      HAL_CAN_ConfigFilter(&hcan, &filter);
-      // return the filter number
-      return fltr_num;
-    }
-  }
+uint8_t can_filters_used(void) {
+  return filter_plan.size();
+}
 
-  return CAN_FILTER_ERROR;
+uint8_t can_filter_handle(uint8_t fmi) {
+  return filter_plan.handle(fmi);
 }
 
-CanState can_tx(CanMessage *tx_msg, uint32_t timeout) { 
-  uint8_t mailbox; // find an empty mailbox
-  for (mailbox = 0; mailbox < 3; ++mailbox) {
-    // check the status
-    if (CAN->sTxMailBox[mailbox].TIR & CAN_TI0R_TXRQ) {
-      continue;
-    } else {
-      break; // found open mailbox
-    }
-  }
+/*
+ * Put a message in an empty transmit mailbox and request that it be sent. The
+ * caller makes sure there is an empty mailbox (TME).
+ */
+static void can_tx_load(const CanMessage *tx_msg) {
+  // the hardware gives the number of the next empty mailbox
+  uint8_t mailbox = (CAN->TSR & CAN_TSR_CODE) >> 24;
+  uint32_t low = 0;
+  uint32_t high = 0;
 
-  // if there are no open mailboxes
-  if (mailbox == 3) {
-    return BUS_BUSY;
+  for (uint8_t i = 0; i < 4; ++i) {
+    low |= (uint32_t)tx_msg->data[i] << (8 * i);
+    high |= (uint32_t)tx_msg->data[i + 4] << (8 * i);
   }
 
   // add data to register
@@ -361,60 +496,422 @@ CanState can_tx(CanMessage *tx_msg, uint32_t timeout) {
   if (tx_msg->rtr) {
     CAN->sTxMailBox[mailbox].TIR |= CAN_TI0R_RTR;
   }
-
   // set message length
   CAN->sTxMailBox[mailbox].TDTR = tx_msg->len & 0x0F;
+  CAN->sTxMailBox[mailbox].TDLR = low;
+  CAN->sTxMailBox[mailbox].TDHR = high;
 
-  // clear mailbox and add new data
-  CAN->sTxMailBox[mailbox].TDHR = 0;
-  CAN->sTxMailBox[mailbox].TDLR = 0;
-  for (uint8_t i = 0; i < 4; ++i) {
-    CAN->sTxMailBox[mailbox].TDHR |= tx_msg->data[i + 4] << (8 * i);
-    CAN->sTxMailBox[mailbox].TDLR |= tx_msg->data[i] << (8 * i);
-  }
   // transmit can frame
   CAN->sTxMailBox[mailbox].TIR |= CAN_TI0R_TXRQ;
+}
 
-  return BUS_OK;
+/*
+ * Check if a message can go into the next empty mailbox. The bxCAN sends
+ * mailboxes with the same id lowest mailbox first, so a message has to wait if
+ * a higher mailbox still holds one with its id or the two would swap places on
+ * the bus. This keeps the frames of a multi-frame transfer in order.
+ */
+static bool can_tx_ready(const CanMessage *tx_msg) {
+  uint32_t tsr = CAN->TSR;
+  if (!(tsr & CAN_TSR_TME)) {
+    return false;
+  }
+
+  uint8_t mailbox = (tsr & CAN_TSR_CODE) >> 24;
+  uint32_t tir = (uint32_t)tx_msg->id << 21;
+  if (tx_msg->rtr) {
+    tir |= CAN_TI0R_RTR;
+  }
+  for (uint8_t box = mailbox + 1; box < CAN_TX_MAILBOXES; ++box) {
+    if (!(tsr & (CAN_TSR_TME0 << box)) &&
+        (CAN->sTxMailBox[box].TIR & (CAN_TI0R_STID | CAN_TI0R_RTR)) == tir) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Micro-seconds from the HAL tick and the SysTick counter, so it keeps
+ * counting in step with HAL_GetTick() on both the F0 and F3 parts. The HAL
+ * tick has to run at the default 1 kHz. Safe to call from interrupts, a tick
+ * that is pending but not yet counted is added in.
+ */
+uint32_t can_time_us(void) {
+  uint32_t load = SysTick->LOAD + 1;
+
+  CAN_CRITICAL_ENTER();
+  uint32_t tick = HAL_GetTick();
+  uint32_t val = SysTick->VAL;
+  if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+    // the counter wrapped but the SysTick interrupt hasn't run yet
+    val = SysTick->VAL;
+    ++tick;
+  }
+  CAN_CRITICAL_EXIT();
+
+  // SysTick counts down from LOAD
+  return tick * 1000 + (load - 1 - val) * 1000 / load;
+}
+
+// bitrate the controller is set up for in bits per second
+static uint32_t can_bitrate_bps() {
+  // a bit is the sync segment plus TS1 + 1 and TS2 + 1 time quanta
+  uint32_t quanta = 3 + ((btr >> 16) & 0x0F) + ((btr >> 20) & 0x07);
+  return HAL_RCC_GetPCLK1Freq() / (((btr & 0x3FF) + 1) * quanta);
+}
+
+// move messages from the transmit queue into any empty mailboxes
+static void can_tx_refill() {
+  CanMessage msg;
+  while (!tx_queue.empty() && can_tx_ready(tx_queue.peek())) {
+    tx_queue.pop(&msg);
+    can_tx_load(&msg);
+  }
+}
+
+/*
+ * Transmit mailbox empty interrupt. Acknowledge the finished requests and
+ * refill the mailboxes from the queue.
+ */
+static void can_tx_isr(void) {
+  uint32_t tsr = CAN->TSR;
+
+  // the RQCP and TXOK bits of the mailboxes are 8 bits apart
+  for (uint8_t box = 0; box < CAN_TX_MAILBOXES; ++box) {
+    if (!(tsr & (CAN_TSR_RQCP0 << (8 * box)))) {
+      continue;
+    }
+    if (tsr & (CAN_TSR_TXOK0 << (8 * box))) {
+      uint32_t tir = CAN->sTxMailBox[box].TIR;
+      stats.sent((uint16_t)(tir >> 21),
+                 (uint8_t)(CAN->sTxMailBox[box].TDTR & 0x0F),
+                 (tir & CAN_TI0R_RTR) != 0);
+      // a frame got through, the bus is fine again
+      if (off_bus) {
+        can_bus_on();
+      }
+      backoff = CAN_RECOVERY_BACKOFF_MIN;
+    } else {
+      stats.aborted();
+    }
+  }
+  // only acknowledge the requests that were counted
+  CAN->TSR = tsr & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2);
+  can_tx_refill();
+}
+
+/**
+ * Messages go straight into a transmit mailbox if one is empty and nothing is
+ * waiting, otherwise they wait in a queue ordered by id. The transmit interrupt
+ * moves the highest priority waiting message into each mailbox that empties.
+ * Messages with the same id are always sent in the order they were given.
+ *
+ * \param tx_msg message to send
+ * \param timeout not used, this function never waits
+ *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * queue was full and the message was dropped (see can_tx_set_policy()),
+ * \ref BUS_OFF if the controller is bus-off and the message was thrown away
+ * (see can_set_recovery()).
+ */
+CanState can_tx(CanMessage *tx_msg, uint32_t timeout) {
+  CanState state = BUS_OK;
+
+  CAN_CRITICAL_ENTER();
+  if (off_bus && recovery_flush) {
+    stats.flushed();
+    state = BUS_OFF;
+  } else if (tx_queue.empty() && can_tx_ready(tx_msg)) {
+    can_tx_load(tx_msg);
+  } else {
+    stats.mailboxFull();
+    if (!tx_queue.push(*tx_msg)) {
+      state = BUS_BUSY;
+    }
+    stats.queueDepth(tx_queue.size());
+    can_tx_refill();
+  }
+  CAN_CRITICAL_EXIT();
+
+  return state;
+}
+
+void can_tx_set_policy(CanTxPolicy policy) {
+  CAN_CRITICAL_ENTER();
+  tx_queue.setPolicy(policy);
+  CAN_CRITICAL_EXIT();
+}
+
+uint16_t can_tx_pending(void) {
+  return tx_queue.size();
+}
+
+uint8_t can_tx_free_mailboxes(void) {
+  uint32_t tsr = CAN->TSR;
+  return ((tsr & CAN_TSR_TME0) ? 1 : 0) + ((tsr & CAN_TSR_TME1) ? 1 : 0) +
+         ((tsr & CAN_TSR_TME2) ? 1 : 0);
+}
+
+uint16_t can_tx_dropped(uint16_t id) {
+  CAN_CRITICAL_ENTER();
+  uint16_t drops = tx_queue.dropped(id);
+  CAN_CRITICAL_EXIT();
+  return drops;
+}
+
+uint32_t can_tx_total_dropped(void) {
+  return tx_queue.totalDropped();
+}
+
+/**
+ * Keep a frame to answer remote requests for its id with. The receive
+ * interrupt sends it as soon as a request comes in, through the same path as
+ * can_tx(), and the request is not put in the receive ring. Call it again
+ * whenever the value changes, the frame is copied with the interrupts held off
+ * so a request never gets half of an old and half of a new value.
+ *
+ * The id needs a filter to be recieved, see can_add_filter_id().
+ *
+ * \param msg frame to answer with, the rtr field is ignored
+ *
+ * \returns false if \ref CAN_RTR_RESPONSES ids already have answers
+ */
+bool can_rtr_response_set(const CanMessage *msg) {
+  CAN_CRITICAL_ENTER();
+  bool added = rtr_table.set(msg);
+  CAN_CRITICAL_EXIT();
+  return added;
+}
+
+void can_rtr_response_clear(uint16_t id) {
+  CAN_CRITICAL_ENTER();
+  rtr_table.clear(id);
+  CAN_CRITICAL_EXIT();
+}
+
+/*
+ * Empty a hardware FIFO into the receive ring. Called from the receive
+ * interrupts, it reads every pending message so the three message hardware
+ * FIFO can't overflow while the main loop is busy.
+ */
+static void can_rx_fifo_isr(uint8_t fifoNum) {
+  volatile uint32_t *rfr = fifoNum == 0 ? &CAN->RF0R : &CAN->RF1R;
+  CAN_FIFOMailBox_TypeDef *mailbox = &CAN->sFIFOMailBox[fifoNum];
+  CanMessage msg;
+#ifdef CAN_TIMESTAMPS
+  // the interrupt runs as soon as a frame arrives, frames that were already
+  // waiting in the FIFO get the same time
+  msg.timestamp = can_time_us();
+#endif
+
+  // the bits of RF0R and RF1R are in the same places
+  while (*rfr & CAN_RF0R_FMP0) {
+    if (*rfr & CAN_RF0R_FOVR0) {
+      // a message was lost before we got here, clear the flag (rc_w1)
+      *rfr = CAN_RF0R_FOVR0;
+      stats.fifoOverrun();
+    }
+
+    // get the id field
+    msg.id = (uint16_t)(mailbox->RIR >> 21);
+    // check if it is a rtr message
+    msg.rtr = (mailbox->RIR & CAN_RI0R_RTR) != 0;
+    // get data length
+    msg.len = (uint8_t)(mailbox->RDTR & CAN_RDT0R_DLC);
+    // get the handle of the mask that let it in
+    msg.fmi = filter_plan.handle((uint8_t)(mailbox->RDTR >> 8));
+
+    // get the data
+    uint32_t low = mailbox->RDLR;
+    uint32_t high = mailbox->RDHR;
+    for (uint8_t i = 0; i < 4; ++i) {
+      msg.data[i] = (uint8_t)(low >> (8 * i));
+      msg.data[i + 4] = (uint8_t)(high >> (8 * i));
+    }
+
+    // release the FIFO output mailbox
+    *rfr = CAN_RF0R_RFOM0;
+
+    stats.recieved(msg.id, msg.len, msg.rtr);
+    if (rx_hook != nullptr) {
+      rx_hook(&msg);
+    }
+    const CanMessage *answer = rtr_table.find(&msg);
+    if (answer != nullptr) {
+      // answer right away, the request doesn't go to the main loop
+      CanMessage reply = *answer;
+      can_tx(&reply, 0);
+      stats.answered();
+    } else if (!rx_ring.push(msg)) {
+      stats.ringOverrun();
+    } else {
+      stats.ringDepth(rx_ring.size());
+    }
+  }
+}
+
+/*
+ * The error state got worse. Count the flags that were set and note a bus-off,
+ * with the policies other than CAN_RECOVER_AUTO the controller now waits for
+ * can_enable() to run again.
+ */
+static void can_error_isr(void) {
+  uint8_t state = (uint8_t)(CAN->ESR & (CAN_ESR_EWGF | CAN_ESR_EPVF |
+                                        CAN_ESR_BOFF));
+  uint8_t reached = state & ~error_state;
+  error_state = state;
+
+  if (reached & CAN_STATS_ERROR_WARNING) {
+    stats.errorWarning();
+  }
+  if (reached & CAN_STATS_ERROR_PASSIVE) {
+    stats.errorPassive();
+  }
+  if ((reached & CAN_STATS_BUS_OFF) && !off_bus) {
+    stats.busOff();
+    off_bus = true;
+    off_since = can_time_us();
+    off_tick = HAL_GetTick();
+    if (recovery != CAN_RECOVER_AUTO) {
+      bus_state = BUS_OFF;
+    }
+    if (recovery_flush) {
+      // the aborted mailboxes are counted by the transmit interrupt
+      stats.flushed(tx_queue.size());
+      tx_queue.clear();
+      CAN->TSR = CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2;
+    }
+  }
+}
+
+/*
+ * Status change interrupt, bus activity woke the controller from sleep mode or
+ * the error state got worse. The hardware has already left sleep mode on its
+ * own (AWUM), all that is left is clearing the flag.
+ */
+static void can_sce_isr(void) {
+  uint32_t msr = CAN->MSR;
+  if (msr & CAN_MSR_WKUI) {
+    // rc_w1
+    CAN->MSR = CAN_MSR_WKUI;
+    stats.wokeUp();
+  }
+  if (msr & CAN_MSR_ERRI) {
+    CAN->MSR = CAN_MSR_ERRI;
+    can_error_isr();
+  }
 }
 
+#ifdef STM32F0
+// the F0 parts share one interrupt vector for all of the CAN interrupts
+extern "C" void CEC_CAN_IRQHandler(void) {
+  can_rx_fifo_isr(0);
+  can_rx_fifo_isr(1);
+  if (CAN->TSR & (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)) {
+    can_tx_isr();
+  }
+  can_sce_isr();
+}
+#else
+extern "C" void USB_HP_CAN_TX_IRQHandler(void) { can_tx_isr(); }
+
+extern "C" void USB_LP_CAN_RX0_IRQHandler(void) { can_rx_fifo_isr(0); }
+
+extern "C" void CAN_RX1_IRQHandler(void) { can_rx_fifo_isr(1); }
+
+extern "C" void CAN_SCE_IRQHandler(void) { can_sce_isr(); }
+#endif
+
 CanState can_rx(CanMessage *rx_msg, uint32_t timeout) {
-	uint8_t fifoNum = 0;
-
-	//check if there is data in fifo0
-	if((CAN->RF0R & CAN_RF0R_FMP0) == 0){ //if there is no data
-		return NO_DATA;
-	}
-
-	//get data from regisers
-	//get the id field
-	rx_msg->id = (uint16_t) (CAN->sFIFOMailBox[fifoNum].RIR >> 21);
-
-	//check if it is a rtr message
-	rx_msg->rtr = false;
-	if(CAN->sFIFOMailBox[fifoNum].RIR & CAN_RI0R_RTR){ 
-		rx_msg->rtr = true;
-	}
-	
-	//get data length
-	rx_msg->len = (uint8_t) (CAN->sFIFOMailBox[fifoNum].RDTR & CAN_RDT0R_DLC);
-	
-	//get filter mask index
-	rx_msg->fmi = (uint8_t) (CAN->sFIFOMailBox[fifoNum].RDTR >> 8);
-
-	//get the data
-    for(uint8_t i=0; i<4; ++i) {
-		rx_msg->data[i+4] = (uint8_t) (CAN->sFIFOMailBox[fifoNum].RDHR >> (8*i));
-		rx_msg->data[i]   = (uint8_t) (CAN->sFIFOMailBox[fifoNum].RDLR >> (8*i));
-	}
-
-	//clear fifo
-	CAN->RF0R |= CAN_RF0R_RFOM0;
-	--num_msg;
-
-	return BUS_OK;
+  // messages are put in the ring by the receive interrupt
+  if (!rx_ring.pop(rx_msg)) {
+    return NO_DATA;
+  }
+  return BUS_OK;
 }
 
 bool is_can_msg_pending() {
-	return ((CAN->RF0R & CAN_RF0R_FMP0) > 0); //if there is no data
+  return !rx_ring.empty();
+}
+
+/**
+ * The hook runs in the receive interrupt for every message that gets through
+ * the filters, before the message goes into the receive ring. CanNode uses it
+ * for its immediate handlers. It has to be short, the hardware FIFOs are only
+ * three messages deep.
+ *
+ * \param hook function to call, nullptr for none
+ */
+void can_rx_set_hook(void (*hook)(CanMessage *msg)) {
+  rx_hook = hook;
+}
+
+/**
+ * Unlike can_rx() the message is not copied out of the receive ring, it stays
+ * in its slot until can_rx_release() is called for it. The interrupt can't
+ * reuse the slot, or any slot after it, until then, so hold on to messages
+ * only briefly.
+ *
+ * \returns the oldest message not yet claimed, nullptr if there is none
+ */
+CanMessage *can_rx_claim(void) {
+  return rx_ring.claim();
+}
+
+void can_rx_retain(const CanMessage *msg) {
+  rx_ring.retain(msg);
+}
+
+void can_rx_release(const CanMessage *msg) {
+  rx_ring.release(msg);
+}
+
+uint32_t can_rx_ring_overruns(void) {
+  return stats.get().rx_ring_overruns;
 }
+
+uint32_t can_rx_fifo_overruns(void) {
+  return stats.get().rx_fifo_overruns;
+}
+
+uint16_t can_rx_ring_peak(void) {
+  return stats.get().rx_ring_peak;
+}
+
+/**
+ * The counters are copied with the CAN interrupts held off. The error
+ * counters, last error code and error state come from the ESR register.
+ *
+ * \param out snapshot to fill in
+ */
+void can_stats_snapshot(CanStats *out) {
+  CAN_CRITICAL_ENTER();
+  stats.copy(out);
+  out->tx_queue_drops = tx_queue.totalDropped() - stats_drops;
+  uint32_t esr = CAN->ESR;
+  CAN_CRITICAL_EXIT();
+
+  out->tec = (uint8_t)((esr & CAN_ESR_TEC) >> 16);
+  out->rec = (uint8_t)((esr & CAN_ESR_REC) >> 24);
+  out->lec = (uint8_t)((esr & CAN_ESR_LEC) >> 4);
+  out->error_state = (uint8_t)(esr & (CAN_ESR_EWGF | CAN_ESR_EPVF |
+                                      CAN_ESR_BOFF));
+  CanStatsCounter::load(out, HAL_GetTick() - stats_since, can_bitrate_bps());
+}
+
+/**
+ * Clears every counter. The error counters of the controller can't be
+ * cleared, they count down on their own as frames go through.
+ */
+void can_stats_reset(void) {
+  uint32_t now = HAL_GetTick();
+
+  CAN_CRITICAL_ENTER();
+  stats.reset();
+  stats_drops = tx_queue.totalDropped();
+  stats_since = now;
+  CAN_CRITICAL_EXIT();
+}
+
+#endif // CAN_HOST
@@ -15,23 +15,113 @@
 
 
 #include "CanTypes.h"
+#include "can_tx_queue.h"
+#include "can_stats.h"
+#include "can_rtr_table.h"
 #include "platform.h"
 
+#ifndef CAN_RX_RING_SIZE
+/// Number of messages buffered between the receive interrupt and can_rx().
+/// Must be a power of two. Can be overwriten by redefinition
+#define CAN_RX_RING_SIZE 16
+#endif
+
+#ifndef CAN_TX_QUEUE_SIZE
+/// Number of messages that can wait for a transmit mailbox. Can be overwriten
+/// by redefinition
+#define CAN_TX_QUEUE_SIZE 16
+#endif
+
+#ifndef CAN_RTR_RESPONSES
+/// Number of ids the receive interrupt can answer remote requests for. Can be
+/// overwriten by redefinition
+#define CAN_RTR_RESPONSES 8
+#endif
+
+#ifndef CAN_AUTOBAUD_LISTEN
+/// Mili-seconds can_autobaud() listens at each bitrate for a frame, has to be
+/// longer than the longest gap between frames on the bus. Can be overwriten by
+/// redefinition
+#define CAN_AUTOBAUD_LISTEN 100
+#endif
+
+#ifndef CAN_RECOVERY_BACKOFF_MIN
+/// Mili-seconds the driver waits after a bus-off before it starts the
+/// recovery with \ref CAN_RECOVER_BACKOFF. Can be overwriten by redefinition
+#define CAN_RECOVERY_BACKOFF_MIN 10
+#endif
+
+#ifndef CAN_RECOVERY_BACKOFF_MAX
+/// Longest wait in mili-seconds with \ref CAN_RECOVER_BACKOFF, the wait doubles
+/// with each bus-off until a frame gets through. Can be overwriten by
+/// redefinition
+#define CAN_RECOVERY_BACKOFF_MAX 1000
+#endif
+
+/**
+ * \enum CanRecoveryPolicy
+ * \brief How the controller gets back on the bus after a bus-off
+ *
+ * However it starts, the recovery takes 128 times 11 recessive bits on the
+ * bus, about 2.8 ms at 500 kbit/s on a quiet bus.
+ */
+typedef enum {
+  CAN_RECOVER_AUTO,    ///< The controller starts it right away on its own
+                       ///< (ABOM) (default)
+  CAN_RECOVER_BACKOFF, ///< The driver starts it from can_recover() after
+                       ///< waiting \ref CAN_RECOVERY_BACKOFF_MIN, twice as
+                       ///< long after every bus-off in a row
+  CAN_RECOVER_MANUAL,  ///< The controller stays off the bus until
+                       ///< can_enable() is called
+} CanRecoveryPolicy;
+
+/*
+ * Define CAN_AUTOBAUD as a number of mili-seconds to have the first CanNode
+ * find the bitrate of the bus with can_autobaud() instead of using 500K. If
+ * nothing is heard in that time it falls back to 500K.
+ */
+
+/// Number of transmit mailboxes in the bxCAN peripheral
+#define CAN_TX_MAILBOXES 3
+/// Number of filter banks in the bxCAN peripheral of the F0 and F3 parts
+#define CAN_FILTER_BANKS 14
+
 uint32_t HAL_GetTick();
 
+/**
+ * \brief Free running micro-second clock used for the receive timestamps.
+ *
+ * It runs off the same clock as HAL_GetTick(), can_time_us() is always
+ * HAL_GetTick() * 1000 plus the micro-seconds into the current mili-second.
+ * The drivers stamp recieved messages on this clock too.
+ */
+uint32_t can_time_us(void);
+
 /// \brief Initilize CAN hardware.
 void can_init(void);
 /// \brief Enable CAN hardware.
 void can_enable(void);
-/// \brief Put CAN hardware to sleep.
+/// \brief Put CAN hardware to sleep until there is activity on the bus.
 void can_sleep(void);
+/// \brief Halt the core until a message is recieved or the time is up.
+bool can_wait(uint32_t timeout);
 /// \brief Set the speed of the CANBus.
 void can_set_bitrate(canBitrate bitrate);
+/// \brief Find the speed of the CANBus by listening to it.
+CanState can_autobaud(canBitrate *bitrate, uint16_t listen, uint32_t timeout);
+/// \brief Set how the controller gets back on the bus after a bus-off.
+void can_set_recovery(CanRecoveryPolicy policy, bool flush);
+/// \brief Follow the recovery from a bus-off, called from the main loop.
+CanState can_recover(void);
 
 /// \brief Add a filter to the can hardware with an id
 uint16_t can_add_filter_id(uint16_t id);
 /// \brief Add a filter to the can hardware with a mask
 uint16_t can_add_filter_mask(uint16_t id, uint16_t mask);
+/// \brief Number of 16-bit hardware filters in use, two per bank.
+uint8_t can_filters_used(void);
+/// \brief Handle returned by can_add_filter_mask() for a hardware filter number.
+uint8_t can_filter_handle(uint8_t fmi);
 
 /// \brief Send a CanMessage over the bus.
 CanState can_tx(CanMessage *tx_msg, uint32_t timeout);
@@ -39,5 +129,41 @@ CanState can_tx(CanMessage *tx_msg, uint32_t timeout);
 CanState can_rx(CanMessage *rx_msg, uint32_t timeout);
 /// \brief Check if a new message is avalible.
 bool is_can_msg_pending();
+/// \brief Call a function from the receive interrupt for every message.
+void can_rx_set_hook(void (*hook)(CanMessage *msg));
+/// \brief Get the next message where it is in the receive ring.
+CanMessage *can_rx_claim(void);
+/// \brief Keep a claimed message until one more can_rx_release().
+void can_rx_retain(const CanMessage *msg);
+/// \brief Give a claimed message's slot back to the receive ring.
+void can_rx_release(const CanMessage *msg);
+
+/// \brief Set what happens to messages sent while the transmit queue is full.
+void can_tx_set_policy(CanTxPolicy policy);
+/// \brief Number of messages waiting in the transmit queue.
+uint16_t can_tx_pending(void);
+/// \brief Number of transmit mailboxes that are empty.
+uint8_t can_tx_free_mailboxes(void);
+/// \brief Number of messages with an id dropped by the transmit queue.
+uint16_t can_tx_dropped(uint16_t id);
+/// \brief Number of messages dropped by the transmit queue.
+uint32_t can_tx_total_dropped(void);
+
+/// \brief Answer remote requests for the id of a message with it.
+bool can_rtr_response_set(const CanMessage *msg);
+/// \brief Stop answering remote requests for an id.
+void can_rtr_response_clear(uint16_t id);
+
+/// \brief Number of messages dropped because the receive ring was full.
+uint32_t can_rx_ring_overruns(void);
+/// \brief Number of messages lost by the hardware receive FIFOs.
+uint32_t can_rx_fifo_overruns(void);
+/// \brief Largest number of messages that have waited in the receive ring.
+uint16_t can_rx_ring_peak(void);
+
+/// \brief Copy the bus and driver statistics.
+void can_stats_snapshot(CanStats *stats);
+/// \brief Start the statistics over.
+void can_stats_reset(void);
 
 #endif // _CAN_H
@@ -0,0 +1,656 @@
+/* can_driver_host.cpp -- implementation of the functions in can_driver.h for
+ * a PC. Instead of bxCAN registers this uses the local controller of the
+ * simulated bus in can_sim.h, so CanNode can be run and measured off the
+ * board.
+ */
+#if defined(CAN_HOST) && !defined(CAN_SOCKETCAN)
+
+#include <chrono>
+#include <thread>
+#include "CanNode.h"
+#include "can_ring.h"
+#include "can_filter_plan.h"
+#include "can_sim.h"
+
+static canBitrate bitrate;
+static CanState bus_state;
+
+// messages taken out of the simulated FIFOs by the receive interrupt
+static CanRing<CanMessage, CAN_RX_RING_SIZE> rx_ring;
+
+// traffic counters, updated from the interrupt (see can_stats.h)
+static CanStatsCounter stats;
+static uint32_t stats_since;
+static uint32_t stats_drops;
+
+// messages waiting for a transmit mailbox, only touched with the simulated
+// interrupt held off or from the interrupt
+static CanTxQueue<CAN_TX_QUEUE_SIZE> tx_queue;
+
+// every id and mask asked for and how they are laid out in the filter banks
+static CanFilterPlan<2 * CAN_FILTER_BANKS> filter_plan;
+static_assert(CAN_FILTER_BANKS <= CAN_SIM_FILTER_BANKS,
+              "the simulated controller has fewer filter banks");
+
+// answers to remote requests sent by the receive interrupt
+static CanRtrTable<CAN_RTR_RESPONSES> rtr_table;
+
+// called by the receive interrupt for every message
+static void (*rx_hook)(CanMessage *msg) = nullptr;
+
+// bus-off handling, see can_set_recovery()
+static CanRecoveryPolicy recovery = CAN_RECOVER_AUTO;
+static bool recovery_flush = false;
+static bool off_bus;        // went bus-off and isn't back yet
+static uint32_t off_since;  // can_time_us() when it went bus-off
+static uint32_t off_tick;   // HAL_GetTick() when it went bus-off
+static uint32_t backoff = CAN_RECOVERY_BACKOFF_MIN;
+// EWGF, EPVF and BOFF as last seen, the interrupt counts the ones that get set
+static uint8_t error_state;
+
+// hold off the interrupt while the transmit queue is used from the main loop
+#define CAN_CRITICAL_ENTER() can_sim_irq_disable()
+#define CAN_CRITICAL_EXIT() can_sim_irq_enable()
+
+uint32_t can_time_us(void) {
+  return (uint32_t)(can_sim_time_ns() / 1000);
+}
+
+uint32_t HAL_GetTick() {
+  can_sim_poll();
+  return (uint32_t)(can_sim_time_ns() / 1000000);
+}
+
+// wait in bus time, see can_sim_set_speed()
+static void can_pause_ns(uint64_t ns) {
+  double speed = can_sim_speed();
+  if (speed == 0) {
+    can_sim_advance(ns);
+  } else {
+    std::this_thread::sleep_for(std::chrono::nanoseconds((uint64_t)(ns / speed)));
+  }
+  can_sim_poll();
+}
+
+void HAL_Delay(uint32_t delay) {
+  can_pause_ns((uint64_t)delay * 1000000);
+}
+
+// empty both FIFOs into the receive ring
+static void can_rx_isr(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  CanMessage msg;
+
+  for (uint8_t fifo = 0; fifo < 2; ++fifo) {
+    if (can->fifo[fifo].overrun) {
+      can->fifo[fifo].overrun = false;
+      stats.fifoOverrun();
+    }
+    for (;;) {
+#ifdef CAN_TIMESTAMPS
+      // the simulator knows when the frame came off the bus
+      uint64_t time = can_sim_fifo_time(CAN_SIM_LOCAL, fifo);
+#endif
+      if (!can_sim_fifo_pop(CAN_SIM_LOCAL, fifo, &msg)) {
+        break;
+      }
+#ifdef CAN_TIMESTAMPS
+      msg.timestamp = (uint32_t)(time / 1000);
+#endif
+      // the handle of the mask that let it in
+      msg.fmi = filter_plan.handle(msg.fmi);
+      stats.recieved(msg.id, msg.len, msg.rtr);
+      if (rx_hook != nullptr) {
+        rx_hook(&msg);
+      }
+      const CanMessage *answer = rtr_table.find(&msg);
+      if (answer != nullptr) {
+        CanMessage reply = *answer;
+        can_tx(&reply, 0);
+        stats.answered();
+      } else if (!rx_ring.push(msg)) {
+        stats.ringOverrun();
+      } else {
+        stats.ringDepth(rx_ring.size());
+      }
+    }
+  }
+}
+
+/*
+ * Check if a message can go into the lowest empty mailbox. Like the bxCAN the
+ * simulator sends mailboxes with the same id lowest mailbox first, so the
+ * message waits while a higher mailbox holds one with its id.
+ */
+static bool can_tx_ready(const CanMessage *tx_msg) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  uint8_t mailbox = 0;
+  while (mailbox < CAN_SIM_TX_MAILBOXES && can->mailbox[mailbox].pending) {
+    ++mailbox;
+  }
+  if (mailbox == CAN_SIM_TX_MAILBOXES) {
+    return false;
+  }
+
+  for (uint8_t box = mailbox + 1; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    const CanSimMailbox *mb = &can->mailbox[box];
+    if (mb->pending && mb->msg.id == tx_msg->id && mb->msg.rtr == tx_msg->rtr) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// move messages from the transmit queue into any empty mailboxes
+static void can_tx_refill() {
+  CanMessage msg;
+  while (!tx_queue.empty() && can_tx_ready(tx_queue.peek())) {
+    tx_queue.pop(&msg);
+    can_sim_tx_request(CAN_SIM_LOCAL, &msg);
+  }
+}
+
+// back on the bus after a bus-off, called with the interrupt held off
+static void can_bus_on(void) {
+  off_bus = false;
+  stats.recovered(can_time_us() - off_since);
+}
+
+// acknowledge the finished requests and refill the mailboxes from the queue
+static void can_tx_isr(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  // the simulator only sets RQCP for frames that were sent, and leaves the
+  // frame in the mailbox
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    if (can->rqcp & (1 << box)) {
+      const CanMessage *msg = &can->mailbox[box].msg;
+      stats.sent(msg->id, msg->len, msg->rtr);
+      if (off_bus) {
+        can_bus_on();
+      }
+      backoff = CAN_RECOVERY_BACKOFF_MIN;
+    }
+  }
+  can->rqcp = 0;
+  can_tx_refill();
+}
+
+// the controller woke up from sleep mode on its own
+static void can_wakeup_isr(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  if (can->wkui) {
+    can->wkui = false;
+    stats.wokeUp();
+  }
+}
+
+// works like the STM32 version, the error state of the simulated controller
+// got worse
+static void can_error_isr(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  if (!can->erri) {
+    return;
+  }
+  can->erri = false;
+
+  uint8_t reached = can->esr & ~error_state;
+  error_state = can->esr;
+  if (reached & CAN_STATS_ERROR_WARNING) {
+    stats.errorWarning();
+  }
+  if (reached & CAN_STATS_ERROR_PASSIVE) {
+    stats.errorPassive();
+  }
+  if ((reached & CAN_STATS_BUS_OFF) && !off_bus) {
+    stats.busOff();
+    off_bus = true;
+    off_since = can_time_us();
+    off_tick = (uint32_t)(can_sim_time_ns() / 1000000);
+    if (recovery != CAN_RECOVER_AUTO) {
+      bus_state = BUS_OFF;
+    }
+    if (recovery_flush) {
+      stats.flushed(tx_queue.size());
+      tx_queue.clear();
+      // abort the mailboxes, the simulator sets no RQCP for them
+      for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+        if (can->mailbox[box].pending) {
+          can->mailbox[box].pending = false;
+          stats.aborted();
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Interrupt of the local controller, run by the simulator from
+ * can_sim_poll(). Like the F0 parts there is one vector for everything.
+ */
+static void can_isr(void) {
+  can_rx_isr();
+  can_tx_isr();
+  can_wakeup_isr();
+  can_error_isr();
+}
+
+void can_init(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  // default to kbit/s
+  can_set_bitrate(CAN_BITRATE_125K);
+  can->mode = CAN_SIM_INIT;
+  bus_state = BUS_OFF;
+  off_bus = false;
+  error_state = 0;
+  backoff = CAN_RECOVERY_BACKOFF_MIN;
+}
+
+void can_enable(void) {
+  if (bus_state == BUS_OFF) {
+    CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+    can_sim_poll();
+    // the bitrate is whatever it was set to from can_set_bitrate()
+    can->bitrate = bitrate;
+    can->abom = recovery == CAN_RECOVER_AUTO;
+    can->mode = CAN_SIM_NORMAL;
+    // leaving initilization mode starts the recovery from a bus-off
+    can_sim_recover(CAN_SIM_LOCAL);
+
+    // FIFO0 and FIFO1 message pending and mailbox empty interrupts
+    can->ier |= CAN_SIM_IER_FMP0 | CAN_SIM_IER_FMP1 | CAN_SIM_IER_TME;
+    // error warning, error passive and bus-off
+    can->ier |= CAN_SIM_IER_ERR | CAN_SIM_IER_EWG | CAN_SIM_IER_EPV |
+                CAN_SIM_IER_BOF;
+    can_sim_set_irq_handler(can_isr);
+
+    bus_state = BUS_OK;
+  } else {
+    CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+    can_sim_poll();
+    if (can->mode == CAN_SIM_SLEEP) {
+      // still asleep from can_sleep(), wake up without waiting for the bus
+      can->mode = CAN_SIM_NORMAL;
+    }
+  }
+}
+
+// works like the STM32 version, the simulator wakes the controller when a
+// frame ends and the frame is lost
+void can_sleep(void) {
+  if (bus_state != BUS_OK) {
+    return;
+  }
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  can_sim_poll();
+  can->awum = true;
+  can->ier |= CAN_SIM_IER_WKU;
+  can->mode = CAN_SIM_SLEEP;
+}
+
+// CAN_RECOVER_BACKOFF has waited long enough after a bus-off
+static bool can_retry_due(void) {
+  return off_bus && bus_state == BUS_OFF && recovery == CAN_RECOVER_BACKOFF &&
+         (uint32_t)(can_sim_time_ns() / 1000000) - off_tick >= backoff;
+}
+
+/*
+ * The thread stands in for the halted core. It yields instead of sleeping so
+ * the time it takes to notice a message is the simulator's and not the
+ * scheduler's, the time spent here is counted as idle all the same. A stopped
+ * bus clock is moved from one frame to the next instead. Like the STM32
+ * version it also ends when can_recover() has a recovery to start.
+ */
+bool can_wait(uint32_t timeout) {
+  uint64_t start = can_sim_time_ns();
+  uint64_t until = start + timeout * 1000000ull;
+  can_sim_poll();
+
+  // a recovery waiting for CAN_RECOVER_BACKOFF ends the wait
+  if (off_bus && bus_state == BUS_OFF && recovery == CAN_RECOVER_BACKOFF) {
+    uint64_t retry = ((uint64_t)off_tick + backoff) * 1000000;
+    if (retry < until) {
+      until = retry > start ? retry : start;
+    }
+  }
+
+  uint64_t now = start;
+  while (rx_ring.empty() && now < until) {
+    if (can_sim_speed() == 0) {
+      uint64_t next = can_sim_next_event_ns();
+      can_sim_advance((next > now && next < until ? next : until) - now);
+    } else {
+      std::this_thread::yield();
+    }
+    can_sim_poll();
+    now = can_sim_time_ns();
+  }
+  stats.idle((uint32_t)((now - start) / 1000));
+  return !rx_ring.empty();
+}
+
+// works like the STM32 version
+void can_set_recovery(CanRecoveryPolicy policy, bool flush) {
+  CAN_CRITICAL_ENTER();
+  recovery = policy;
+  recovery_flush = flush;
+  if (bus_state == BUS_OK) {
+    can_sim_controller(CAN_SIM_LOCAL)->abom = policy == CAN_RECOVER_AUTO;
+  }
+  CAN_CRITICAL_EXIT();
+}
+
+// works like the STM32 version, the error state comes from the simulated
+// controller
+CanState can_recover(void) {
+  can_sim_poll();
+  if (!off_bus && error_state == 0) {
+    return BUS_OK;
+  }
+
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  CAN_CRITICAL_ENTER();
+  error_state &= can->esr;
+  if (off_bus && bus_state == BUS_OK && !(can->esr & CAN_SIM_ESR_BOFF)) {
+    can_bus_on();
+  }
+  bool retry = can_retry_due();
+  CAN_CRITICAL_EXIT();
+
+  if (retry) {
+    can_enable();
+    backoff = backoff * 2 < CAN_RECOVERY_BACKOFF_MAX ? backoff * 2
+                                                     : CAN_RECOVERY_BACKOFF_MAX;
+  }
+  return off_bus ? BUS_OFF : BUS_OK;
+}
+
+void can_set_bitrate(canBitrate rate) {
+  bitrate = rate;
+}
+
+// bitrates in the order can_autobaud() tries them, the most common first
+static const canBitrate autobaud_order[] = {
+    CAN_BITRATE_500K, CAN_BITRATE_1000K, CAN_BITRATE_250K,
+    CAN_BITRATE_125K, CAN_BITRATE_750K,  CAN_BITRATE_100K,
+    CAN_BITRATE_50K,  CAN_BITRATE_20K,   CAN_BITRATE_10K};
+
+// works like the STM32 version, the simulated controller listens in silent
+// mode and its last error code tells if a frame was heard at the bitrate
+CanState can_autobaud(canBitrate *rate, uint16_t listen, uint32_t timeout) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  CanState state = NO_DATA;
+  uint32_t start = HAL_GetTick();
+  uint8_t next = 0;
+
+  if (bus_state != BUS_OFF) {
+    return BUS_BUSY;
+  }
+
+  while (state != BUS_OK && HAL_GetTick() - start < timeout) {
+    canBitrate candidate = autobaud_order[next];
+    next = (next + 1) % (sizeof(autobaud_order) / sizeof(autobaud_order[0]));
+
+    can_sim_poll();
+    can->bitrate = candidate;
+    can->silent = true;
+    can->lec = 7;
+    can->mode = CAN_SIM_NORMAL;
+
+    uint32_t since = HAL_GetTick();
+    while (can->lec == 7 && HAL_GetTick() - since < listen &&
+           HAL_GetTick() - start < timeout) {
+      can_pause_ns(100000);
+    }
+    if (can->lec == 0) {
+      *rate = candidate;
+      state = BUS_OK;
+    }
+  }
+
+  // back to initilization mode for can_enable()
+  can_sim_poll();
+  can->silent = false;
+  can->mode = CAN_SIM_INIT;
+  if (state == BUS_OK) {
+    can_set_bitrate(*rate);
+  }
+  return state;
+}
+
+// the 16-bit filter register for a slot of the plan, the RTR bit is ignored
+// and the IDE bit is always compared so extended frames never match
+static uint32_t can_filter_reg(const CanFilterSlot &slot) {
+  uint32_t id = (uint32_t)slot.id << 5;
+  uint32_t mask = ((uint32_t)slot.mask << 5) | 0x0008;
+  return mask << 16 | id;
+}
+
+// write the filter plan to the filter banks, two 16-bit mask filters a bank
+static void can_filter_apply() {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  uint8_t count = filter_plan.size();
+
+  can->fa1r = 0;
+  can->fm1r = 0;
+  can->fs1r = 0;
+  can->ffa1r = 0;
+  for (uint8_t bank = 0; bank < CAN_FILTER_BANKS && 2 * bank < count; ++bank) {
+    uint32_t fr1 = can_filter_reg(filter_plan.slot(2 * bank));
+    // an odd filter at the end is written twice
+    uint32_t fr2 = 2 * bank + 1 < count
+                       ? can_filter_reg(filter_plan.slot(2 * bank + 1))
+                       : fr1;
+    can->bank[bank].fr1 = fr1;
+    can->bank[bank].fr2 = fr2;
+    can->fa1r |= 1UL << bank;
+  }
+}
+
+/**
+ * The id is added to the filter plan and the filter banks are laid out again
+ * (see can_filter_plan.h).
+ *
+ * \param id id to filter on
+ *
+ * \returns the id, or \ref CAN_FILTER_ERROR if there was no room for it.
+ */
+uint16_t can_add_filter_id(uint16_t id) {
+  can_sim_poll();
+  // the plan is worked out with the interrupts on, only the copy is not
+  if (!filter_plan.addId(id)) {
+    return CAN_FILTER_ERROR;
+  }
+  CAN_CRITICAL_ENTER();
+  if (filter_plan.apply()) {
+    can_filter_apply();
+  }
+  CAN_CRITICAL_EXIT();
+
+  return id;
+}
+
+/**
+ * The mask is added to the filter plan and the filter banks are laid out
+ * again (see can_filter_plan.h).
+ *
+ * \param id base id of the filter mask
+ * \param mask mask on top of the base id, 0's are don't cares
+ *
+ * \returns the handle of the added filter returns \ref CAN_FILTER_ERROR
+ * if the function was unable to add a filter.
+ */
+uint16_t can_add_filter_mask(uint16_t id, uint16_t mask) {
+  can_sim_poll();
+  uint8_t handle = filter_plan.addMask(id, mask);
+  if (handle == CAN_FILTER_NO_HANDLE) {
+    return CAN_FILTER_ERROR;
+  }
+  CAN_CRITICAL_ENTER();
+  if (filter_plan.apply()) {
+    can_filter_apply();
+  }
+  CAN_CRITICAL_EXIT();
+
+  return handle;
+}
+
+uint8_t can_filters_used(void) {
+  return filter_plan.size();
+}
+
+uint8_t can_filter_handle(uint8_t fmi) {
+  return filter_plan.handle(fmi);
+}
+
+/**
+ * Messages go straight into a transmit mailbox if one is empty and nothing is
+ * waiting, otherwise they wait in a queue ordered by id. Messages with the same
+ * id are always sent in the order they were given.
+ *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * queue was full and the message was dropped, \ref BUS_OFF if the controller
+ * is bus-off and the message was thrown away.
+ */
+CanState can_tx(CanMessage *tx_msg, uint32_t timeout) {
+  (void)timeout;
+  CanState state = BUS_OK;
+
+  can_sim_poll();
+  CAN_CRITICAL_ENTER();
+  if (off_bus && recovery_flush) {
+    stats.flushed();
+    state = BUS_OFF;
+  } else if (tx_queue.empty() && can_tx_ready(tx_msg)) {
+    can_sim_tx_request(CAN_SIM_LOCAL, tx_msg);
+  } else {
+    stats.mailboxFull();
+    if (!tx_queue.push(*tx_msg)) {
+      state = BUS_BUSY;
+    }
+    stats.queueDepth(tx_queue.size());
+    can_tx_refill();
+  }
+  CAN_CRITICAL_EXIT();
+
+  return state;
+}
+
+void can_tx_set_policy(CanTxPolicy policy) {
+  CAN_CRITICAL_ENTER();
+  tx_queue.setPolicy(policy);
+  CAN_CRITICAL_EXIT();
+}
+
+uint16_t can_tx_pending(void) {
+  return tx_queue.size();
+}
+
+uint8_t can_tx_free_mailboxes(void) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  uint8_t free = 0;
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    if (!can->mailbox[box].pending) {
+      ++free;
+    }
+  }
+  return free;
+}
+
+uint16_t can_tx_dropped(uint16_t id) {
+  return tx_queue.dropped(id);
+}
+
+bool can_rtr_response_set(const CanMessage *msg) {
+  CAN_CRITICAL_ENTER();
+  bool added = rtr_table.set(msg);
+  CAN_CRITICAL_EXIT();
+  return added;
+}
+
+void can_rtr_response_clear(uint16_t id) {
+  CAN_CRITICAL_ENTER();
+  rtr_table.clear(id);
+  CAN_CRITICAL_EXIT();
+}
+
+uint32_t can_tx_total_dropped(void) {
+  return tx_queue.totalDropped();
+}
+
+CanState can_rx(CanMessage *rx_msg, uint32_t timeout) {
+  (void)timeout;
+  can_sim_poll();
+  // messages are put in the ring by the receive interrupt
+  if (!rx_ring.pop(rx_msg)) {
+    return NO_DATA;
+  }
+  return BUS_OK;
+}
+
+bool is_can_msg_pending() {
+  can_sim_poll();
+  return !rx_ring.empty();
+}
+
+void can_rx_set_hook(void (*hook)(CanMessage *msg)) {
+  rx_hook = hook;
+}
+
+CanMessage *can_rx_claim(void) {
+  can_sim_poll();
+  return rx_ring.claim();
+}
+
+void can_rx_retain(const CanMessage *msg) {
+  rx_ring.retain(msg);
+}
+
+void can_rx_release(const CanMessage *msg) {
+  rx_ring.release(msg);
+}
+
+uint32_t can_rx_ring_overruns(void) {
+  return stats.get().rx_ring_overruns;
+}
+
+uint32_t can_rx_fifo_overruns(void) {
+  return stats.get().rx_fifo_overruns;
+}
+
+uint16_t can_rx_ring_peak(void) {
+  return stats.get().rx_ring_peak;
+}
+
+/**
+ * The counters are copied with the simulated interrupt held off. The error
+ * counters and last error code come from the simulated controller.
+ *
+ * \param out snapshot to fill in
+ */
+void can_stats_snapshot(CanStats *out) {
+  CanSimController *can = can_sim_controller(CAN_SIM_LOCAL);
+  uint32_t now = HAL_GetTick();
+
+  CAN_CRITICAL_ENTER();
+  stats.copy(out);
+  out->tx_queue_drops = tx_queue.totalDropped() - stats_drops;
+  CAN_CRITICAL_EXIT();
+
+  out->tec = can->tec;
+  out->rec = can->rec;
+  out->lec = can->lec;
+  out->error_state = can->esr;
+  CanStatsCounter::load(out, now - stats_since, can_sim_bitrate_bps(bitrate));
+}
+
+void can_stats_reset(void) {
+  uint32_t now = HAL_GetTick();
+
+  CAN_CRITICAL_ENTER();
+  stats.reset();
+  stats_drops = tx_queue.totalDropped();
+  stats_since = now;
+  CAN_CRITICAL_EXIT();
+}
+
+#endif // CAN_HOST
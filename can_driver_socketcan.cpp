@@ -0,0 +1,722 @@
+/* can_driver_socketcan.cpp -- implementation of the functions in can_driver.h
+ * on a Linux SocketCAN interface (see can_socketcan.h), so a PC with a CAN
+ * adapter can run CanNode.
+ *
+ * There is no receive interrupt. Whenever the receive ring runs empty the
+ * frames waiting in the socket are read in one recvmmsg() call, and what the
+ * receive interrupt does with each frame (the hook, remote request answers,
+ * the counters) is done then. The receive buffer of the socket takes the
+ * place of the hardware FIFOs, frames the kernel had to drop because it was
+ * full count as FIFO overruns. The kernel filters the frames with the filter
+ * plan (CAN_RAW_FILTER), so frames no CanNode wants never reach the program.
+ *
+ * The send queue of the interface takes the place of the transmit mailboxes,
+ * a frame counts as sent once the kernel takes it. When the kernel pushes
+ * back frames wait in the transmit queue and go out in batches with
+ * sendmmsg().
+ *
+ * The kernel handles bus-off itself, the interface restarts on its own after
+ * restart-ms (`ip link set can0 type can restart-ms 100`) or when told to
+ * (`ip link set can0 type can restart`). Restarting it takes CAP_NET_ADMIN, so
+ * the driver only follows the error frames to count the bus-offs and time the
+ * recoveries, and throws the queued frames away if asked to.
+ */
+#if defined(CAN_HOST) && defined(CAN_SOCKETCAN)
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "CanNode.h"
+#include "can_ring.h"
+#include "can_filter_plan.h"
+#include "can_socketcan.h"
+
+static canBitrate bitrate;
+static CanState bus_state;
+
+static char ifname[IFNAMSIZ] = CAN_SOCKETCAN_INTERFACE;
+static int sock = -1;
+
+// messages read from the socket
+static CanRing<CanMessage, CAN_RX_RING_SIZE> rx_ring;
+
+// traffic counters (see can_stats.h)
+static CanStatsCounter stats;
+static uint32_t stats_since;
+static uint32_t stats_drops;
+
+// messages the kernel had no room for yet
+static CanTxQueue<CAN_TX_QUEUE_SIZE> tx_queue;
+
+// every id and mask asked for, each filter of the plan is a kernel filter
+static CanFilterPlan<2 * CAN_FILTER_BANKS> filter_plan;
+
+// answers to remote requests sent as the requests are read
+static CanRtrTable<CAN_RTR_RESPONSES> rtr_table;
+
+// called for every message as it is read
+static void (*rx_hook)(CanMessage *msg) = nullptr;
+
+// state of the controller from the error frames, in place of the ESR
+static uint8_t tec;
+static uint8_t rec;
+static uint8_t lec;
+static uint8_t error_state;
+
+// bus-off handling, see can_set_recovery()
+static bool recovery_flush = false;
+static bool off_bus;       // went bus-off and isn't back yet
+static uint32_t off_since; // can_time_us() when it went bus-off
+
+// frames the kernel has dropped for the socket so far (SO_RXQ_OVFL)
+static uint32_t kernel_drops;
+
+// buffers for one recvmmsg() call
+static struct can_frame rx_frames[CAN_SOCKETCAN_BATCH];
+static struct iovec rx_iovs[CAN_SOCKETCAN_BATCH];
+static struct mmsghdr rx_msgs[CAN_SOCKETCAN_BATCH];
+static char rx_controls[CAN_SOCKETCAN_BATCH]
+                       [CMSG_SPACE(sizeof(uint32_t)) +
+                        CMSG_SPACE(sizeof(struct scm_timestamping))];
+
+// buffers for one sendmmsg() call, remote requests are answered with
+// can_tx() while the receive buffers are in use
+static struct can_frame tx_frames[CAN_SOCKETCAN_BATCH];
+static struct iovec tx_iovs[CAN_SOCKETCAN_BATCH];
+static struct mmsghdr tx_msgs[CAN_SOCKETCAN_BATCH];
+
+#ifdef CAN_TIMESTAMPS
+// the kernel stamps frames with the real time clock, this is how far it is
+// ahead of the monotonic one, measured at every read
+static int64_t realtime_offset;
+#ifdef CAN_SOCKETCAN_HW_TIMESTAMPS
+// how far the monotonic clock is ahead of the adapter's, see can_rx_stamp()
+static int64_t adapter_offset;
+static int64_t adapter_checked; // monotonic time adapter_offset was set at
+#endif
+#endif
+
+static int64_t timespec_ns(const struct timespec *ts) {
+  return (int64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+// both clocks come from the monotonic clock, which doesn't jump when the
+// date is set
+static int64_t can_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return timespec_ns(&ts);
+}
+
+uint32_t can_time_us(void) {
+  return (uint32_t)(can_clock_ns() / 1000);
+}
+
+uint32_t HAL_GetTick() {
+  return (uint32_t)(can_clock_ns() / 1000000);
+}
+
+void HAL_Delay(uint32_t delay) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+}
+
+void can_socketcan_set_interface(const char *name) {
+  strncpy(ifname, name, sizeof(ifname) - 1);
+  ifname[sizeof(ifname) - 1] = '\0';
+}
+
+int can_socketcan_fd(void) {
+  return sock;
+}
+
+// the filter number the hardware would give a frame, the first filter of the
+// plan that matches it
+static uint8_t can_filter_number(uint16_t id) {
+  uint8_t fmi = 0;
+  while (fmi < filter_plan.size()) {
+    const CanFilterSlot &slot = filter_plan.slot(fmi);
+    if (((id ^ slot.id) & slot.mask) == 0) {
+      break;
+    }
+    ++fmi;
+  }
+  return fmi;
+}
+
+// hand the filter plan to the kernel, the RTR bit is ignored and extended
+// frames never match
+static void can_filter_apply() {
+  struct can_filter filters[2 * CAN_FILTER_BANKS];
+  uint8_t count = filter_plan.size();
+
+  for (uint8_t i = 0; i < count; ++i) {
+    filters[i].can_id = filter_plan.slot(i).id;
+    filters[i].can_mask = filter_plan.slot(i).mask | CAN_EFF_FLAG;
+  }
+  if (sock >= 0) {
+    // no filters at all lets nothing through, like empty filter banks
+    setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+               count * sizeof(filters[0]));
+  }
+}
+
+// an error frame from the interface, it stands in for the ESR register and
+// the error interrupt
+static void can_error_frame(const struct can_frame *frame) {
+  canid_t err = frame->can_id & CAN_ERR_MASK;
+  uint8_t before = error_state;
+
+  if (err & CAN_ERR_CRTL) {
+    uint8_t ctrl = frame->data[1];
+    if (ctrl & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+      error_state |= CAN_STATS_ERROR_WARNING;
+    }
+    if (ctrl & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+      error_state |= CAN_STATS_ERROR_PASSIVE;
+    }
+    if (ctrl & CAN_ERR_CRTL_ACTIVE) {
+      error_state &= ~(CAN_STATS_ERROR_WARNING | CAN_STATS_ERROR_PASSIVE);
+    }
+  }
+  if (err & CAN_ERR_BUSOFF) {
+    error_state |= CAN_STATS_BUS_OFF;
+  }
+  if (err & CAN_ERR_RESTARTED) {
+    error_state = 0;
+  }
+
+  uint8_t reached = error_state & ~before;
+  if (reached & CAN_STATS_ERROR_WARNING) {
+    stats.errorWarning();
+  }
+  if (reached & CAN_STATS_ERROR_PASSIVE) {
+    stats.errorPassive();
+  }
+  if ((reached & CAN_STATS_BUS_OFF) && !off_bus) {
+    stats.busOff();
+    off_bus = true;
+    off_since = can_time_us();
+    if (recovery_flush) {
+      stats.flushed(tx_queue.size());
+      tx_queue.clear();
+    }
+  }
+  if ((err & CAN_ERR_RESTARTED) && off_bus) {
+    off_bus = false;
+    stats.recovered(can_time_us() - off_since);
+  }
+
+  if (err & CAN_ERR_ACK) {
+    lec = 3;
+  }
+  if (err & CAN_ERR_PROT) {
+    uint8_t type = frame->data[2];
+    if (frame->data[3] == CAN_ERR_PROT_LOC_CRC_SEQ) {
+      lec = 6;
+    } else if (type & CAN_ERR_PROT_STUFF) {
+      lec = 1;
+    } else if (type & CAN_ERR_PROT_FORM) {
+      lec = 2;
+    } else if (type & CAN_ERR_PROT_BIT1) {
+      // sent a recessive bit and saw a dominant one
+      lec = 4;
+    } else if (type & CAN_ERR_PROT_BIT0) {
+      lec = 5;
+    }
+  }
+  if (err & CAN_ERR_CNT) {
+    tec = frame->data[6];
+    rec = frame->data[7];
+  }
+}
+
+#ifdef CAN_TIMESTAMPS
+/*
+ * The time a frame was recieved on the clock of can_time_us(). The kernel's
+ * stamp is moved over from the real time clock. The adapter's stamp is moved
+ * over by the smallest gap between it and the kernel's stamp of the same
+ * frame, the frames that got to the kernel the quickest. The gap may grow by
+ * CAN_SOCKETCAN_HW_DRIFT over time, so it follows an adapter clock that runs
+ * slower than the system's.
+ */
+static uint32_t can_rx_stamp(const struct scm_timestamping *stamps) {
+  // ts[0] is the kernel's time, ts[2] the adapter's
+  int64_t kernel = timespec_ns(&stamps->ts[0]) - realtime_offset;
+#ifdef CAN_SOCKETCAN_HW_TIMESTAMPS
+  if (stamps->ts[2].tv_sec != 0) {
+    int64_t adapter = timespec_ns(&stamps->ts[2]);
+    if (stamps->ts[0].tv_sec != 0) {
+      int64_t gap = kernel - adapter;
+      int64_t drift = (kernel - adapter_checked) / 1000000 *
+                      CAN_SOCKETCAN_HW_DRIFT;
+      if (adapter_checked == 0 || gap < adapter_offset + drift) {
+        adapter_offset = gap;
+        adapter_checked = kernel;
+      }
+    }
+    kernel = adapter + adapter_offset;
+  }
+#endif
+  return (uint32_t)(kernel / 1000);
+}
+#endif
+
+// the control messages of a frame, the drop count and the timestamp
+static void can_rx_control(struct msghdr *hdr, CanMessage *msg) {
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET) {
+      continue;
+    }
+    if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      if (drops != kernel_drops) {
+        stats.fifoOverrun(drops - kernel_drops);
+        kernel_drops = drops;
+      }
+    }
+#ifdef CAN_TIMESTAMPS
+    if (cmsg->cmsg_type == SCM_TIMESTAMPING) {
+      struct scm_timestamping stamps;
+      memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+      msg->timestamp = can_rx_stamp(&stamps);
+    }
+#else
+    (void)msg;
+#endif
+  }
+}
+
+/*
+ * Read as many frames as the receive ring has room for in one call and do
+ * what the receive interrupt does with each of them.
+ */
+static void can_rx_read(void) {
+  uint16_t room = rx_ring.capacity() - rx_ring.size();
+  unsigned int count = room < CAN_SOCKETCAN_BATCH ? room : CAN_SOCKETCAN_BATCH;
+  if (sock < 0 || count == 0) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < count; ++i) {
+    rx_iovs[i].iov_base = &rx_frames[i];
+    rx_iovs[i].iov_len = sizeof(rx_frames[i]);
+    memset(&rx_msgs[i].msg_hdr, 0, sizeof(rx_msgs[i].msg_hdr));
+    rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+    rx_msgs[i].msg_hdr.msg_iovlen = 1;
+    rx_msgs[i].msg_hdr.msg_control = rx_controls[i];
+    rx_msgs[i].msg_hdr.msg_controllen = sizeof(rx_controls[i]);
+  }
+  int got = recvmmsg(sock, rx_msgs, count, MSG_DONTWAIT, nullptr);
+#ifdef CAN_TIMESTAMPS
+  if (got > 0) {
+    struct timespec real;
+    clock_gettime(CLOCK_REALTIME, &real);
+    realtime_offset = timespec_ns(&real) - can_clock_ns();
+  }
+#endif
+
+  for (int i = 0; i < got; ++i) {
+    const struct can_frame *frame = &rx_frames[i];
+    CanMessage msg;
+    can_rx_control(&rx_msgs[i].msg_hdr, &msg);
+
+    if (frame->can_id & CAN_ERR_FLAG) {
+      can_error_frame(frame);
+      continue;
+    }
+    if (frame->can_id & CAN_EFF_FLAG) {
+      // only before the first filter is set
+      continue;
+    }
+
+    msg.id = (uint16_t)(frame->can_id & CAN_SFF_MASK);
+    msg.rtr = (frame->can_id & CAN_RTR_FLAG) != 0;
+    msg.len = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+    memcpy(msg.data, frame->data, 8);
+    msg.fmi = filter_plan.handle(can_filter_number(msg.id));
+
+    stats.recieved(msg.id, msg.len, msg.rtr);
+    if (rx_hook != nullptr) {
+      rx_hook(&msg);
+    }
+    const CanMessage *answer = rtr_table.find(&msg);
+    if (answer != nullptr) {
+      CanMessage reply = *answer;
+      can_tx(&reply, 0);
+      stats.answered();
+    } else if (!rx_ring.push(msg)) {
+      stats.ringOverrun();
+    } else {
+      stats.ringDepth(rx_ring.size());
+    }
+  }
+}
+
+// the socket is only read once everything read before has been claimed
+static void can_rx_poll(void) {
+  if (rx_ring.empty()) {
+    can_rx_read();
+  }
+}
+
+static void can_frame_load(struct can_frame *frame, const CanMessage *msg) {
+  memset(frame, 0, sizeof(*frame));
+  frame->can_id = msg->id & CAN_SFF_MASK;
+  if (msg->rtr) {
+    frame->can_id |= CAN_RTR_FLAG;
+  }
+  frame->can_dlc = msg->len > 8 ? 8 : msg->len;
+  memcpy(frame->data, msg->data, frame->can_dlc);
+}
+
+// hand the queued messages to the kernel, highest priority first, until it
+// takes no more
+static void can_tx_refill() {
+  while (sock >= 0 && !tx_queue.empty()) {
+    unsigned int count = 0;
+    const CanMessage *msg;
+    while (count < CAN_SOCKETCAN_BATCH &&
+           (msg = tx_queue.peek(count)) != nullptr) {
+      can_frame_load(&tx_frames[count], msg);
+      tx_iovs[count].iov_base = &tx_frames[count];
+      tx_iovs[count].iov_len = sizeof(tx_frames[count]);
+      memset(&tx_msgs[count].msg_hdr, 0, sizeof(tx_msgs[count].msg_hdr));
+      tx_msgs[count].msg_hdr.msg_iov = &tx_iovs[count];
+      tx_msgs[count].msg_hdr.msg_iovlen = 1;
+      ++count;
+    }
+
+    int sent = sendmmsg(sock, tx_msgs, count, MSG_DONTWAIT);
+    if (sent <= 0) {
+      return;
+    }
+    for (int i = 0; i < sent; ++i) {
+      const CanMessage *done = tx_queue.peek(i);
+      stats.sent(done->id, done->len, done->rtr);
+    }
+    tx_queue.remove((uint16_t)sent);
+    if ((unsigned int)sent < count) {
+      return;
+    }
+  }
+}
+
+void can_init(void) {
+  // default to kbit/s
+  can_set_bitrate(CAN_BITRATE_125K);
+  if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+  bus_state = BUS_OFF;
+}
+
+/**
+ * Opens a raw CAN socket on the interface and binds it. If the interface
+ * doesn't exist or isn't up the bus stays off and can_tx() returns
+ * \ref BUS_OFF.
+ */
+void can_enable(void) {
+  if (bus_state != BUS_OFF) {
+    return;
+  }
+
+  int fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (fd < 0) {
+    return;
+  }
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = (int)if_nametoindex(ifname);
+  if (addr.can_ifindex == 0 ||
+      bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return;
+  }
+
+  int rcvbuf = CAN_SOCKETCAN_RCVBUF;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#ifdef CAN_TIMESTAMPS
+  int stamping = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+                 SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &stamping, sizeof(stamping));
+#endif
+  can_err_mask_t errors = CAN_ERR_CRTL | CAN_ERR_BUSOFF | CAN_ERR_RESTARTED |
+                          CAN_ERR_ACK | CAN_ERR_PROT | CAN_ERR_CNT;
+  setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errors, sizeof(errors));
+
+  sock = fd;
+  can_filter_apply();
+  kernel_drops = 0;
+  tec = rec = lec = error_state = 0;
+  off_bus = false;
+  bus_state = BUS_OK;
+}
+
+// the interface is shared with the rest of the system, it stays up
+void can_sleep(void) {}
+
+/**
+ * Waits in poll() for frames on the socket, the thread uses no CPU until one
+ * arrives. While messages wait in the transmit queue it wakes every
+ * mili-second to hand them over, the kernel doesn't say when it has room.
+ *
+ * \param timeout longest time to wait in mili-seconds
+ *
+ * \returns true if there is a message in the receive ring
+ */
+bool can_wait(uint32_t timeout) {
+  uint32_t start = HAL_GetTick();
+  uint32_t begin = can_time_us();
+
+  can_rx_poll();
+  while (sock >= 0 && rx_ring.empty()) {
+    uint32_t elapsed = HAL_GetTick() - start;
+    if (elapsed >= timeout) {
+      break;
+    }
+    uint32_t left = timeout - elapsed;
+    if (!tx_queue.empty()) {
+      can_tx_refill();
+      left = 1;
+    }
+
+    struct pollfd pfd = {sock, POLLIN, 0};
+    poll(&pfd, 1, left > INT32_MAX ? INT32_MAX : (int)left);
+    can_rx_poll();
+  }
+  stats.idle(can_time_us() - begin);
+  return !rx_ring.empty();
+}
+
+/*
+ * The interface decides when to restart after a bus-off (restart-ms), so only
+ * flush is used here.
+ */
+void can_set_recovery(CanRecoveryPolicy policy, bool flush) {
+  (void)policy;
+  recovery_flush = flush;
+}
+
+// reads the socket for the error frames, the kernel does the recovery
+CanState can_recover(void) {
+  can_rx_poll();
+  return off_bus ? BUS_OFF : BUS_OK;
+}
+
+void can_set_bitrate(canBitrate rate) {
+  bitrate = rate;
+}
+
+// the bitrate is set when the interface is brought up, not found by the node
+CanState can_autobaud(canBitrate *rate, uint16_t listen, uint32_t timeout) {
+  (void)rate;
+  (void)listen;
+  (void)timeout;
+  return BUS_BUSY;
+}
+
+/**
+ * The id is added to the filter plan and the kernel filters are set again
+ * (see can_filter_plan.h).
+ *
+ * \param id id to filter on
+ *
+ * \returns the id, or \ref CAN_FILTER_ERROR if there was no room for it.
+ */
+uint16_t can_add_filter_id(uint16_t id) {
+  if (!filter_plan.addId(id)) {
+    return CAN_FILTER_ERROR;
+  }
+  if (filter_plan.apply()) {
+    can_filter_apply();
+  }
+  return id;
+}
+
+/**
+ * The mask is added to the filter plan and the kernel filters are set again
+ * (see can_filter_plan.h).
+ *
+ * \param id base id of the filter mask
+ * \param mask mask on top of the base id, 0's are don't cares
+ *
+ * \returns the handle of the added filter returns \ref CAN_FILTER_ERROR
+ * if the function was unable to add a filter.
+ */
+uint16_t can_add_filter_mask(uint16_t id, uint16_t mask) {
+  uint8_t handle = filter_plan.addMask(id, mask);
+  if (handle == CAN_FILTER_NO_HANDLE) {
+    return CAN_FILTER_ERROR;
+  }
+  if (filter_plan.apply()) {
+    can_filter_apply();
+  }
+  return handle;
+}
+
+uint8_t can_filters_used(void) {
+  return filter_plan.size();
+}
+
+uint8_t can_filter_handle(uint8_t fmi) {
+  return filter_plan.handle(fmi);
+}
+
+/**
+ * Messages go straight to the kernel if nothing is waiting, otherwise they
+ * wait in a queue ordered by id. Messages with the same id are always sent in
+ * the order they were given.
+ *
+ * \returns \ref BUS_OK if the message was sent or queued, \ref BUS_BUSY if the
+ * queue was full and the message was dropped, \ref BUS_OFF if the socket
+ * isn't open or the interface is bus-off and the message was thrown away.
+ */
+CanState can_tx(CanMessage *tx_msg, uint32_t timeout) {
+  (void)timeout;
+  if (sock < 0) {
+    return BUS_OFF;
+  }
+  if (off_bus && recovery_flush) {
+    stats.flushed();
+    return BUS_OFF;
+  }
+
+  can_tx_refill();
+  if (tx_queue.empty()) {
+    struct can_frame frame;
+    can_frame_load(&frame, tx_msg);
+    if (send(sock, &frame, sizeof(frame), MSG_DONTWAIT) == sizeof(frame)) {
+      stats.sent(tx_msg->id, tx_msg->len, tx_msg->rtr);
+      return BUS_OK;
+    }
+  }
+
+  CanState state = BUS_OK;
+  stats.mailboxFull();
+  if (!tx_queue.push(*tx_msg)) {
+    state = BUS_BUSY;
+  }
+  stats.queueDepth(tx_queue.size());
+  return state;
+}
+
+void can_tx_set_policy(CanTxPolicy policy) {
+  tx_queue.setPolicy(policy);
+}
+
+uint16_t can_tx_pending(void) {
+  can_tx_refill();
+  return tx_queue.size();
+}
+
+// the kernel has room as long as nothing had to wait for it
+uint8_t can_tx_free_mailboxes(void) {
+  return tx_queue.empty() ? CAN_TX_MAILBOXES : 0;
+}
+
+uint16_t can_tx_dropped(uint16_t id) {
+  return tx_queue.dropped(id);
+}
+
+uint32_t can_tx_total_dropped(void) {
+  return tx_queue.totalDropped();
+}
+
+bool can_rtr_response_set(const CanMessage *msg) {
+  return rtr_table.set(msg);
+}
+
+void can_rtr_response_clear(uint16_t id) {
+  rtr_table.clear(id);
+}
+
+CanState can_rx(CanMessage *rx_msg, uint32_t timeout) {
+  (void)timeout;
+  can_rx_poll();
+  if (!rx_ring.pop(rx_msg)) {
+    return NO_DATA;
+  }
+  return BUS_OK;
+}
+
+bool is_can_msg_pending() {
+  can_rx_poll();
+  return !rx_ring.empty();
+}
+
+void can_rx_set_hook(void (*hook)(CanMessage *msg)) {
+  rx_hook = hook;
+}
+
+CanMessage *can_rx_claim(void) {
+  can_rx_poll();
+  return rx_ring.claim();
+}
+
+void can_rx_retain(const CanMessage *msg) {
+  rx_ring.retain(msg);
+}
+
+void can_rx_release(const CanMessage *msg) {
+  rx_ring.release(msg);
+}
+
+uint32_t can_rx_ring_overruns(void) {
+  return stats.get().rx_ring_overruns;
+}
+
+uint32_t can_rx_fifo_overruns(void) {
+  return stats.get().rx_fifo_overruns;
+}
+
+uint16_t can_rx_ring_peak(void) {
+  return stats.get().rx_ring_peak;
+}
+
+// bits per second of each canBitrate
+static uint32_t can_bitrate_bps() {
+  static const uint32_t bps[] = {10000,  20000,  50000,  100000, 125000,
+                                 250000, 500000, 750000, 1000000};
+  return bps[bitrate];
+}
+
+/**
+ * The error counters, last error code and error state come from the error
+ * frames of the interface. Adapters that don't report the counters leave
+ * them at 0.
+ *
+ * \param out snapshot to fill in
+ */
+void can_stats_snapshot(CanStats *out) {
+  stats.copy(out);
+  out->tx_queue_drops = tx_queue.totalDropped() - stats_drops;
+  out->tec = tec;
+  out->rec = rec;
+  out->lec = lec;
+  out->error_state = error_state;
+  CanStatsCounter::load(out, HAL_GetTick() - stats_since, can_bitrate_bps());
+}
+
+void can_stats_reset(void) {
+  stats.reset();
+  stats_drops = tx_queue.totalDropped();
+  stats_since = HAL_GetTick();
+}
+
+#endif // CAN_HOST && CAN_SOCKETCAN
@@ -0,0 +1,294 @@
+/**
+ * \file can_filter_plan.h
+ * \brief Works out the filter bank settings for every id and mask requested.
+ *
+ * The drivers don't put each can_add_filter_id() or can_add_filter_mask()
+ * call in a bank of its own. They keep all of the requests here and lay out
+ * the banks again each time one is added, so every request is known when the
+ * banks are filled in.
+ *
+ * Every bank is used as two 16-bit mask filters. A mask filter can ignore the
+ * RTR bit, so one filter takes both the data and remote frames of an id where
+ * an id list filter would need two slots for them. Ids that differ in a single
+ * bit are merged into one filter that ignores that bit, over and over. A run of
+ * ids like the four that every CanNode asks for ends up in one or two filters.
+ * Merged filters only ever match ids that were asked for. Only when there are
+ * more filters than the banks can hold are the closest filters widened, and
+ * CanNode then throws out the extra frames.
+ *
+ * Masks from can_add_filter_mask() always get a filter of their own. They go
+ * in front of the id filters so that their filter number wins when a frame
+ * matches both. The hardware filter number a frame arrives with is turned into
+ * the handle can_add_filter_mask() returned, and the handle never changes when
+ * the banks are laid out again.
+ *
+ * Laying out the banks takes a while with many ids, so addId() and addMask()
+ * only work out the new layout next to the one in use. The receive interrupt
+ * keeps using the old one until apply() copies the new one over, which is
+ * short enough to do with the interrupts held off. Requests are only added
+ * from the main loop.
+ */
+
+#ifndef _CAN_FILTER_PLAN_H_
+#define _CAN_FILTER_PLAN_H_
+
+#include <cstdint>
+
+#ifndef CAN_FILTER_IDS
+/// Number of different ids that can be given to can_add_filter_id(). Can be
+/// overwriten by redefinition
+#define CAN_FILTER_IDS 64
+#endif
+
+#ifndef CAN_FILTER_MASKS
+/// Number of different masks that can be given to can_add_filter_mask(). Can
+/// be overwriten by redefinition
+#define CAN_FILTER_MASKS 16
+#endif
+
+static_assert(CAN_FILTER_MASKS <= 53,
+              "mask handles have to fit in the CanNode filter numbers (0 - 52)");
+
+/// Handle of a filter that is only there for ids, not for a mask
+#define CAN_FILTER_NO_HANDLE 0xFF
+
+/**
+ * \struct CanFilterSlot
+ * \brief One 16-bit mask filter
+ */
+typedef struct {
+  uint16_t id;    ///< id bits that have to match
+  uint16_t mask;  ///< bits of the id that are compared
+  uint8_t handle; ///< handle of the mask request or \ref CAN_FILTER_NO_HANDLE
+} CanFilterSlot;
+
+/**
+ * \class CanFilterPlan
+ * \brief All the requested ids and masks and the filters that cover them.
+ *
+ * SLOTS is the number of 16-bit filters the hardware has, two per bank.
+ */
+template <uint8_t SLOTS> class CanFilterPlan {
+private:
+  uint16_t ids[CAN_FILTER_IDS];
+  uint8_t numIds;
+  CanFilterSlot masks[CAN_FILTER_MASKS];
+  uint8_t numMasks;
+  CanFilterSlot slots[SLOTS]; ///< layout in use, read by the interrupt
+  uint8_t numSlots;
+  CanFilterSlot next[SLOTS];  ///< layout apply() puts in use
+  uint8_t numNext;
+  bool changed;               ///< next differs from slots
+
+  // check if every id a matches is also matched by b
+  static bool covers(const CanFilterSlot &b, const CanFilterSlot &a) {
+    return (a.mask & b.mask) == b.mask && (a.id & b.mask) == b.id;
+  }
+
+  // number of ids a filter matches
+  static uint16_t width(uint16_t mask) {
+    uint16_t n = 1;
+    for (uint16_t bit = 1; bit < 0x800; bit <<= 1) {
+      if (!(mask & bit)) {
+        n <<= 1;
+      }
+    }
+    return n;
+  }
+
+  // remove an entry from a filter list
+  static void remove(CanFilterSlot *list, uint8_t *count, uint8_t i) {
+    for (--*count; i < *count; ++i) {
+      list[i] = list[i + 1];
+    }
+  }
+
+  /*
+   * Lay out the filters for all the requests in work[], returns false if they
+   * don't fit. The masks go first, then the ids that no mask already takes.
+   */
+  bool plan(CanFilterSlot *work, uint8_t *count) const {
+    uint8_t n = 0;
+    uint8_t first = numMasks;
+    CanFilterSlot cube[CAN_FILTER_IDS];
+
+    if (numMasks > SLOTS) {
+      return false;
+    }
+    for (uint8_t i = 0; i < numMasks; ++i) {
+      work[i] = masks[i];
+    }
+
+    for (uint8_t i = 0; i < numIds; ++i) {
+      CanFilterSlot single = {ids[i], 0x7FF, CAN_FILTER_NO_HANDLE};
+      bool taken = false;
+      for (uint8_t m = 0; m < numMasks && !taken; ++m) {
+        taken = covers(masks[m], single);
+      }
+      if (!taken) {
+        cube[n++] = single;
+      }
+    }
+
+    // merge filters that are the same except for one bit, lowest bits first
+    // so runs of ids collapse into aligned blocks
+    bool merged = true;
+    while (merged) {
+      merged = false;
+      for (uint16_t bit = 1; bit < 0x800; bit <<= 1) {
+        for (uint8_t i = 0; i < n; ++i) {
+          for (uint8_t j = i + 1; j < n; ++j) {
+            if (cube[i].mask == cube[j].mask && (cube[i].mask & bit) &&
+                (cube[i].id ^ cube[j].id) == bit) {
+              cube[i].mask &= ~bit;
+              cube[i].id &= ~bit;
+              remove(cube, &n, j);
+              merged = true;
+              break;
+            }
+          }
+        }
+      }
+    }
+
+    // too many filters, widen the pair that lets the fewest extra ids through
+    while (first + n > SLOTS) {
+      if (n < 2) {
+        return false;
+      }
+      uint8_t bestI = 0;
+      uint8_t bestJ = 1;
+      uint16_t bestWidth = 0xFFFF;
+      for (uint8_t i = 0; i < n; ++i) {
+        for (uint8_t j = i + 1; j < n; ++j) {
+          uint16_t mask =
+              cube[i].mask & cube[j].mask & ~(cube[i].id ^ cube[j].id);
+          if (width(mask) < bestWidth) {
+            bestWidth = width(mask);
+            bestI = i;
+            bestJ = j;
+          }
+        }
+      }
+      CanFilterSlot wide = cube[bestI];
+      wide.mask &= cube[bestJ].mask & ~(cube[bestI].id ^ cube[bestJ].id);
+      wide.id &= wide.mask;
+      cube[bestI] = wide;
+      remove(cube, &n, bestJ);
+      for (uint8_t k = 0; k < n; ++k) {
+        if (k != bestI && covers(wide, cube[k])) {
+          if (k < bestI) {
+            --bestI;
+          }
+          remove(cube, &n, k--);
+        }
+      }
+    }
+
+    for (uint8_t i = 0; i < n; ++i) {
+      work[first + i] = cube[i];
+    }
+    *count = first + n;
+    return true;
+  }
+
+  // lay out the filters into next, it only replaces the old plan if it fits
+  bool replan() {
+    CanFilterSlot work[SLOTS];
+    uint8_t count;
+    if (!plan(work, &count)) {
+      return false;
+    }
+    for (uint8_t i = 0; i < count; ++i) {
+      next[i] = work[i];
+    }
+    numNext = count;
+    changed = true;
+    return true;
+  }
+
+public:
+  CanFilterPlan()
+      : numIds(0), numMasks(0), numSlots(0), numNext(0), changed(false) {}
+
+  /// \brief Add an id, returns false if it doesn't fit. See apply().
+  bool addId(uint16_t id) {
+    id &= 0x7FF;
+    for (uint8_t i = 0; i < numIds; ++i) {
+      if (ids[i] == id) {
+        return true;
+      }
+    }
+    if (numIds >= CAN_FILTER_IDS) {
+      return false;
+    }
+    ids[numIds++] = id;
+    if (!replan()) {
+      --numIds;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Add a mask. A mask that was already added gets the same handle again.
+   * See apply().
+   *
+   * \returns the handle of the mask or \ref CAN_FILTER_NO_HANDLE if it doesn't
+   * fit.
+   */
+  uint8_t addMask(uint16_t id, uint16_t mask) {
+    CanFilterSlot slot = {(uint16_t)(id & mask & 0x7FF), (uint16_t)(mask & 0x7FF),
+                          numMasks};
+    for (uint8_t i = 0; i < numMasks; ++i) {
+      if (masks[i].id == slot.id && masks[i].mask == slot.mask) {
+        return masks[i].handle;
+      }
+    }
+    if (numMasks >= CAN_FILTER_MASKS) {
+      return CAN_FILTER_NO_HANDLE;
+    }
+    masks[numMasks++] = slot;
+    if (!replan()) {
+      --numMasks;
+      return CAN_FILTER_NO_HANDLE;
+    }
+    return slot.handle;
+  }
+
+  /**
+   * Put the layout worked out by the last addId() or addMask() in use. Call
+   * it with the interrupts held off, it only copies the filters.
+   *
+   * \returns false if the layout is the same as before
+   */
+  bool apply() {
+    if (!changed) {
+      return false;
+    }
+    for (uint8_t i = 0; i < numNext; ++i) {
+      slots[i] = next[i];
+    }
+    numSlots = numNext;
+    changed = false;
+    return true;
+  }
+
+  /// \brief Forget every request, right away.
+  void clear() {
+    numIds = numMasks = numSlots = numNext = 0;
+    changed = false;
+  }
+
+  /// \brief Number of filters in use.
+  uint8_t size() const { return numSlots; }
+  /// \brief A filter, the index is the filter number (FMI) it gets.
+  const CanFilterSlot &slot(uint8_t i) const { return slots[i]; }
+
+  /// \brief Handle of the mask a filter number belongs to.
+  uint8_t handle(uint8_t fmi) const {
+    return fmi < numSlots ? slots[fmi].handle : CAN_FILTER_NO_HANDLE;
+  }
+};
+
+#endif // _CAN_FILTER_PLAN_H_
@@ -0,0 +1,430 @@
+/**
+ * \file can_gateway.cpp
+ * \brief Receive threads, routing and dispatch of a CanGateway.
+ */
+
+#ifdef CAN_HOST
+
+#include "can_gateway.h"
+#include "can_capture.h"
+#include <chrono>
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+static_assert(CAN_GATEWAY_BUSES < CAN_GATEWAY_ANY_BUS,
+              "CAN_GATEWAY_BUSES must be below CAN_GATEWAY_ANY_BUS");
+
+// longest a receive thread waits for frames, it notices stop() after it
+static const uint32_t READ_TIMEOUT = 10;
+
+uint64_t can_gateway_time_ns(void) {
+  return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+#ifdef __linux__
+CanSocketBus::CanSocketBus(const char *ifname) : fd(-1), drops(0) {
+  int s = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (s < 0) {
+    return;
+  }
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = (int)if_nametoindex(ifname);
+  if (addr.can_ifindex == 0 ||
+      bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(s);
+    return;
+  }
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+  // a gateway sees its own writes on the other buses, not on this one
+  int off = 0;
+  setsockopt(s, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &off, sizeof(off));
+  fd = s;
+}
+
+CanSocketBus::~CanSocketBus() {
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+int CanSocketBus::read(CanMessage *msgs, int max, uint32_t timeout) {
+  struct can_frame frames[CAN_GATEWAY_BATCH];
+  struct iovec iovs[CAN_GATEWAY_BATCH];
+  struct mmsghdr hdrs[CAN_GATEWAY_BATCH];
+  char controls[CAN_GATEWAY_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+
+  if (fd < 0) {
+    return 0;
+  }
+  struct pollfd pfd = {fd, POLLIN, 0};
+  if (poll(&pfd, 1, (int)timeout) <= 0) {
+    return 0;
+  }
+
+  int count = max < CAN_GATEWAY_BATCH ? max : CAN_GATEWAY_BATCH;
+  for (int i = 0; i < count; ++i) {
+    iovs[i].iov_base = &frames[i];
+    iovs[i].iov_len = sizeof(frames[i]);
+    memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+    hdrs[i].msg_hdr.msg_iov = &iovs[i];
+    hdrs[i].msg_hdr.msg_iovlen = 1;
+    hdrs[i].msg_hdr.msg_control = controls[i];
+    hdrs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+  }
+  int got = recvmmsg(fd, hdrs, (unsigned int)count, MSG_DONTWAIT, nullptr);
+
+  int kept = 0;
+  for (int i = 0; i < got; ++i) {
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdrs[i].msg_hdr);
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t total;
+      memcpy(&total, CMSG_DATA(cmsg), sizeof(total));
+      drops.store(total, std::memory_order_relaxed);
+    }
+
+    const struct can_frame *frame = &frames[i];
+    if (frame->can_id & (CAN_ERR_FLAG | CAN_EFF_FLAG)) {
+      continue;
+    }
+    CanMessage *msg = &msgs[kept++];
+    msg->id = (uint16_t)(frame->can_id & CAN_SFF_MASK);
+    msg->rtr = (frame->can_id & CAN_RTR_FLAG) != 0;
+    msg->len = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+    msg->fmi = 0;
+    memcpy(msg->data, frame->data, 8);
+  }
+  return kept;
+}
+
+int CanSocketBus::write(const CanMessage *msgs, int count) {
+  struct can_frame frames[CAN_GATEWAY_BATCH];
+  struct iovec iovs[CAN_GATEWAY_BATCH];
+  struct mmsghdr hdrs[CAN_GATEWAY_BATCH];
+
+  if (fd < 0) {
+    return 0;
+  }
+  int done = 0;
+  while (done < count) {
+    int n = count - done < CAN_GATEWAY_BATCH ? count - done : CAN_GATEWAY_BATCH;
+    for (int i = 0; i < n; ++i) {
+      const CanMessage *msg = &msgs[done + i];
+      memset(&frames[i], 0, sizeof(frames[i]));
+      frames[i].can_id = msg->id & CAN_SFF_MASK;
+      if (msg->rtr) {
+        frames[i].can_id |= CAN_RTR_FLAG;
+      }
+      frames[i].can_dlc = msg->len > 8 ? 8 : msg->len;
+      memcpy(frames[i].data, msg->data, frames[i].can_dlc);
+      iovs[i].iov_base = &frames[i];
+      iovs[i].iov_len = sizeof(frames[i]);
+      memset(&hdrs[i].msg_hdr, 0, sizeof(hdrs[i].msg_hdr));
+      hdrs[i].msg_hdr.msg_iov = &iovs[i];
+      hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int sent = sendmmsg(fd, hdrs, (unsigned int)n, MSG_DONTWAIT);
+    if (sent <= 0) {
+      break;
+    }
+    done += sent;
+    if (sent < n) {
+      break;
+    }
+  }
+  return done;
+}
+#endif // __linux__
+
+int CanMemoryBus::read(CanMessage *msgs, int max, uint32_t timeout) {
+  auto until = std::chrono::steady_clock::now() +
+               std::chrono::milliseconds(timeout);
+  uint32_t tries = 0;
+  while (inbox.empty()) {
+    if (std::chrono::steady_clock::now() >= until) {
+      return 0;
+    }
+    // give other threads the core, and stop spinning on a quiet bus
+    if (++tries < 64) {
+      std::this_thread::yield();
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+  int got = 0;
+  while (got < max && inbox.pop(&msgs[got])) {
+    ++got;
+  }
+  return got;
+}
+
+int CanMemoryBus::write(const CanMessage *msgs, int count) {
+  std::lock_guard<std::mutex> lock(writing);
+  int done = 0;
+  while (done < count && outbox.push(msgs[done])) {
+    ++done;
+  }
+  return done;
+}
+
+CanGateway::CanGateway()
+    : numBuses(0), numRoutes(0), numHandlers(0), first(0), capture(nullptr),
+      running(false) {
+  clearStats();
+}
+
+CanGateway::~CanGateway() { stop(); }
+
+uint8_t CanGateway::addBus(CanBus *bus) {
+  if (numBuses >= CAN_GATEWAY_BUSES || running) {
+    return CAN_GATEWAY_NO_BUS;
+  }
+  buses[numBuses].backend = bus;
+  buses[numBuses].wanted = false;
+  for (uint8_t i = 0; i < numHandlers; ++i) {
+    if (handlers[i].bus == CAN_GATEWAY_ANY_BUS) {
+      buses[numBuses].wanted = true;
+    }
+  }
+  return numBuses++;
+}
+
+bool CanGateway::addRoute(uint8_t from, uint16_t id, uint16_t mask,
+                          uint8_t to, uint16_t newId) {
+  if (numRoutes >= CAN_GATEWAY_ROUTES || running || from >= numBuses ||
+      to >= numBuses || from == to) {
+    return false;
+  }
+  routes[numRoutes++] = {from, to, id, mask, newId};
+  return true;
+}
+
+bool CanGateway::addHandler(uint8_t bus, uint16_t id, uint16_t mask,
+                            gatewayHandler handle) {
+  if (numHandlers >= CAN_GATEWAY_HANDLERS || running || handle == nullptr ||
+      (bus >= numBuses && bus != CAN_GATEWAY_ANY_BUS)) {
+    return false;
+  }
+  handlers[numHandlers++] = {bus, id, mask, handle};
+  for (uint8_t i = 0; i < numBuses; ++i) {
+    if (bus == i || bus == CAN_GATEWAY_ANY_BUS) {
+      buses[i].wanted = true;
+    }
+  }
+  return true;
+}
+
+void CanGateway::setCapture(CanCaptureWriter *writer) {
+  if (!running) {
+    capture = writer;
+  }
+}
+
+void CanGateway::start() {
+  if (running.exchange(true)) {
+    return;
+  }
+  for (uint8_t i = 0; i < numBuses; ++i) {
+    buses[i].reader = std::thread(&CanGateway::receive, this, i);
+  }
+}
+
+void CanGateway::stop() {
+  if (!running.exchange(false)) {
+    return;
+  }
+  for (uint8_t i = 0; i < numBuses; ++i) {
+    buses[i].reader.join();
+  }
+}
+
+/*
+ * The receive thread of a bus. The copies for other buses are collected for
+ * the whole batch and written with one call per bus, the frames for handlers
+ * go in the ring of the bus. Nothing here waits on another thread except the
+ * write() of a backend.
+ */
+void CanGateway::receive(uint8_t index) {
+  Bus *bus = &buses[index];
+  CanMessage msgs[CAN_GATEWAY_BATCH];
+  CanMessage out[CAN_GATEWAY_BUSES][CAN_GATEWAY_BATCH];
+  uint8_t outCount[CAN_GATEWAY_BUSES];
+
+  // the routes of this bus, so the others aren't checked for every frame
+  Route mine[CAN_GATEWAY_ROUTES];
+  uint8_t numMine = 0;
+  for (uint8_t r = 0; r < numRoutes; ++r) {
+    if (routes[r].from == index) {
+      mine[numMine++] = routes[r];
+    }
+  }
+
+  auto flush = [&](uint8_t to) {
+    int took = buses[to].backend->write(out[to], outCount[to]);
+    took = took < 0 ? 0 : took;
+    bus->routed.fetch_add((uint32_t)took, std::memory_order_relaxed);
+    bus->routeDrops.fetch_add(outCount[to] - (uint32_t)took,
+                              std::memory_order_relaxed);
+    outCount[to] = 0;
+  };
+
+  memset(outCount, 0, sizeof(outCount));
+  while (running.load(std::memory_order_relaxed)) {
+    int got = bus->backend->read(msgs, CAN_GATEWAY_BATCH, READ_TIMEOUT);
+    if (got <= 0) {
+      continue;
+    }
+    uint64_t now = can_gateway_time_ns();
+    uint32_t dropped = 0;
+
+    for (int i = 0; i < got; ++i) {
+      const CanMessage *msg = &msgs[i];
+      for (uint8_t r = 0; r < numMine; ++r) {
+        const Route *route = &mine[r];
+        if (!matches(msg->id, route->id, route->mask)) {
+          continue;
+        }
+        if (outCount[route->to] == CAN_GATEWAY_BATCH) {
+          flush(route->to);
+        }
+        CanMessage *copy = &out[route->to][outCount[route->to]++];
+        *copy = *msg;
+        if (route->newId != CAN_GATEWAY_SAME_ID) {
+          copy->id = route->newId;
+        }
+      }
+      if (!bus->wanted && capture == nullptr) {
+        continue;
+      }
+      CanBusFrame frame = {*msg, now, index};
+#ifdef CAN_TIMESTAMPS
+      frame.msg.timestamp = (uint32_t)(now / 1000);
+#endif
+      if (capture != nullptr) {
+        capture->record(&frame);
+      }
+      if (bus->wanted && !bus->queue.push(frame)) {
+        ++dropped;
+      }
+    }
+
+    for (uint8_t r = 0; r < numMine; ++r) {
+      if (outCount[mine[r].to] > 0) {
+        flush(mine[r].to);
+      }
+    }
+    bus->frames.fetch_add((uint32_t)got, std::memory_order_relaxed);
+    if (dropped > 0) {
+      bus->dropped.fetch_add(dropped, std::memory_order_relaxed);
+    }
+  }
+}
+
+uint16_t CanGateway::dispatch(uint8_t index, uint16_t limit) {
+  Bus *bus = &buses[index];
+  uint16_t count = 0;
+  CanBusFrame *frame;
+  while (count < limit && (frame = bus->queue.claim()) != nullptr) {
+    uint64_t start = can_gateway_time_ns();
+    for (uint8_t h = 0; h < numHandlers; ++h) {
+      const Handler *handler = &handlers[h];
+      if ((handler->bus == index || handler->bus == CAN_GATEWAY_ANY_BUS) &&
+          matches(frame->msg.id, handler->id, handler->mask)) {
+        handler->handle(frame);
+      }
+    }
+    uint64_t end = can_gateway_time_ns();
+
+    uint32_t queued = (uint32_t)((start - frame->time) / 1000);
+    bus->latency.record(frame->msg.id, queued,
+                        (uint32_t)((end - start) / 1000));
+    if (queued > bus->maxLatency) {
+      bus->maxLatency = queued;
+    }
+    bus->totalLatency += queued;
+    ++bus->handled;
+    bus->queue.release(frame);
+    ++count;
+  }
+  return count;
+}
+
+uint16_t CanGateway::poll(uint16_t limit) {
+  uint16_t count = 0;
+  for (uint8_t i = 0; i < numBuses && count < limit; ++i) {
+    count += dispatch((uint8_t)((first + i) % numBuses), limit - count);
+  }
+  if (numBuses > 0) {
+    first = (uint8_t)((first + 1) % numBuses);
+  }
+  return count;
+}
+
+uint16_t CanGateway::poll(uint8_t bus, uint16_t limit) {
+  if (bus >= numBuses) {
+    return 0;
+  }
+  return dispatch(bus, limit);
+}
+
+CanState CanGateway::send(uint8_t bus, const CanMessage *msg) {
+  if (bus >= numBuses) {
+    return DATA_ERROR;
+  }
+  if (buses[bus].backend->write(msg, 1) != 1) {
+    return BUS_BUSY;
+  }
+  buses[bus].sent.fetch_add(1, std::memory_order_relaxed);
+  return DATA_OK;
+}
+
+void CanGateway::stats(uint8_t index, CanGatewayStats *out) const {
+  memset(out, 0, sizeof(*out));
+  if (index >= numBuses) {
+    return;
+  }
+  const Bus *bus = &buses[index];
+  out->frames = bus->frames.load(std::memory_order_relaxed);
+  out->routed = bus->routed.load(std::memory_order_relaxed);
+  out->routeDrops = bus->routeDrops.load(std::memory_order_relaxed);
+  out->dropped = bus->dropped.load(std::memory_order_relaxed);
+  out->lost = bus->backend->lost();
+  out->sent = bus->sent.load(std::memory_order_relaxed);
+  out->handled = bus->handled;
+  out->maxLatency = bus->maxLatency;
+  out->totalLatency = bus->totalLatency;
+}
+
+CanLatencyTable *CanGateway::latency(uint8_t bus) {
+  return bus < numBuses ? &buses[bus].latency : nullptr;
+}
+
+void CanGateway::clearStats() {
+  for (uint8_t i = 0; i < CAN_GATEWAY_BUSES; ++i) {
+    Bus *bus = &buses[i];
+    bus->frames = 0;
+    bus->routed = 0;
+    bus->routeDrops = 0;
+    bus->dropped = 0;
+    bus->sent = 0;
+    bus->handled = 0;
+    bus->maxLatency = 0;
+    bus->totalLatency = 0;
+    bus->latency.clear();
+  }
+}
+
+#endif // CAN_HOST
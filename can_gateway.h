@@ -0,0 +1,343 @@
+/**
+ * \file can_gateway.h
+ * \brief Several buses at once on a PC, with routing between them.
+ *
+ * The driver in can_driver.h runs one bus. A PC that watches the powertrain
+ * and body buses together uses a CanGateway instead. Each bus is a CanBus
+ * backend (a SocketCAN interface, or a CanMemoryBus for testing) and gets a
+ * receive thread of its own. The thread reads frames in batches, sends the
+ * ones a route asks for on to their other bus and pushes the frames for the
+ * handlers into a lock free ring of the bus (see can_ring.h). poll() takes
+ * them out of the rings and calls the handlers.
+ *
+ * Each ring has the bus's receive thread as its only producer and whoever
+ * polls the bus as its only consumer, and each bus keeps its counters in a
+ * cache line of its own, so the buses never wait on each other. Routes go
+ * from the receive thread straight to the other bus without waiting for
+ * poll(). The handlers of a bus can be run on a thread of its own with
+ * poll(bus), then the work spreads over as many cores as there are buses.
+ *
+ * Buses, routes and handlers are set up before start() and stay fixed while
+ * the receive threads run. A gateway holds the rings of every bus it can
+ * have, a few hundred kilobytes, so it is best made static.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * static CanSocketBus powertrain("can0");
+ * static CanSocketBus body("can1");
+ * static CanGateway gateway;
+ * uint8_t pt = gateway.addBus(&powertrain);
+ * uint8_t bd = gateway.addBus(&body);
+ *
+ * // the dash on the body bus wants the engine temperature
+ * gateway.addRoute(pt, ENGINE_TEMP, 0x7FF, bd);
+ * gateway.addHandler(CAN_GATEWAY_ANY_BUS, 0, 0, logFrame);
+ * gateway.start();
+ * while (true) {
+ *   gateway.poll();
+ * }
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_GATEWAY_H_
+#define _CAN_GATEWAY_H_
+
+#ifdef CAN_HOST
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include "CanTypes.h"
+#include "can_ring.h"
+#include "can_latency.h"
+
+class CanCaptureWriter;
+
+/**
+ * \defgroup CanGateway_Module CanGateway
+ * \brief Runtime for several buses on a PC
+ *@{
+ */
+
+#ifndef CAN_GATEWAY_BUSES
+/// Most buses a gateway can have. Can be overwriten by redefinition
+#define CAN_GATEWAY_BUSES 8
+#endif
+
+#ifndef CAN_GATEWAY_QUEUE_SIZE
+/// Frames each bus can hold for poll(). Must be a power of two. Can be
+/// overwriten by redefinition
+#define CAN_GATEWAY_QUEUE_SIZE 1024
+#endif
+
+#ifndef CAN_GATEWAY_ROUTES
+/// Most routes between buses. Can be overwriten by redefinition
+#define CAN_GATEWAY_ROUTES 32
+#endif
+
+#ifndef CAN_GATEWAY_HANDLERS
+/// Most handlers over all of the buses. Can be overwriten by redefinition
+#define CAN_GATEWAY_HANDLERS 32
+#endif
+
+#ifndef CAN_GATEWAY_BATCH
+/// Most frames a receive thread reads at once. Can be overwriten by
+/// redefinition
+#define CAN_GATEWAY_BATCH 32
+#endif
+
+/// Returned by CanGateway::addBus() if there is no room for the bus
+#define CAN_GATEWAY_NO_BUS 0xFF
+/// Bus of a handler that takes frames from every bus
+#define CAN_GATEWAY_ANY_BUS 0xFE
+/// New id of a route that keeps the id of the frame
+#define CAN_GATEWAY_SAME_ID 0xFFFF
+
+/**
+ * \struct CanBusFrame
+ * \brief A frame read by a gateway and the bus it came from
+ */
+typedef struct {
+  CanMessage msg; ///< the frame
+  uint64_t time;  ///< can_gateway_time_ns() when it was read
+  uint8_t bus;    ///< index of the bus from CanGateway::addBus()
+} CanBusFrame;
+
+/**
+ * Functions of this type handle the frames of a gateway, they are called by
+ * CanGateway::poll().
+ */
+typedef void (*gatewayHandler)(const CanBusFrame *frame);
+
+/**
+ * \struct CanGatewayStats
+ * \brief Counters of one bus of a gateway
+ *
+ * Times are in micro-seconds. The latency runs from when the receive thread
+ * read a frame to when poll() started its handlers.
+ */
+typedef struct {
+  uint32_t frames;      ///< frames read from the bus
+  uint32_t routed;      ///< copies sent on to other buses
+  uint32_t routeDrops;  ///< copies the other bus didn't take
+  uint32_t dropped;     ///< frames lost because the ring for poll() was full
+  uint32_t lost;        ///< frames the backend lost before they were read
+  uint32_t sent;        ///< frames sent on the bus with CanGateway::send()
+  uint32_t handled;     ///< frames handed to handlers
+  uint32_t maxLatency;  ///< longest latency
+  uint64_t totalLatency; ///< latency of every frame handled, for the mean
+} CanGatewayStats;
+
+/// \brief Nano-seconds on the clock the gateway stamps frames with.
+uint64_t can_gateway_time_ns(void);
+
+/**
+ * \class CanBus
+ * \brief A bus the gateway reads and writes.
+ *
+ * read() is only called from the bus's receive thread. write() is called from
+ * the receive threads of buses with a route to this one and from
+ * CanGateway::send(), so it has to be safe to call from several threads.
+ */
+class CanBus {
+public:
+  virtual ~CanBus() {}
+
+  /**
+   * Wait for frames and read the ones that are there.
+   *
+   * \param msgs where to put the frames
+   * \param max most frames to read
+   * \param timeout longest time to wait in mili-seconds
+   *
+   * \returns frames read, 0 if none came in time
+   */
+  virtual int read(CanMessage *msgs, int max, uint32_t timeout) = 0;
+
+  /**
+   * Send frames without waiting for room.
+   *
+   * \returns frames the bus took, in order from the first
+   */
+  virtual int write(const CanMessage *msgs, int count) = 0;
+
+  /// \brief Frames the backend lost before they were read.
+  virtual uint32_t lost() { return 0; }
+};
+
+#ifdef __linux__
+/**
+ * \class CanSocketBus
+ * \brief A Linux SocketCAN interface.
+ *
+ * Frames are read with recvmmsg() and written with sendmmsg(). Extended and
+ * error frames are left out, frames the kernel drops because the socket is
+ * full count as lost.
+ */
+class CanSocketBus : public CanBus {
+private:
+  int fd;
+  std::atomic<uint32_t> drops;
+
+public:
+  /// \brief Open a raw socket on a network interface.
+  explicit CanSocketBus(const char *ifname);
+  ~CanSocketBus();
+
+  /// \brief The socket is open.
+  bool isOpen() const { return fd >= 0; }
+
+  int read(CanMessage *msgs, int max, uint32_t timeout) override;
+  int write(const CanMessage *msgs, int count) override;
+  uint32_t lost() override { return drops.load(std::memory_order_relaxed); }
+};
+#endif // __linux__
+
+/**
+ * \class CanMemoryBus
+ * \brief A bus in memory, for trying a gateway out without hardware.
+ *
+ * Frames given to inject() are read by the gateway as if another node sent
+ * them, inject() has to be called from one thread only. Frames the gateway
+ * writes wait in an outbox until take() picks them up.
+ */
+class CanMemoryBus : public CanBus {
+private:
+  CanRing<CanMessage, CAN_GATEWAY_QUEUE_SIZE> inbox;
+  CanRing<CanMessage, CAN_GATEWAY_QUEUE_SIZE> outbox;
+  std::mutex writing; ///< several threads can write at once
+
+public:
+  /// \brief Have another node send a frame, false if the bus is full.
+  bool inject(const CanMessage *msg) { return inbox.push(*msg); }
+  /// \brief Take a frame the gateway sent, false if there is none.
+  bool take(CanMessage *msg) { return outbox.pop(msg); }
+
+  int read(CanMessage *msgs, int max, uint32_t timeout) override;
+  int write(const CanMessage *msgs, int count) override;
+};
+
+/**
+ * \class CanGateway
+ * \brief Buses, the routes between them and the handlers of their frames.
+ */
+class CanGateway {
+private:
+  /// A route from one bus to another
+  struct Route {
+    uint8_t from;  ///< bus the frames come from
+    uint8_t to;    ///< bus they are sent on
+    uint16_t id;   ///< id bits that have to match
+    uint16_t mask; ///< bits of the id that are compared
+    uint16_t newId; ///< id they are sent with, or CAN_GATEWAY_SAME_ID
+  };
+
+  /// A handler of the frames of a bus
+  struct Handler {
+    uint8_t bus;   ///< bus, or CAN_GATEWAY_ANY_BUS
+    uint16_t id;   ///< id bits that have to match
+    uint16_t mask; ///< bits of the id that are compared
+    gatewayHandler handle;
+  };
+
+  /// Everything about one bus, a cache line of its own so the receive
+  /// threads don't slow each other down
+  struct alignas(64) Bus {
+    CanBus *backend;
+    std::thread reader;
+    bool wanted; ///< some handler takes frames from the bus
+    CanRing<CanBusFrame, CAN_GATEWAY_QUEUE_SIZE> queue;
+
+    // written by the receive thread
+    std::atomic<uint32_t> frames;
+    std::atomic<uint32_t> routed;
+    std::atomic<uint32_t> routeDrops;
+    std::atomic<uint32_t> dropped;
+    // written by whoever calls send()
+    std::atomic<uint32_t> sent;
+
+    // written by the thread that polls the bus
+    uint32_t handled;
+    uint32_t maxLatency;
+    uint64_t totalLatency;
+    CanLatencyTable latency;
+  };
+
+  Bus buses[CAN_GATEWAY_BUSES];
+  uint8_t numBuses;
+  Route routes[CAN_GATEWAY_ROUTES];
+  uint8_t numRoutes;
+  Handler handlers[CAN_GATEWAY_HANDLERS];
+  uint8_t numHandlers;
+  uint8_t first; ///< bus poll() starts with, so every bus gets its turn
+  CanCaptureWriter *capture;
+  std::atomic<bool> running;
+
+  static bool matches(uint16_t id, uint16_t want, uint16_t mask) {
+    return ((id ^ want) & mask) == 0;
+  }
+
+  void receive(uint8_t bus);
+  uint16_t dispatch(uint8_t bus, uint16_t limit);
+
+public:
+  CanGateway();
+  ~CanGateway();
+
+  /// \brief Add a bus, returns its index.
+  uint8_t addBus(CanBus *bus);
+  /// \brief Send matching frames of one bus on another.
+  bool addRoute(uint8_t from, uint16_t id, uint16_t mask, uint8_t to,
+                uint16_t newId = CAN_GATEWAY_SAME_ID);
+  /// \brief Call a function from poll() for matching frames.
+  bool addHandler(uint8_t bus, uint16_t id, uint16_t mask,
+                  gatewayHandler handle);
+
+  /**
+   * Record every frame read from the buses, see can_capture.h. The bus
+   * indexes in the file are the ones from addBus().
+   */
+  void setCapture(CanCaptureWriter *writer);
+
+  /// \brief Start a receive thread for every bus.
+  void start();
+  /// \brief Stop the receive threads.
+  void stop();
+
+  /**
+   * Call the handlers of the frames waiting on every bus, from one thread.
+   *
+   * \param limit most frames to handle
+   *
+   * \returns frames handled
+   */
+  uint16_t poll(uint16_t limit = CAN_GATEWAY_QUEUE_SIZE);
+
+  /**
+   * Call the handlers of the frames waiting on one bus. Each bus can be
+   * polled from a thread of its own, but only from that one thread and never
+   * together with poll() of every bus.
+   *
+   * \param bus index of the bus
+   * \param limit most frames to handle
+   *
+   * \returns frames handled
+   */
+  uint16_t poll(uint8_t bus, uint16_t limit);
+
+  /// \brief Send a frame on a bus.
+  CanState send(uint8_t bus, const CanMessage *msg);
+
+  /// \brief Copy the counters of a bus.
+  void stats(uint8_t bus, CanGatewayStats *out) const;
+  /// \brief Latency histograms of a bus, read from the thread that polls it.
+  CanLatencyTable *latency(uint8_t bus);
+  /// \brief Start the counters of every bus over, only while stopped.
+  void clearStats();
+};
+
+//@}
+#endif // CAN_HOST
+#endif // _CAN_GATEWAY_H_
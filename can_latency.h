@@ -0,0 +1,149 @@
+/**
+ * \file can_latency.h
+ * \brief Histograms of how long recieved frames wait and how long their
+ * handlers take.
+ *
+ * Only used when the library is built with CAN_TIMESTAMPS defined. Every frame
+ * gets the time it was recieved in CanMessage::timestamp, and
+ * CanNode::checkForMessages() records two times for each frame it hands out:
+ *
+ * - queued: from reception to the start of its handlers, the time the frame
+ *   spent in the receive ring
+ * - handled: from the start to the end of its handlers
+ *
+ * Each is kept as a histogram of \ref CAN_LATENCY_BUCKETS power of two
+ * buckets in micro-seconds, bucket 0 is under 1 us, bucket n is 2^(n-1) up to
+ * 2^n us and the last bucket takes everything longer. The histograms are kept
+ * for up to \ref CAN_LATENCY_IDS ids in a fixed table, frames with other ids
+ * only count towards the totals.
+ */
+
+#ifndef _CAN_LATENCY_H_
+#define _CAN_LATENCY_H_
+
+#include <cstdint>
+#include <cstring>
+
+#ifndef CAN_LATENCY_IDS
+/// Number of ids latency is kept for. Must be a power of two. Can be
+/// overwriten by redefinition
+#define CAN_LATENCY_IDS 8
+#endif
+
+#ifndef CAN_LATENCY_BUCKETS
+/// Number of buckets in each histogram, the last one starts at
+/// 2^(CAN_LATENCY_BUCKETS - 2) us. Can be overwriten by redefinition
+#define CAN_LATENCY_BUCKETS 16
+#endif
+
+static_assert((CAN_LATENCY_IDS & (CAN_LATENCY_IDS - 1)) == 0,
+              "CAN_LATENCY_IDS must be a power of two");
+static_assert(CAN_LATENCY_BUCKETS >= 2 && CAN_LATENCY_BUCKETS <= 33,
+              "CAN_LATENCY_BUCKETS must be between 2 and 33");
+
+/**
+ * \struct CanLatency
+ * \brief Latency histograms of one id
+ *
+ * The counts stop at 0xFFFF instead of wrapping.
+ */
+typedef struct {
+  uint16_t id;                            ///< id of the frames
+  uint16_t queued[CAN_LATENCY_BUCKETS];   ///< reception to handler start
+  uint16_t handled[CAN_LATENCY_BUCKETS];  ///< handler start to handler end
+  uint32_t maxQueued;                     ///< longest wait in us
+  uint32_t maxHandled;                    ///< longest handler time in us
+} CanLatency;
+
+/**
+ * \class CanLatencyTable
+ * \brief Latency histograms for a fixed number of ids.
+ *
+ * Ids get a slot the first time they are seen, like the driver statistics the
+ * slot is found from the low bits of the id with a few probes.
+ */
+class CanLatencyTable {
+private:
+  static const uint16_t EMPTY = 0xFFFF;
+  static const uint8_t PROBES = 4;
+
+  CanLatency slots[CAN_LATENCY_IDS];
+  CanLatency all;
+
+  static uint8_t bucket(uint32_t us) {
+    if (us == 0) {
+      return 0;
+    }
+    uint8_t b = (uint8_t)(32 - __builtin_clz(us));
+    return b < CAN_LATENCY_BUCKETS - 1 ? b : CAN_LATENCY_BUCKETS - 1;
+  }
+
+  static void add(CanLatency *hist, uint32_t queued, uint32_t handled) {
+    uint16_t *q = &hist->queued[bucket(queued)];
+    uint16_t *h = &hist->handled[bucket(handled)];
+    if (*q < 0xFFFF) {
+      ++*q;
+    }
+    if (*h < 0xFFFF) {
+      ++*h;
+    }
+    if (queued > hist->maxQueued) {
+      hist->maxQueued = queued;
+    }
+    if (handled > hist->maxHandled) {
+      hist->maxHandled = handled;
+    }
+  }
+
+  CanLatency *find(uint16_t id, bool claim) {
+    for (uint8_t i = 0; i < PROBES; ++i) {
+      CanLatency *slot = &slots[(id + i) & (CAN_LATENCY_IDS - 1)];
+      if (slot->id == id) {
+        return slot;
+      }
+      if (slot->id == EMPTY) {
+        if (claim) {
+          slot->id = id;
+          return slot;
+        }
+        return nullptr;
+      }
+    }
+    return nullptr;
+  }
+
+public:
+  CanLatencyTable() { clear(); }
+
+  /// \brief Forget every recorded frame.
+  void clear() {
+    memset(slots, 0, sizeof(slots));
+    memset(&all, 0, sizeof(all));
+    for (uint16_t i = 0; i < CAN_LATENCY_IDS; ++i) {
+      slots[i].id = EMPTY;
+    }
+    all.id = EMPTY;
+  }
+
+  /**
+   * Record a frame.
+   *
+   * \param id id of the frame
+   * \param queued us from reception to the start of its handlers
+   * \param handled us the handlers took
+   */
+  void record(uint16_t id, uint32_t queued, uint32_t handled) {
+    add(&all, queued, handled);
+    CanLatency *slot = find(id, true);
+    if (slot != nullptr) {
+      add(slot, queued, handled);
+    }
+  }
+
+  /// \brief Histograms of an id, nullptr if the id has none.
+  const CanLatency *get(uint16_t id) { return find(id, false); }
+  /// \brief Histograms of every frame, the id is 0xFFFF.
+  const CanLatency *total() const { return &all; }
+};
+
+#endif // _CAN_LATENCY_H_
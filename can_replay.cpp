@@ -0,0 +1,168 @@
+/**
+ * \file can_replay.cpp
+ * \brief Playing captures on the simulated bus.
+ */
+
+#if defined(CAN_HOST) && !defined(CAN_SOCKETCAN)
+
+#include "can_replay.h"
+#include <thread>
+#include "CanNode.h"
+#include "can_sim.h"
+
+CanReplay::CanReplay()
+    : numFilters(0), bus(CAN_REPLAY_ANY_BUS), speed(1.0),
+      node(CAN_SIM_NO_NODE), started(false), waiting(false), first(0),
+      origin(0), numPlayed(0), numSkipped(0), latest(0) {}
+
+bool CanReplay::open(const char *path) {
+  if (!reader.open(path)) {
+    return false;
+  }
+  if (node == CAN_SIM_NO_NODE) {
+    node = can_sim_add_node(can_sim_controller(CAN_SIM_LOCAL)->bitrate);
+    if (node == CAN_SIM_NO_NODE) {
+      reader.close();
+      return false;
+    }
+  }
+  started = waiting = false;
+  numPlayed = numSkipped = latest = 0;
+  return true;
+}
+
+void CanReplay::setSpeed(double times) {
+  speed = times;
+  if (started) {
+    can_sim_set_speed(speed);
+  }
+}
+
+bool CanReplay::addFilter(uint16_t id, uint16_t mask) {
+  if (numFilters >= CAN_REPLAY_FILTERS) {
+    return false;
+  }
+  filters[numFilters++] = {id, mask};
+  return true;
+}
+
+// the next frame that passes the filters
+bool CanReplay::load() {
+  while (reader.next(&frame)) {
+    bool wanted = bus == CAN_REPLAY_ANY_BUS || frame.bus == bus;
+    if (wanted && numFilters > 0) {
+      wanted = false;
+      for (uint8_t i = 0; i < numFilters && !wanted; ++i) {
+        wanted = ((frame.msg.id ^ filters[i].id) & filters[i].mask) == 0;
+      }
+    }
+    if (wanted) {
+      return true;
+    }
+    ++numSkipped;
+  }
+  return false;
+}
+
+bool CanReplay::sending() const {
+  const CanSimController *can = can_sim_controller(node);
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    if (can->mailbox[box].pending) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// the first whole mili-second of the bus clock at or after time
+static uint64_t whole_ms(uint64_t time) {
+  return (time + 999999) / 1000000 * 1000000;
+}
+
+/*
+ * Move a stopped bus clock to a time one frame start or end at a time, the
+ * node handles each frame as soon as it is in, like it would in real time.
+ * The clock also stops on every tick of HAL_GetTick() on the way, so a
+ * timeout runs out at its tick and not at whatever frame comes after it.
+ */
+void CanReplay::advanceTo(uint64_t time) {
+  uint64_t now = can_sim_time_ns();
+  do {
+    uint64_t next = can_sim_next_event_ns();
+    if (next <= now || next > time) {
+      next = time;
+    }
+    uint64_t tick = whole_ms(now + 1);
+    can_sim_advance((tick < next ? tick : next) - now);
+    can_sim_poll();
+    CanNode::checkForMessages();
+    now = can_sim_time_ns();
+  } while (now < time);
+}
+
+bool CanReplay::step() {
+  if (node == CAN_SIM_NO_NODE) {
+    return false;
+  }
+  if (!started) {
+    started = true;
+    // the node may have changed its bitrate since open()
+    can_sim_controller(node)->bitrate =
+        can_sim_controller(CAN_SIM_LOCAL)->bitrate;
+    can_sim_set_speed(speed);
+    // frames keep the same place between the ticks of HAL_GetTick() from one
+    // replay to the next
+    origin = whole_ms(can_sim_time_ns());
+    waiting = load();
+    first = waiting ? frame.time : 0;
+  }
+  bool stopped = can_sim_speed() == 0;
+
+  if (!waiting) {
+    // let the last frames off the bus
+    if (!sending()) {
+      CanNode::checkForMessages();
+      return false;
+    }
+    if (stopped) {
+      advanceTo(can_sim_next_event_ns());
+    } else {
+      CanNode::checkForMessages();
+      std::this_thread::yield();
+    }
+    return true;
+  }
+
+  uint64_t due = origin + (frame.time - first);
+  if (stopped && due > can_sim_time_ns()) {
+    advanceTo(due);
+  }
+  uint64_t now = can_sim_time_ns();
+  if (now < due) {
+    CanNode::checkForMessages();
+    std::this_thread::yield();
+    return true;
+  }
+
+  if (can_sim_send(node, &frame.msg) == BUS_OK) {
+    uint32_t late = (uint32_t)((now - due) / 1000);
+    if (late > latest) {
+      latest = late;
+    }
+    ++numPlayed;
+    waiting = load();
+  } else if (stopped) {
+    // every mailbox is full, the bus has to get to the next frame first
+    advanceTo(can_sim_next_event_ns());
+  }
+  CanNode::checkForMessages();
+  return true;
+}
+
+uint32_t CanReplay::run() {
+  while (step()) {
+  }
+  return numPlayed;
+}
+
+#endif // CAN_HOST && !CAN_SOCKETCAN
@@ -0,0 +1,130 @@
+/**
+ * \file can_replay.h
+ * \brief Playing a capture back to a node on the simulated bus.
+ *
+ * A CanReplay reads a capture (see can_capture.h) and sends its frames from a
+ * remote node of the simulated bus at the times they were recorded, while it
+ * runs CanNode::checkForMessages() for the local node. The frames go over the
+ * bus like any others, through arbitration, the filter banks and the receive
+ * FIFOs.
+ *
+ * Times in the capture are mapped onto the bus clock, and the bus clock is
+ * what HAL_GetTick(), HAL_Delay() and can_time_us() tell the library (see
+ * can_sim_set_speed()). A replay at ten times real time runs the bus clock
+ * ten times as fast, at \ref CAN_REPLAY_MAX_SPEED the clock is stopped and
+ * jumps from one frame to the next. Either way the node sees the frames the
+ * same number of mili-seconds apart as when they were recorded, so timeouts
+ * like the one of getString() come out the same at any speed.
+ *
+ * Only available with the simulated bus, not with CAN_SOCKETCAN.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanNode node(THROTTLE, throttleRTR);
+ * node.addFilter(BRAKE, brakeHandler);
+ *
+ * CanReplay replay;
+ * replay.open("drive.cap");
+ * replay.setBus(0);
+ * replay.addFilter(BRAKE);
+ * replay.setSpeed(CAN_REPLAY_MAX_SPEED);
+ * replay.run();
+ * can_sim_set_speed(1);
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_REPLAY_H_
+#define _CAN_REPLAY_H_
+
+#if defined(CAN_HOST) && !defined(CAN_SOCKETCAN)
+
+#include <cstdint>
+#include "CanTypes.h"
+#include "can_capture.h"
+
+/**
+ * \defgroup CanReplay_Module CanReplay
+ * \brief Replaying captures on the simulated bus
+ *@{
+ */
+
+#ifndef CAN_REPLAY_FILTERS
+/// Most id filters of a replay. Can be overwriten by redefinition
+#define CAN_REPLAY_FILTERS 8
+#endif
+
+/// Speed that plays the frames one after the other without waiting
+#define CAN_REPLAY_MAX_SPEED 0
+/// Bus of a replay that plays the frames of every bus
+#define CAN_REPLAY_ANY_BUS 0xFF
+
+/**
+ * \class CanReplay
+ * \brief Sends the frames of a capture on the simulated bus.
+ */
+class CanReplay {
+private:
+  struct Filter {
+    uint16_t id;
+    uint16_t mask;
+  };
+
+  CanCaptureReader reader;
+  Filter filters[CAN_REPLAY_FILTERS];
+  uint8_t numFilters;
+  uint8_t bus;
+  double speed;
+  uint8_t node;     ///< remote node the frames are sent from
+
+  bool started;
+  bool waiting;     ///< frame holds the next frame to send
+  CanBusFrame frame;
+  uint64_t first;   ///< capture time of the first frame
+  uint64_t origin;  ///< bus time the first frame is due
+
+  uint32_t numPlayed;
+  uint32_t numSkipped;
+  uint32_t latest;  ///< longest a frame went out after it was due, in us
+
+  bool load();
+  bool sending() const;
+  void advanceTo(uint64_t time);
+
+public:
+  CanReplay();
+
+  /// \brief Open a capture and add the node that sends it to the bus.
+  bool open(const char *path);
+
+  /**
+   * Set how fast to play, 1 for real time, 10 for ten times as fast or
+   * \ref CAN_REPLAY_MAX_SPEED. Sets the speed of the bus clock.
+   */
+  void setSpeed(double times);
+  /// \brief Only play the frames of one bus of the capture.
+  void setBus(uint8_t index) { bus = index; }
+  /// \brief Only play frames with matching ids, every frame if none are set.
+  bool addFilter(uint16_t id, uint16_t mask = 0x7FF);
+
+  /**
+   * Send the frames that are due and let the node handle what it got. Call
+   * it in place of CanNode::checkForMessages() in the main loop.
+   *
+   * \returns false once every frame is sent and off the bus
+   */
+  bool step();
+  /// \brief Play the whole capture, returns frames played.
+  uint32_t run();
+
+  /// \brief Frames sent so far.
+  uint32_t played() const { return numPlayed; }
+  /// \brief Frames of the capture left out by the bus or id filters.
+  uint32_t skipped() const { return numSkipped; }
+  /// \brief Longest a frame went out after its time, in micro-seconds.
+  uint32_t maxLate() const { return latest; }
+};
+
+//@}
+#endif // CAN_HOST && !CAN_SOCKETCAN
+#endif // _CAN_REPLAY_H_
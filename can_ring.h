@@ -0,0 +1,114 @@
+/**
+ * \file can_ring.h
+ * \brief Lock-free single producer, single consumer ring buffer.
+ *
+ * Used to pass messages from the CAN interrupts to the main loop. The producer
+ * (an interrupt) only writes the head index and the consumer (the main loop)
+ * only writes the tail index, so no critical sections are needed as long as
+ * each side stays on its own end of the ring.
+ *
+ * The consumer can also use the elements where they are in the ring instead
+ * of copying them out. claim() hands out the oldest element that hasn't been
+ * claimed yet and release() gives it back. Elements can be released in any
+ * order, but a slot only becomes free for the producer once every older slot
+ * has been released too, so claimed elements should be released soon.
+ */
+
+#ifndef _CAN_RING_H_
+#define _CAN_RING_H_
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * \class CanRing
+ * \brief Fixed size ring of N elements of type T. N must be a power of two.
+ *
+ * The indices are free running and wrap at 2^16, the number of stored
+ * elements is always head - tail.
+ */
+template <typename T, uint16_t N> class CanRing {
+  static_assert(N > 0 && (N & (N - 1)) == 0,
+                "CanRing size must be a power of two");
+  static_assert(N <= 0x8000, "CanRing size must fit the 16-bit indices");
+
+private:
+  T buff[N];
+  std::atomic<uint16_t> head; ///< next slot to write, owned by the producer
+  std::atomic<uint16_t> tail; ///< oldest slot in use, owned by the consumer
+  uint16_t next;              ///< next slot to claim, owned by the consumer
+  uint8_t refs[N];            ///< holders of each claimed slot (consumer)
+
+public:
+  CanRing() : head(0), tail(0), next(0), refs() {}
+
+  /// \brief Add an element, returns false if the ring is full. (producer)
+  bool push(const T &item) {
+    uint16_t h = head.load(std::memory_order_relaxed);
+    if ((uint16_t)(h - tail.load(std::memory_order_acquire)) >= N) {
+      return false;
+    }
+    buff[h & (N - 1)] = item;
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+
+  /// \brief Remove the oldest element, returns false if empty. (consumer)
+  bool pop(T *item) {
+    T *slot = claim();
+    if (slot == nullptr) {
+      return false;
+    }
+    *item = *slot;
+    release(slot);
+    return true;
+  }
+
+  /**
+   * Take the oldest unclaimed element without copying it. The element stays
+   * in its slot until it is released. (consumer)
+   *
+   * \returns the element, or nullptr if there is nothing new
+   */
+  T *claim() {
+    if (next == head.load(std::memory_order_acquire)) {
+      return nullptr;
+    }
+    uint16_t slot = next++ & (N - 1);
+    refs[slot] = 1;
+    return &buff[slot];
+  }
+
+  /// \brief Keep a claimed element until one more release(). (consumer)
+  void retain(const T *item) { ++refs[item - buff]; }
+
+  /**
+   * Give back a claimed element. Once every holder has released it the slot,
+   * and any released slots after it, go back to the producer. (consumer)
+   */
+  void release(const T *item) {
+    uint16_t slot = (uint16_t)(item - buff);
+    if (refs[slot] == 0 || --refs[slot] > 0) {
+      return;
+    }
+    uint16_t t = tail.load(std::memory_order_relaxed);
+    while (t != next && refs[t & (N - 1)] == 0) {
+      ++t;
+    }
+    tail.store(t, std::memory_order_release);
+  }
+
+  /// \brief Number of elements in the ring, including claimed ones.
+  uint16_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_acquire);
+  }
+
+  /// \brief Check if there is anything to read or claim. (consumer)
+  bool empty() const { return next == head.load(std::memory_order_acquire); }
+
+  /// \brief Number of elements the ring can hold.
+  static constexpr uint16_t capacity() { return N; }
+};
+
+#endif // _CAN_RING_H_
@@ -0,0 +1,78 @@
+/**
+ * \file can_rtr_table.h
+ * \brief Frames the receive interrupt answers remote requests with.
+ *
+ * A node that always answers a remote request with its latest value doesn't
+ * need the main loop to do it. The value is encoded ahead of time and kept
+ * here, when a remote request for its id arrives the receive interrupt hands
+ * the frame straight to the transmit mailboxes and the request never reaches
+ * the receive ring.
+ *
+ * The table itself is not protected, the driver changes it with the CAN
+ * interrupts held off and reads it from the receive interrupt.
+ */
+
+#ifndef _CAN_RTR_TABLE_H_
+#define _CAN_RTR_TABLE_H_
+
+#include <cstdint>
+#include "CanTypes.h"
+
+/**
+ * \class CanRtrTable
+ * \brief Up to N ids with a ready made answer to a remote request.
+ */
+template <uint8_t N> class CanRtrTable {
+private:
+  CanMessage frames[N];
+  uint8_t count;
+
+  int8_t indexOf(uint16_t id) const {
+    for (uint8_t i = 0; i < count; ++i) {
+      if (frames[i].id == id) {
+        return (int8_t)i;
+      }
+    }
+    return -1;
+  }
+
+public:
+  CanRtrTable() : count(0) {}
+
+  /**
+   * Set the answer for the id of a frame, replacing the one it had.
+   *
+   * \returns false if the id is new and the table is full
+   */
+  bool set(const CanMessage *msg) {
+    int8_t i = indexOf(msg->id);
+    if (i < 0) {
+      if (count >= N) {
+        return false;
+      }
+      i = (int8_t)count++;
+    }
+    frames[i] = *msg;
+    frames[i].rtr = false;
+    return true;
+  }
+
+  /// \brief Stop answering requests for an id.
+  void clear(uint16_t id) {
+    int8_t i = indexOf(id);
+    if (i >= 0) {
+      frames[i] = frames[--count];
+    }
+  }
+
+  /// \brief The answer for a remote request, nullptr if there is none.
+  const CanMessage *find(const CanMessage *request) const {
+    if (!request->rtr || count == 0) {
+      return nullptr;
+    }
+    int8_t i = indexOf(request->id);
+    return i < 0 ? nullptr : &frames[i];
+  }
+};
+
+#endif // _CAN_RTR_TABLE_H_
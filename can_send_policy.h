@@ -0,0 +1,250 @@
+/**
+ * \file can_send_policy.h
+ * \brief Decides which of a node's messages are worth putting on the bus.
+ *
+ * A sensor that changes slowly doesn't need every reading sent. With a policy
+ * set (see CanNode::setSendPolicy()) each message the node sends is compared
+ * with the last one of the same kind that went out and goes out only if
+ *
+ * - nothing of its kind has been sent yet, or
+ * - at least minInterval mili-seconds have passed since the last one of its
+ *   kind and a value moved by more than the deadband, or the length of the
+ *   message changed, or
+ * - maxInterval mili-seconds have passed since the last one of its kind, as a
+ *   heartbeat so the other nodes know the sender is alive (0 turns the
+ *   heartbeat off)
+ *
+ * The kind of a message is its type byte for the sendData functions, all
+ * messages from sendData_custom() are one kind, and each periodic message is
+ * a kind of its own. The policy keeps the last message of up to
+ * \ref CAN_SEND_POLICY_KINDS kinds, a new kind takes the place of the one
+ * that was sent the longest ago, which then counts as never sent.
+ *
+ * The deadband is in the raw integer units of the message. Messages that hold
+ * an array move when any one value moves by more than the deadband. Messages
+ * without a type byte are read with the \ref CanSignal layout given to the
+ * policy, and move when any one signal moves by more than the deadband. With
+ * no layout they move when any byte changes. Periodic messages are read with
+ * the layout if there is one, otherwise as typed messages when the first byte
+ * is the type byte of an integer. Values are compared with the last message
+ * sent rather than the last one offered, so a slow drift still goes out once
+ * it adds up to more than the deadband.
+ *
+ * Messages that are held back count as suppressed. A change that comes before
+ * minInterval has passed is not sent later on its own, it goes out with the
+ * next message of its kind that is offered after the interval.
+ */
+
+#ifndef _CAN_SEND_POLICY_H_
+#define _CAN_SEND_POLICY_H_
+
+#include <cstdint>
+#include <cstring>
+#include "CanTypes.h"
+#include "CanSignal.h"
+
+#ifndef CAN_SEND_POLICY_KINDS
+/// Kinds of message a send policy keeps the last one of. Can be overwriten by
+/// redefinition
+#define CAN_SEND_POLICY_KINDS 4
+#endif
+
+/// Kind of the messages from CanNode::sendData_custom()
+#define CAN_SEND_KIND_CUSTOM 0x100
+/// Kind of the messages of periodic entry n
+#define CAN_SEND_KIND_PERIODIC(n) (0x200 | (n))
+
+/**
+ * \class CanSendPolicy
+ * \brief Deadband and interval limits for the messages of one node.
+ */
+class CanSendPolicy {
+private:
+  /// last message sent of one kind
+  struct Last {
+    uint16_t kind;   ///< type byte or CAN_SEND_KIND_*
+    uint8_t len;     ///< length of the message, 0 if the entry is free
+    uint8_t data[8]; ///< data of the message
+    uint32_t tick;   ///< tick the message was sent
+  };
+
+  uint32_t deadband;    ///< largest change that is not sent
+  uint16_t minInterval; ///< mili-seconds a change waits after the last send
+  uint16_t maxInterval; ///< mili-seconds between heartbeats, 0 for none
+  bool enabled;         ///< the policy is in use, otherwise send everything
+  uint8_t numSignals;   ///< signals in layout
+  const CanSignal *layout; ///< signals of messages without a type byte
+  Last last[CAN_SEND_POLICY_KINDS]; ///< last message sent of each kind
+  uint32_t numSent;     ///< messages let through
+  uint32_t numSuppressed; ///< messages held back
+
+  // bytes in each value of an integer data message, 0 for other messages
+  static uint8_t valueSize(uint8_t config) {
+    if ((config & 0x1F) != CAN_DATA) {
+      return 0;
+    }
+    switch ((CanNodeDataType)(config >> 5)) {
+    case CAN_UINT8:
+    case CAN_INT8:
+      return 1;
+    case CAN_UINT16:
+    case CAN_INT16:
+      return 2;
+    case CAN_UINT32:
+    case CAN_INT32:
+      return 4;
+    default:
+      return 0;
+    }
+  }
+
+  // value of the data at in, least significant byte first
+  static int64_t value(const uint8_t *in, uint8_t size, bool isSigned) {
+    uint32_t bits = 0;
+    for (uint8_t i = 0; i < size; ++i) {
+      bits |= (uint32_t)in[i] << (8 * i);
+    }
+    if (isSigned && size < 4 && (bits >> (8 * size - 1)) & 1) {
+      bits |= ~0u << (8 * size);
+    }
+    return isSigned ? (int64_t)(int32_t)bits : (int64_t)bits;
+  }
+
+  bool outside(int64_t diff) const {
+    return diff > (int64_t)deadband || -diff > (int64_t)deadband;
+  }
+
+  // a value after the type byte moved
+  bool movedValue(const Last *prev, const CanMessage *msg, uint8_t size) const {
+    if (msg->data[0] != prev->data[0]) {
+      return true;
+    }
+    // the signed types are the odd ones
+    bool isSigned = (msg->data[0] >> 5) & 1;
+    for (uint8_t i = 1; i < msg->len; i += size) {
+      if (outside(value(&msg->data[i], size, isSigned) -
+                  value(&prev->data[i], size, isSigned))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // a signal of the layout moved
+  bool movedSignal(const Last *prev, const CanMessage *msg) const {
+    CanMessage before;
+    before.len = prev->len;
+    memcpy(before.data, prev->data, prev->len);
+    CanSignalFrame now(msg), then(&before);
+    for (uint8_t i = 0; i < numSignals; ++i) {
+      if (outside((int64_t)now.getRaw(layout[i]) - then.getRaw(layout[i]))) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool moved(const Last *prev, const CanMessage *msg) const {
+    if (msg->len != prev->len) {
+      return true;
+    }
+    bool periodic = prev->kind >= CAN_SEND_KIND_PERIODIC(0);
+    if (prev->kind >= CAN_SEND_KIND_CUSTOM && layout != nullptr) {
+      return movedSignal(prev, msg);
+    }
+    if (prev->kind < CAN_SEND_KIND_CUSTOM || periodic) {
+      uint8_t size = valueSize(msg->data[0]);
+      if (size != 0 && (msg->len - 1) % size == 0) {
+        return movedValue(prev, msg, size);
+      }
+    }
+    return memcmp(msg->data, prev->data, msg->len) != 0;
+  }
+
+  // the last message of a kind, nullptr if none was sent
+  const Last *find(uint16_t kind) const {
+    for (uint8_t i = 0; i < CAN_SEND_POLICY_KINDS; ++i) {
+      if (last[i].len != 0 && last[i].kind == kind) {
+        return &last[i];
+      }
+    }
+    return nullptr;
+  }
+
+public:
+  CanSendPolicy() { set(false, 0, 0, 0); }
+
+  /// \brief Turn the policy on or off and start the counters over.
+  void set(bool on, uint32_t band, uint16_t minimum, uint16_t maximum,
+           const CanSignal *signals = nullptr, uint8_t count = 0) {
+    deadband = band;
+    minInterval = minimum;
+    maxInterval = maximum;
+    enabled = on;
+    layout = count != 0 ? signals : nullptr;
+    numSignals = layout != nullptr ? count : 0;
+    memset(last, 0, sizeof(last));
+    numSent = 0;
+    numSuppressed = 0;
+  }
+
+  /**
+   * Decide if a message goes out, counting it as suppressed if it doesn't.
+   *
+   * \param msg message about to be sent
+   * \param kind its type byte or one of the CAN_SEND_KIND values
+   * \param now current tick
+   *
+   * \returns true if the message should be sent
+   */
+  bool admit(const CanMessage *msg, uint16_t kind, uint32_t now) {
+    const Last *prev = find(kind);
+    if (!enabled || msg->rtr || prev == nullptr) {
+      return true;
+    }
+    uint32_t elapsed = now - prev->tick;
+    if ((elapsed >= minInterval && moved(prev, msg)) ||
+        (maxInterval != 0 && elapsed >= maxInterval)) {
+      return true;
+    }
+    ++numSuppressed;
+    return false;
+  }
+
+  /// \brief Remember a message the driver took as the last one of its kind.
+  void sent(const CanMessage *msg, uint16_t kind, uint32_t now) {
+    if (!enabled || msg->rtr) {
+      return;
+    }
+    ++numSent;
+    if (msg->len == 0) {
+      // nothing to compare, always sent
+      return;
+    }
+    // the entry of the kind, or the one sent the longest ago
+    Last *entry = &last[0];
+    for (uint8_t i = 0; i < CAN_SEND_POLICY_KINDS; ++i) {
+      if (last[i].len != 0 && last[i].kind == kind) {
+        entry = &last[i];
+        break;
+      }
+      if (last[i].len == 0 ||
+          (entry->len != 0 && now - last[i].tick > now - entry->tick)) {
+        entry = &last[i];
+      }
+    }
+    entry->kind = kind;
+    entry->len = msg->len > 8 ? 8 : msg->len;
+    memcpy(entry->data, msg->data, entry->len);
+    entry->tick = now;
+  }
+
+  /// \brief The policy is in use.
+  bool active() const { return enabled; }
+  /// \brief Messages that were let through since the policy was set.
+  uint32_t passed() const { return numSent; }
+  /// \brief Messages that were held back since the policy was set.
+  uint32_t suppressed() const { return numSuppressed; }
+};
+
+#endif // _CAN_SEND_POLICY_H_
@@ -0,0 +1,787 @@
+/**
+ * can_sim.cpp
+ * \brief Simulated CANBus used by the host build of the library
+ *
+ * The model follows the bxCAN reference manual where it affects which frames
+ * a node sees and when: lowest id wins arbitration, frames are only accepted
+ * by a controller whose filters match, a full FIFO overwrites its newest
+ * frame and sets the overrun flag, and a frame that nobody acknowledges is
+ * retransmitted. A controller that keeps failing to send goes bus-off.
+ */
+#ifdef CAN_HOST
+
+#include <chrono>
+#include <cstring>
+#include "can_sim.h"
+
+static struct {
+  CanSimController ctrl[CAN_SIM_MAX_CONTROLLERS];
+  uint8_t count;
+
+  bool busy;          // a frame is on the wire
+  uint8_t tx_node;    // controller sending the frame
+  uint8_t tx_box;     // mailbox the frame is in
+  uint64_t tx_start;  // time the frame started
+  uint64_t tx_end;    // time the frame will be finished
+  uint64_t idle_since;
+
+  uint32_t frames;
+  uint64_t busy_ns;
+} bus;
+
+// interrupt of the local controller
+static void (*irq_handler)(void) = nullptr;
+static uint8_t irq_disabled = 0;
+static bool in_irq = false;
+
+// the bus clock, clock_base ns at clock_anchor and running clock_speed times
+// as fast as real time from there
+static std::chrono::steady_clock::time_point clock_anchor =
+    std::chrono::steady_clock::now();
+static uint64_t clock_base = 0;
+static double clock_speed = 1.0;
+
+static void controller_reset(CanSimController *can) {
+  std::memset(can, 0, sizeof(*can));
+  can->mode = CAN_SIM_INIT;
+  can->bitrate = CAN_BITRATE_125K;
+}
+
+void can_sim_reset(void) {
+  std::memset(&bus, 0, sizeof(bus));
+  for (uint8_t i = 0; i < CAN_SIM_MAX_CONTROLLERS; ++i) {
+    controller_reset(&bus.ctrl[i]);
+  }
+  // the local controller always exists
+  bus.count = 1;
+  clock_anchor = std::chrono::steady_clock::now();
+  clock_base = 0;
+  clock_speed = 1.0;
+}
+
+/**
+ * Remote nodes accept every frame on the bus and start out in normal mode, so
+ * they acknowledge frames from the local node. They recover from bus-off on
+ * their own (ABOM).
+ *
+ * \param bitrate bitrate the node communicates at
+ *
+ * \returns the index of the new node, or \ref CAN_SIM_NO_NODE if the bus
+ * already has \ref CAN_SIM_MAX_CONTROLLERS controllers.
+ */
+uint8_t can_sim_add_node(canBitrate bitrate) {
+  if (bus.count == 0) {
+    can_sim_reset();
+  }
+  if (bus.count >= CAN_SIM_MAX_CONTROLLERS) {
+    return CAN_SIM_NO_NODE;
+  }
+
+  CanSimController *can = &bus.ctrl[bus.count];
+  controller_reset(can);
+  can->mode = CAN_SIM_NORMAL;
+  can->bitrate = bitrate;
+  can->accept_all = true;
+  can->abom = true;
+  return bus.count++;
+}
+
+CanSimController *can_sim_controller(uint8_t node) {
+  if (bus.count == 0) {
+    can_sim_reset();
+  }
+  if (node >= bus.count) {
+    return nullptr;
+  }
+  return &bus.ctrl[node];
+}
+
+uint64_t can_sim_time_ns(void) {
+  if (clock_speed == 0) {
+    return clock_base;
+  }
+  uint64_t real = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - clock_anchor)
+                      .count();
+  return clock_base +
+         (clock_speed == 1.0 ? real : (uint64_t)(real * clock_speed));
+}
+
+/**
+ * The time the library sees (HAL_GetTick(), can_time_us()) is the bus time,
+ * so a node on a faster clock behaves the same, timeouts and all, it just
+ * gets there sooner. A speed of 0 stops the clock, then it only moves with
+ * can_sim_advance() and HAL_Delay() and can_wait() move it themselves.
+ *
+ * \param speed times real time, 1 for real time
+ */
+void can_sim_set_speed(double speed) {
+  clock_base = can_sim_time_ns();
+  clock_anchor = std::chrono::steady_clock::now();
+  clock_speed = speed > 0 ? speed : 0;
+}
+
+double can_sim_speed(void) {
+  return clock_speed;
+}
+
+/**
+ * Works with a running clock too, it jumps ahead. The bus catches up on the
+ * next call into the simulator.
+ */
+void can_sim_advance(uint64_t ns) {
+  clock_base += ns;
+}
+
+uint32_t can_sim_bitrate_bps(canBitrate bitrate) {
+  switch (bitrate) {
+  case CAN_BITRATE_10K:
+    return 10000;
+  case CAN_BITRATE_20K:
+    return 20000;
+  case CAN_BITRATE_50K:
+    return 50000;
+  case CAN_BITRATE_100K:
+    return 100000;
+  case CAN_BITRATE_125K:
+    return 125000;
+  case CAN_BITRATE_250K:
+    return 250000;
+  case CAN_BITRATE_500K:
+    return 500000;
+  case CAN_BITRATE_750K:
+    return 750000;
+  case CAN_BITRATE_1000K:
+    return 1000000;
+  }
+  return 125000;
+}
+
+/**
+ * Counts every bit of a standard frame, from the start of frame bit to the
+ * end of the interframe space. Stuff bits are counted exactly by building the
+ * stuffed part of the frame (SOF through the CRC) bit by bit.
+ */
+uint32_t can_sim_frame_bits(const CanMessage *msg) {
+  uint8_t bits[19 + 64 + 15];
+  uint8_t n = 0;
+  uint8_t len = msg->len > 8 ? 8 : msg->len;
+
+  bits[n++] = 0; // SOF
+  for (int8_t i = 10; i >= 0; --i) {
+    bits[n++] = (msg->id >> i) & 1;
+  }
+  bits[n++] = msg->rtr ? 1 : 0;
+  bits[n++] = 0; // IDE
+  bits[n++] = 0; // r0
+  for (int8_t i = 3; i >= 0; --i) {
+    bits[n++] = (len >> i) & 1;
+  }
+  if (!msg->rtr) {
+    for (uint8_t byte = 0; byte < len; ++byte) {
+      for (int8_t i = 7; i >= 0; --i) {
+        bits[n++] = (msg->data[byte] >> i) & 1;
+      }
+    }
+  }
+
+  // CRC-15 over everything so far
+  uint16_t crc = 0;
+  for (uint8_t i = 0; i < n; ++i) {
+    bool next = bits[i] ^ ((crc >> 14) & 1);
+    crc = (crc << 1) & 0x7FFF;
+    if (next) {
+      crc ^= 0x4599;
+    }
+  }
+  for (int8_t i = 14; i >= 0; --i) {
+    bits[n++] = (crc >> i) & 1;
+  }
+
+  // a stuff bit of the opposite value is added after five equal bits
+  uint8_t stuff = 0;
+  uint8_t run = 1;
+  uint8_t prev = bits[0];
+  for (uint8_t i = 1; i < n; ++i) {
+    if (bits[i] == prev) {
+      ++run;
+    } else {
+      prev = bits[i];
+      run = 1;
+    }
+    if (run == 5) {
+      ++stuff;
+      prev = !prev;
+      run = 1;
+    }
+  }
+
+  // CRC delimiter, ACK slot and delimiter, EOF and the interframe space
+  return n + stuff + 1 + 2 + 7 + 3;
+}
+
+int8_t can_sim_tx_request(uint8_t node, const CanMessage *msg) {
+  CanSimController *can = can_sim_controller(node);
+  if (can == nullptr) {
+    return -1;
+  }
+
+  for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+    if (!can->mailbox[box].pending) {
+      can->mailbox[box].msg = *msg;
+      can->mailbox[box].requested = can_sim_time_ns();
+      can->mailbox[box].period = 0;
+      can->mailbox[box].pending = true;
+      return box;
+    }
+  }
+  return -1;
+}
+
+bool can_sim_fifo_pop(uint8_t node, uint8_t fifo, CanMessage *msg) {
+  CanSimController *can = can_sim_controller(node);
+  if (can == nullptr || fifo > 1) {
+    return false;
+  }
+
+  CanSimFifo *f = &can->fifo[fifo];
+  if (f->count == 0) {
+    return false;
+  }
+  *msg = f->msg[f->head];
+  f->head = (f->head + 1) % CAN_SIM_FIFO_DEPTH;
+  --f->count;
+  return true;
+}
+
+CanState can_sim_send(uint8_t node, const CanMessage *msg) {
+  can_sim_poll();
+  return can_sim_tx_request(node, msg) < 0 ? BUS_BUSY : BUS_OK;
+}
+
+/**
+ * The frame stays in a mailbox of the node and is requested again every
+ * \p period_us micro-seconds after its first request, like a node sending a
+ * cyclic message. Requests that come due while the frame is still waiting are
+ * merged, so a bus that is too slow for the period sends it less often. The
+ * mailbox is freed again by clearing its pending flag.
+ *
+ * \returns \ref BUS_BUSY if the node has no free mailbox
+ */
+CanState can_sim_send_periodic(uint8_t node, const CanMessage *msg,
+                               uint32_t period_us) {
+  can_sim_poll();
+  int8_t box = can_sim_tx_request(node, msg);
+  if (box < 0) {
+    return BUS_BUSY;
+  }
+  can_sim_controller(node)->mailbox[box].period = (uint64_t)period_us * 1000;
+  return BUS_OK;
+}
+
+CanState can_sim_receive(uint8_t node, CanMessage *msg) {
+  can_sim_poll();
+  if (can_sim_fifo_pop(node, 0, msg) || can_sim_fifo_pop(node, 1, msg)) {
+    return DATA_OK;
+  }
+  return NO_DATA;
+}
+
+uint32_t can_sim_bus_frames(void) {
+  can_sim_poll();
+  return bus.frames;
+}
+
+uint64_t can_sim_bus_busy_ns(void) {
+  can_sim_poll();
+  return bus.busy_ns;
+}
+
+// filter matching ------------------------------------------------------------
+
+// a match found while searching the filter banks, used to pick the filter with
+// the highest priority
+struct FilterMatch {
+  bool found;
+  uint8_t fifo;
+  uint8_t fmi;
+  uint8_t rank; // 0 is the highest priority
+};
+
+static void consider(FilterMatch *best, uint8_t fifo, uint8_t fmi,
+                     uint8_t rank) {
+  if (!best->found || rank < best->rank) {
+    best->found = true;
+    best->fifo = fifo;
+    best->fmi = fmi;
+    best->rank = rank;
+  }
+}
+
+/*
+ * Search all of the filter banks for a match. Filter numbers are given per
+ * FIFO in bank order, whether the bank is active or not. When more than one
+ * filter matches, 32-bit filters win over 16-bit ones, id lists win over masks
+ * and then the lowest filter number wins.
+ */
+static FilterMatch match_filters(const CanSimController *can,
+                                 const CanMessage *msg) {
+  FilterMatch best = {false, 0, 0, 0};
+  uint8_t number[2] = {0, 0};
+  uint16_t frame16 = (uint16_t)((msg->id & 0x7FF) << 5) | (msg->rtr ? 0x10 : 0);
+  uint32_t frame32 = ((uint32_t)(msg->id & 0x7FF) << 21) | (msg->rtr ? 0x2 : 0);
+
+  for (uint8_t bank = 0; bank < CAN_SIM_FILTER_BANKS; ++bank) {
+    uint32_t bit = 1UL << bank;
+    uint8_t fifo = (can->ffa1r & bit) ? 1 : 0;
+    bool active = can->fa1r & bit;
+    bool list = can->fm1r & bit;
+    uint32_t fr1 = can->bank[bank].fr1;
+    uint32_t fr2 = can->bank[bank].fr2;
+    uint8_t fmi = number[fifo];
+
+    if (can->fs1r & bit) {
+      if (list) {
+        number[fifo] += 2;
+        if (active && frame32 == (fr1 & ~1UL)) {
+          consider(&best, fifo, fmi, 0);
+        } else if (active && frame32 == (fr2 & ~1UL)) {
+          consider(&best, fifo, fmi + 1, 0);
+        }
+      } else {
+        number[fifo] += 1;
+        if (active && ((frame32 ^ fr1) & fr2 & ~1UL) == 0) {
+          consider(&best, fifo, fmi, 1);
+        }
+      }
+    } else {
+      if (list) {
+        uint16_t slot[4] = {(uint16_t)fr1, (uint16_t)(fr1 >> 16), (uint16_t)fr2,
+                            (uint16_t)(fr2 >> 16)};
+        number[fifo] += 4;
+        for (uint8_t i = 0; active && i < 4; ++i) {
+          if (frame16 == slot[i]) {
+            consider(&best, fifo, fmi + i, 2);
+            break;
+          }
+        }
+      } else {
+        number[fifo] += 2;
+        if (active && ((frame16 ^ fr1) & (fr1 >> 16) & 0xFFFF) == 0) {
+          consider(&best, fifo, fmi, 3);
+        } else if (active && ((frame16 ^ fr2) & (fr2 >> 16) & 0xFFFF) == 0) {
+          consider(&best, fifo, fmi + 1, 3);
+        }
+      }
+    }
+  }
+  return best;
+}
+
+// bus ------------------------------------------------------------------------
+
+// put a frame in a FIFO, a full FIFO is not locked (RFLM = 0) so its newest
+// frame gets overwritten
+static void fifo_store(CanSimController *can, uint8_t fifo,
+                       const CanMessage *msg, uint8_t fmi, uint64_t time) {
+  CanSimFifo *f = &can->fifo[fifo];
+  uint8_t index;
+  if (f->count < CAN_SIM_FIFO_DEPTH) {
+    index = (f->head + f->count) % CAN_SIM_FIFO_DEPTH;
+    ++f->count;
+  } else {
+    index = (f->head + CAN_SIM_FIFO_DEPTH - 1) % CAN_SIM_FIFO_DEPTH;
+    f->overrun = true;
+  }
+  CanMessage *slot = &f->msg[index];
+  *slot = *msg;
+  slot->fmi = fmi;
+  f->time[index] = time;
+  ++can->rx_frames;
+}
+
+static void deliver(CanSimController *can, const CanMessage *msg) {
+  FilterMatch match = {true, 0, 0, 0};
+  if (!can->accept_all) {
+    match = match_filters(can, msg);
+    if (!match.found) {
+      return;
+    }
+  }
+  // the frame is recieved at the end of the frame
+  fifo_store(can, match.fifo, msg, match.fmi, bus.tx_end);
+}
+
+// bit times a bus-off controller waits for, 128 times 11 recessive bits
+static const uint32_t RECOVERY_BITS = 128 * 11;
+
+// takes part in bus traffic
+static bool on_bus(const CanSimController *can) {
+  return can->mode == CAN_SIM_NORMAL && !(can->esr & CAN_SIM_ESR_BOFF);
+}
+
+/*
+ * Work out the error state from the counters, a flag that gets set raises
+ * ERRI if its interrupt is enabled.
+ */
+static void update_errors(CanSimController *can, bool off) {
+  uint8_t esr = off ? CAN_SIM_ESR_BOFF : 0;
+  if (can->tec >= 96 || can->rec >= 96) {
+    esr |= CAN_SIM_ESR_EWGF;
+  }
+  if (can->tec >= 128 || can->rec >= 128) {
+    esr |= CAN_SIM_ESR_EPVF;
+  }
+  // EWGIE, EPVIE and BOFIE are the ESR bits moved up by 8
+  if (esr & ~can->esr & (can->ier >> 8)) {
+    can->erri = true;
+  }
+  can->esr = esr;
+}
+
+// time a controller that starts its recovery now is back on the bus
+static uint64_t recovery_end(const CanSimController *can, uint64_t now) {
+  return now + (uint64_t)RECOVERY_BITS * 1000000000ULL /
+                   can_sim_bitrate_bps(can->bitrate);
+}
+
+// the transmit error counter passed 255, with ABOM the recovery starts
+// right away
+static void bus_off(CanSimController *can) {
+  can->tec = 255;
+  update_errors(can, true);
+  can->rejoin = can->abom ? recovery_end(can, bus.tx_end) : 0;
+}
+
+static void finish_frame() {
+  CanSimController *tx = &bus.ctrl[bus.tx_node];
+  CanSimMailbox *box = &tx->mailbox[bus.tx_box];
+  bool acked = false;
+  bool corrupted = false;
+
+  // a controller running at the wrong bitrate destroys the frame with error
+  // flags, one at the right bitrate acknowledges it. Silent controllers do
+  // neither.
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *rx = &bus.ctrl[i];
+    if (i == bus.tx_node || !on_bus(rx) || rx->silent) {
+      continue;
+    }
+    if (rx->bitrate == tx->bitrate) {
+      acked = true;
+    } else {
+      corrupted = true;
+    }
+  }
+
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *rx = &bus.ctrl[i];
+    if (i == bus.tx_node || !on_bus(rx)) {
+      continue;
+    }
+    if (rx->bitrate != tx->bitrate || corrupted) {
+      rx->rec = rx->rec < 255 ? rx->rec + 1 : 255;
+      // a frame at another bitrate breaks the stuffing rule
+      rx->lec = 1;
+    } else if (!acked) {
+      // only silent controllers heard it, the error flag the sender raises
+      // for the missing acknowledgment lands in the end of frame
+      rx->rec = rx->rec < 255 ? rx->rec + 1 : 255;
+      rx->lec = 2;
+    } else {
+      rx->rec = rx->rec > 0 ? rx->rec - 1 : 0;
+      rx->lec = 0;
+      deliver(rx, &box->msg);
+    }
+  }
+
+  // controllers sleeping with automatic wakeup are woken by the frame, it is
+  // over by the time they are in step with the bus so they miss it
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *rx = &bus.ctrl[i];
+    if (rx->mode == CAN_SIM_SLEEP && rx->awum) {
+      rx->mode = CAN_SIM_NORMAL;
+      rx->wkui = true;
+    }
+  }
+
+  if (acked && !corrupted) {
+    if (box->period > 0) {
+      // the next request of a periodic frame, skipping any that were missed
+      do {
+        box->requested += box->period;
+      } while (box->requested < bus.tx_end);
+    } else {
+      box->pending = false;
+    }
+    tx->rqcp |= 1 << bus.tx_box;
+    tx->tec = tx->tec > 0 ? tx->tec - 1 : 0;
+    tx->lec = 0;
+    ++tx->tx_frames;
+  } else {
+    // automatic retransmission, the frame takes part in the next arbitration.
+    // An error passive sender that only missed the acknowledgment keeps its
+    // count, so a node alone on the bus never goes bus-off.
+    if (corrupted || tx->tec < 128) {
+      if (tx->tec > 255 - 8) {
+        bus_off(tx);
+      } else {
+        tx->tec += 8;
+      }
+    }
+    tx->lec = corrupted ? 1 : 3;
+    box->requested = bus.tx_end;
+  }
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *can = &bus.ctrl[i];
+    update_errors(can, (can->esr & CAN_SIM_ESR_BOFF) != 0);
+  }
+
+  ++bus.frames;
+  bus.busy_ns += bus.tx_end - bus.tx_start;
+  bus.idle_since = bus.tx_end;
+  bus.busy = false;
+}
+
+// when the next frame can start, UINT64_MAX if nothing is waiting
+static uint64_t next_start() {
+  uint64_t earliest = UINT64_MAX;
+
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *can = &bus.ctrl[i];
+    if (!on_bus(can) || can->silent) {
+      continue;
+    }
+    for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+      if (can->mailbox[box].pending && can->mailbox[box].requested < earliest) {
+        earliest = can->mailbox[box].requested;
+      }
+    }
+  }
+  if (earliest == UINT64_MAX) {
+    return UINT64_MAX;
+  }
+  return earliest > bus.idle_since ? earliest : bus.idle_since;
+}
+
+// when the next bus-off controller is back, UINT64_MAX if none is recovering
+static uint64_t next_rejoin() {
+  uint64_t earliest = UINT64_MAX;
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    const CanSimController *can = &bus.ctrl[i];
+    if ((can->esr & CAN_SIM_ESR_BOFF) && can->rejoin != 0 &&
+        can->rejoin < earliest) {
+      earliest = can->rejoin;
+    }
+  }
+  return earliest;
+}
+
+/*
+ * Put the bus-off controllers whose recovery is over by the given time back
+ * on the bus with their error counters cleared. Frames left in their mailboxes
+ * can't go out before then.
+ */
+static void rejoin(uint64_t now) {
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *can = &bus.ctrl[i];
+    if (!(can->esr & CAN_SIM_ESR_BOFF) || can->rejoin == 0 ||
+        can->rejoin > now) {
+      continue;
+    }
+    for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+      CanSimMailbox *mb = &can->mailbox[box];
+      if (mb->pending && mb->requested < can->rejoin) {
+        mb->requested = can->rejoin;
+      }
+    }
+    can->tec = 0;
+    can->rec = 0;
+    can->rejoin = 0;
+    update_errors(can, false);
+  }
+}
+
+/*
+ * Start the next frame if one was requested by the given time. Returns false
+ * if the bus stays idle.
+ */
+static bool start_frame(uint64_t now) {
+  uint64_t start = next_start();
+  if (start == UINT64_MAX || start > now) {
+    return false;
+  }
+
+  // arbitration: every frame waiting at the start of frame takes part, the
+  // lowest id wins and a data frame wins over a remote frame with the same id
+  bool found = false;
+  uint16_t best = 0;
+  for (uint8_t i = 0; i < bus.count; ++i) {
+    CanSimController *can = &bus.ctrl[i];
+    if (!on_bus(can) || can->silent) {
+      continue;
+    }
+    for (uint8_t box = 0; box < CAN_SIM_TX_MAILBOXES; ++box) {
+      CanSimMailbox *mb = &can->mailbox[box];
+      if (!mb->pending || mb->requested > start) {
+        continue;
+      }
+      uint16_t prio = (uint16_t)((mb->msg.id & 0x7FF) << 1) | (mb->msg.rtr ? 1 : 0);
+      if (!found || prio < best) {
+        found = true;
+        best = prio;
+        bus.tx_node = i;
+        bus.tx_box = box;
+      }
+    }
+  }
+
+  CanSimController *tx = &bus.ctrl[bus.tx_node];
+  uint32_t bits = can_sim_frame_bits(&tx->mailbox[bus.tx_box].msg);
+  bus.busy = true;
+  bus.tx_start = start;
+  bus.tx_end = start + (uint64_t)bits * 1000000000ULL /
+                           can_sim_bitrate_bps(tx->bitrate);
+  return true;
+}
+
+// interrupts ----------------------------------------------------------------
+
+// run the interrupt handler while one of the enabled conditions is true, like
+// the level triggered interrupt lines of the bxCAN
+static void raise_irqs() {
+  CanSimController *can = &bus.ctrl[CAN_SIM_LOCAL];
+  if (irq_handler == nullptr || irq_disabled || in_irq) {
+    return;
+  }
+
+  in_irq = true;
+  for (uint8_t i = 0; i < 8; ++i) {
+    bool pending = ((can->ier & CAN_SIM_IER_FMP0) && can->fifo[0].count) ||
+                   ((can->ier & CAN_SIM_IER_FMP1) && can->fifo[1].count) ||
+                   ((can->ier & CAN_SIM_IER_TME) && can->rqcp) ||
+                   ((can->ier & CAN_SIM_IER_WKU) && can->wkui) ||
+                   ((can->ier & CAN_SIM_IER_ERR) && can->erri);
+    if (!pending) {
+      break;
+    }
+    irq_handler();
+  }
+  in_irq = false;
+}
+
+/**
+ * The frame skips the bus and the filter banks, it goes straight into FIFO0 of
+ * the controller with the filter number already in msg->fmi. Useful for
+ * feeding the receive path as fast as possible.
+ *
+ * \param node controller to recieve the frame
+ * \param msg frame to recieve
+ */
+void can_sim_inject(uint8_t node, const CanMessage *msg) {
+  CanSimController *can = can_sim_controller(node);
+  if (can == nullptr) {
+    return;
+  }
+  fifo_store(can, 0, msg, msg->fmi, can_sim_time_ns());
+  if (node == CAN_SIM_LOCAL) {
+    raise_irqs();
+  }
+}
+
+/**
+ * Like the timestamp in the RDTR register of the oldest frame, read it before
+ * the frame is taken out with can_sim_fifo_pop().
+ *
+ * \returns 0 if the FIFO is empty
+ */
+uint64_t can_sim_fifo_time(uint8_t node, uint8_t fifo) {
+  CanSimController *can = can_sim_controller(node);
+  if (can == nullptr || fifo > 1 || can->fifo[fifo].count == 0) {
+    return 0;
+  }
+  return can->fifo[fifo].time[can->fifo[fifo].head];
+}
+
+void can_sim_set_irq_handler(void (*handler)(void)) {
+  irq_handler = handler;
+}
+
+void can_sim_irq_disable(void) {
+  ++irq_disabled;
+}
+
+void can_sim_irq_enable(void) {
+  if (irq_disabled > 0 && --irq_disabled == 0) {
+    raise_irqs();
+  }
+}
+
+/**
+ * With the clock stopped this is how far it can be moved before anything
+ * happens on the bus.
+ *
+ * \returns the time in ns a frame starts or ends next, UINT64_MAX if the bus
+ * stays idle until a node asks to send
+ */
+uint64_t can_sim_next_event_ns(void) {
+  if (bus.count == 0) {
+    can_sim_reset();
+  }
+  if (bus.busy) {
+    return bus.tx_end;
+  }
+  uint64_t start = next_start();
+  uint64_t back = next_rejoin();
+  return back < start ? back : start;
+}
+
+/**
+ * Like leaving initilization mode after a bus-off on the bxCAN without ABOM,
+ * the controller is back on the bus after 128 times 11 recessive bits with its
+ * error counters cleared. The simulator counts them as bit times, the time
+ * they take on an idle bus. Does nothing if the controller isn't bus-off or is
+ * already recovering.
+ *
+ * \param node controller to recover
+ */
+void can_sim_recover(uint8_t node) {
+  CanSimController *can = can_sim_controller(node);
+  if (can == nullptr || !(can->esr & CAN_SIM_ESR_BOFF) || can->rejoin != 0) {
+    return;
+  }
+  can->rejoin = recovery_end(can, can_sim_time_ns());
+}
+
+void can_sim_poll(void) {
+  if (bus.count == 0) {
+    can_sim_reset();
+  }
+  // the interrupt handler sees the bus as it was when it was raised
+  if (in_irq) {
+    return;
+  }
+
+  uint64_t now = can_sim_time_ns();
+  for (;;) {
+    if (bus.busy) {
+      if (bus.tx_end > now) {
+        break;
+      }
+      finish_frame();
+      raise_irqs();
+    } else {
+      // a controller coming back takes part in the frames after it
+      uint64_t back = next_rejoin();
+      if (back <= now && back <= next_start()) {
+        rejoin(back);
+        raise_irqs();
+      } else if (!start_frame(now)) {
+        break;
+      }
+    }
+  }
+  raise_irqs();
+}
+
+#endif // CAN_HOST
@@ -0,0 +1,245 @@
+/**
+ * \file can_sim.h
+ * \brief Simulated CANBus for running the library on a PC.
+ *
+ * When the library is compiled with CAN_HOST defined, can_driver_host.cpp
+ * implements the functions in can_driver.h on top of controller 0 of this
+ * simulated bus instead of the bxCAN registers. The other controllers on the
+ * bus act as remote nodes and are driven directly with the can_sim functions.
+ *
+ * Each controller models the parts of the bxCAN peripheral that shape the
+ * traffic a node sees: three transmit mailboxes, two receive FIFOs that are
+ * three messages deep, the filter banks, silent mode and sleep mode with
+ * automatic wakeup. A sleeping controller wakes up when a frame on the bus
+ * ends, without recieving it, the way bxCAN loses the frame that wakes it.
+ * The error counters follow the fault confinement rules, a controller goes
+ * bus-off when its transmit error counter passes 255 and is off the bus until
+ * it recovers, see can_sim_recover().
+ * Pending frames are arbitrated by id and occupy the bus for as long as they
+ * would on the wire (including stuff bits) at the bitrate of the transmitting
+ * controller.
+ *
+ * The bus runs in real time, or faster, slower or stopped with
+ * can_sim_set_speed(). Work on the bus is done lazily, every call into the
+ * driver or the simulator first brings the bus up to the current time.
+ * Interrupts of the local controller are modelled the same way, the handler
+ * set with can_sim_set_irq_handler() runs from inside can_sim_poll() whenever
+ * an enabled interrupt condition is true.
+ *
+ * Example code
+ *
+ * ~~~~~~~~~~~~ {.cpp}
+ * CanNode node(THROTTLE, throttleRTR);
+ * uint8_t ecu = can_sim_add_node(CAN_BITRATE_500K);
+ *
+ * CanMessage msg = {THROTTLE, 0, 0, true};
+ * can_sim_send(ecu, &msg); // ask the throttle for data
+ * while (true) {
+ *   CanNode::checkForMessages();
+ *   if (can_sim_receive(ecu, &msg) == DATA_OK) {
+ *     // do something with the answer
+ *   }
+ * }
+ * ~~~~~~~~~~~~
+ */
+
+#ifndef _CAN_SIM_H_
+#define _CAN_SIM_H_
+
+#include "CanTypes.h"
+
+/**
+ * \defgroup CanSim_Module CanSim
+ * \brief Simulated CANBus used by the host build of the library
+ *@{
+ */
+
+#ifndef CAN_SIM_MAX_CONTROLLERS
+/// Maximum number of controllers on the simulated bus (including the local one)
+#define CAN_SIM_MAX_CONTROLLERS 8
+#endif
+
+/// Number of transmit mailboxes in a bxCAN controller
+#define CAN_SIM_TX_MAILBOXES 3
+/// Number of messages each receive FIFO can hold
+#define CAN_SIM_FIFO_DEPTH 3
+/// Number of filter banks in a single bxCAN controller
+#define CAN_SIM_FILTER_BANKS 14
+
+/// Index of the controller used by the can_driver.h functions
+#define CAN_SIM_LOCAL 0
+/// Returned by can_sim_add_node() if the bus is full
+#define CAN_SIM_NO_NODE 0xFF
+
+/// Transmit mailbox empty interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_TME 0x01
+/// FIFO0 message pending interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_FMP0 0x02
+/// FIFO1 message pending interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_FMP1 0x10
+/// Wakeup interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_WKU 0x10000
+/// Error warning interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_EWG 0x100
+/// Error passive interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_EPV 0x200
+/// Bus-off interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_BOF 0x400
+/// Error interrupt enable, same bit as in the bxCAN IER
+#define CAN_SIM_IER_ERR 0x8000
+
+/// Error warning flag, same bit as in the bxCAN ESR
+#define CAN_SIM_ESR_EWGF 0x01
+/// Error passive flag, same bit as in the bxCAN ESR
+#define CAN_SIM_ESR_EPVF 0x02
+/// Bus-off flag, same bit as in the bxCAN ESR
+#define CAN_SIM_ESR_BOFF 0x04
+
+/**
+ * \enum CanSimMode
+ * \brief Operating mode of a simulated controller
+ */
+typedef enum {
+  CAN_SIM_INIT,   ///< Initilization mode, the controller is off the bus
+  CAN_SIM_NORMAL, ///< Taking part in bus traffic
+  CAN_SIM_SLEEP,  ///< Sleep mode, the controller is off the bus until it is
+                  ///< woken up
+} CanSimMode;
+
+/**
+ * \struct CanSimMailbox
+ * \brief A transmit mailbox of a simulated controller
+ */
+typedef struct {
+  bool pending;       ///< Transmit request is set (TXRQ)
+  uint64_t requested; ///< Time the transmit was requested in ns
+  uint64_t period;    ///< Request again this many ns after each request that
+                      ///< went out, 0 to send once
+  CanMessage msg;     ///< Frame to transmit
+} CanSimMailbox;
+
+/**
+ * \struct CanSimFifo
+ * \brief A receive FIFO of a simulated controller
+ */
+typedef struct {
+  CanMessage msg[CAN_SIM_FIFO_DEPTH]; ///< Stored frames
+  uint64_t time[CAN_SIM_FIFO_DEPTH];  ///< Time each frame was recieved in ns
+  uint8_t head;                       ///< Index of the oldest frame
+  uint8_t count;                      ///< Number of frames pending (FMP)
+  bool overrun;                       ///< A frame was lost (FOVR)
+} CanSimFifo;
+
+/**
+ * \struct CanSimFilterBank
+ * \brief Filter bank registers, these use the bxCAN register layout
+ */
+typedef struct {
+  uint32_t fr1; ///< Filter register 1
+  uint32_t fr2; ///< Filter register 2
+} CanSimFilterBank;
+
+/**
+ * \struct CanSimController
+ * \brief State of a single bxCAN controller on the simulated bus
+ *
+ * The filter bitmaps use the bxCAN register layout, bit n of each one
+ * controls filter bank n.
+ */
+typedef struct {
+  CanSimMode mode;       ///< Current operating mode
+  canBitrate bitrate;    ///< Bitrate the controller is configured for
+  bool accept_all;       ///< Ignore the filter banks and accept every frame
+  bool silent;           ///< Silent mode (SILM), the controller recieves but
+                         ///< never sends frames, acknowledgments or error
+                         ///< flags
+  CanSimMailbox mailbox[CAN_SIM_TX_MAILBOXES]; ///< Transmit mailboxes
+  CanSimFifo fifo[2];    ///< Receive FIFOs
+
+  uint32_t fa1r;  ///< Filter banks that are active
+  uint32_t fm1r;  ///< Filter banks in id list mode (mask mode if clear)
+  uint32_t fs1r;  ///< Filter banks in 32-bit mode (16-bit mode if clear)
+  uint32_t ffa1r; ///< Filter banks assigned to FIFO1 (FIFO0 if clear)
+  CanSimFilterBank bank[CAN_SIM_FILTER_BANKS]; ///< Filter bank registers
+
+  uint32_t ier;       ///< Interrupts that are enabled (CAN_SIM_IER bits)
+  uint8_t rqcp;       ///< Mailboxes that finished a request (RQCP bits),
+                      ///< cleared by the driver
+  bool awum;          ///< Leave sleep mode on bus activity (AWUM)
+  bool wkui;          ///< Bus activity ended sleep mode (WKUI), cleared by
+                      ///< the driver
+
+  uint8_t tec;        ///< Transmit error counter
+  uint8_t rec;        ///< Receive error counter
+  uint8_t lec;        ///< Last error code, bxCAN ESR encoding (0 after a
+                      ///< frame without errors, 1 stuff, 3 acknowledgment)
+  uint8_t esr;        ///< Error state (CAN_SIM_ESR bits)
+  bool erri;          ///< An error state flag with its interrupt enabled was
+                      ///< set (ERRI), cleared by the driver
+  bool abom;          ///< Recover from bus-off without the driver (ABOM)
+  uint64_t rejoin;    ///< Time a bus-off controller is back on the bus in ns,
+                      ///< 0 until its recovery has started
+  uint32_t tx_frames; ///< Frames successfully transmitted
+  uint32_t rx_frames; ///< Frames accepted into a FIFO
+} CanSimController;
+
+/// \brief Reset the bus and all controllers to their power on state.
+void can_sim_reset(void);
+/// \brief Add a remote node to the bus.
+uint8_t can_sim_add_node(canBitrate bitrate);
+/// \brief Get the state of a controller on the bus.
+CanSimController *can_sim_controller(uint8_t node);
+
+/// \brief Place a frame in a free transmit mailbox of a controller.
+int8_t can_sim_tx_request(uint8_t node, const CanMessage *msg);
+/// \brief Take the oldest frame out of a receive FIFO of a controller.
+bool can_sim_fifo_pop(uint8_t node, uint8_t fifo, CanMessage *msg);
+/// \brief Time the oldest frame in a receive FIFO was recieved in ns.
+uint64_t can_sim_fifo_time(uint8_t node, uint8_t fifo);
+
+/// \brief Send a frame from a remote node.
+CanState can_sim_send(uint8_t node, const CanMessage *msg);
+/// \brief Send a frame from a remote node over and over.
+CanState can_sim_send_periodic(uint8_t node, const CanMessage *msg,
+                               uint32_t period_us);
+/// \brief Receive a frame on a remote node.
+CanState can_sim_receive(uint8_t node, CanMessage *msg);
+
+/// \brief Start the bus-off recovery of a controller.
+void can_sim_recover(uint8_t node);
+
+/// \brief Put a frame directly in a receive FIFO, bypassing bus and filters.
+void can_sim_inject(uint8_t node, const CanMessage *msg);
+
+/// \brief Set the function run as the interrupt of the local controller.
+void can_sim_set_irq_handler(void (*handler)(void));
+/// \brief Hold off the local controller's interrupt (like __disable_irq()).
+void can_sim_irq_disable(void);
+/// \brief Allow the local controller's interrupt again.
+void can_sim_irq_enable(void);
+
+/// \brief Bring the bus up to the current time.
+void can_sim_poll(void);
+/// \brief Time since the bus was reset in nano-seconds.
+uint64_t can_sim_time_ns(void);
+/// \brief Run the bus clock faster or slower than real time, or stop it.
+void can_sim_set_speed(double speed);
+/// \brief Speed of the bus clock, 0 if it is stopped.
+double can_sim_speed(void);
+/// \brief Move the bus clock forward.
+void can_sim_advance(uint64_t ns);
+/// \brief Time of the next start or end of a frame or bus-off recovery.
+uint64_t can_sim_next_event_ns(void);
+
+/// \brief Number of frames that have been sent over the bus.
+uint32_t can_sim_bus_frames(void);
+/// \brief Time the bus has spent transmitting frames in nano-seconds.
+uint64_t can_sim_bus_busy_ns(void);
+
+/// \brief Bitrate in bits per second of a canBitrate value.
+uint32_t can_sim_bitrate_bps(canBitrate bitrate);
+/// \brief Number of bits a frame takes on the bus.
+uint32_t can_sim_frame_bits(const CanMessage *msg);
+
+//@}
+#endif // _CAN_SIM_H_
@@ -0,0 +1,59 @@
+/**
+ * \file can_socketcan.h
+ * \brief Settings of the Linux SocketCAN driver.
+ *
+ * When the library is compiled with both CAN_HOST and CAN_SOCKETCAN defined,
+ * can_driver_socketcan.cpp implements the functions in can_driver.h on a
+ * SocketCAN network interface instead of the simulated bus. It works the same
+ * with a real adapter (can0) or a virtual interface for testing:
+ *
+ * ~~~~~~~~~~~~ {.sh}
+ * sudo ip link add dev vcan0 type vcan
+ * sudo ip link set up vcan0
+ * ~~~~~~~~~~~~
+ *
+ * The bitrate of a real adapter is set when the interface is brought up
+ * (`ip link set can0 type can bitrate 500000`), can_set_bitrate() only tells
+ * the driver what it is for the bus load.
+ */
+
+#ifndef _CAN_SOCKETCAN_H_
+#define _CAN_SOCKETCAN_H_
+
+#ifndef CAN_SOCKETCAN_INTERFACE
+/// Network interface can_enable() opens. Can be overwriten by redefinition
+#define CAN_SOCKETCAN_INTERFACE "vcan0"
+#endif
+
+#ifndef CAN_SOCKETCAN_BATCH
+/// Most frames read or written with one system call. Can be overwriten by
+/// redefinition
+#define CAN_SOCKETCAN_BATCH 32
+#endif
+
+#ifndef CAN_SOCKETCAN_RCVBUF
+/// Bytes asked for the receive buffer of the socket, it holds the frames the
+/// receive ring has no room for yet. Each frame takes a few hundred bytes of
+/// it. Can be overwriten by redefinition
+#define CAN_SOCKETCAN_RCVBUF (512 * 1024)
+#endif
+
+/*
+ * Define CAN_SOCKETCAN_HW_TIMESTAMPS to stamp messages with the time from the
+ * adapter rather than the time the kernel got them. The driver moves the
+ * adapter's times onto the clock of can_time_us() by comparing them with the
+ * kernel's, the adapter's clock doesn't have to be set.
+ */
+
+#ifndef CAN_SOCKETCAN_HW_DRIFT
+/// How fast the adapter's clock may fall behind the system clock, in
+/// nano-seconds per mili-second. Can be overwriten by redefinition
+#define CAN_SOCKETCAN_HW_DRIFT 100
+#endif
+
+/// \brief Use another network interface, call before can_enable().
+void can_socketcan_set_interface(const char *name);
+/// \brief File descriptor of the socket, -1 if it is not open.
+int can_socketcan_fd(void);
+
+#endif // _CAN_SOCKETCAN_H_
@@ -0,0 +1,263 @@
+/**
+ * \file can_stats.h
+ * \brief Counters the drivers keep about the traffic and health of the bus.
+ *
+ * The counters are updated from the receive and transmit interrupts, each
+ * frame costs an increment or two and a lookup in a small hash table of ids.
+ * can_stats_snapshot() copies them out with the interrupts held off so all the
+ * numbers belong together, can_stats_reset() starts them over.
+ *
+ * The error counters (TEC and REC), the last error code and the error state
+ * are read from the controller when the snapshot is taken. The times the
+ * error state got worse and how long the controller took to get back on the
+ * bus after each bus-off are counted by the error interrupt.
+ *
+ * The bus load is worked out from the frames this node has sent and the
+ * frames that got through its filters, so traffic that is filtered out is not
+ * part of it. Frames are counted without stuff bits, on a busy bus the real
+ * load is a few percent higher.
+ */
+
+#ifndef _CAN_STATS_H_
+#define _CAN_STATS_H_
+
+#include <cstdint>
+#include <cstring>
+
+#ifndef CAN_STATS_IDS
+/// Number of ids that frames are counted for individually. Must be a power of
+/// two. Can be overwriten by redefinition
+#define CAN_STATS_IDS 16
+#endif
+
+static_assert((CAN_STATS_IDS & (CAN_STATS_IDS - 1)) == 0,
+              "CAN_STATS_IDS must be a power of two");
+
+/// Error state bits of CanStats::error_state, same bits as the bxCAN ESR
+#define CAN_STATS_ERROR_WARNING 0x01
+#define CAN_STATS_ERROR_PASSIVE 0x02
+#define CAN_STATS_BUS_OFF 0x04
+
+/**
+ * \struct CanIdCount
+ * \brief Frames sent and recieved with one id
+ */
+typedef struct {
+  uint16_t id; ///< id of the frames
+  uint32_t rx; ///< frames recieved, including ones dropped by the driver
+  uint32_t tx; ///< frames sent
+} CanIdCount;
+
+/**
+ * \struct CanStats
+ * \brief Snapshot of the driver statistics
+ */
+typedef struct {
+  uint32_t rx_frames;        ///< frames taken out of the hardware FIFOs
+  uint32_t tx_frames;        ///< frames the hardware finished sending
+  uint32_t rx_fifo_overruns; ///< frames lost by the hardware FIFOs (FOVR)
+  uint32_t rx_ring_overruns; ///< frames dropped because the ring was full
+  uint32_t tx_queue_drops;   ///< frames dropped by the transmit queue
+  uint32_t tx_mailbox_full;  ///< frames that had to wait for a mailbox
+  uint32_t tx_aborted;       ///< transmit requests that ended without success
+  uint32_t rtr_answered;     ///< remote requests answered by the interrupt
+  uint16_t rx_ring_peak;     ///< most frames that waited in the receive ring
+  uint16_t tx_queue_peak;    ///< most frames that waited in the transmit queue
+
+  uint8_t tec;         ///< transmit error counter
+  uint8_t rec;         ///< receive error counter
+  uint8_t lec;         ///< last error code (0 none, 1 stuff, 2 form, 3 ack,
+                       ///< 4 bit recessive, 5 bit dominant, 6 CRC)
+  uint8_t error_state; ///< CAN_STATS_ERROR_WARNING, _PASSIVE and BUS_OFF bits
+
+  uint32_t elapsed_ms; ///< time since the counters were reset
+  uint64_t bus_bits;   ///< bits of every frame counted
+  uint16_t bus_load;   ///< share of the bus in use, in tenths of a percent
+
+  uint32_t error_warnings; ///< times TEC or REC reached 96 (error warning)
+  uint32_t error_passives; ///< times TEC or REC reached 128 (error passive)
+  uint32_t bus_offs;       ///< times TEC passed 255 and the controller went
+                           ///< bus-off
+  uint32_t recoveries;     ///< times it got back on the bus after a bus-off
+  uint32_t recover_us;     ///< time from the last bus-off until it was back
+  uint32_t recover_us_max; ///< longest time it took to get back
+  uint64_t bus_off_us;     ///< time spent off the bus over every recovery
+  uint32_t tx_flushed;     ///< frames thrown away because of a bus-off (see
+                           ///< can_set_recovery()), the ones that were queued
+                           ///< are counted in tx_queue_drops as well
+
+  uint32_t wakeups; ///< times bus activity woke the controller from sleep
+  uint64_t idle_us; ///< time the core spent halted in can_wait()
+  uint16_t idle;    ///< share of the time spent in can_wait(), in tenths of a
+                    ///< percent
+
+  uint32_t untracked_rx; ///< frames recieved with an id the table had no room
+  uint32_t untracked_tx; ///< frames sent with an id the table had no room for
+  uint16_t num_ids;      ///< entries used in ids
+  CanIdCount ids[CAN_STATS_IDS]; ///< frames per id, in no particular order
+} CanStats;
+
+/**
+ * \class CanStatsCounter
+ * \brief The counters the drivers update as frames come and go.
+ *
+ * The per id counts live in an open addressed hash table keyed on the low bits
+ * of the id. Every CanNode uses a run of consecutive ids, those land in
+ * neighbouring slots without colliding. An id that finds no free slot within
+ * a few probes is counted as untracked.
+ */
+class CanStatsCounter {
+private:
+  static const uint16_t EMPTY = 0xFFFF;
+  static const uint8_t PROBES = 4;
+
+  CanIdCount slots[CAN_STATS_IDS];
+  CanStats totals;
+
+  // bits a frame takes on the bus without stuff bits
+  static uint32_t frameBits(uint8_t len, bool rtr) {
+    return 47 + (rtr ? 0 : 8 * (len > 8 ? 8 : len));
+  }
+
+  CanIdCount *find(uint16_t id) {
+    for (uint8_t i = 0; i < PROBES; ++i) {
+      CanIdCount *slot = &slots[(id + i) & (CAN_STATS_IDS - 1)];
+      if (slot->id == id) {
+        return slot;
+      }
+      if (slot->id == EMPTY) {
+        slot->id = id;
+        return slot;
+      }
+    }
+    return nullptr;
+  }
+
+public:
+  CanStatsCounter() { reset(); }
+
+  /// \brief Clear every counter.
+  void reset() {
+    memset(&totals, 0, sizeof(totals));
+    for (uint16_t i = 0; i < CAN_STATS_IDS; ++i) {
+      slots[i].id = EMPTY;
+      slots[i].rx = 0;
+      slots[i].tx = 0;
+    }
+  }
+
+  /// \brief A frame was taken out of a hardware FIFO.
+  void recieved(uint16_t id, uint8_t len, bool rtr) {
+    ++totals.rx_frames;
+    totals.bus_bits += frameBits(len, rtr);
+    CanIdCount *slot = find(id);
+    if (slot != nullptr) {
+      ++slot->rx;
+    } else {
+      ++totals.untracked_rx;
+    }
+  }
+
+  /// \brief The hardware finished sending a frame.
+  void sent(uint16_t id, uint8_t len, bool rtr) {
+    ++totals.tx_frames;
+    totals.bus_bits += frameBits(len, rtr);
+    CanIdCount *slot = find(id);
+    if (slot != nullptr) {
+      ++slot->tx;
+    } else {
+      ++totals.untracked_tx;
+    }
+  }
+
+  /// \brief A transmit request ended without the frame being sent.
+  void aborted() { ++totals.tx_aborted; }
+  /// \brief A hardware FIFO lost frames.
+  void fifoOverrun(uint32_t lost = 1) { totals.rx_fifo_overruns += lost; }
+  /// \brief The receive ring had no room for a frame.
+  void ringOverrun() { ++totals.rx_ring_overruns; }
+  /// \brief A frame had to wait for a transmit mailbox.
+  void mailboxFull() { ++totals.tx_mailbox_full; }
+  /// \brief The receive interrupt answered a remote request.
+  void answered() { ++totals.rtr_answered; }
+  /// \brief TEC or REC reached 96.
+  void errorWarning() { ++totals.error_warnings; }
+  /// \brief TEC or REC reached 128.
+  void errorPassive() { ++totals.error_passives; }
+  /// \brief The controller went bus-off.
+  void busOff() { ++totals.bus_offs; }
+  /// \brief The controller is back on the bus after being off for us.
+  void recovered(uint32_t us) {
+    ++totals.recoveries;
+    totals.recover_us = us;
+    if (us > totals.recover_us_max) {
+      totals.recover_us_max = us;
+    }
+    totals.bus_off_us += us;
+  }
+  /// \brief Frames were thrown away because of a bus-off.
+  void flushed(uint32_t count = 1) { totals.tx_flushed += count; }
+  /// \brief Bus activity woke the controller from sleep mode.
+  void wokeUp() { ++totals.wakeups; }
+  /// \brief The core was halted waiting for a message.
+  void idle(uint32_t us) { totals.idle_us += us; }
+
+  /// \brief Note the number of frames in the receive ring.
+  void ringDepth(uint16_t depth) {
+    if (depth > totals.rx_ring_peak) {
+      totals.rx_ring_peak = depth;
+    }
+  }
+  /// \brief Note the number of frames in the transmit queue.
+  void queueDepth(uint16_t depth) {
+    if (depth > totals.tx_queue_peak) {
+      totals.tx_queue_peak = depth;
+    }
+  }
+
+  /// \brief The counters without the per id table or the controller state.
+  const CanStats &get() const { return totals; }
+
+  /**
+   * Copy the counters into a snapshot. The error counters and the time based
+   * fields are left for the driver to fill in.
+   */
+  void copy(CanStats *stats) const {
+    *stats = totals;
+    stats->num_ids = 0;
+    for (uint16_t i = 0; i < CAN_STATS_IDS; ++i) {
+      if (slots[i].id != EMPTY) {
+        stats->ids[stats->num_ids++] = slots[i];
+      }
+    }
+  }
+
+  /**
+   * Work out the bus load and the idle share of a snapshot.
+   *
+   * \param stats snapshot with bus_bits and idle_us filled in
+   * \param elapsed_ms time the bits were counted over
+   * \param bps bitrate of the bus in bits per second
+   */
+  static void load(CanStats *stats, uint32_t elapsed_ms, uint32_t bps) {
+    uint64_t capacity = (uint64_t)bps * elapsed_ms / 1000;
+    stats->elapsed_ms = elapsed_ms;
+    if (capacity == 0) {
+      stats->bus_load = 0;
+    } else if (stats->bus_bits >= capacity) {
+      stats->bus_load = 1000;
+    } else {
+      stats->bus_load = (uint16_t)(stats->bus_bits * 1000 / capacity);
+    }
+    // micro-seconds per mili-second are tenths of a percent
+    if (elapsed_ms == 0) {
+      stats->idle = 0;
+    } else if (stats->idle_us >= (uint64_t)elapsed_ms * 1000) {
+      stats->idle = 1000;
+    } else {
+      stats->idle = (uint16_t)(stats->idle_us / elapsed_ms);
+    }
+  }
+};
+
+#endif // _CAN_STATS_H_
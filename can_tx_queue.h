@@ -0,0 +1,182 @@
+/**
+ * \file can_tx_queue.h
+ * \brief Software transmit queue that sits behind the hardware mailboxes.
+ *
+ * Messages that can't go straight into a transmit mailbox wait here. The
+ * queue is kept in CAN priority order (lowest id first, then the order they
+ * were added) so that the transmit interrupt always refills the mailboxes with
+ * the message that would win arbitration on the bus.
+ *
+ * The queue itself is not protected, the driver calls it with the CAN
+ * interrupts held off or from the transmit interrupt.
+ */
+
+#ifndef _CAN_TX_QUEUE_H_
+#define _CAN_TX_QUEUE_H_
+
+#include <cstdint>
+#include <cstring>
+#include "CanTypes.h"
+
+#ifndef CAN_TX_DROP_IDS
+/// Number of ids that drops are counted for individually. Can be overwriten by
+/// redefinition
+#define CAN_TX_DROP_IDS 8
+#endif
+
+/**
+ * \enum CanTxPolicy
+ * \brief What the transmit queue does with a message it has no room for
+ */
+typedef enum {
+  CAN_TX_DROP_NEW,    ///< The new message is dropped (default)
+  CAN_TX_DROP_LOWEST, ///< The lowest priority message is dropped, this can be
+                      ///< the new message
+  CAN_TX_OVERWRITE,   ///< A queued message with the same id is replaced by the
+                      ///< new one even if there is room, otherwise the new
+                      ///< message is dropped. Only for single frame data,
+                      ///< segments of a multi-frame transfer would be lost.
+} CanTxPolicy;
+
+/**
+ * \class CanTxQueue
+ * \brief Priority ordered queue of up to N messages waiting to be sent.
+ *
+ * The messages are stored from lowest to highest priority, the next message to
+ * send is always the last one.
+ */
+template <uint16_t N> class CanTxQueue {
+private:
+  CanMessage queue[N];
+  uint16_t count;
+  CanTxPolicy policy;
+
+  struct DropCount {
+    uint16_t id;
+    uint16_t drops;
+  };
+  DropCount dropIds[CAN_TX_DROP_IDS]; ///< drops for the first ids to drop
+  uint8_t numDropIds;
+  uint32_t totalDrops;
+
+  void countDrop(uint16_t id) {
+    ++totalDrops;
+    for (uint8_t i = 0; i < numDropIds; ++i) {
+      if (dropIds[i].id == id) {
+        ++dropIds[i].drops;
+        return;
+      }
+    }
+    if (numDropIds < CAN_TX_DROP_IDS) {
+      dropIds[numDropIds].id = id;
+      dropIds[numDropIds].drops = 1;
+      ++numDropIds;
+    }
+  }
+
+  // lower values win arbitration, a data frame wins over a remote frame
+  static uint16_t priority(const CanMessage &msg) {
+    return (uint16_t)((msg.id & 0x7FF) << 1) | (msg.rtr ? 1 : 0);
+  }
+
+public:
+  CanTxQueue() : count(0), policy(CAN_TX_DROP_NEW), numDropIds(0),
+                 totalDrops(0) {}
+
+  /**
+   * Add a message to the queue.
+   *
+   * \returns false if the new message was dropped. If the policy makes room
+   * by dropping a queued message this still returns true.
+   */
+  bool push(const CanMessage &msg) {
+    uint16_t prio = priority(msg);
+
+    if (policy == CAN_TX_OVERWRITE) {
+      for (uint16_t i = 0; i < count; ++i) {
+        if (priority(queue[i]) == prio) {
+          countDrop(queue[i].id);
+          queue[i] = msg;
+          return true;
+        }
+      }
+    }
+
+    if (count >= N) {
+      if (policy != CAN_TX_DROP_LOWEST || prio >= priority(queue[0])) {
+        countDrop(msg.id);
+        return false;
+      }
+      // drop the lowest priority message to make room
+      countDrop(queue[0].id);
+      memmove(&queue[0], &queue[1], (count - 1) * sizeof(CanMessage));
+      --count;
+    }
+
+    // goes in front of (sent after) messages with the same priority
+    uint16_t pos = 0;
+    while (pos < count && priority(queue[pos]) > prio) {
+      ++pos;
+    }
+    memmove(&queue[pos + 1], &queue[pos], (count - pos) * sizeof(CanMessage));
+    queue[pos] = msg;
+    ++count;
+    return true;
+  }
+
+  /// \brief Take the highest priority message, returns false if empty.
+  bool pop(CanMessage *msg) {
+    if (count == 0) {
+      return false;
+    }
+    *msg = queue[--count];
+    return true;
+  }
+
+  /// \brief The highest priority message without taking it, nullptr if empty.
+  const CanMessage *peek() const {
+    return count == 0 ? nullptr : &queue[count - 1];
+  }
+
+  /// \brief The message n places behind the next one, nullptr past the end.
+  const CanMessage *peek(uint16_t n) const {
+    return n >= count ? nullptr : &queue[count - 1 - n];
+  }
+
+  /// \brief Take the next n messages after they were sent from peek().
+  void remove(uint16_t n) { count = n >= count ? 0 : count - n; }
+
+  /// \brief Drop every queued message, they are counted as drops.
+  void clear() {
+    while (count > 0) {
+      countDrop(queue[--count].id);
+    }
+  }
+
+  /// \brief Number of messages waiting.
+  uint16_t size() const { return count; }
+  /// \brief Check if there are no messages waiting.
+  bool empty() const { return count == 0; }
+
+  /// \brief Set what happens to messages when the queue is full.
+  void setPolicy(CanTxPolicy newPolicy) { policy = newPolicy; }
+
+  /**
+   * Number of messages with an id that were dropped. Only the first
+   * \ref CAN_TX_DROP_IDS ids that have drops are counted individually, all
+   * drops are counted by totalDropped().
+   */
+  uint16_t dropped(uint16_t id) const {
+    for (uint8_t i = 0; i < numDropIds; ++i) {
+      if (dropIds[i].id == id) {
+        return dropIds[i].drops;
+      }
+    }
+    return 0;
+  }
+
+  /// \brief Number of messages that were dropped.
+  uint32_t totalDropped() const { return totalDrops; }
+};
+
+#endif // _CAN_TX_QUEUE_H_
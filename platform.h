@@ -1,6 +1,15 @@
 #ifndef _PLATFORM_CAN_H_
 #define _PLATFORM_CAN_H_
 
+#ifdef CAN_HOST
+// host build, the bxCAN hardware is replaced by the simulated bus in can_sim.h
+#include <stdint.h>
+
+/// \brief Wait for a number of mili-seconds (host implementation).
+void HAL_Delay(uint32_t delay);
+
+#else
+
 #ifndef STM32F3
 #define STM32F3
 #endif
@@ -19,6 +28,8 @@
 #define CAN_EN_GPIO_Port GPIOB
 #define CAN_EN_Pin GPIO_PIN_7
 
+#endif // CAN_HOST
+
 //#define HAL_Delay(ms_delay) (usleep(ms_delay * 1000))
 
 #endif //_PLATFORM_CAN_H_